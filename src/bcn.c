@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "bcn.h"
+#include "rucksack.h"
+#include "cpu.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// BC7 mode 6 interpolates 16 colors between its endpoints with these
+// weights, out of 64
+static const int BC7_WEIGHTS[16] = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64,
+};
+
+// 4x4 pixels, in rows from the top
+struct Block {
+    int px[16][4];
+    // the channels again, interleaved in pairs (r g r g ..., b a b a ...),
+    // which is the layout the SSE2 distance search multiplies in. the alpha
+    // lanes are 0 when alpha does not take part in the color search.
+    int16_t rg[32];
+    int16_t ba[32];
+};
+
+bool rucksack_bcn_is_block_format(int format) {
+    return format == RuckSackTextureFormatBc1 || format == RuckSackTextureFormatBc3 ||
+        format == RuckSackTextureFormatBc7;
+}
+
+static int block_bytes(int format) {
+    return (format == RuckSackTextureFormatBc1) ? 8 : 16;
+}
+
+long rucksack_bcn_pitch(int format, int width) {
+    return (long)((width + 3) / 4) * block_bytes(format);
+}
+
+long rucksack_bcn_size(int format, int width, int height) {
+    return rucksack_bcn_pitch(format, width) * ((height + 3) / 4);
+}
+
+static float clamp255(float x) {
+    return (x < 0.0f) ? 0.0f : (x > 255.0f) ? 255.0f : x;
+}
+
+static void load_block(struct Block *b, const unsigned char *rgba, long pitch, bool with_alpha) {
+    for (int y = 0; y < 4; y += 1) {
+        const unsigned char *row = rgba + y * pitch;
+        for (int x = 0; x < 4; x += 1) {
+            int i = 4 * y + x;
+            for (int c = 0; c < 4; c += 1)
+                b->px[i][c] = row[4 * x + c];
+            b->rg[2 * i] = row[4 * x];
+            b->rg[2 * i + 1] = row[4 * x + 1];
+            b->ba[2 * i] = row[4 * x + 2];
+            b->ba[2 * i + 1] = with_alpha ? row[4 * x + 3] : 0;
+        }
+    }
+}
+
+// picks the nearest palette color for every pixel and returns the squared
+// error of the pixels in mask. ties go to the lower index. the alpha of the
+// palette must be 0 when the block was loaded without alpha.
+#ifdef __SSE2__
+static uint32_t find_indices(const struct Block *b, int16_t palette[][4], int count,
+        uint16_t mask, uint8_t idx[16])
+{
+    // 4 pixels per register, all 16 compared against one palette color at
+    // a time. pmaddwd squares the channel differences and adds them in
+    // pairs, so r g and b a each take one instruction per 4 pixels.
+    __m128i rg[4], ba[4], best[4], best_index[4];
+    for (int j = 0; j < 4; j += 1) {
+        rg[j] = _mm_loadu_si128((const __m128i *)&b->rg[8 * j]);
+        ba[j] = _mm_loadu_si128((const __m128i *)&b->ba[8 * j]);
+        best[j] = _mm_set1_epi32(INT32_MAX);
+        best_index[j] = _mm_setzero_si128();
+    }
+    for (int k = 0; k < count; k += 1) {
+        __m128i p_rg = _mm_set1_epi32((uint16_t)palette[k][0] | ((uint16_t)palette[k][1] << 16));
+        __m128i p_ba = _mm_set1_epi32((uint16_t)palette[k][2] | ((uint16_t)palette[k][3] << 16));
+        __m128i index = _mm_set1_epi32(k);
+        for (int j = 0; j < 4; j += 1) {
+            __m128i d_rg = _mm_sub_epi16(rg[j], p_rg);
+            __m128i d_ba = _mm_sub_epi16(ba[j], p_ba);
+            __m128i dist = _mm_add_epi32(_mm_madd_epi16(d_rg, d_rg), _mm_madd_epi16(d_ba, d_ba));
+            __m128i less = _mm_cmplt_epi32(dist, best[j]);
+            best[j] = _mm_or_si128(_mm_and_si128(less, dist), _mm_andnot_si128(less, best[j]));
+            best_index[j] = _mm_or_si128(_mm_and_si128(less, index),
+                    _mm_andnot_si128(less, best_index[j]));
+        }
+    }
+    int32_t dist[16];
+    int32_t index[16];
+    for (int j = 0; j < 4; j += 1) {
+        _mm_storeu_si128((__m128i *)&dist[4 * j], best[j]);
+        _mm_storeu_si128((__m128i *)&index[4 * j], best_index[j]);
+    }
+    uint32_t err = 0;
+    for (int i = 0; i < 16; i += 1) {
+        idx[i] = index[i];
+        if (mask & (1 << i))
+            err += dist[i];
+    }
+    return err;
+}
+#else
+static uint32_t find_indices(const struct Block *b, int16_t palette[][4], int count,
+        uint16_t mask, uint8_t idx[16])
+{
+    uint32_t err = 0;
+    for (int i = 0; i < 16; i += 1) {
+        const int16_t px[4] = {b->rg[2 * i], b->rg[2 * i + 1], b->ba[2 * i], b->ba[2 * i + 1]};
+        int32_t best = INT32_MAX;
+        for (int k = 0; k < count; k += 1) {
+            int32_t dist = 0;
+            for (int c = 0; c < 4; c += 1) {
+                int32_t d = px[c] - palette[k][c];
+                dist += d * d;
+            }
+            if (dist < best) {
+                best = dist;
+                idx[i] = k;
+            }
+        }
+        if (mask & (1 << i))
+            err += best;
+    }
+    return err;
+}
+#endif
+
+// finds the line through the colors of the pixels in mask along which they
+// spread the most, and returns the ends of their projection onto it. mask
+// must not be empty.
+static void fit_line(const struct Block *b, int channels, uint16_t mask, float lo[4], float hi[4]) {
+    float mean[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    int n = 0;
+    for (int i = 0; i < 16; i += 1) {
+        if (!(mask & (1 << i)))
+            continue;
+        for (int c = 0; c < channels; c += 1)
+            mean[c] += b->px[i][c];
+        n += 1;
+    }
+    for (int c = 0; c < channels; c += 1)
+        mean[c] /= n;
+
+    float cov[4][4];
+    memset(cov, 0, sizeof(cov));
+    for (int i = 0; i < 16; i += 1) {
+        if (!(mask & (1 << i)))
+            continue;
+        float d[4];
+        for (int c = 0; c < channels; c += 1)
+            d[c] = b->px[i][c] - mean[c];
+        for (int j = 0; j < channels; j += 1) {
+            for (int k = 0; k < channels; k += 1)
+                cov[j][k] += d[j] * d[k];
+        }
+    }
+
+    // power iteration, starting from the covariance of the channel that
+    // varies the most
+    int widest = 0;
+    for (int c = 1; c < channels; c += 1) {
+        if (cov[c][c] > cov[widest][widest])
+            widest = c;
+    }
+    float axis[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int c = 0; c < channels; c += 1)
+        axis[c] = cov[widest][c];
+    for (int iter = 0; iter < 8; iter += 1) {
+        float next[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        float len = 0.0f;
+        for (int j = 0; j < channels; j += 1) {
+            for (int k = 0; k < channels; k += 1)
+                next[j] += cov[j][k] * axis[k];
+            float mag = (next[j] < 0.0f) ? -next[j] : next[j];
+            if (mag > len)
+                len = mag;
+        }
+        if (len == 0.0f)
+            break;
+        for (int j = 0; j < channels; j += 1)
+            axis[j] = next[j] / len;
+    }
+
+    float norm = 0.0f;
+    for (int c = 0; c < channels; c += 1)
+        norm += axis[c] * axis[c];
+    float t_min = 0.0f;
+    float t_max = 0.0f;
+    if (norm > 0.0f) {
+        for (int i = 0; i < 16; i += 1) {
+            if (!(mask & (1 << i)))
+                continue;
+            float t = 0.0f;
+            for (int c = 0; c < channels; c += 1)
+                t += (b->px[i][c] - mean[c]) * axis[c];
+            if (t < t_min)
+                t_min = t;
+            if (t > t_max)
+                t_max = t;
+        }
+        t_min /= norm;
+        t_max /= norm;
+    }
+    for (int c = 0; c < 4; c += 1) {
+        lo[c] = (c < channels) ? clamp255(mean[c] + axis[c] * t_min) : 255.0f;
+        hi[c] = (c < channels) ? clamp255(mean[c] + axis[c] * t_max) : 255.0f;
+    }
+}
+
+// least squares fit of the endpoints, given where between them each pixel
+// of mask landed. weights maps an index to its position from e0 to e1.
+// returns false if the pixels do not pin down a solution.
+static bool refine_endpoints(const struct Block *b, int channels, uint16_t mask,
+        const uint8_t idx[16], const float *weights, float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    float bx[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 16; i += 1) {
+        if (!(mask & (1 << i)))
+            continue;
+        float t = weights[idx[i]];
+        float s = 1.0f - t;
+        aa += s * s;
+        ab += s * t;
+        bb += t * t;
+        for (int c = 0; c < channels; c += 1) {
+            ax[c] += s * b->px[i][c];
+            bx[c] += t * b->px[i][c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (det < 1e-4f)
+        return false;
+    for (int c = 0; c < channels; c += 1) {
+        e0[c] = clamp255((ax[c] * bb - bx[c] * ab) / det);
+        e1[c] = clamp255((bx[c] * aa - ax[c] * ab) / det);
+    }
+    return true;
+}
+
+static int quantize565(const float c[4]) {
+    int r = (int)(c[0] * 31.0f / 255.0f + 0.5f);
+    int g = (int)(c[1] * 63.0f / 255.0f + 0.5f);
+    int b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+    return (r << 11) | (g << 5) | b;
+}
+
+static void expand565(int c, int16_t out[4]) {
+    int r = (c >> 11) & 31;
+    int g = (c >> 5) & 63;
+    int b = c & 31;
+    out[0] = (r << 3) | (r >> 2);
+    out[1] = (g << 2) | (g >> 4);
+    out[2] = (b << 3) | (b >> 2);
+    out[3] = 0;
+}
+
+// puts the endpoints in the order that selects the mode, then picks the
+// indices and returns the squared error of the pixels in mask
+static uint32_t bc1_evaluate(const struct Block *b, uint16_t mask, bool three_color,
+        int *c0, int *c1, uint8_t idx[16])
+{
+    if (three_color ? (*c0 > *c1) : (*c0 < *c1)) {
+        int tmp = *c0;
+        *c0 = *c1;
+        *c1 = tmp;
+    }
+    int16_t palette[4][4];
+    expand565(*c0, palette[0]);
+    expand565(*c1, palette[1]);
+    for (int c = 0; c < 4; c += 1) {
+        if (three_color || *c0 == *c1) {
+            // index 3 is transparent black here, so it gets a copy of
+            // color 0 which never wins a tie
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = palette[0][c];
+        } else {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+    }
+    uint32_t err = find_indices(b, palette, 4, mask, idx);
+    for (int i = 0; i < 16; i += 1) {
+        if (!(mask & (1 << i)) && three_color)
+            idx[i] = 3;
+    }
+    return err;
+}
+
+// the 8 byte color block shared by BC1 and BC3. only the pixels in mask
+// count toward the fit. with three_color, the rest become transparent.
+static void encode_color(const struct Block *b, uint16_t mask, bool three_color,
+        unsigned char out[8])
+{
+    int c0 = 0;
+    int c1 = 0;
+    uint8_t idx[16];
+    memset(idx, three_color ? 3 : 0, sizeof(idx));
+    if (mask != 0) {
+        static const float weights4[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+        static const float weights3[4] = {0.0f, 1.0f, 0.5f, 0.0f};
+        float e0[4], e1[4];
+        fit_line(b, 3, mask, e0, e1);
+        c0 = quantize565(e0);
+        c1 = quantize565(e1);
+        uint32_t err = bc1_evaluate(b, mask, three_color, &c0, &c1, idx);
+        for (int iter = 0; iter < 2 && err > 0; iter += 1) {
+            int16_t q0[4], q1[4];
+            expand565(c0, q0);
+            expand565(c1, q1);
+            for (int c = 0; c < 3; c += 1) {
+                e0[c] = q0[c];
+                e1[c] = q1[c];
+            }
+            if (!refine_endpoints(b, 3, mask, idx, three_color ? weights3 : weights4, e0, e1))
+                break;
+            int n0 = quantize565(e0);
+            int n1 = quantize565(e1);
+            uint8_t next_idx[16];
+            uint32_t next_err = bc1_evaluate(b, mask, three_color, &n0, &n1, next_idx);
+            if (next_err >= err)
+                break;
+            c0 = n0;
+            c1 = n1;
+            err = next_err;
+            memcpy(idx, next_idx, sizeof(idx));
+        }
+    }
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; i += 1)
+        bits |= (uint32_t)idx[i] << (2 * i);
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int k = 0; k < 4; k += 1)
+        out[4 + k] = (bits >> (8 * k)) & 0xff;
+}
+
+static void encode_bc1(const struct Block *b, unsigned char out[8]) {
+    // BC1 has 1 bit alpha, which only the three color mode can express
+    uint16_t opaque = 0;
+    for (int i = 0; i < 16; i += 1) {
+        if (b->px[i][3] >= 128)
+            opaque |= 1 << i;
+    }
+    encode_color(b, opaque, opaque != 0xffff, out);
+}
+
+static uint32_t alpha_evaluate(const struct Block *b, int a0, int a1, uint8_t idx[16]) {
+    int palette[8];
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1) {
+        for (int i = 1; i < 7; i += 1)
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    } else {
+        for (int i = 1; i < 5; i += 1)
+            palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint32_t err = 0;
+    for (int i = 0; i < 16; i += 1) {
+        int best = INT32_MAX;
+        for (int k = 0; k < 8; k += 1) {
+            int d = b->px[i][3] - palette[k];
+            if (d * d < best) {
+                best = d * d;
+                idx[i] = k;
+            }
+        }
+        err += best;
+    }
+    return err;
+}
+
+// the 8 byte alpha block of BC3
+static void encode_alpha(const struct Block *b, unsigned char out[8]) {
+    int lo = 255, hi = 0;
+    int inner_lo = 255, inner_hi = 0;
+    for (int i = 0; i < 16; i += 1) {
+        int a = b->px[i][3];
+        if (a < lo) lo = a;
+        if (a > hi) hi = a;
+        if (a != 0 && a != 255) {
+            if (a < inner_lo) inner_lo = a;
+            if (a > inner_hi) inner_hi = a;
+        }
+    }
+    int a0 = hi;
+    int a1 = lo;
+    uint8_t idx[16];
+    uint32_t err = alpha_evaluate(b, a0, a1, idx);
+    if (err > 0) {
+        // the 6 value mode has exact 0 and 255 besides its ramp, which suits
+        // the soft edges of sprites. it only fails to fit when some value
+        // lies between 0 and 255, so the inner range is not empty here.
+        uint8_t idx6[16];
+        uint32_t err6 = alpha_evaluate(b, inner_lo, inner_hi, idx6);
+        if (err6 < err) {
+            a0 = inner_lo;
+            a1 = inner_hi;
+            memcpy(idx, idx6, sizeof(idx));
+        }
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; i += 1)
+        bits |= (uint64_t)idx[i] << (3 * i);
+    out[0] = a0;
+    out[1] = a1;
+    for (int k = 0; k < 6; k += 1)
+        out[2 + k] = (bits >> (8 * k)) & 0xff;
+}
+
+static void encode_bc3(const struct Block *b, unsigned char out[16]) {
+    encode_alpha(b, out);
+    // the color of invisible pixels does not matter
+    uint16_t visible = 0;
+    for (int i = 0; i < 16; i += 1) {
+        if (b->px[i][3] > 0)
+            visible |= 1 << i;
+    }
+    encode_color(b, visible ? visible : 0xffff, false, out + 8);
+}
+
+// rounds an endpoint to 7 bits per channel plus the shared low bit
+static void quantize_bc7(const float e[4], int q[4], int *pbit) {
+    float best_err = -1.0f;
+    for (int p = 0; p < 2; p += 1) {
+        int v[4];
+        float err = 0.0f;
+        for (int c = 0; c < 4; c += 1) {
+            v[c] = (int)((e[c] - p) / 2.0f + 0.5f);
+            if (v[c] < 0) v[c] = 0;
+            if (v[c] > 127) v[c] = 127;
+            float d = ((v[c] << 1) | p) - e[c];
+            err += d * d;
+        }
+        if (best_err < 0.0f || err < best_err) {
+            best_err = err;
+            memcpy(q, v, sizeof(v));
+            *pbit = p;
+        }
+    }
+}
+
+static uint32_t bc7_evaluate(const struct Block *b, const int q0[4], int p0,
+        const int q1[4], int p1, uint8_t idx[16])
+{
+    int16_t palette[16][4];
+    for (int k = 0; k < 16; k += 1) {
+        int w = BC7_WEIGHTS[k];
+        for (int c = 0; c < 4; c += 1) {
+            int v0 = (q0[c] << 1) | p0;
+            int v1 = (q1[c] << 1) | p1;
+            palette[k][c] = ((64 - w) * v0 + w * v1 + 32) >> 6;
+        }
+    }
+    return find_indices(b, palette, 16, 0xffff, idx);
+}
+
+struct BitWriter {
+    unsigned char *out;
+    int pos;
+};
+
+static void put_bits(struct BitWriter *w, uint32_t value, int count) {
+    for (int i = 0; i < count; i += 1) {
+        if ((value >> i) & 1)
+            w->out[w->pos >> 3] |= 1 << (w->pos & 7);
+        w->pos += 1;
+    }
+}
+
+// BC7 mode 6: one subset, RGBA endpoints and 4 bit indices. the other modes
+// split the block into subsets, which buys little on sprites compared to
+// what it costs to search them.
+static void encode_bc7(const struct Block *b, unsigned char out[16]) {
+    float weights[16];
+    for (int k = 0; k < 16; k += 1)
+        weights[k] = BC7_WEIGHTS[k] / 64.0f;
+
+    float e0[4], e1[4];
+    fit_line(b, 4, 0xffff, e0, e1);
+    int q0[4], q1[4], p0, p1;
+    quantize_bc7(e0, q0, &p0);
+    quantize_bc7(e1, q1, &p1);
+    uint8_t idx[16];
+    uint32_t err = bc7_evaluate(b, q0, p0, q1, p1, idx);
+    for (int iter = 0; iter < 2 && err > 0; iter += 1) {
+        if (!refine_endpoints(b, 4, 0xffff, idx, weights, e0, e1))
+            break;
+        int n0[4], n1[4], np0, np1;
+        quantize_bc7(e0, n0, &np0);
+        quantize_bc7(e1, n1, &np1);
+        uint8_t next_idx[16];
+        uint32_t next_err = bc7_evaluate(b, n0, np0, n1, np1, next_idx);
+        if (next_err >= err)
+            break;
+        memcpy(q0, n0, sizeof(q0));
+        memcpy(q1, n1, sizeof(q1));
+        p0 = np0;
+        p1 = np1;
+        err = next_err;
+        memcpy(idx, next_idx, sizeof(idx));
+    }
+
+    // the first index is stored without its top bit, so it must be below 8
+    if (idx[0] & 8) {
+        int tmp[4];
+        memcpy(tmp, q0, sizeof(tmp));
+        memcpy(q0, q1, sizeof(tmp));
+        memcpy(q1, tmp, sizeof(tmp));
+        int tmp_p = p0;
+        p0 = p1;
+        p1 = tmp_p;
+        for (int i = 0; i < 16; i += 1)
+            idx[i] = 15 - idx[i];
+    }
+
+    memset(out, 0, 16);
+    struct BitWriter w = {out, 0};
+    put_bits(&w, 1 << 6, 7);
+    for (int c = 0; c < 4; c += 1) {
+        put_bits(&w, q0[c], 7);
+        put_bits(&w, q1[c], 7);
+    }
+    put_bits(&w, p0, 1);
+    put_bits(&w, p1, 1);
+    put_bits(&w, idx[0], 3);
+    for (int i = 1; i < 16; i += 1)
+        put_bits(&w, idx[i], 4);
+}
+
+struct EncodeJob {
+    int format;
+    const unsigned char *rgba;
+    int width;
+    int height;
+    unsigned char *out;
+    // the next row of blocks that no thread has taken
+    int next_row;
+};
+
+static void encode_row(struct EncodeJob *job, int row) {
+    long pitch = (long)job->width * 4;
+    int bytes = block_bytes(job->format);
+    const unsigned char *src = job->rgba + (long)row * 4 * pitch;
+    unsigned char *dest = job->out + row * rucksack_bcn_pitch(job->format, job->width);
+    bool with_alpha = (job->format == RuckSackTextureFormatBc7);
+    struct Block b;
+    for (int x = 0; x < job->width; x += 4) {
+        load_block(&b, src + x * 4, pitch, with_alpha);
+        switch (job->format) {
+            case RuckSackTextureFormatBc1:
+                encode_bc1(&b, dest);
+                break;
+            case RuckSackTextureFormatBc3:
+                encode_bc3(&b, dest);
+                break;
+            default:
+                encode_bc7(&b, dest);
+                break;
+        }
+        dest += bytes;
+    }
+}
+
+static void *encode_rows(void *arg) {
+    struct EncodeJob *job = arg;
+    int rows = job->height / 4;
+    for (;;) {
+        int row = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+        if (row >= rows)
+            break;
+        encode_row(job, row);
+    }
+    return NULL;
+}
+
+int rucksack_bcn_encode(int format, const unsigned char *rgba, int width, int height,
+        unsigned char *out, int thread_count)
+{
+    if (!rucksack_bcn_is_block_format(format))
+        return RuckSackErrorTextureFormat;
+    if (width % 4 != 0 || height % 4 != 0)
+        return RuckSackErrorInvalidFormat;
+
+    struct EncodeJob job;
+    job.format = format;
+    job.rgba = rgba;
+    job.width = width;
+    job.height = height;
+    job.out = out;
+    job.next_row = 0;
+
+    int rows = height / 4;
+    if (thread_count <= 0)
+        thread_count = rucksack_cpu_count();
+    if (thread_count > rows)
+        thread_count = rows;
+
+    // the calling thread encodes too, so it is one fewer to start
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (thread_count > 1) {
+        threads = malloc((thread_count - 1) * sizeof(pthread_t));
+        if (!threads)
+            return RuckSackErrorNoMem;
+        for (; started < thread_count - 1; started += 1) {
+            // if a thread does not start, the others take its rows
+            if (pthread_create(&threads[started], NULL, encode_rows, &job))
+                break;
+        }
+    }
+    encode_rows(&job);
+    for (int i = 0; i < started; i += 1)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    return RuckSackErrorNone;
+}
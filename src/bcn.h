@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_BCN_H_INCLUDED
+#define RUCKSACK_BCN_H_INCLUDED
+
+#include <stdbool.h>
+
+// block compression for textures. format is one of the block formats of
+// enum RuckSackTextureFormat.
+
+bool rucksack_bcn_is_block_format(int format);
+
+// the size of an image of width x height pixels in format
+long rucksack_bcn_size(int format, int width, int height);
+
+// bytes from one row of blocks to the next
+long rucksack_bcn_pitch(int format, int width);
+
+// encodes RGBA8 pixels, rows from top to bottom, into rucksack_bcn_size
+// bytes at out. width and height must be multiples of 4. the rows of blocks
+// are spread over thread_count threads, 0 for one per CPU. returns an enum
+// RuckSackError value.
+int rucksack_bcn_encode(int format, const unsigned char *rgba, int width, int height,
+        unsigned char *out, int thread_count);
+
+#endif /* RUCKSACK_BCN_H_INCLUDED */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "config.h"
+#include "checksum.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+#include <nmmintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// slicing-by-8 tables for CPUs without a crc32 instruction
+static uint32_t soft_table[8][256];
+
+static void init_soft_table(void) {
+    for (uint32_t i = 0; i < 256; i += 1) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j += 1)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        soft_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i += 1) {
+        for (int t = 1; t < 8; t += 1) {
+            uint32_t prev = soft_table[t - 1][i];
+            soft_table[t][i] = (prev >> 8) ^ soft_table[0][prev & 0xff];
+        }
+    }
+}
+
+static uint32_t load_uint32le(const unsigned char *p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// updates the raw crc register, without the inversions around it
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t size) {
+    while (size >= 8) {
+        uint32_t lo = load_uint32le(p) ^ crc;
+        uint32_t hi = load_uint32le(p + 4);
+        crc = soft_table[7][lo & 0xff] ^ soft_table[6][(lo >> 8) & 0xff] ^
+            soft_table[5][(lo >> 16) & 0xff] ^ soft_table[4][lo >> 24] ^
+            soft_table[3][hi & 0xff] ^ soft_table[2][(hi >> 8) & 0xff] ^
+            soft_table[1][(hi >> 16) & 0xff] ^ soft_table[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ soft_table[0][(crc ^ *p) & 0xff];
+        p += 1;
+        size -= 1;
+    }
+    return crc;
+}
+
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+// one crc32 instruction takes 3 cycles but a new one can start every cycle,
+// so large buffers are split into three lanes that are checksummed side by
+// side and then combined.
+static const size_t LANE_SIZE = 4096;
+
+static bool have_sse42;
+
+// shift_table[j][v] is the crc register that results from feeding
+// LANE_SIZE zero bytes into a register holding v << (8 * j)
+static uint32_t shift_table[4][256];
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_zeros_sse42(uint32_t crc, size_t size) {
+    uint64_t c = crc;
+    for (size_t i = 0; i < size; i += 8)
+        c = _mm_crc32_u64(c, 0);
+    return (uint32_t)c;
+}
+
+static void init_shift_table(void) {
+    // the crc of zeros is linear in the starting register, so it is enough
+    // to know where each bit ends up
+    uint32_t bit_result[32];
+    for (int k = 0; k < 32; k += 1)
+        bit_result[k] = crc32c_zeros_sse42((uint32_t)1 << k, LANE_SIZE);
+    for (int j = 0; j < 4; j += 1) {
+        for (int v = 0; v < 256; v += 1) {
+            uint32_t result = 0;
+            for (int b = 0; b < 8; b += 1) {
+                if (v & (1 << b))
+                    result ^= bit_result[8 * j + b];
+            }
+            shift_table[j][v] = result;
+        }
+    }
+}
+
+static uint32_t shift_lane(uint32_t crc) {
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+        shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size) {
+    uint64_t c0 = crc;
+    while (size >= 3 * LANE_SIZE) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (size_t i = 0; i < LANE_SIZE; i += 8) {
+            uint64_t x0, x1, x2;
+            memcpy(&x0, p + i, 8);
+            memcpy(&x1, p + LANE_SIZE + i, 8);
+            memcpy(&x2, p + 2 * LANE_SIZE + i, 8);
+            c0 = _mm_crc32_u64(c0, x0);
+            c1 = _mm_crc32_u64(c1, x1);
+            c2 = _mm_crc32_u64(c2, x2);
+        }
+        c0 = shift_lane(shift_lane((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        p += 3 * LANE_SIZE;
+        size -= 3 * LANE_SIZE;
+    }
+    while (size >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c0 = _mm_crc32_u64(c0, x);
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p);
+        p += 1;
+        size -= 1;
+    }
+    return (uint32_t)c0;
+}
+#endif
+
+static void init_crc32c(void) {
+    init_soft_table();
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+    if (have_sse42)
+        init_shift_table();
+#endif
+}
+
+uint32_t rucksack_crc32c(uint32_t crc, const unsigned char *data, size_t size) {
+    pthread_once(&init_once, init_crc32c);
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+    if (have_sse42)
+        return ~crc32c_sse42(~crc, data, size);
+#endif
+    return ~crc32c_soft(~crc, data, size);
+}
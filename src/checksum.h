@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_CHECKSUM_H_INCLUDED
+#define RUCKSACK_CHECKSUM_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli). pass 0 to start, or the previous result to continue
+// where it left off. uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t rucksack_crc32c(uint32_t crc, const unsigned char *data, size_t size);
+
+#endif /* RUCKSACK_CHECKSUM_H_INCLUDED */
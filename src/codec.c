@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "config.h"
+#include "codec.h"
+#include "rucksack.h"
+
+#include <stdlib.h>
+#include <limits.h>
+
+#ifdef RUCKSACK_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// smaller files gain too little to be worth a decompression step
+static const long MIN_COMPRESS_SIZE = 512;
+// how many bytes to look at when guessing whether data is compressible
+static const long ENTROPY_SAMPLE_SIZE = 64 * 1024;
+// data whose byte distribution is this close to uniform is most likely
+// already compressed. 180 distinct bytes worth of collision entropy is
+// about 7.5 bits per byte.
+static const long long MAX_EFFECTIVE_SYMBOLS = 180;
+
+#ifdef RUCKSACK_HAVE_ZSTD
+static const int ZSTD_LEVEL = 12;
+#endif
+
+int rucksack_codec_available(int codec) {
+    switch (codec) {
+        case RuckSackCompressionNone:
+            return 1;
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+            return 1;
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+            return 1;
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+// uses collision entropy, which needs no logarithms: the data looks random
+// when the chance of two sampled bytes being equal is close to 1/256
+static int looks_random(const unsigned char *data, long size) {
+    long sample_size = (size < ENTROPY_SAMPLE_SIZE) ? size : ENTROPY_SAMPLE_SIZE;
+    long long counts[256] = {0};
+    for (long i = 0; i < sample_size; i += 1)
+        counts[data[i]] += 1;
+
+    long long collisions = 0;
+    for (int i = 0; i < 256; i += 1)
+        collisions += counts[i] * counts[i];
+    return collisions * MAX_EFFECTIVE_SYMBOLS < (long long)sample_size * sample_size;
+}
+
+int rucksack_codec_choose(const unsigned char *data, long size) {
+    if (size < MIN_COMPRESS_SIZE)
+        return RuckSackCompressionNone;
+    if (looks_random(data, size))
+        return RuckSackCompressionNone;
+
+    // zstd gets close to deflate's ratio while decompressing much faster;
+    // lz4 decompresses faster still but compresses less
+    if (rucksack_codec_available(RuckSackCompressionZstd))
+        return RuckSackCompressionZstd;
+    if (rucksack_codec_available(RuckSackCompressionLz4))
+        return RuckSackCompressionLz4;
+    if (rucksack_codec_available(RuckSackCompressionDeflate))
+        return RuckSackCompressionDeflate;
+    return RuckSackCompressionNone;
+}
+
+int rucksack_codec_compress(int codec, const unsigned char *src, long src_size,
+        unsigned char **dst, long *dst_size)
+{
+    *dst = NULL;
+    *dst_size = 0;
+
+    switch (codec) {
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+        {
+            uLongf out_size = compressBound(src_size);
+            unsigned char *out = malloc(out_size);
+            if (!out)
+                return RuckSackErrorNoMem;
+            int zerr = compress2(out, &out_size, src, src_size, Z_BEST_COMPRESSION);
+            if (zerr != Z_OK) {
+                free(out);
+                return (zerr == Z_MEM_ERROR) ? RuckSackErrorNoMem : RuckSackErrorCodecFailed;
+            }
+            *dst = out;
+            *dst_size = out_size;
+            return RuckSackErrorNone;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+        {
+            // the frame format rather than a single block, so that entries
+            // can be decompressed a piece at a time
+            size_t bound = LZ4F_compressFrameBound(src_size, NULL);
+            unsigned char *out = malloc(bound);
+            if (!out)
+                return RuckSackErrorNoMem;
+            size_t out_size = LZ4F_compressFrame(out, bound, src, src_size, NULL);
+            if (LZ4F_isError(out_size)) {
+                free(out);
+                return RuckSackErrorCodecFailed;
+            }
+            *dst = out;
+            *dst_size = out_size;
+            return RuckSackErrorNone;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+        {
+            size_t bound = ZSTD_compressBound(src_size);
+            unsigned char *out = malloc(bound);
+            if (!out)
+                return RuckSackErrorNoMem;
+            size_t out_size = ZSTD_compress(out, bound, src, src_size, ZSTD_LEVEL);
+            if (ZSTD_isError(out_size)) {
+                free(out);
+                return RuckSackErrorCodecFailed;
+            }
+            *dst = out;
+            *dst_size = out_size;
+            return RuckSackErrorNone;
+        }
+#endif
+        case RuckSackCompressionNone:
+            return RuckSackErrorNone;
+        default:
+            return RuckSackErrorCompressionUnsupported;
+    }
+}
+
+int rucksack_codec_decompress(int codec, const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size)
+{
+    switch (codec) {
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+        {
+            uLongf out_size = dst_size;
+            if (uncompress(dst, &out_size, src, src_size) != Z_OK || out_size != dst_size)
+                return RuckSackErrorCorruptData;
+            return RuckSackErrorNone;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+        {
+            struct RuckSackDecoder *decoder;
+            int err = rucksack_decoder_create(codec, &decoder);
+            if (err)
+                return err;
+            long written;
+            err = rucksack_decoder_run(decoder, &src, &src_size, dst, dst_size, &written);
+            rucksack_decoder_destroy(decoder);
+            if (err)
+                return err;
+            return (written == dst_size) ? RuckSackErrorNone : RuckSackErrorCorruptData;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+        {
+            size_t out_size = ZSTD_decompress(dst, dst_size, src, src_size);
+            if (ZSTD_isError(out_size) || out_size != (size_t)dst_size)
+                return RuckSackErrorCorruptData;
+            return RuckSackErrorNone;
+        }
+#endif
+        default:
+            return RuckSackErrorCompressionUnsupported;
+    }
+}
+
+struct RuckSackDecoder {
+    int codec;
+#ifdef RUCKSACK_HAVE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+};
+
+int rucksack_decoder_create(int codec, struct RuckSackDecoder **out_decoder) {
+    *out_decoder = NULL;
+    if (codec == RuckSackCompressionNone || !rucksack_codec_available(codec))
+        return RuckSackErrorCompressionUnsupported;
+
+    struct RuckSackDecoder *d = calloc(1, sizeof(struct RuckSackDecoder));
+    if (!d)
+        return RuckSackErrorNoMem;
+    d->codec = codec;
+
+    switch (codec) {
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+        {
+            int zerr = inflateInit(&d->zlib);
+            if (zerr != Z_OK) {
+                free(d);
+                return (zerr == Z_MEM_ERROR) ? RuckSackErrorNoMem : RuckSackErrorCodecFailed;
+            }
+            break;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION))) {
+                free(d);
+                return RuckSackErrorCodecFailed;
+            }
+            break;
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+            d->zstd = ZSTD_createDStream();
+            if (!d->zstd) {
+                free(d);
+                return RuckSackErrorNoMem;
+            }
+            if (ZSTD_isError(ZSTD_initDStream(d->zstd))) {
+                ZSTD_freeDStream(d->zstd);
+                free(d);
+                return RuckSackErrorCodecFailed;
+            }
+            break;
+#endif
+    }
+
+    *out_decoder = d;
+    return RuckSackErrorNone;
+}
+
+void rucksack_decoder_destroy(struct RuckSackDecoder *d) {
+    if (!d)
+        return;
+    switch (d->codec) {
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+            inflateEnd(&d->zlib);
+            break;
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+            LZ4F_freeDecompressionContext(d->lz4);
+            break;
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+            ZSTD_freeDStream(d->zstd);
+            break;
+#endif
+    }
+    free(d);
+}
+
+int rucksack_decoder_run(struct RuckSackDecoder *d, const unsigned char **src,
+        long *src_size, unsigned char *dst, long dst_size, long *written)
+{
+    *written = 0;
+    switch (d->codec) {
+#ifdef RUCKSACK_HAVE_ZLIB
+        case RuckSackCompressionDeflate:
+        {
+            // zlib counts in unsigned ints
+            uInt in_size = (*src_size > UINT_MAX) ? UINT_MAX : *src_size;
+            uInt out_size = (dst_size > UINT_MAX) ? UINT_MAX : dst_size;
+            d->zlib.next_in = (unsigned char *)*src;
+            d->zlib.avail_in = in_size;
+            d->zlib.next_out = dst;
+            d->zlib.avail_out = out_size;
+            int ret = inflate(&d->zlib, Z_NO_FLUSH);
+            // Z_BUF_ERROR only means that no progress was possible
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                return RuckSackErrorCorruptData;
+            *written = out_size - d->zlib.avail_out;
+            *src += in_size - d->zlib.avail_in;
+            *src_size -= in_size - d->zlib.avail_in;
+            return RuckSackErrorNone;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_LZ4
+        case RuckSackCompressionLz4:
+        {
+            // LZ4F_decompress may stop early, so keep going while there is
+            // room. it can also have output buffered from earlier input, so
+            // it gets called even when there is no input left.
+            while (*written < dst_size) {
+                size_t out_size = dst_size - *written;
+                size_t in_size = *src_size;
+                size_t ret = LZ4F_decompress(d->lz4, dst + *written, &out_size,
+                        *src, &in_size, NULL);
+                if (LZ4F_isError(ret))
+                    return RuckSackErrorCorruptData;
+                *written += out_size;
+                *src += in_size;
+                *src_size -= in_size;
+                if (out_size == 0 && in_size == 0)
+                    break;
+            }
+            return RuckSackErrorNone;
+        }
+#endif
+#ifdef RUCKSACK_HAVE_ZSTD
+        case RuckSackCompressionZstd:
+        {
+            ZSTD_inBuffer in = {*src, *src_size, 0};
+            ZSTD_outBuffer out = {dst, dst_size, 0};
+            size_t ret = ZSTD_decompressStream(d->zstd, &out, &in);
+            if (ZSTD_isError(ret))
+                return RuckSackErrorCorruptData;
+            *written = out.pos;
+            *src += in.pos;
+            *src_size -= in.pos;
+            return RuckSackErrorNone;
+        }
+#endif
+    }
+    return RuckSackErrorCompressionUnsupported;
+}
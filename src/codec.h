@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_CODEC_H_INCLUDED
+#define RUCKSACK_CODEC_H_INCLUDED
+
+// compression codecs for file entries. codec is one of enum
+// RuckSackCompression and errors are enum RuckSackError values.
+
+// whether this build can compress and decompress with codec
+int rucksack_codec_available(int codec);
+
+// picks a codec for data based on its size and how random its bytes look.
+// returns RuckSackCompressionNone for data that is not worth compressing.
+int rucksack_codec_choose(const unsigned char *data, long size);
+
+// compresses src into a newly allocated buffer. if the codec cannot handle
+// data this large, sets *dst to NULL and returns no error.
+int rucksack_codec_compress(int codec, const unsigned char *src, long src_size,
+        unsigned char **dst, long *dst_size);
+
+// dst_size must be exactly the uncompressed size
+int rucksack_codec_decompress(int codec, const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size);
+
+// incremental decompression, for reading entries a piece at a time
+struct RuckSackDecoder;
+
+int rucksack_decoder_create(int codec, struct RuckSackDecoder **decoder);
+void rucksack_decoder_destroy(struct RuckSackDecoder *decoder);
+
+// decompresses as much of the *src_size bytes at *src as fits in dst_size
+// bytes, advancing *src and *src_size past the input it used up. *written
+// may be 0 if the decoder needs more input.
+int rucksack_decoder_run(struct RuckSackDecoder *decoder, const unsigned char **src,
+        long *src_size, unsigned char *dst, long dst_size, long *written);
+
+#endif /* RUCKSACK_CODEC_H_INCLUDED */
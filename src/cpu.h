@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_CPU_H_INCLUDED
+#define RUCKSACK_CPU_H_INCLUDED
+
+// how many threads to start when the caller leaves it to us: one per online
+// CPU, or 4 when that cannot be found out
+int rucksack_cpu_count(void);
+
+#endif /* RUCKSACK_CPU_H_INCLUDED */
@@ -29,6 +29,7 @@
 #include "path.h"
 #include "util.h"
 #include "mkdirp.h"
+#include "mipmap.h"
 
 struct RuckSackBundle *bundle;
 static char buffer[16384];
@@ -37,6 +38,7 @@ static struct LaxJsonContext *json;
 enum State {
     StateStart,
     StateTopLevelProp,
+    StateTopLevelAlignment,
     StateDone,
     StateTextures,
     StateTextureName,
@@ -50,33 +52,48 @@ enum State {
     StateImagePropAnchorX,
     StateImagePropAnchorY,
     StateImagePropPath,
+    StateImagePropTrim,
     StateExpectTextureObject,
     StateTextureProp,
     StateTextureMaxWidth,
     StateTextureMaxHeight,
     StateTexturePow2,
     StateTextureAllowRotate90,
+    StateTextureFormat,
+    StateTextureCompression,
+    StateTextureMipLevels,
+    StateTextureMaxPages,
+    StateTextureSmallestSize,
+    StateTexturePacking,
+    StateTextureSortBy,
+    StateTextureTrim,
     StateExpectFilesObject,
     StateFileName,
     StateFileObjectBegin,
     StateFilePropName,
     StateFilePropPath,
+    StateFilePropCompression,
+    StateFilePropAlignment,
     StateExpectGlobArray,
     StateGlobObject,
     StateGlobObjectProp,
     StateGlobValueGlob,
     StateGlobValuePrefix,
     StateGlobValuePath,
+    StateGlobValueCompression,
+    StateGlobValueAlignment,
     StateGlobImageObject,
     StateGlobImageObjectProp,
     StateGlobImageValueGlob,
     StateGlobImageValuePrefix,
     StateGlobImageValuePath,
+    StateGlobImageValueTrim,
 };
 
 static const char *STATE_STR[] = {
     "StateStart",
     "StateTopLevelProp",
+    "StateTopLevelAlignment",
     "StateDone",
     "StateTextures",
     "StateTextureName",
@@ -90,28 +107,42 @@ static const char *STATE_STR[] = {
     "StateImagePropAnchorX",
     "StateImagePropAnchorY",
     "StateImagePropPath",
+    "StateImagePropTrim",
     "StateExpectTextureObject",
     "StateTextureProp",
     "StateTextureMaxWidth",
     "StateTextureMaxHeight",
     "StateTexturePow2",
     "StateTextureAllowRotate90",
+    "StateTextureFormat",
+    "StateTextureCompression",
+    "StateTextureMipLevels",
+    "StateTextureMaxPages",
+    "StateTextureSmallestSize",
+    "StateTexturePacking",
+    "StateTextureSortBy",
+    "StateTextureTrim",
     "StateExpectFilesObject",
     "StateFileName",
     "StateFileObjectBegin",
     "StateFilePropName",
     "StateFilePropPath",
+    "StateFilePropCompression",
+    "StateFilePropAlignment",
     "StateExpectGlobArray",
     "StateGlobObject",
     "StateGlobObjectProp",
     "StateGlobValueGlob",
     "StateGlobValuePrefix",
     "StateGlobValuePath",
+    "StateGlobValueCompression",
+    "StateGlobValueAlignment",
     "StateGlobImageObject",
     "StateGlobImageObjectProp",
     "StateGlobImageValueGlob",
     "StateGlobImageValuePrefix",
     "StateGlobImageValuePath",
+    "StateGlobImageValueTrim",
 };
 
 static enum State state;
@@ -135,6 +166,14 @@ static struct RuckSackImage **bundle_texture_images = NULL;
 static char *file_key = NULL;
 static int file_key_size = 0;
 static char *file_path = NULL;
+static int file_compression = RuckSackCompressionAuto;
+static long file_alignment = 0;
+
+// files that need to be (re)written. they are added all at once at the end
+// so that they can be compressed in parallel.
+static struct RuckSackFileSource *pending_files = NULL;
+static long pending_file_count = 0;
+static long pending_file_capacity = 0;
 
 struct RuckSackImage *image = NULL;
 
@@ -145,6 +184,8 @@ static struct RuckSackStringList *deps_list = NULL;
 static char *glob_glob = NULL;
 static char *glob_path = NULL;
 static char *glob_prefix = NULL;
+static int glob_compression = RuckSackCompressionAuto;
+static long glob_alignment = 0;
 
 // after collecting the anchor property, sets state to this one
 static enum State anchor_next_state;
@@ -177,6 +218,46 @@ static const char *JSON_TYPE_STR[] = {
     "Null",
 };
 
+// indexed by enum RuckSackTextureFormat
+static const char *TEXTURE_FORMAT_STR[] = {
+    "png",
+    "rgba8",
+    "bc1",
+    "bc3",
+    "bc7",
+};
+static const int TEXTURE_FORMAT_COUNT =
+    sizeof(TEXTURE_FORMAT_STR) / sizeof(TEXTURE_FORMAT_STR[0]);
+
+// indexed by enum RuckSackPacking
+static const char *PACKING_STR[] = {
+    "shortSideFit",
+    "longSideFit",
+    "areaFit",
+    "bottomLeft",
+    "contactPoint",
+    "best",
+};
+static const int PACKING_COUNT = sizeof(PACKING_STR) / sizeof(PACKING_STR[0]);
+
+// indexed by enum RuckSackSortBy
+static const char *SORT_BY_STR[] = {
+    "maxSide",
+    "area",
+    "perimeter",
+    "height",
+};
+static const int SORT_BY_COUNT = sizeof(SORT_BY_STR) / sizeof(SORT_BY_STR[0]);
+
+// the index of value in names, or -1
+static int find_name(const char **names, int count, const char *value) {
+    for (int i = 0; i < count; i += 1) {
+        if (strcmp(value, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
 static char *dupe_c_string(const char *str) {
     int len = -1;
     return dupe_string(str, &len);
@@ -243,10 +324,13 @@ static void check_if_image_dirty(void) {
     for (int i = 0; i < bundle_texture_image_count; i += 1) {
         struct RuckSackImage *bundle_image = bundle_texture_images[i];
         if (memneql(bundle_image->key, bundle_image->key_size, image->key, image->key_size) == 0) {
+            // a texture that trims every image trims this one either way.
+            // the trim of the texture itself is compared with the rest of it.
             dirty_texture_flag = bundle_image->anchor != image->anchor ||
                 (image->anchor == RuckSackAnchorExplicit &&
                 (bundle_image->anchor_x != image->anchor_x ||
-                bundle_image->anchor_y != image->anchor_y));
+                bundle_image->anchor_y != image->anchor_y)) ||
+                (!bundle_texture->trim && bundle_image->trim != image->trim);
             return;
         }
     }
@@ -255,6 +339,18 @@ static void check_if_image_dirty(void) {
     dirty_texture_flag = 1;
 }
 
+// whether a texture in the bundle has the mip levels that the manifest asks
+// for. a full chain is stored as the number of levels it came to.
+static int mip_levels_match(struct RuckSackTexture *stored, int wanted) {
+    if (wanted == stored->mip_levels)
+        return 1;
+    if (wanted > 0 && wanted < stored->mip_levels)
+        return 0;
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(stored, 0, &level);
+    return stored->mip_levels == rucksack_mipmap_full_count(level.width, level.height);
+}
+
 static int add_texture_if_outdated(struct RuckSackBundle *bundle, 
         struct RuckSackTexture *texture)
 {
@@ -263,9 +359,18 @@ static int add_texture_if_outdated(struct RuckSackBundle *bundle,
             bundle_texture->max_width == texture->max_width &&
             bundle_texture->max_height == texture->max_height &&
             bundle_texture->pow2 == texture->pow2 &&
-            bundle_texture->allow_r90 == texture->allow_r90;
+            bundle_texture->allow_r90 == texture->allow_r90 &&
+            bundle_texture->smallest_size == texture->smallest_size &&
+            bundle_texture->packing == texture->packing &&
+            bundle_texture->sort_by == texture->sort_by &&
+            bundle_texture->trim == texture->trim &&
+            bundle_texture->format == texture->format &&
+            rucksack_texture_requested_compression(bundle_texture) == texture->compression &&
+            mip_levels_match(bundle_texture, texture->mip_levels) &&
+            (texture->max_pages == 0 ||
+             rucksack_texture_page_count(bundle_texture) <= texture->max_pages);
         rucksack_texture_touch(bundle_texture);
-        rucksack_texture_destroy(bundle_texture);
+        rucksack_texture_close(bundle_texture);
         free(bundle_texture_images);
         bundle_texture_images = NULL;
         if (up_to_date) {
@@ -286,8 +391,87 @@ static int add_texture_if_outdated(struct RuckSackBundle *bundle,
     return 0;
 }
 
+static int parse_compression(const char *value, int *compression) {
+    if (strcmp(value, "none") == 0) {
+        *compression = RuckSackCompressionNone;
+    } else if (strcmp(value, "deflate") == 0) {
+        *compression = RuckSackCompressionDeflate;
+    } else if (strcmp(value, "lz4") == 0) {
+        *compression = RuckSackCompressionLz4;
+    } else if (strcmp(value, "zstd") == 0) {
+        *compression = RuckSackCompressionZstd;
+    } else if (strcmp(value, "auto") == 0) {
+        *compression = RuckSackCompressionAuto;
+    } else {
+        snprintf(strbuf, sizeof(strbuf), "unknown compression value: %s", value);
+        return parse_error(strbuf);
+    }
+    if (*compression != RuckSackCompressionAuto &&
+        !rucksack_compression_available(*compression))
+    {
+        snprintf(strbuf, sizeof(strbuf), "compression not supported by this build: %s", value);
+        return parse_error(strbuf);
+    }
+    return 0;
+}
+
+static int parse_alignment(double x, long *alignment) {
+    long value = (long)x;
+    if (x != (double)value || value < 1 || value > (1L << 24) || (value & (value - 1)))
+        return parse_error("alignment must be a power of 2 up to 16MB");
+    *alignment = value;
+    return 0;
+}
+
+static int add_pending_file(char *key, int key_size, char *path, int compression,
+        long alignment)
+{
+    if (pending_file_count >= pending_file_capacity) {
+        long new_capacity = pending_file_capacity ? pending_file_capacity * 2 : 64;
+        struct RuckSackFileSource *new_files = realloc(pending_files,
+                new_capacity * sizeof(struct RuckSackFileSource));
+        if (!new_files)
+            return parse_error("out of memory");
+        pending_files = new_files;
+        pending_file_capacity = new_capacity;
+    }
+    struct RuckSackFileSource *src = &pending_files[pending_file_count];
+    src->key = memstrclone(key, key_size);
+    src->key_size = key_size;
+    src->path = dupe_c_string(path);
+    src->compression = compression;
+    src->alignment = alignment;
+    if (!src->key || !src->path)
+        return parse_error("out of memory");
+    pending_file_count += 1;
+    return 0;
+}
+
+static void free_pending_files(void) {
+    for (long i = 0; i < pending_file_count; i += 1) {
+        free((char *)pending_files[i].key);
+        free((char *)pending_files[i].path);
+    }
+    free(pending_files);
+    pending_files = NULL;
+    pending_file_count = 0;
+    pending_file_capacity = 0;
+}
+
+static int add_pending_files(struct RuckSackBundle *bundle) {
+    long failed_index;
+    int err = rucksack_bundle_add_files(bundle, pending_files, pending_file_count,
+            0, &failed_index);
+    if (err) {
+        fprintf(stderr, "unable to add %s: %s\n", pending_files[failed_index].path,
+                rucksack_err_str(err));
+    }
+    free_pending_files();
+    return err;
+}
+
 static int add_file_if_outdated(struct RuckSackBundle *bundle,
-        char *key, int key_size, char *path)
+        char *key, int key_size, char *path, int compression, long alignment)
 {
     struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
     if (entry) {
@@ -295,7 +479,13 @@ static int add_file_if_outdated(struct RuckSackBundle *bundle,
         struct stat st;
         stat(path, &st);
         long file_mtime = st.st_mtime;
-        if (file_mtime <= bundle_mtime) {
+        long wanted_alignment = alignment ? alignment : rucksack_bundle_alignment(bundle);
+        // auto is happy with whatever was stored
+        if (file_mtime <= bundle_mtime &&
+            rucksack_file_alignment(entry) % wanted_alignment == 0 &&
+            (compression == RuckSackCompressionAuto ||
+             rucksack_file_compression(entry) == compression))
+        {
             if (verbose)
                 fprintf(stderr, "File up to date: %s\n", key);
             rucksack_file_touch(entry);
@@ -307,12 +497,7 @@ static int add_file_if_outdated(struct RuckSackBundle *bundle,
         fprintf(stderr, "New file: %s\n", key);
     }
     append_dep(path);
-    int err = rucksack_bundle_add_file(bundle, key, key_size, path);
-    if (err) {
-        snprintf(strbuf, sizeof(strbuf), "unable to add %s: %s", path, rucksack_err_str(err));
-        return parse_error(strbuf);
-    }
-    return 0;
+    return add_pending_file(key, key_size, path, compression, alignment);
 }
 
 static int perform_glob(int (*match_callback)(char *key, int key_size, char *path)) {
@@ -365,7 +550,8 @@ static int perform_glob(int (*match_callback)(char *key, int key_size, char *pat
 }
 
 static int add_glob_match_to_bundle(char *key, int key_size, char *path) {
-    return add_file_if_outdated(bundle, key, key_size, path);
+    return add_file_if_outdated(bundle, key, key_size, path, glob_compression,
+            glob_alignment);
 }
 
 static int glob_insert_files(void) {
@@ -409,6 +595,8 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 state = StateExpectFilesObject;
             } else if (strcmp(value, "globFiles") == 0) {
                 state = StateExpectGlobArray;
+            } else if (strcmp(value, "alignment") == 0) {
+                state = StateTopLevelAlignment;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown top level property: %s", value);
                 return parse_error(strbuf);
@@ -446,6 +634,7 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
             return parse_error("expected globImages array, not string");
         case StateImageName:
             image->anchor = RuckSackAnchorCenter;
+            image->trim = 0;
             image->path = NULL;
             image->key = memstrclone(value, length);
             if (!image->key)
@@ -463,6 +652,10 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
         case StateFilePropName:
             if (strcmp(value, "path") == 0) {
                 state = StateFilePropPath;
+            } else if (strcmp(value, "compression") == 0) {
+                state = StateFilePropCompression;
+            } else if (strcmp(value, "alignment") == 0) {
+                state = StateFilePropAlignment;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown file property: %s", value);
                 return parse_error(strbuf);
@@ -474,6 +667,8 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 anchor_next_state = StateImagePropName;
             } else if (strcmp(value, "path") == 0) {
                 state = StateImagePropPath;
+            } else if (strcmp(value, "trim") == 0) {
+                state = StateImagePropTrim;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown image property: %s", value);
                 return parse_error(strbuf);
@@ -523,6 +718,40 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 return parse_error("out of memory");
             state = StateFilePropName;
             break;
+        case StateTextureFormat:
+            texture->format = find_name(TEXTURE_FORMAT_STR, TEXTURE_FORMAT_COUNT, value);
+            if (texture->format == -1) {
+                snprintf(strbuf, sizeof(strbuf), "unknown texture format: %s", value);
+                return parse_error(strbuf);
+            }
+            state = StateTextureProp;
+            break;
+        case StateTextureCompression:
+            if (parse_compression(value, &texture->compression))
+                return -1;
+            state = StateTextureProp;
+            break;
+        case StateTexturePacking:
+            texture->packing = find_name(PACKING_STR, PACKING_COUNT, value);
+            if (texture->packing == -1) {
+                snprintf(strbuf, sizeof(strbuf), "unknown packing: %s", value);
+                return parse_error(strbuf);
+            }
+            state = StateTextureProp;
+            break;
+        case StateTextureSortBy:
+            texture->sort_by = find_name(SORT_BY_STR, SORT_BY_COUNT, value);
+            if (texture->sort_by == -1) {
+                snprintf(strbuf, sizeof(strbuf), "unknown sort order: %s", value);
+                return parse_error(strbuf);
+            }
+            state = StateTextureProp;
+            break;
+        case StateFilePropCompression:
+            if (parse_compression(value, &file_compression))
+                return -1;
+            state = StateFilePropName;
+            break;
         case StateImagePropPath:
             image->path = resolve_path(value);
             if (!image->path)
@@ -542,6 +771,22 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 state = StateTexturePow2;
             } else if (strcmp(value, "allowRotate90") == 0) {
                 state = StateTextureAllowRotate90;
+            } else if (strcmp(value, "format") == 0) {
+                state = StateTextureFormat;
+            } else if (strcmp(value, "compression") == 0) {
+                state = StateTextureCompression;
+            } else if (strcmp(value, "mipLevels") == 0) {
+                state = StateTextureMipLevels;
+            } else if (strcmp(value, "maxPages") == 0) {
+                state = StateTextureMaxPages;
+            } else if (strcmp(value, "smallestSize") == 0) {
+                state = StateTextureSmallestSize;
+            } else if (strcmp(value, "packing") == 0) {
+                state = StateTexturePacking;
+            } else if (strcmp(value, "sortBy") == 0) {
+                state = StateTextureSortBy;
+            } else if (strcmp(value, "trim") == 0) {
+                state = StateTextureTrim;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown texture property: %s", value);
                 return parse_error(strbuf);
@@ -554,6 +799,10 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 state = StateGlobValuePrefix;
             } else if (strcmp(value, "path") == 0) {
                 state = StateGlobValuePath;
+            } else if (strcmp(value, "compression") == 0) {
+                state = StateGlobValueCompression;
+            } else if (strcmp(value, "alignment") == 0) {
+                state = StateGlobValueAlignment;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown globFiles property: %s", value);
                 return parse_error(strbuf);
@@ -569,6 +818,8 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
             } else if (strcmp(value, "anchor") == 0) {
                 state = StateImagePropAnchor;
                 anchor_next_state = StateGlobImageObjectProp;
+            } else if (strcmp(value, "trim") == 0) {
+                state = StateGlobImageValueTrim;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown globImages property: %s", value);
                 return parse_error(strbuf);
@@ -586,6 +837,11 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
             glob_prefix = dupe_c_string(value);
             state = StateGlobObjectProp;
             break;
+        case StateGlobValueCompression:
+            if (parse_compression(value, &glob_compression))
+                return -1;
+            state = StateGlobObjectProp;
+            break;
         case StateGlobImageValueGlob:
             glob_glob = dupe_c_string(value);
             state = StateGlobImageObjectProp;
@@ -606,6 +862,7 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
 }
 
 static int on_number(struct LaxJsonContext *json, double x) {
+    long alignment;
     if (debug_mode)
         fprintf(stderr, "state: %s, number: %f\n", STATE_STR[state], x);
     switch (state) {
@@ -645,6 +902,34 @@ static int on_number(struct LaxJsonContext *json, double x) {
             texture->max_height = (int)x;
             state = StateTextureProp;
             break;
+        case StateTextureMipLevels:
+            if (x != (double)(int)x || x < 0)
+                return parse_error("expected non-negative integer");
+            texture->mip_levels = (int)x;
+            state = StateTextureProp;
+            break;
+        case StateTextureMaxPages:
+            if (x != (double)(int)x || x < 0)
+                return parse_error("expected non-negative integer");
+            texture->max_pages = (int)x;
+            state = StateTextureProp;
+            break;
+        case StateTopLevelAlignment:
+            if (parse_alignment(x, &alignment))
+                return -1;
+            rucksack_bundle_set_alignment(bundle, alignment);
+            state = StateTopLevelProp;
+            break;
+        case StateFilePropAlignment:
+            if (parse_alignment(x, &file_alignment))
+                return -1;
+            state = StateFilePropName;
+            break;
+        case StateGlobValueAlignment:
+            if (parse_alignment(x, &glob_alignment))
+                return -1;
+            state = StateGlobObjectProp;
+            break;
         default:
             return parse_error("unexpected number");
     }
@@ -682,6 +967,46 @@ static int on_primitive(struct LaxJsonContext *json, enum LaxJsonType type) {
             }
             state = StateTextureProp;
             break;
+        case StateTextureSmallestSize:
+            switch (type) {
+                case LaxJsonTypeTrue:
+                    texture->smallest_size = 1;
+                    break;
+                case LaxJsonTypeFalse:
+                    texture->smallest_size = 0;
+                    break;
+                default:
+                    return parse_error("expected true or false");
+            }
+            state = StateTextureProp;
+            break;
+        case StateTextureTrim:
+            switch (type) {
+                case LaxJsonTypeTrue:
+                    texture->trim = 1;
+                    break;
+                case LaxJsonTypeFalse:
+                    texture->trim = 0;
+                    break;
+                default:
+                    return parse_error("expected true or false");
+            }
+            state = StateTextureProp;
+            break;
+        case StateImagePropTrim:
+        case StateGlobImageValueTrim:
+            switch (type) {
+                case LaxJsonTypeTrue:
+                    image->trim = 1;
+                    break;
+                case LaxJsonTypeFalse:
+                    image->trim = 0;
+                    break;
+                default:
+                    return parse_error("expected true or false");
+            }
+            state = (state == StateImagePropTrim) ? StateImagePropName : StateGlobImageObjectProp;
+            break;
         default:
             return parse_error("unexpected primitive");
     }
@@ -724,6 +1049,8 @@ static int on_begin(struct LaxJsonContext *json, enum LaxJsonType type) {
                 break;
             case StateFileObjectBegin:
                 state = StateFilePropName;
+                file_compression = RuckSackCompressionAuto;
+                file_alignment = 0;
                 break;
             case StateImagePropAnchor:
                 state = StateImagePropAnchorObject;
@@ -737,14 +1064,17 @@ static int on_begin(struct LaxJsonContext *json, enum LaxJsonType type) {
                 glob_glob = NULL;
                 glob_path = NULL;
                 glob_prefix = NULL;
+                glob_compression = RuckSackCompressionAuto;
+                glob_alignment = 0;
                 break;
             case StateGlobImageObject:
                 state = StateGlobImageObjectProp;
                 glob_glob = NULL;
                 glob_path = NULL;
                 glob_prefix = NULL;
-                // image is used to store anchor information
+                // image is used to store anchor and trim information
                 image->anchor = RuckSackAnchorCenter;
+                image->trim = 0;
                 break;
             default:
                 return parse_error("unexpected object");
@@ -778,13 +1108,14 @@ static int on_end(struct LaxJsonContext *json, enum LaxJsonType type) {
 
             free(image->path);
             image->path = NULL;
-            free(image->key);
+            free((char *)image->key);
             image->key = NULL;
 
             state = StateImageName;
             break;
         case StateFilePropName:
-            err = add_file_if_outdated(bundle, file_key, file_key_size, file_path);
+            err = add_file_if_outdated(bundle, file_key, file_key_size, file_path,
+                    file_compression, file_alignment);
             if (err) return err;
 
             free(file_path);
@@ -948,6 +1279,12 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
         parse_error("unexpected EOF");
 
     if (parse_err_occurred) {
+        free_pending_files();
+        rucksack_bundle_close(bundle);
+        return 1;
+    }
+
+    if (add_pending_files(bundle)) {
         rucksack_bundle_close(bundle);
         return 1;
     }
@@ -991,6 +1328,26 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
     return 0;
 }
 
+// streams the contents of e to out_f so that big files need no big buffer
+static int write_entry_to_file(struct RuckSackFileEntry *e, FILE *out_f) {
+    struct RuckSackInStream *stream;
+    int rs_err = rucksack_file_open_stream(e, &stream);
+    if (rs_err)
+        return rs_err;
+    for (;;) {
+        long amt_read;
+        rs_err = rucksack_in_stream_read(stream, buffer, sizeof(buffer), &amt_read);
+        if (rs_err || amt_read == 0)
+            break;
+        if (fwrite(buffer, 1, amt_read, out_f) != amt_read) {
+            rs_err = RuckSackErrorFileAccess;
+            break;
+        }
+    }
+    rucksack_in_stream_close(stream);
+    return rs_err;
+}
+
 static int command_cat(char *arg0, int argc, char *argv[]) {
     char *bundle_filename = NULL;
     char *resource_name = NULL;
@@ -1071,6 +1428,24 @@ static int command_cat(char *arg0, int argc, char *argv[]) {
             printf("  \"maxHeight\": %d,\n", texture->max_height);
             printf("  \"pow2\": %d,\n", texture->pow2);
             printf("  \"allowRotate90\": %d,\n", texture->allow_r90);
+            printf("  \"smallestSize\": %d,\n", texture->smallest_size);
+            printf("  \"packing\": \"%s\",\n",
+                    (texture->packing >= 0 && texture->packing < PACKING_COUNT) ?
+                    PACKING_STR[texture->packing] : "unknown");
+            printf("  \"sortBy\": \"%s\",\n",
+                    (texture->sort_by >= 0 && texture->sort_by < SORT_BY_COUNT) ?
+                    SORT_BY_STR[texture->sort_by] : "unknown");
+            printf("  \"trim\": %d,\n", texture->trim);
+            struct RuckSackTextureLevel level;
+            rucksack_texture_get_level(texture, 0, &level);
+            int format = texture->format;
+            printf("  \"format\": \"%s\",\n",
+                    (format >= 0 && format < TEXTURE_FORMAT_COUNT) ?
+                    TEXTURE_FORMAT_STR[format] : "unknown");
+            printf("  \"width\": %d,\n", level.width);
+            printf("  \"height\": %d,\n", level.height);
+            printf("  \"mipLevels\": %d,\n", texture->mip_levels);
+            printf("  \"pages\": %ld,\n", rucksack_texture_page_count(texture));
             printf("  \"images\": {\n");
             long image_count = rucksack_texture_image_count(texture);
             struct RuckSackImage **images = malloc(sizeof(struct RuckSackImage *) * image_count);
@@ -1083,6 +1458,13 @@ static int command_cat(char *arg0, int argc, char *argv[]) {
                 printf("      \"w\": %d,\n", image->width);
                 printf("      \"h\": %d,\n", image->height);
                 printf("      \"r90\": %d,\n", image->r90);
+                printf("      \"page\": %d,\n", image->page);
+                printf("      \"trim\": {\n");
+                printf("        \"x\": %d,\n", image->trim_x);
+                printf("        \"y\": %d,\n", image->trim_y);
+                printf("        \"w\": %d,\n", image->full_width);
+                printf("        \"h\": %d\n", image->full_height);
+                printf("      },\n");
                 printf("      \"anchor\": {\n");
                 printf("        \"x\": %f,\n", image->anchor_x);
                 printf("        \"y\": %f\n", image->anchor_y);
@@ -1095,27 +1477,11 @@ static int command_cat(char *arg0, int argc, char *argv[]) {
         }
         rucksack_texture_close(texture);
     } else {
-        long size = rucksack_file_size(entry);
-
-        unsigned char *buffer = malloc(size);
-        if (!buffer) {
-            fprintf(stderr, "out of memory\n");
-            return 1;
-        }
-
-        rs_err = rucksack_file_read(entry, buffer);
-
+        rs_err = write_entry_to_file(entry, stdout);
         if (rs_err) {
             fprintf(stderr, "unable to read file entry: %s\n", rucksack_err_str(rs_err));
             return 1;
         }
-
-        if (fwrite(buffer, 1, size, stdout) != size) {
-            fprintf(stderr, "error writing to stdout\n");
-            return 1;
-        }
-
-        free(buffer);
     }
 
     rs_err = rucksack_bundle_close(bundle);
@@ -1134,13 +1500,21 @@ static int help_usage(char *arg0) {
 }
 
 static int list_usage(char *arg0) {
-    fprintf(stderr, "Usage: %s list bundlefile\n"
+    fprintf(stderr, "Usage: %s list bundlefile [prefix]\n"
+            "\n"
+            "Lists the keys that start with prefix, or all of them, in order.\n"
             , arg0);
     return 1;
 }
 
+static int print_entry_name(struct RuckSackFileEntry *entry, void *userdata) {
+    printf("%s\n", rucksack_file_name(entry));
+    return 0;
+}
+
 static int command_list(char *arg0, int argc, char *argv[]) {
     char *bundle_filename = NULL;
+    char *prefix = "";
 
     for (int i = 0; i < argc; i += 1) {
         char *arg = argv[i];
@@ -1148,6 +1522,8 @@ static int command_list(char *arg0, int argc, char *argv[]) {
             return list_usage(arg0);
         } else if (!bundle_filename) {
             bundle_filename = arg;
+        } else if (!prefix[0]) {
+            prefix = arg;
         } else {
             return list_usage(arg0);
         }
@@ -1162,24 +1538,12 @@ static int command_list(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    size_t count = rucksack_bundle_file_count(bundle);
-
-    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
-
-    if (!entries) {
-        fprintf(stderr, "out of memory\n");
+    rs_err = rucksack_bundle_iter_prefix(bundle, prefix, -1, print_entry_name, NULL);
+    if (rs_err) {
+        fprintf(stderr, "unable to list %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
         return 1;
     }
 
-    rucksack_bundle_get_files(bundle, entries);
-
-    for (int i = 0; i < count; i += 1) {
-        struct RuckSackFileEntry *e = entries[i];
-        printf("%s\n", rucksack_file_name(e));
-    }
-
-    free(entries);
-
     rs_err = rucksack_bundle_close(bundle);
     if (rs_err) {
         fprintf(stderr, "unable to close bundle: %s\n", rucksack_err_str(rs_err));
@@ -1242,7 +1606,11 @@ static int command_strip(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    rucksack_bundle_get_files(bundle, entries);
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
 
     long headers_size = rucksack_bundle_get_headers_byte_count(bundle);
 
@@ -1252,30 +1620,32 @@ static int command_strip(char *arg0, int argc, char *argv[]) {
         fprintf(stderr, "unable to open %s: %s\n", tmp_filename, rucksack_err_str(rs_err));
         return 1;
     }
-    // determine max file size
+    rucksack_bundle_set_alignment(out_bundle, rucksack_bundle_alignment(bundle));
+    // determine max file size. entries are copied as stored so that
+    // compressed entries stay compressed.
     long max_file_size = 0;
     for (int i = 0; i < count; i += 1) {
         struct RuckSackFileEntry *e = entries[i];
-        long file_size = rucksack_file_size(e);
+        long file_size = rucksack_file_stored_size(e);
         if (file_size > max_file_size)
             max_file_size = file_size;
     }
     unsigned char *buffer = malloc(max_file_size);
     for (int i = 0; i < count; i += 1) {
         struct RuckSackFileEntry *e = entries[i];
-        long file_size = rucksack_file_size(e);
+        long file_size = rucksack_file_stored_size(e);
         const char *file_name = rucksack_file_name(e);
         int file_name_size = rucksack_file_name_size(e);
         long file_mtime = rucksack_file_mtime(e);
         struct RuckSackOutStream *stream;
-        rs_err = rucksack_bundle_add_stream_precise(out_bundle, file_name,
-            file_name_size, file_size, &stream, file_mtime);
+        rs_err = rucksack_bundle_add_stream_precise_aligned(out_bundle, file_name,
+            file_name_size, file_size, rucksack_file_alignment(e), &stream, file_mtime);
         if (rs_err) {
             fprintf(stderr, "unable to add stream: %s\n", rucksack_err_str(rs_err));
             remove(tmp_filename);
             return 1;
         }
-        rs_err = rucksack_file_read(e, buffer);
+        rs_err = rucksack_file_read_stored(e, buffer);
         if (rs_err) {
             fprintf(stderr, "unable to read %s: %s\n", file_name, rucksack_err_str(rs_err));
             remove(tmp_filename);
@@ -1287,6 +1657,9 @@ static int command_strip(char *arg0, int argc, char *argv[]) {
             remove(tmp_filename);
             return 1;
         }
+        int compression = rucksack_file_compression(e);
+        if (compression != RuckSackCompressionNone)
+            rucksack_stream_set_compression(stream, compression, rucksack_file_size(e));
         rucksack_stream_close(stream);
     }
     free(buffer);
@@ -1362,8 +1735,92 @@ static int command_rm(char *arg0, int argc, char *argv[]) {
     return 0;
 }
 
+static int verify_usage(char *arg0) {
+    fprintf(stderr, "Usage: %s verify bundlefile\n", arg0);
+    return 1;
+}
+
+static int command_verify(char *arg0, int argc, char *argv[]) {
+    char *bundle_filename = NULL;
+
+    for (int i = 0; i < argc; i += 1) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] == '-') {
+            return verify_usage(arg0);
+        } else if (!bundle_filename) {
+            bundle_filename = arg;
+        } else {
+            return verify_usage(arg0);
+        }
+    }
+
+    if (!bundle_filename)
+        return verify_usage(arg0);
+
+    int rs_err = rucksack_bundle_open_mmap(bundle_filename, &bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    int ret = 1;
+    long count = rucksack_bundle_file_count(bundle);
+    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
+    int *results = malloc(count * sizeof(int));
+    if ((!entries || !results) && count > 0) {
+        fprintf(stderr, "out of memory\n");
+        goto cleanup;
+    }
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        goto cleanup;
+    }
+
+    rs_err = rucksack_bundle_verify(bundle, 0, results);
+    if (rs_err) {
+        fprintf(stderr, "unable to verify %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        goto cleanup;
+    }
+
+    long damaged_count = 0;
+    long unchecked_count = 0;
+    for (long i = 0; i < count; i += 1) {
+        unsigned long checksum;
+        if (results[i]) {
+            fprintf(stderr, "%s: %s\n", rucksack_file_name(entries[i]),
+                    rucksack_err_str(results[i]));
+            damaged_count += 1;
+        } else if (!rucksack_file_checksum(entries[i], &checksum)) {
+            unchecked_count += 1;
+        }
+    }
+
+    printf("%ld files checked, %ld damaged", count - unchecked_count, damaged_count);
+    if (unchecked_count > 0)
+        printf(", %ld without a checksum", unchecked_count);
+    printf("\n");
+    ret = damaged_count > 0;
+
+cleanup:
+    free(results);
+    free(entries);
+
+    rs_err = rucksack_bundle_close(bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to close bundle: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    return ret;
+}
+
 static int unpack_usage(char *arg0) {
-    fprintf(stderr, "Usage: %s unpack bundlefile [outputdir]\n", arg0);
+    fprintf(stderr, "Usage: %s unpack bundlefile [outputdir]\n"
+            "\n"
+            "Options:\n"
+            "  [--prefix prefix]  only unpack the files whose key starts with prefix\n"
+            , arg0);
     return 1;
 }
 
@@ -1395,14 +1852,82 @@ static void json_escape(const char *str, char *out) {
     *out = 0;
 }
 
+struct UnpackContext {
+    const char *output_dir;
+    FILE *manifest_f;
+    int indent;
+    int indent_amt;
+    int count;
+    int failed;
+};
+
+static int unpack_entry(struct RuckSackFileEntry *e, void *userdata) {
+    struct UnpackContext *ctx = userdata;
+    FILE *manifest_f = ctx->manifest_f;
+
+    if (ctx->count == 0) {
+        fprintf(manifest_f, "%*sfiles: {\n", ctx->indent, "");
+        ctx->indent += ctx->indent_amt;
+    }
+    ctx->count += 1;
+
+    const char *name = rucksack_file_name(e);
+    json_escape(name, strbuf4);
+    fprintf(manifest_f, "%*s%s: {\n", ctx->indent, "", strbuf4);
+    ctx->indent += ctx->indent_amt;
+
+    json_escape(name, strbuf4);
+    fprintf(manifest_f, "%*spath: %s,\n", ctx->indent, "", strbuf4);
+
+    ctx->indent -= ctx->indent_amt;
+    fprintf(manifest_f, "%*s},\n", ctx->indent, "");
+
+    path_join(ctx->output_dir, name, strbuf);
+    path_dirname(strbuf, strbuf4);
+    if (rucksack_mkdirp(strbuf4)) {
+        fprintf(stderr, "unable to mkdir %s\n", strbuf4);
+        ctx->failed = 1;
+        return 1;
+    }
+    FILE *out_f = fopen(strbuf, "wb");
+    if (!out_f) {
+        fprintf(stderr, "unable to open %s\n", strbuf);
+        ctx->failed = 1;
+        return 1;
+    }
+
+    int rs_err = write_entry_to_file(e, out_f);
+    if (rs_err) {
+        fprintf(stderr, "unable to write %s: %s\n", strbuf, rucksack_err_str(rs_err));
+        ctx->failed = 1;
+        return 1;
+    }
+
+    if (fclose(out_f)) {
+        fprintf(stderr, "unable to close %s\n", strbuf);
+        ctx->failed = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
 static int command_unpack(char *arg0, int argc, char *argv[]) {
     const char *bundle_filename = NULL;
     const char *output_dir = NULL;
+    const char *prefix = "";
 
     for (int i = 0; i < argc; i += 1) {
         char *arg = argv[i];
         if (arg[0] == '-' && arg[1] == '-') {
-            return unpack_usage(arg0);
+            arg += 2;
+            if (i + 1 >= argc) {
+                return unpack_usage(arg0);
+            } else if (strcmp(arg, "prefix") == 0) {
+                prefix = argv[++i];
+            } else {
+                return unpack_usage(arg0);
+            }
         } else if (!bundle_filename) {
             bundle_filename = arg;
         } else if (!output_dir) {
@@ -1438,85 +1963,27 @@ static int command_unpack(char *arg0, int argc, char *argv[]) {
         return 1;
     }
     fprintf(manifest_f, "{\n");
-    int indent_amt = 2;
-    int indent = indent_amt;
 
-    size_t count = rucksack_bundle_file_count(bundle);
-    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
-    if (!entries) {
-        fprintf(stderr, "out of memory\n");
-        return 1;
-    }
-    rucksack_bundle_get_files(bundle, entries);
+    struct UnpackContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.output_dir = output_dir;
+    ctx.manifest_f = manifest_f;
+    ctx.indent_amt = 2;
+    ctx.indent = ctx.indent_amt;
 
-    // determine max file size
-    long max_file_size = 0;
-    for (int i = 0; i < count; i += 1) {
-        struct RuckSackFileEntry *e = entries[i];
-        long file_size = rucksack_file_size(e);
-        if (file_size > max_file_size)
-            max_file_size = file_size;
+    rs_err = rucksack_bundle_iter_prefix(bundle, prefix, -1, unpack_entry, &ctx);
+    if (rs_err) {
+        fprintf(stderr, "unable to list %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        return 1;
     }
-    if (count > 0) {
-        fprintf(manifest_f, "%*sfiles: {\n", indent, "");
-        indent += indent_amt;
-
-        unsigned char *buffer = malloc(max_file_size);
-        if (!buffer) {
-            fprintf(stderr, "out of memory\n");
-            return 1;
-        }
-        for (int i = 0; i < count; i += 1) {
-            struct RuckSackFileEntry *e = entries[i];
-
-            const char *name = rucksack_file_name(e);
-            json_escape(name, strbuf4);
-            fprintf(manifest_f, "%*s%s: {\n", indent, "", strbuf4);
-            indent += indent_amt;
-
-            json_escape(name, strbuf4);
-            fprintf(manifest_f, "%*spath: %s,\n", indent, "", strbuf4);
-
-            indent -= indent_amt;
-            fprintf(manifest_f, "%*s},\n", indent, "");
-
-            path_join(output_dir, name, strbuf);
-            path_dirname(strbuf, strbuf4);
-            if (rucksack_mkdirp(strbuf4)) {
-                fprintf(stderr, "unable to mkdir %s\n", strbuf4);
-                return 1;
-            }
-            FILE *out_f = fopen(strbuf, "wb");
-            if (!out_f) {
-                fprintf(stderr, "unable to open %s\n", strbuf);
-                return 1;
-            }
-
-            rs_err = rucksack_file_read(e, buffer);
-            if (rs_err) {
-                fprintf(stderr, "unable to read %s: %s\n", name, rucksack_err_str(rs_err));
-                return 1;
-            }
-            long file_size = rucksack_file_size(e);
-            size_t amt_written = fwrite(buffer, 1, file_size, out_f);
-            if (amt_written != file_size) {
-                fprintf(stderr, "unable to write %s\n", strbuf);
-                return 1;
-            }
-
-            if (fclose(out_f)) {
-                fprintf(stderr, "unable to close %s\n", strbuf);
-                return 1;
-            }
+    if (ctx.failed)
+        return 1;
 
-        }
-        indent -= indent_amt;
-        fprintf(manifest_f, "%*s},\n", indent, "");
-        free(buffer);
+    if (ctx.count > 0) {
+        ctx.indent -= ctx.indent_amt;
+        fprintf(manifest_f, "%*s},\n", ctx.indent, "");
     }
 
-    free(entries);
-
     fprintf(manifest_f, "}\n");
     if (fclose(manifest_f)) {
         fprintf(stderr, "unable to close manifest file\n");
@@ -1555,6 +2022,8 @@ static struct Command commands[] = {
         "make an existing bundle as small as possible"},
     {"unpack", command_unpack, unpack_usage,
         "create a directory with the bundle contents"},
+    {"verify", command_verify, verify_usage,
+        "check every file in the bundle against its checksum"},
     {NULL, NULL, NULL},
 };
 
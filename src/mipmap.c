@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "mipmap.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// linear light of each sRGB value
+static float to_linear[256];
+// halfway between the linear light of consecutive sRGB values. searching it
+// turns linear light back into the nearest sRGB value, so that a flat color
+// comes back out unchanged.
+static float srgb_bounds[255];
+
+static void init_tables(void) {
+    for (int i = 0; i < 256; i += 1) {
+        float c = i / 255.0f;
+        to_linear[i] = (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < 255; i += 1)
+        srgb_bounds[i] = (to_linear[i] + to_linear[i + 1]) / 2.0f;
+}
+
+static unsigned char to_srgb(float linear) {
+    int lo = 0;
+    int hi = 255;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (linear < srgb_bounds[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+int rucksack_mipmap_full_count(int width, int height) {
+    int count = 1;
+    while (width > 1 || height > 1) {
+        rucksack_mipmap_next_size(width, height, &width, &height);
+        count += 1;
+    }
+    return count;
+}
+
+void rucksack_mipmap_next_size(int width, int height, int *next_width, int *next_height) {
+    *next_width = (width > 1) ? width / 2 : 1;
+    *next_height = (height > 1) ? height / 2 : 1;
+}
+
+// averages 4 pixels. the color channels are weighted by alpha, unless all
+// 4 are transparent, in which case their color is kept for whatever
+// filtering reaches it.
+static void average_quad(const unsigned char *px[4], unsigned char *out) {
+    float sum[4];
+    float plain[4];
+#ifdef __SSE2__
+    // r g b and alpha go side by side through the same operations
+    __m128 weighted = _mm_setzero_ps();
+    __m128 unweighted = _mm_setzero_ps();
+    for (int k = 0; k < 4; k += 1) {
+        __m128 c = _mm_set_ps(1.0f, to_linear[px[k][2]], to_linear[px[k][1]],
+                to_linear[px[k][0]]);
+        unweighted = _mm_add_ps(unweighted, c);
+        weighted = _mm_add_ps(weighted, _mm_mul_ps(c, _mm_set1_ps(px[k][3] / 255.0f)));
+    }
+    _mm_storeu_ps(sum, weighted);
+    _mm_storeu_ps(plain, unweighted);
+#else
+    for (int c = 0; c < 4; c += 1) {
+        sum[c] = 0.0f;
+        plain[c] = 0.0f;
+    }
+    for (int k = 0; k < 4; k += 1) {
+        float a = px[k][3] / 255.0f;
+        for (int c = 0; c < 3; c += 1) {
+            float linear = to_linear[px[k][c]];
+            sum[c] += linear * a;
+            plain[c] += linear;
+        }
+        sum[3] += a;
+    }
+#endif
+    float alpha = sum[3];
+    for (int c = 0; c < 3; c += 1)
+        out[c] = to_srgb((alpha > 0.0f) ? sum[c] / alpha : plain[c] / 4.0f);
+    out[3] = (unsigned char)(alpha / 4.0f * 255.0f + 0.5f);
+}
+
+void rucksack_mipmap_downsample(const unsigned char *src, int width, int height,
+        unsigned char *dest)
+{
+    pthread_once(&init_once, init_tables);
+    int next_width, next_height;
+    rucksack_mipmap_next_size(width, height, &next_width, &next_height);
+    long pitch = 4L * width;
+    for (int y = 0; y < next_height; y += 1) {
+        // a side of 1 averages its only row or column with itself. odd
+        // sides drop their last one, like GPUs do when they size levels.
+        const unsigned char *row0 = src + (long)(2 * y) * pitch;
+        const unsigned char *row1 = (height > 1) ? row0 + pitch : row0;
+        unsigned char *out = dest + 4L * next_width * y;
+        for (int x = 0; x < next_width; x += 1) {
+            int x0 = 4 * (2 * x);
+            int x1 = (width > 1) ? x0 + 4 : x0;
+            const unsigned char *px[4] = {row0 + x0, row0 + x1, row1 + x0, row1 + x1};
+            average_quad(px, out + 4 * x);
+        }
+    }
+}
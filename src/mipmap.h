@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_MIPMAP_H_INCLUDED
+#define RUCKSACK_MIPMAP_H_INCLUDED
+
+// the number of levels from width x height down to 1x1
+int rucksack_mipmap_full_count(int width, int height);
+
+// the size of the level below one of width x height
+void rucksack_mipmap_next_size(int width, int height, int *next_width, int *next_height);
+
+// halves sRGB RGBA8 pixels, rows from the top, into dest, which holds the
+// size that rucksack_mipmap_next_size gives. each pixel of dest is the box
+// average of 2x2 pixels of src, taken in linear light and weighted by
+// alpha so that transparent pixels do not darken the edges of sprites.
+void rucksack_mipmap_downsample(const unsigned char *src, int width, int height,
+        unsigned char *dest);
+
+#endif /* RUCKSACK_MIPMAP_H_INCLUDED */
@@ -9,6 +9,9 @@
 #include "rucksack.h"
 #include "shared.h"
 #include "util.h"
+#include "codec.h"
+#include "checksum.h"
+#include "cpu.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -20,15 +23,55 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef RUCKSACK_HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#ifdef RUCKSACK_HAVE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
 
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 static const char *BUNDLE_UUID = "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20";
 
-static const int BUNDLE_VERSION = 1;
-static const int MAIN_HEADER_LEN = 28;
-static const int HEADER_ENTRY_LEN = 36; // not taking into account key bytes
+// version 8 changes nothing in the bundle itself, but it is the first one
+// that can hold version 2 textures, which older readers would misread
+static const int BUNDLE_VERSION = 8;
+static const int MAIN_HEADER_LEN = 40;
+// before version 5 the main header has no key table fields
+static const int MAIN_HEADER_LEN_V4 = 28;
+// before version 7 the main header has no alignment
+static const int MAIN_HEADER_LEN_V6 = 36;
+static const int HEADER_ENTRY_LEN = 64; // not taking into account key bytes
+// version 1 entries have no compression fields
+static const int HEADER_ENTRY_LEN_V1 = 36;
+// version 2 entries have no content hash or flags
+static const int HEADER_ENTRY_LEN_V2 = 48;
+// version 3 entries have no checksum
+static const int HEADER_ENTRY_LEN_V3 = 60;
+
+// header entry flags
+static const uint32_t ENTRY_FLAG_CONTENT_HASH = 0x1; // the content hash is valid
+static const uint32_t ENTRY_FLAG_DUPLICATE = 0x2; // see RuckSackFileEntry::is_duplicate
+static const uint32_t ENTRY_FLAG_CHECKSUM = 0x4; // the checksum is valid
+// bits 8 to 15 of the flags hold log2 of the alignment of the entry
+static const int ENTRY_ALIGNMENT_SHIFT = 8;
+
+static const long MAX_ALIGNMENT = 1L << 24;
+
+// a key table slot holds the key hash, the index of the entry and the
+// position of its header entry relative to the first header entry
+static const int KEY_TABLE_SLOT_LEN = 12;
+static const uint32_t KEY_TABLE_EMPTY = 0xffffffff;
+// since version 6 the key table is followed by the entry index and header
+// entry position of every key, in key order
+static const int SORTED_KEY_LEN = 8;
 
 static const char *ERROR_STR[] = {
     "",
@@ -43,6 +86,25 @@ static const char *ERROR_STR[] = {
     "unrecognized image format",
     "key not found",
     "cannot delete while stream open",
+    "read range out of bounds",
+    "compression codec not available",
+    "compressed data is corrupt",
+    "checksum mismatch",
+    "invalid alignment",
+    "unsupported texture format",
+    "unsupported packing or sort order",
+    "invalid argument",
+    "compression codec failed",
+};
+
+// open addressing hash table (linear probing) of indexes into the entries
+// of a bundle. -1 marks an empty slot.
+struct EntryIndex {
+    long *slots;
+    long size; // always a power of 2
+    uint32_t (*hash)(const struct RuckSackFileEntry *e);
+    // which entries belong in the index. NULL means all of them.
+    bool (*holds)(const struct RuckSackFileEntry *e);
 };
 
 struct RuckSackBundlePrivate {
@@ -61,36 +123,172 @@ struct RuckSackBundlePrivate {
     long int headers_byte_count;
     long int first_file_offset;
 
+    // the alignment of new entries that do not ask for their own
+    long alignment;
+
     bool read_only;
 
+    struct EntryIndex key_index;
+    // entries that own a region with a known content hash, which is where
+    // new entries look for identical contents
+    struct EntryIndex content_index;
+
+    // set when b->f has buffered writes that pread would not see
+    bool write_pending;
+
+    // see rucksack_bundle_set_verify_reads
+    bool verify_reads;
+
+    // read-only bundles that have a key table look keys up in it and parse
+    // header entries only when they are asked for, see open_key_table.
+    // entries that have not been parsed yet have no b.
+    bool lazy;
+    int bundle_version;
+    const unsigned char *header_region; // header entries, then the key table
+    unsigned char *header_buf; // owns header_region when it is not mapped
+    const unsigned char *key_table;
+    long key_table_slots;
+    const unsigned char *sorted_keys; // NULL before version 6
+    bool all_loaded;
+
+    // the entries in key order, for bundles that do not have sorted_keys.
+    // sorted when first needed and forgotten when entries come or go.
+    struct RuckSackFileEntry **sorted_entries;
+
+    // protects parsing the entries of a lazy bundle and sorting entries
+    pthread_mutex_t load_mutex;
+
     long mem_buffer_size;
     const char *mem_buffer;
-    long mem_offset;
+    // set when mem_buffer belongs to us, see map_bundle_file
+    bool mem_mapped;
 };
 
-static int bundle_seek(struct RuckSackBundlePrivate *b, long offset) {
-    if (b->f) {
-        if (fseek(b->f, offset, SEEK_SET))
-            return RuckSackErrorFileAccess;
-        return RuckSackErrorNone;
+// makes sure data written through b->f is visible to the file descriptor
+static int bundle_flush(struct RuckSackBundlePrivate *b) {
+    if (b->write_pending) {
+        if (fflush(b->f))
+            return -1;
+        b->write_pending = false;
+    }
+    return 0;
+}
+
+// reads size bytes at offset without using any shared file position, so
+// any number of threads may read from a read-only bundle at once.
+// returns the number of bytes read, which is short at end of file, or -1.
+static long bundle_pread(struct RuckSackBundlePrivate *b, void *buf, long size,
+        long offset)
+{
+    if (!b->f) {
+        if (offset < 0 || offset >= b->mem_buffer_size)
+            return 0;
+        long amt_to_read = MIN(b->mem_buffer_size - offset, size);
+        memcpy(buf, b->mem_buffer + offset, amt_to_read);
+        return amt_to_read;
+    }
+
+    if (bundle_flush(b))
+        return -1;
+
+#ifdef RUCKSACK_HAVE_PREAD
+    int fd = fileno(b->f);
+    long amt_read = 0;
+    while (amt_read < size) {
+        ssize_t amt = pread(fd, (char *)buf + amt_read, size - amt_read, offset + amt_read);
+        if (amt < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (amt == 0)
+            break;
+        amt_read += amt;
+    }
+    return amt_read;
+#else
+    // not thread safe, but the best we can do
+    if (fseek(b->f, offset, SEEK_SET))
+        return -1;
+    return fread(buf, 1, size, b->f);
+#endif
+}
+
+// maps the whole file read-only. where mmap is not available the file is
+// read into a heap buffer instead so that the same API works everywhere.
+static int map_bundle_file(const char *bundle_path, const char **out_buffer,
+        long *out_size)
+{
+#ifdef RUCKSACK_HAVE_MMAP
+    int fd = open(bundle_path, O_RDONLY);
+    if (fd == -1)
+        return RuckSackErrorFileAccess;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return RuckSackErrorFileAccess;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return RuckSackErrorEmptyFile;
     }
-    if (offset >= b->mem_buffer_size)
+
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return RuckSackErrorFileAccess;
+
+    *out_buffer = ptr;
+    *out_size = st.st_size;
+    return RuckSackErrorNone;
+#else
+    FILE *f = fopen(bundle_path, "rb");
+    if (!f)
+        return RuckSackErrorFileAccess;
+
+    struct stat st;
+    if (fstat(fileno(f), &st)) {
+        fclose(f);
+        return RuckSackErrorFileAccess;
+    }
+
+    if (st.st_size == 0) {
+        fclose(f);
+        return RuckSackErrorEmptyFile;
+    }
+
+    char *buffer = malloc(st.st_size);
+    if (!buffer) {
+        fclose(f);
+        return RuckSackErrorNoMem;
+    }
+
+    if (fread(buffer, 1, st.st_size, f) != st.st_size) {
+        free(buffer);
+        fclose(f);
         return RuckSackErrorFileAccess;
-    b->mem_offset = offset;
+    }
+    fclose(f);
+
+    *out_buffer = buffer;
+    *out_size = st.st_size;
     return RuckSackErrorNone;
+#endif
 }
 
-static long bundle_read(struct RuckSackBundlePrivate *b, void *buf, long size) {
-    if (b->f)
-        return fread(buf, 1, size, b->f);
-    long amt_left = b->mem_buffer_size - b->mem_offset;
-    long amt_to_read = MIN(amt_left, size);
-    memcpy(buf, b->mem_buffer + b->mem_offset, amt_to_read);
-    b->mem_offset += amt_to_read;
-    return amt_to_read;
+static void unmap_bundle_file(const char *buffer, long size) {
+#ifdef RUCKSACK_HAVE_MMAP
+    munmap((void *)buffer, size);
+#else
+    free((void *)buffer);
+#endif
 }
 
 static int bundle_close(struct RuckSackBundlePrivate *b) {
+    if (b->mem_mapped)
+        unmap_bundle_file(b->mem_buffer, b->mem_buffer_size);
     return b->f ? fclose(b->f) : 0;
 }
 
@@ -101,6 +299,130 @@ static int memneql(const char *mem1, int mem1_size, const char *mem2, int mem2_s
         return memcmp(mem1, mem2, mem1_size);
 }
 
+// FNV-1a again, but 64 bits wide since it stands for whole files. it only
+// narrows down the candidates; identical contents are always confirmed byte
+// by byte.
+static const uint64_t CONTENT_HASH_INIT = 14695981039346656037ull;
+
+static uint64_t hash_content(uint64_t hash, const unsigned char *data, long size) {
+    for (long i = 0; i < size; i += 1) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint32_t entry_key_hash(const struct RuckSackFileEntry *e) {
+    return e->key_hash;
+}
+
+static uint32_t entry_content_hash(const struct RuckSackFileEntry *e) {
+    return (uint32_t)(e->content_hash ^ (e->content_hash >> 32));
+}
+
+static bool entry_owns_hashed_region(const struct RuckSackFileEntry *e) {
+    return e->has_content_hash && !e->is_duplicate;
+}
+
+static void entry_index_insert(struct RuckSackBundlePrivate *b,
+        struct EntryIndex *index, long entry_index)
+{
+    long mask = index->size - 1;
+    long slot = index->hash(&b->entries[entry_index]) & mask;
+    while (index->slots[slot] != -1)
+        slot = (slot + 1) & mask;
+    index->slots[slot] = entry_index;
+}
+
+// makes sure the index has room for count entries, rebuilding it if necessary
+static int entry_index_reserve(struct RuckSackBundlePrivate *b,
+        struct EntryIndex *index, long count)
+{
+    // keep the load factor at or below 1/2
+    if (index->slots && count * 2 <= index->size)
+        return RuckSackErrorNone;
+
+    long new_size = 16;
+    while (new_size < count * 2)
+        new_size *= 2;
+
+    long *new_slots = malloc(new_size * sizeof(long));
+    if (!new_slots)
+        return RuckSackErrorNoMem;
+    for (long i = 0; i < new_size; i += 1)
+        new_slots[i] = -1;
+
+    free(index->slots);
+    index->slots = new_slots;
+    index->size = new_size;
+
+    for (long i = 0; i < b->header_entry_count; i += 1) {
+        if (!index->holds || index->holds(&b->entries[i]))
+            entry_index_insert(b, index, i);
+    }
+
+    return RuckSackErrorNone;
+}
+
+static long entry_index_find_slot(struct RuckSackBundlePrivate *b,
+        struct EntryIndex *index, long entry_index)
+{
+    long mask = index->size - 1;
+    long slot = index->hash(&b->entries[entry_index]) & mask;
+    while (index->slots[slot] != entry_index) {
+        assert(index->slots[slot] != -1);
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void entry_index_remove(struct RuckSackBundlePrivate *b,
+        struct EntryIndex *index, long entry_index)
+{
+    long mask = index->size - 1;
+    long hole = entry_index_find_slot(b, index, entry_index);
+    long slot = hole;
+
+    // shift back any entries that probed past the hole
+    for (;;) {
+        slot = (slot + 1) & mask;
+        long other = index->slots[slot];
+        if (other == -1)
+            break;
+        long home = index->hash(&b->entries[other]) & mask;
+        bool stays = (hole <= slot) ? (hole < home && home <= slot) :
+            (hole < home || home <= slot);
+        if (stays)
+            continue;
+        index->slots[hole] = other;
+        hole = slot;
+    }
+    index->slots[hole] = -1;
+}
+
+static int reserve_indexes(struct RuckSackBundlePrivate *b, long count) {
+    int err = entry_index_reserve(b, &b->key_index, count);
+    if (err)
+        return err;
+    return entry_index_reserve(b, &b->content_index, count);
+}
+
+// the entry that owns the region a duplicate entry points at
+static struct RuckSackFileEntry *find_region_owner(struct RuckSackBundlePrivate *b,
+        const struct RuckSackFileEntry *dup)
+{
+    struct EntryIndex *index = &b->content_index;
+    long mask = index->size - 1;
+    for (long slot = entry_content_hash(dup) & mask; index->slots[slot] != -1;
+            slot = (slot + 1) & mask)
+    {
+        struct RuckSackFileEntry *e = &b->entries[index->slots[slot]];
+        if (e->offset == dup->offset && e->content_hash == dup->content_hash)
+            return e;
+    }
+    return NULL;
+}
+
 static long alloc_size(long actual_size) {
     return 2 * actual_size + 8192;
 }
@@ -184,63 +506,132 @@ static float read_float32be(const unsigned char *buf) {
     return read_uint32be(buf) / FIXED_POINT_N;
 }
 
-static int read_header(struct RuckSackBundlePrivate *b) {
-    // read all the header entries
-    if (bundle_seek(b, 0))
-        return RuckSackErrorFileAccess;
+// makes sure that at least `needed` bytes of the header entry region, which
+// starts at first_header_offset, are in *buf. the first call reads *buf_size
+// bytes; later calls only happen when that guess was too small.
+static int read_header_bytes(struct RuckSackBundlePrivate *b, unsigned char **buf,
+        long *buf_size, long *buf_len, long needed)
+{
+    if (needed <= *buf_len)
+        return RuckSackErrorNone;
 
-    unsigned char buf[MAX(HEADER_ENTRY_LEN, MAIN_HEADER_LEN)];
-    long amt_read = bundle_read(b, buf, MAIN_HEADER_LEN);
+    // a short read means we already have everything up to the end of the file
+    if (*buf && *buf_len < *buf_size)
+        return RuckSackErrorInvalidFormat;
 
-    if (amt_read == 0)
-        return RuckSackErrorEmptyFile;
+    long new_size = *buf ? MAX(*buf_size * 2, needed) : MAX(*buf_size, needed);
+    unsigned char *new_buf = realloc(*buf, new_size);
+    if (!new_buf)
+        return RuckSackErrorNoMem;
+    *buf = new_buf;
+    *buf_size = new_size;
 
-    if (amt_read != MAIN_HEADER_LEN)
-        return RuckSackErrorInvalidFormat;
+    long amt_read = bundle_pread(b, *buf + *buf_len, new_size - *buf_len,
+            b->first_header_offset + *buf_len);
+    if (amt_read < 0)
+        return RuckSackErrorFileAccess;
+    *buf_len += amt_read;
 
-    if (memcmp(BUNDLE_UUID, buf, UUID_SIZE) != 0)
+    if (needed > *buf_len)
         return RuckSackErrorInvalidFormat;
 
-    int bundle_version = read_uint32be(&buf[16]);
-    if (bundle_version != BUNDLE_VERSION)
-        return RuckSackErrorWrongVersion;
+    return RuckSackErrorNone;
+}
 
-    b->first_header_offset = read_uint32be(&buf[20]);
-    b->header_entry_count = read_uint32be(&buf[24]);
-    b->header_entry_mem_count = alloc_count(b->header_entry_count);
-    b->entries = calloc(b->header_entry_mem_count, sizeof(struct RuckSackFileEntry));
+static bool valid_alignment(long alignment) {
+    return alignment >= 1 && alignment <= MAX_ALIGNMENT && (alignment & (alignment - 1)) == 0;
+}
 
-    if (!b->entries)
-        return RuckSackErrorNoMem;
+static bool is_aligned(long offset, long alignment) {
+    return (offset & (alignment - 1)) == 0;
+}
 
-    // calculate how many bytes are used by all the headers
-    b->headers_byte_count = 0; 
+static long align_up(long offset, long alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// log2 of a valid alignment
+static int alignment_shift(long alignment) {
+    int shift = 0;
+    while ((1L << shift) < alignment)
+        shift += 1;
+    return shift;
+}
+
+static int header_entry_len(int bundle_version) {
+    if (bundle_version == 1)
+        return HEADER_ENTRY_LEN_V1;
+    if (bundle_version == 2)
+        return HEADER_ENTRY_LEN_V2;
+    if (bundle_version == 3)
+        return HEADER_ENTRY_LEN_V3;
+    return HEADER_ENTRY_LEN;
+}
+
+// fills in entry from the fixed size part of a header entry and returns the
+// size of the whole header entry, or -1 if it does not make sense
+static long parse_header_entry(const unsigned char *entry_buf, int bundle_version,
+        struct RuckSackFileEntry *entry)
+{
+    long int entry_size = read_uint32be(&entry_buf[0]);
+    entry->offset = read_uint64be(&entry_buf[4]);
+    entry->size = read_uint64be(&entry_buf[12]);
+    entry->allocated_size = read_uint64be(&entry_buf[20]);
+    entry->mtime = read_uint32be(&entry_buf[28]);
+    entry->key_size = read_uint32be(&entry_buf[32]);
+    if (bundle_version >= 2) {
+        entry->compression = read_uint32be(&entry_buf[36]);
+        entry->uncompressed_size = read_uint64be(&entry_buf[40]);
+    }
+    if (bundle_version >= 3) {
+        entry->content_hash = read_uint64be(&entry_buf[48]);
+        uint32_t flags = read_uint32be(&entry_buf[56]);
+        entry->has_content_hash = (flags & ENTRY_FLAG_CONTENT_HASH) != 0;
+        entry->is_duplicate = (flags & ENTRY_FLAG_DUPLICATE) != 0;
+        if (bundle_version >= 4) {
+            entry->checksum = read_uint32be(&entry_buf[60]);
+            entry->has_checksum = (flags & ENTRY_FLAG_CHECKSUM) != 0;
+        }
+        if (entry->is_duplicate && !entry->has_content_hash)
+            return -1;
+        int shift = (flags >> ENTRY_ALIGNMENT_SHIFT) & 0xff;
+        entry->alignment = (shift < 30) ? 1L << shift : 0;
+        if (!valid_alignment(entry->alignment))
+            return -1;
+    } else {
+        entry->alignment = 1;
+    }
+    entry->ref_count = 1;
+
+    if (entry->key_size < 0 || entry_size < header_entry_len(bundle_version) + entry->key_size)
+        return -1;
+    return entry_size;
+}
+
+// copies the key that follows the header entry into entry, which makes the
+// entry ready for use
+static int set_entry_key(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, const unsigned char *key)
+{
+    entry->key = malloc(entry->key_size + 1);
+    if (!entry->key)
+        return RuckSackErrorNoMem;
+    memcpy(entry->key, key, entry->key_size);
+    entry->key[entry->key_size] = 0;
+    entry->key_hash = hash_key(entry->key, entry->key_size);
+    entry->b = b;
+    return RuckSackErrorNone;
+}
 
-    long int header_offset = b->first_header_offset;
+// works out the layout of the regions and builds the indexes once every
+// entry has been parsed
+static int finish_entries(struct RuckSackBundlePrivate *b) {
     for (int i = 0; i < b->header_entry_count; i += 1) {
-        if (bundle_seek(b, header_offset))
-            return RuckSackErrorFileAccess;
-        amt_read = bundle_read(b, buf, HEADER_ENTRY_LEN);
-        if (amt_read != HEADER_ENTRY_LEN)
-            return RuckSackErrorInvalidFormat;
-        long int entry_size = read_uint32be(&buf[0]);
-        header_offset += entry_size;
         struct RuckSackFileEntry *entry = &b->entries[i];
-        entry->offset = read_uint64be(&buf[4]);
-        entry->size = read_uint64be(&buf[12]);
-        entry->allocated_size = read_uint64be(&buf[20]);
-        entry->mtime = read_uint32be(&buf[28]);
-        entry->key_size = read_uint32be(&buf[32]);
-        entry->key = malloc(entry->key_size + 1);
-        if (!entry->key)
-            return RuckSackErrorNoMem;
-        amt_read = bundle_read(b, entry->key, entry->key_size);
-        if (amt_read != entry->key_size)
-            return RuckSackErrorInvalidFormat;
-        entry->key[entry->key_size] = 0;
-        entry->b = b;
 
-        b->headers_byte_count += HEADER_ENTRY_LEN + entry->key_size;
+        // duplicates are not part of the layout of regions
+        if (entry->is_duplicate)
+            continue;
 
         if (!b->last_entry || entry->offset > b->last_entry->offset)
             b->last_entry = entry;
@@ -251,122 +642,519 @@ static int read_header(struct RuckSackBundlePrivate *b) {
         }
     }
 
-    return RuckSackErrorNone;
-}
+    int err = reserve_indexes(b, b->header_entry_count);
+    if (err)
+        return err;
 
-static struct RuckSackFileEntry *get_prev_entry(struct RuckSackBundlePrivate *b,
-        struct RuckSackFileEntry *entry)
-{
-    struct RuckSackFileEntry *prev = NULL;
+    // count the references to each shared region
     for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
-
-        if (e->offset < entry->offset && (!prev || e->offset > prev->offset))
-            prev = e;
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        if (!entry->is_duplicate)
+            continue;
+        struct RuckSackFileEntry *owner = find_region_owner(b, entry);
+        if (!owner)
+            return RuckSackErrorInvalidFormat;
+        owner->ref_count += 1;
     }
-    return prev;
+
+    return RuckSackErrorNone;
 }
 
-static struct RuckSackFileEntry *get_next_entry(struct RuckSackBundlePrivate *b,
-        struct RuckSackFileEntry *entry)
+// the bytes needed for the header entries and the key tables after them
+static long header_region_size(struct RuckSackBundlePrivate *b) {
+    return b->headers_byte_count +
+        key_table_slot_count(b->header_entry_count) * KEY_TABLE_SLOT_LEN +
+        b->header_entry_count * SORTED_KEY_LEN;
+}
+
+// sets up a read-only bundle to find keys through the key table stored after
+// the header entries. the header region is mapped or read in one go, and
+// nothing in it is parsed until it is asked for, so opening a bundle does not
+// take longer the more keys it has.
+static int open_key_table(struct RuckSackBundlePrivate *b, int bundle_version,
+        long table_offset, long slot_count)
 {
-    struct RuckSackFileEntry *next = NULL;
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
+    if ((slot_count & (slot_count - 1)) || slot_count <= b->header_entry_count)
+        return RuckSackErrorInvalidFormat;
 
-        if (e->offset > entry->offset && (!next || e->offset < next->offset))
-            next = e;
+    long region_size = table_offset + slot_count * KEY_TABLE_SLOT_LEN;
+    if (bundle_version >= 6)
+        region_size += b->header_entry_count * SORTED_KEY_LEN;
+    if (b->f) {
+        b->header_buf = malloc(region_size);
+        if (!b->header_buf)
+            return RuckSackErrorNoMem;
+        long amt_read = bundle_pread(b, b->header_buf, region_size, b->first_header_offset);
+        if (amt_read < 0)
+            return RuckSackErrorFileAccess;
+        if (amt_read != region_size)
+            return RuckSackErrorInvalidFormat;
+        b->header_region = b->header_buf;
+    } else {
+        if (b->first_header_offset + region_size > b->mem_buffer_size)
+            return RuckSackErrorInvalidFormat;
+        b->header_region = (const unsigned char *)b->mem_buffer + b->first_header_offset;
     }
-    return next;
+
+    b->header_entry_mem_count = b->header_entry_count;
+    b->entries = calloc(b->header_entry_mem_count, sizeof(struct RuckSackFileEntry));
+    if (!b->entries)
+        return RuckSackErrorNoMem;
+
+    b->headers_byte_count = table_offset;
+    b->key_table = b->header_region + table_offset;
+    b->key_table_slots = slot_count;
+    if (bundle_version >= 6)
+        b->sorted_keys = b->key_table + slot_count * KEY_TABLE_SLOT_LEN;
+    b->bundle_version = bundle_version;
+    b->lazy = true;
+    return RuckSackErrorNone;
 }
 
-static int copy_data(struct RuckSackBundlePrivate *b, long int source,
-        long int dest, long int size)
+// parses entry number index of a lazy bundle from its header entry at pos,
+// unless that already happened. the caller holds load_mutex.
+static int load_entry(struct RuckSackBundlePrivate *b, long index, long pos,
+        struct RuckSackFileEntry **out_entry)
 {
-    if (source == dest)
+    if (index >= b->header_entry_count)
+        return RuckSackErrorInvalidFormat;
+    struct RuckSackFileEntry *entry = &b->entries[index];
+    if (entry->b) {
+        *out_entry = entry;
         return RuckSackErrorNone;
+    }
 
-    const long int max_buf_size = 1048576;
-    long int buf_size = MIN(max_buf_size, size);
-    char *buffer = malloc(buf_size);
+    int entry_header_len = header_entry_len(b->bundle_version);
+    if (pos + entry_header_len > b->headers_byte_count)
+        return RuckSackErrorInvalidFormat;
+    const unsigned char *entry_buf = &b->header_region[pos];
 
-    if (!buffer)
-        return RuckSackErrorNoMem;
+    struct RuckSackFileEntry parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    if (parse_header_entry(entry_buf, b->bundle_version, &parsed) < 0 ||
+        pos + entry_header_len + parsed.key_size > b->headers_byte_count)
+    {
+        return RuckSackErrorInvalidFormat;
+    }
+    int err = set_entry_key(b, &parsed, &entry_buf[entry_header_len]);
+    if (err)
+        return err;
 
-    while (size > 0) {
-        long int amt_to_read = MIN(buf_size, size);
-        if (fseek(b->f, source, SEEK_SET)) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
-        }
-        if (fread(buffer, 1, amt_to_read, b->f) != amt_to_read) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
-        }
-        if (fseek(b->f, dest, SEEK_SET)) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
-        }
-        if (fwrite(buffer, 1, amt_to_read, b->f) != amt_to_read) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
+    *entry = parsed;
+    *out_entry = entry;
+    return RuckSackErrorNone;
+}
+
+// parses all the entries of a lazy bundle that have not been parsed yet
+static int load_all_entries(struct RuckSackBundlePrivate *b) {
+    if (!b->lazy)
+        return RuckSackErrorNone;
+
+    int err = RuckSackErrorNone;
+    pthread_mutex_lock(&b->load_mutex);
+    if (!b->all_loaded) {
+        long pos = 0;
+        for (long i = 0; i < b->header_entry_count && !err; i += 1) {
+            struct RuckSackFileEntry *entry;
+            err = load_entry(b, i, pos, &entry);
+            if (!err)
+                pos += read_uint32be(&b->header_region[pos]);
         }
-        size -= amt_to_read;
-        source += amt_to_read;
-        dest += amt_to_read;
+        b->all_loaded = !err;
     }
+    pthread_mutex_unlock(&b->load_mutex);
+    return err;
+}
 
-    free(buffer);
+// gives a lazy bundle everything a bundle that can change has. the key table
+// no longer describes the entries once they change, so it is not used again.
+static int stop_lazy_loading(struct RuckSackBundlePrivate *b) {
+    if (!b->lazy)
+        return RuckSackErrorNone;
+    int err = load_all_entries(b);
+    if (err)
+        return err;
+    err = finish_entries(b);
+    if (err)
+        return err;
+    b->lazy = false;
     return RuckSackErrorNone;
 }
 
-static void allocate_file(struct RuckSackBundlePrivate *b, long int size,
-        struct RuckSackFileEntry *entry, char precise)
-{
-    entry->allocated_size = size;
+// orders keys bytewise, with a key before the longer keys it is a prefix of
+static int compare_keys(const char *key1, long key1_size, const char *key2, long key2_size) {
+    int cmp = memcmp(key1, key2, MIN(key1_size, key2_size));
+    if (cmp)
+        return cmp;
+    return (key1_size > key2_size) - (key1_size < key2_size);
+}
 
-    long int wanted_headers_alloc_bytes = alloc_size_precise(precise, b->headers_byte_count);
-    long int wanted_headers_alloc_end = precise ? b->first_file_offset :
-        (b->first_header_offset + wanted_headers_alloc_bytes);
+static int compare_entry_keys(const void *a, const void *b) {
+    const struct RuckSackFileEntry *e1 = *(struct RuckSackFileEntry * const *)a;
+    const struct RuckSackFileEntry *e2 = *(struct RuckSackFileEntry * const *)b;
+    return compare_keys(e1->key, e1->key_size, e2->key, e2->key_size);
+}
 
-    // can we put it between the header and the first entry?
-    if (b->first_entry) {
-        long int extra = b->first_entry->offset - wanted_headers_alloc_end;
-        if (extra >= entry->allocated_size) {
-            // we can fit it here
-            entry->offset = b->first_entry->offset - entry->allocated_size;
-            b->first_entry = entry;
-            b->first_file_offset = entry->offset;
-            return;
+// makes sure get_sorted_key and get_sorted_entry can be used
+static int prepare_key_order(struct RuckSackBundlePrivate *b) {
+    if (b->lazy && b->sorted_keys)
+        return RuckSackErrorNone;
+
+    int err = load_all_entries(b);
+    if (err)
+        return err;
+
+    pthread_mutex_lock(&b->load_mutex);
+    if (!b->sorted_entries) {
+        struct RuckSackFileEntry **sorted =
+            malloc(MAX(b->header_entry_count, 1) * sizeof(struct RuckSackFileEntry *));
+        if (sorted) {
+            for (long i = 0; i < b->header_entry_count; i += 1)
+                sorted[i] = &b->entries[i];
+            qsort(sorted, b->header_entry_count, sizeof(struct RuckSackFileEntry *),
+                    compare_entry_keys);
+            b->sorted_entries = sorted;
+        } else {
+            err = RuckSackErrorNoMem;
         }
     }
+    pthread_mutex_unlock(&b->load_mutex);
+    return err;
+}
 
-    // figure out offset and allocated_size
-    // find a file that has too much allocated room and stick it there
+static void forget_key_order(struct RuckSackBundlePrivate *b) {
+    free(b->sorted_entries);
+    b->sorted_entries = NULL;
+}
+
+// where the header entry of the rank-th key in key order of a lazy bundle is
+static int get_sorted_position(struct RuckSackBundlePrivate *b, long rank,
+        long *index, long *pos)
+{
+    const unsigned char *buf = &b->sorted_keys[rank * SORTED_KEY_LEN];
+    *index = read_uint32be(&buf[0]);
+    *pos = read_uint32be(&buf[4]);
+    if (*pos + header_entry_len(b->bundle_version) > b->headers_byte_count)
+        return RuckSackErrorInvalidFormat;
+    return RuckSackErrorNone;
+}
+
+// the rank-th key in key order. lazy bundles read it straight from the
+// header region without parsing the entry.
+static int get_sorted_key(struct RuckSackBundlePrivate *b, long rank,
+        const char **key, long *key_size)
+{
+    if (!b->lazy || !b->sorted_keys) {
+        struct RuckSackFileEntry *entry = b->sorted_entries[rank];
+        *key = entry->key;
+        *key_size = entry->key_size;
+        return RuckSackErrorNone;
+    }
+
+    long index, pos;
+    int err = get_sorted_position(b, rank, &index, &pos);
+    if (err)
+        return err;
+    int entry_header_len = header_entry_len(b->bundle_version);
+    *key_size = read_uint32be(&b->header_region[pos + 32]);
+    if (pos + entry_header_len + *key_size > b->headers_byte_count)
+        return RuckSackErrorInvalidFormat;
+    *key = (const char *)&b->header_region[pos + entry_header_len];
+    return RuckSackErrorNone;
+}
+
+static int get_sorted_entry(struct RuckSackBundlePrivate *b, long rank,
+        struct RuckSackFileEntry **entry)
+{
+    if (!b->lazy || !b->sorted_keys) {
+        *entry = b->sorted_entries[rank];
+        return RuckSackErrorNone;
+    }
+
+    long index, pos;
+    int err = get_sorted_position(b, rank, &index, &pos);
+    if (err)
+        return err;
+    pthread_mutex_lock(&b->load_mutex);
+    err = load_entry(b, index, pos, entry);
+    pthread_mutex_unlock(&b->load_mutex);
+    return err;
+}
+
+// looks key up in the key table of a lazy bundle, comparing the key bytes in
+// the header region so that only the matching entry gets parsed
+static struct RuckSackFileEntry *find_lazy_entry(struct RuckSackBundlePrivate *b,
+        const char *key, int key_size)
+{
+    int entry_header_len = header_entry_len(b->bundle_version);
+    uint32_t hash = hash_key(key, key_size);
+    long mask = b->key_table_slots - 1;
+    long slot = hash & mask;
+    for (long probes = 0; probes < b->key_table_slots; probes += 1) {
+        const unsigned char *slot_buf = &b->key_table[slot * KEY_TABLE_SLOT_LEN];
+        slot = (slot + 1) & mask;
+
+        uint32_t index = read_uint32be(&slot_buf[4]);
+        if (index == KEY_TABLE_EMPTY)
+            return NULL;
+        if (read_uint32be(&slot_buf[0]) != hash)
+            continue;
+
+        long pos = read_uint32be(&slot_buf[8]);
+        if (pos + entry_header_len > b->headers_byte_count)
+            continue;
+        const unsigned char *entry_buf = &b->header_region[pos];
+        long entry_key_size = read_uint32be(&entry_buf[32]);
+        if (pos + entry_header_len + entry_key_size > b->headers_byte_count ||
+            memneql(key, key_size, (const char *)&entry_buf[entry_header_len],
+                entry_key_size) != 0)
+        {
+            continue;
+        }
+
+        struct RuckSackFileEntry *entry;
+        pthread_mutex_lock(&b->load_mutex);
+        int err = load_entry(b, index, pos, &entry);
+        pthread_mutex_unlock(&b->load_mutex);
+        return err ? NULL : entry;
+    }
+    return NULL;
+}
+
+static int read_header(struct RuckSackBundlePrivate *b) {
+    // read all the header entries
+    unsigned char buf[MAIN_HEADER_LEN];
+    long amt_read = bundle_pread(b, buf, MAIN_HEADER_LEN, 0);
+
+    if (amt_read < 0)
+        return RuckSackErrorFileAccess;
+
+    if (amt_read == 0)
+        return RuckSackErrorEmptyFile;
+
+    if (amt_read < MAIN_HEADER_LEN_V4)
+        return RuckSackErrorInvalidFormat;
+
+    if (memcmp(BUNDLE_UUID, buf, UUID_SIZE) != 0)
+        return RuckSackErrorInvalidFormat;
+
+    int bundle_version = read_uint32be(&buf[16]);
+    if (bundle_version < 1 || bundle_version > BUNDLE_VERSION)
+        return RuckSackErrorWrongVersion;
+    if (bundle_version >= 7 && amt_read < MAIN_HEADER_LEN)
+        return RuckSackErrorInvalidFormat;
+    if (bundle_version >= 5 && amt_read < MAIN_HEADER_LEN_V6)
+        return RuckSackErrorInvalidFormat;
+    int entry_header_len = header_entry_len(bundle_version);
+
+    b->first_header_offset = read_uint32be(&buf[20]);
+    b->header_entry_count = read_uint32be(&buf[24]);
+    if (bundle_version >= 7) {
+        b->alignment = read_uint32be(&buf[36]);
+        if (!valid_alignment(b->alignment))
+            return RuckSackErrorInvalidFormat;
+    }
+
+    if (bundle_version >= 5 && b->read_only) {
+        long key_table_slots = read_uint32be(&buf[32]);
+        if (key_table_slots > 0)
+            return open_key_table(b, bundle_version, read_uint32be(&buf[28]), key_table_slots);
+    }
+
+    b->header_entry_mem_count = alloc_count(b->header_entry_count);
+    b->entries = calloc(b->header_entry_mem_count, sizeof(struct RuckSackFileEntry));
+
+    if (!b->entries)
+        return RuckSackErrorNoMem;
+
+    // calculate how many bytes are used by all the headers
+    b->headers_byte_count = 0;
+
+    // read the whole header entry region at once. we don't know how big it
+    // is until we have parsed it, so start with a generous guess and grow.
+    long headers_size = b->header_entry_count * (HEADER_ENTRY_LEN + 64);
+    long headers_len = 0;
+    unsigned char *headers = NULL;
+
+    long pos = 0;
+    for (int i = 0; i < b->header_entry_count; i += 1) {
+        int err = read_header_bytes(b, &headers, &headers_size, &headers_len,
+                pos + entry_header_len);
+        if (err) {
+            free(headers);
+            return err;
+        }
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        long entry_size = parse_header_entry(&headers[pos], bundle_version, entry);
+        if (entry_size < 0) {
+            free(headers);
+            return RuckSackErrorInvalidFormat;
+        }
+        err = read_header_bytes(b, &headers, &headers_size, &headers_len,
+                pos + entry_header_len + entry->key_size);
+        if (err) {
+            free(headers);
+            return err;
+        }
+        err = set_entry_key(b, entry, &headers[pos + entry_header_len]);
+        if (err) {
+            free(headers);
+            return err;
+        }
+        pos += entry_size;
+
+        b->headers_byte_count += HEADER_ENTRY_LEN + entry->key_size;
+    }
+    free(headers);
+
+    // the main header grew in version 5. entries that are in its way move
+    // when the header is written.
+    if (b->first_header_offset < MAIN_HEADER_LEN)
+        b->first_header_offset = MAIN_HEADER_LEN;
+
+    return finish_entries(b);
+}
+
+static struct RuckSackFileEntry *get_prev_entry(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry)
+{
+    struct RuckSackFileEntry *prev = NULL;
+    for (int i = 0; i < b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+
+        if (e->is_duplicate)
+            continue;
+        if (e->offset < entry->offset && (!prev || e->offset > prev->offset))
+            prev = e;
+    }
+    return prev;
+}
+
+static struct RuckSackFileEntry *get_next_entry(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry)
+{
+    struct RuckSackFileEntry *next = NULL;
+    for (int i = 0; i < b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+
+        if (e->is_duplicate)
+            continue;
+        if (e->offset > entry->offset && (!next || e->offset < next->offset))
+            next = e;
+    }
+    return next;
+}
+
+static int copy_data(struct RuckSackBundlePrivate *b, long int source,
+        long int dest, long int size)
+{
+    if (source == dest)
+        return RuckSackErrorNone;
+
+    const long int max_buf_size = 1048576;
+    long int buf_size = MIN(max_buf_size, size);
+    char *buffer = malloc(buf_size);
+
+    if (!buffer)
+        return RuckSackErrorNoMem;
+
+    while (size > 0) {
+        long int amt_to_read = MIN(buf_size, size);
+        if (fseek(b->f, source, SEEK_SET)) {
+            free(buffer);
+            return RuckSackErrorFileAccess;
+        }
+        if (fread(buffer, 1, amt_to_read, b->f) != amt_to_read) {
+            free(buffer);
+            return RuckSackErrorFileAccess;
+        }
+        if (fseek(b->f, dest, SEEK_SET)) {
+            free(buffer);
+            return RuckSackErrorFileAccess;
+        }
+        b->write_pending = true;
+        if (fwrite(buffer, 1, amt_to_read, b->f) != amt_to_read) {
+            free(buffer);
+            return RuckSackErrorFileAccess;
+        }
+        size -= amt_to_read;
+        source += amt_to_read;
+        dest += amt_to_read;
+    }
+
+    free(buffer);
+    return RuckSackErrorNone;
+}
+
+// the alignment the region of entry needs, which has to suit every entry
+// that shares it
+static long region_alignment(struct RuckSackBundlePrivate *b,
+        const struct RuckSackFileEntry *entry)
+{
+    long alignment = entry->alignment;
+    if (entry->ref_count > 1) {
+        for (int i = 0; i < b->header_entry_count; i += 1) {
+            struct RuckSackFileEntry *e = &b->entries[i];
+            if (e->is_duplicate && e->offset == entry->offset)
+                alignment = MAX(alignment, e->alignment);
+        }
+    }
+    return alignment;
+}
+
+// picks the region of entry. padding needed to align it goes to the region
+// in front of it.
+static void allocate_file(struct RuckSackBundlePrivate *b, long int size,
+        struct RuckSackFileEntry *entry, char precise)
+{
+    entry->allocated_size = size;
+    long alignment = region_alignment(b, entry);
+
+    long int wanted_headers_alloc_bytes = alloc_size_precise(precise, header_region_size(b));
+    long int wanted_headers_alloc_end = precise ? b->first_file_offset :
+        (b->first_header_offset + wanted_headers_alloc_bytes);
+
+    // can we put it between the header and the first entry?
+    if (b->first_entry) {
+        long int offset = (b->first_entry->offset - entry->allocated_size) & ~(alignment - 1);
+        if (offset >= wanted_headers_alloc_end) {
+            // we can fit it here
+            entry->offset = offset;
+            entry->allocated_size = b->first_entry->offset - offset;
+            b->first_entry = entry;
+            b->first_file_offset = entry->offset;
+            return;
+        }
+    }
+
+    // figure out offset and allocated_size
+    // find a file that has too much allocated room and stick it there
     for (int i = 0; i < b->header_entry_count; i += 1) {
         struct RuckSackFileEntry *e = &b->entries[i];
 
         // don't overwrite a stream!
         if (e->is_open || e == entry) continue;
 
+        // duplicates have no room of their own
+        if (e->is_duplicate) continue;
+
         // don't put it somewhere that is likely to 
         if (e->offset < wanted_headers_alloc_end) continue;
 
         long int needed_alloc_size = alloc_size_precise(precise, e->size);
-        long int extra = e->allocated_size - needed_alloc_size;
+        long int new_offset = align_up(e->offset + needed_alloc_size, alignment);
+        long int extra = e->offset + e->allocated_size - new_offset;
 
         // not enough room.
         if (extra < entry->allocated_size) continue;
 
-        long int new_offset = e->offset + needed_alloc_size;
-
         // don't put it too close to the headers
         if (new_offset < wanted_headers_alloc_end) continue;
 
         // we can fit it here!
         entry->offset = new_offset;
         entry->allocated_size = extra;
-        e->allocated_size = needed_alloc_size;
+        e->allocated_size = new_offset - e->offset;
 
         if (e == b->last_entry)
             b->last_entry = entry;
@@ -378,16 +1166,16 @@ static void allocate_file(struct RuckSackBundlePrivate *b, long int size,
     if (b->last_entry) {
         if (!b->last_entry->is_open)
             b->last_entry->allocated_size = alloc_size_precise(precise, b->last_entry->size);
-        entry->offset = MAX(b->last_entry->offset + b->last_entry->allocated_size,
-                wanted_headers_alloc_end);
+        entry->offset = align_up(MAX(b->last_entry->offset + b->last_entry->allocated_size,
+                    wanted_headers_alloc_end), alignment);
+        b->last_entry->allocated_size = entry->offset - b->last_entry->offset;
         b->last_entry = entry;
     } else {
         // this is the first entry in the bundle
         long this_entry_header_len = HEADER_ENTRY_LEN + entry->key_size;
         long min_offset = b->first_header_offset +
             (precise ? this_entry_header_len : alloc_size(this_entry_header_len * 10));
-        b->first_file_offset = (b->first_file_offset < min_offset) ?
-            min_offset : b->first_file_offset;
+        b->first_file_offset = align_up(MAX(b->first_file_offset, min_offset), alignment);
         entry->offset = b->first_file_offset;
         b->first_entry = entry;
         b->last_entry = entry;
@@ -414,10 +1202,70 @@ static int resize_file_entry(struct RuckSackBundlePrivate *b,
     long int old_offset = entry->offset;
     allocate_file(b, size, entry, precise);
 
+    // entries sharing the region move along with it
+    if (entry->ref_count > 1) {
+        for (int i = 0; i < b->header_entry_count; i += 1) {
+            struct RuckSackFileEntry *e = &b->entries[i];
+            if (e->is_duplicate && e->offset == old_offset)
+                e->offset = entry->offset;
+        }
+    }
+
     // copy the old data to the new location
     return copy_data(b, old_offset, entry->offset, entry->size);
 }
 
+// writes the key tables that follow the header entries, see open_key_table
+static int write_key_tables(struct RuckSackBundlePrivate *b) {
+    long slot_count = key_table_slot_count(b->header_entry_count);
+    if (slot_count == 0)
+        return RuckSackErrorNone;
+
+    int err = prepare_key_order(b);
+    if (err)
+        return err;
+
+    long table_size = slot_count * KEY_TABLE_SLOT_LEN;
+    long sorted_size = b->header_entry_count * SORTED_KEY_LEN;
+    unsigned char *table = malloc(table_size + sorted_size);
+    long *positions = malloc(b->header_entry_count * sizeof(long));
+    if (!table || !positions) {
+        free(table);
+        free(positions);
+        return RuckSackErrorNoMem;
+    }
+    memset(table, 0xff, table_size);
+
+    long mask = slot_count - 1;
+    long pos = 0;
+    for (int i = 0; i < b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        long slot = entry->key_hash & mask;
+        while (read_uint32be(&table[slot * KEY_TABLE_SLOT_LEN + 4]) != KEY_TABLE_EMPTY)
+            slot = (slot + 1) & mask;
+        unsigned char *slot_buf = &table[slot * KEY_TABLE_SLOT_LEN];
+        write_uint32be(&slot_buf[0], entry->key_hash);
+        write_uint32be(&slot_buf[4], i);
+        write_uint32be(&slot_buf[8], pos);
+        positions[i] = pos;
+        pos += HEADER_ENTRY_LEN + entry->key_size;
+    }
+
+    unsigned char *sorted_buf = &table[table_size];
+    for (long rank = 0; rank < b->header_entry_count; rank += 1) {
+        long index = b->sorted_entries[rank] - b->entries;
+        write_uint32be(&sorted_buf[rank * SORTED_KEY_LEN], index);
+        write_uint32be(&sorted_buf[rank * SORTED_KEY_LEN + 4], positions[index]);
+    }
+    free(positions);
+
+    long amt_written = fwrite(table, 1, table_size + sorted_size, b->f);
+    free(table);
+    if (amt_written != table_size + sorted_size)
+        return RuckSackErrorFileAccess;
+    return RuckSackErrorNone;
+}
+
 static int write_header(struct RuckSackBundlePrivate *b) {
     FILE *f = b->f;
     if (fseek(f, 0, SEEK_SET))
@@ -428,17 +1276,20 @@ static int write_header(struct RuckSackBundlePrivate *b) {
     write_uint32be(&buf[16], BUNDLE_VERSION);
     write_uint32be(&buf[20], b->first_header_offset);
     write_uint32be(&buf[24], b->header_entry_count);
+    write_uint32be(&buf[28], b->headers_byte_count);
+    write_uint32be(&buf[32], key_table_slot_count(b->header_entry_count));
+    write_uint32be(&buf[36], b->alignment);
     long int amt_written = fwrite(buf, 1, MAIN_HEADER_LEN, f);
     if (amt_written != MAIN_HEADER_LEN)
         return RuckSackErrorFileAccess;
 
     long int allocated_header_bytes = b->first_file_offset - b->first_header_offset;
-    if (b->headers_byte_count > allocated_header_bytes) {
-        long int wanted_entry_bytes = alloc_size(b->headers_byte_count);
+    if (header_region_size(b) > allocated_header_bytes) {
+        long int wanted_entry_bytes = alloc_size(header_region_size(b));
         long int wanted_offset_end = b->first_header_offset + wanted_entry_bytes;
         for (int i = 0; i < b->header_entry_count; i += 1) {
             struct RuckSackFileEntry *entry = &b->entries[i];
-            if (entry->offset < wanted_offset_end) {
+            if (!entry->is_duplicate && entry->offset < wanted_offset_end) {
                 int err = resize_file_entry(b, entry, alloc_size(entry->size), 0);
                 if (err)
                     return err;
@@ -457,6 +1308,19 @@ static int write_header(struct RuckSackBundlePrivate *b) {
         write_uint64be(&buf[20], entry->allocated_size);
         write_uint32be(&buf[28], entry->mtime);
         write_uint32be(&buf[32], entry->key_size);
+        write_uint32be(&buf[36], entry->compression);
+        write_uint64be(&buf[40], entry->compression ? entry->uncompressed_size : 0);
+        uint32_t flags = 0;
+        if (entry->has_content_hash)
+            flags |= ENTRY_FLAG_CONTENT_HASH;
+        if (entry->is_duplicate)
+            flags |= ENTRY_FLAG_DUPLICATE;
+        if (entry->has_checksum)
+            flags |= ENTRY_FLAG_CHECKSUM;
+        flags |= alignment_shift(entry->alignment) << ENTRY_ALIGNMENT_SHIFT;
+        write_uint64be(&buf[48], entry->has_content_hash ? entry->content_hash : 0);
+        write_uint32be(&buf[56], flags);
+        write_uint32be(&buf[60], entry->has_checksum ? entry->checksum : 0);
         amt_written = fwrite(buf, 1, HEADER_ENTRY_LEN, f);
         if (amt_written != HEADER_ENTRY_LEN)
             return RuckSackErrorFileAccess;
@@ -465,7 +1329,7 @@ static int write_header(struct RuckSackBundlePrivate *b) {
             return RuckSackErrorFileAccess;
     }
 
-    return RuckSackErrorNone;
+    return write_key_tables(b);
 }
 
 static void init_new_bundle(struct RuckSackBundlePrivate *b, long headers_size) {
@@ -475,6 +1339,137 @@ static void init_new_bundle(struct RuckSackBundlePrivate *b, long headers_size)
     b->first_file_offset = b->first_header_offset + allocated_header_bytes;
 }
 
+// gives the space of e's region to its neighbor. nothing else may be using
+// the region.
+static void free_region(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
+    struct RuckSackFileEntry *prev = get_prev_entry(b, e);
+    struct RuckSackFileEntry *next = get_next_entry(b, e);
+    if (prev) {
+        prev->allocated_size += e->allocated_size;
+    } else if (next) {
+        b->first_entry = next;
+        b->first_file_offset = b->first_entry->offset;
+    } else {
+        b->first_entry = NULL;
+        init_new_bundle(b, -1);
+    }
+    if (e == b->last_entry)
+        b->last_entry = prev;
+    e->allocated_size = 0;
+}
+
+// hands the region of e over to one of the duplicates that point at it
+static void pass_on_region(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
+    struct RuckSackFileEntry *heir = NULL;
+    for (int i = 0; i < b->header_entry_count && !heir; i += 1) {
+        struct RuckSackFileEntry *other = &b->entries[i];
+        if (other->is_duplicate && other->offset == e->offset)
+            heir = other;
+    }
+    assert(heir);
+
+    // same contents, so the heir hashes to the same slot
+    long slot = entry_index_find_slot(b, &b->content_index, e - b->entries);
+    b->content_index.slots[slot] = heir - b->entries;
+
+    heir->is_duplicate = false;
+    heir->allocated_size = e->allocated_size;
+    heir->ref_count = e->ref_count - 1;
+    if (b->first_entry == e)
+        b->first_entry = heir;
+    if (b->last_entry == e)
+        b->last_entry = heir;
+
+    e->allocated_size = 0;
+    e->ref_count = 1;
+}
+
+// stops e from using its region, which is freed once no entry uses it.
+// afterwards e has neither a region nor known contents.
+static void leave_region(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
+    if (e->is_duplicate) {
+        find_region_owner(b, e)->ref_count -= 1;
+        e->is_duplicate = false;
+    } else if (e->ref_count > 1) {
+        pass_on_region(b, e);
+    } else {
+        if (entry_owns_hashed_region(e))
+            entry_index_remove(b, &b->content_index, e - b->entries);
+        free_region(b, e);
+    }
+    e->allocated_size = 0;
+    e->has_content_hash = false;
+    e->has_checksum = false;
+}
+
+// points e at the region of owner, which has the contents e should have
+static void share_region(struct RuckSackFileEntry *e, struct RuckSackFileEntry *owner) {
+    e->offset = owner->offset;
+    e->size = owner->size;
+    e->allocated_size = 0;
+    e->compression = owner->compression;
+    e->uncompressed_size = owner->uncompressed_size;
+    e->content_hash = owner->content_hash;
+    e->has_content_hash = true;
+    e->checksum = owner->checksum;
+    e->has_checksum = owner->has_checksum;
+    e->is_duplicate = true;
+    owner->ref_count += 1;
+}
+
+// reports whether the size bytes at offset are the same as data, or the
+// same as the size bytes at other_offset when data is NULL. read errors
+// count as a mismatch.
+static bool region_matches(struct RuckSackBundlePrivate *b, long offset, long size,
+        const unsigned char *data, long other_offset)
+{
+    long chunk_size = MIN(1048576, MAX(size, 1));
+    unsigned char *buf = malloc(2 * chunk_size);
+    if (!buf)
+        return false;
+
+    bool match = true;
+    for (long pos = 0; pos < size && match; pos += chunk_size) {
+        long amt = MIN(chunk_size, size - pos);
+        const unsigned char *other = data ? data + pos : buf + chunk_size;
+        if (bundle_pread(b, buf, amt, offset + pos) != amt)
+            match = false;
+        else if (!data && bundle_pread(b, buf + chunk_size, amt, other_offset + pos) != amt)
+            match = false;
+        else
+            match = memcmp(buf, other, amt) == 0;
+    }
+    free(buf);
+    return match;
+}
+
+// looks for an entry that already stores the bytes described by `like`.
+// the bytes are data, or when data is NULL, the region `like` points at.
+static struct RuckSackFileEntry *find_same_contents(struct RuckSackBundlePrivate *b,
+        const struct RuckSackFileEntry *like, const unsigned char *data)
+{
+    struct EntryIndex *index = &b->content_index;
+    if (!index->slots)
+        return NULL;
+
+    long mask = index->size - 1;
+    for (long slot = entry_content_hash(like) & mask; index->slots[slot] != -1;
+            slot = (slot + 1) & mask)
+    {
+        struct RuckSackFileEntry *e = &b->entries[index->slots[slot]];
+        if (e == like || e->content_hash != like->content_hash ||
+            !is_aligned(e->offset, like->alignment) || e->size != like->size ||
+            e->compression != like->compression ||
+            (e->compression && e->uncompressed_size != like->uncompressed_size))
+        {
+            continue;
+        }
+        if (region_matches(b, e->offset, e->size, data, like->offset))
+            return e;
+    }
+    return NULL;
+}
+
 // when memory is true, bundle_path is the pointer to the memory and
 // headers_size is the length of the memory buffer
 static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bundle,
@@ -488,6 +1483,11 @@ static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bund
 
     init_new_bundle(b, headers_size);
     b->read_only = read_only;
+    b->alignment = 1;
+    pthread_mutex_init(&b->load_mutex, NULL);
+    b->key_index.hash = entry_key_hash;
+    b->content_index.hash = entry_content_hash;
+    b->content_index.holds = entry_owns_hashed_region;
 
     if (memory) {
         b->mem_buffer = bundle_path;
@@ -559,6 +1559,26 @@ int rucksack_bundle_open_read_mem(const unsigned char *buffer, long size,
     return open_bundle((const char *)buffer, out_bundle, true, size, true);
 }
 
+int rucksack_bundle_open_mmap(const char *bundle_path, struct RuckSackBundle **out_bundle) {
+    const char *buffer;
+    long size;
+    int err = map_bundle_file(bundle_path, &buffer, &size);
+    if (err) {
+        *out_bundle = NULL;
+        return err;
+    }
+
+    err = open_bundle(buffer, out_bundle, true, size, true);
+    if (err) {
+        unmap_bundle_file(buffer, size);
+        return err;
+    }
+
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)*out_bundle;
+    b->mem_mapped = true;
+    return RuckSackErrorNone;
+}
+
 int rucksack_bundle_close(struct RuckSackBundle *bundle) {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
 
@@ -574,6 +1594,11 @@ int rucksack_bundle_close(struct RuckSackBundle *bundle) {
         }
         free(b->entries);
     }
+    free(b->key_index.slots);
+    free(b->content_index.slots);
+    free(b->header_buf);
+    free(b->sorted_entries);
+    pthread_mutex_destroy(&b->load_mutex);
 
     int close_err = bundle_close(b);
     free(b);
@@ -641,9 +1666,16 @@ int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
     return RuckSackErrorNone;
 }
 
-static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key, int key_size,
-        long int size, struct RuckSackFileEntry **out_entry, char precise)
+// adds an entry with no region yet
+static int create_file_entry(struct RuckSackBundlePrivate *b, const char *key, int key_size,
+        long alignment, struct RuckSackFileEntry **out_entry)
 {
+    int err = reserve_indexes(b, b->header_entry_count + 1);
+    if (err) {
+        *out_entry = NULL;
+        return err;
+    }
+
     char *key_dupe = dupe_string(key, &key_size);
     if (!key_dupe) {
         *out_entry = NULL;
@@ -652,10 +1684,15 @@ static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key,
 
     // create a new entry
     if (b->header_entry_count >= b->header_entry_mem_count) {
+        // realloc may move the entries, so remember where these point
+        long first_index = b->first_entry ? b->first_entry - b->entries : -1;
+        long last_index = b->last_entry ? b->last_entry - b->entries : -1;
+
         b->header_entry_mem_count = alloc_count(b->header_entry_mem_count);
         struct RuckSackFileEntry *new_ptr = realloc(b->entries,
                 b->header_entry_mem_count * sizeof(struct RuckSackFileEntry));
         if (!new_ptr) {
+            free(key_dupe);
             *out_entry = NULL;
             return RuckSackErrorNoMem;
         }
@@ -663,42 +1700,80 @@ static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key,
         long int clear_size = clear_amt * sizeof(struct RuckSackFileEntry);
         memset(new_ptr + b->header_entry_count, 0, clear_size);
         b->entries = new_ptr;
+        b->first_entry = (first_index == -1) ? NULL : &b->entries[first_index];
+        b->last_entry = (last_index == -1) ? NULL : &b->entries[last_index];
     }
     struct RuckSackFileEntry *entry = &b->entries[b->header_entry_count];
     b->header_entry_count += 1;
     entry->key = key_dupe;
     entry->key_size = key_size;
+    entry->key_hash = hash_key(key_dupe, key_size);
     entry->b = b;
+    entry->ref_count = 1;
+    entry->alignment = alignment;
     b->headers_byte_count += HEADER_ENTRY_LEN + entry->key_size;
-
-    allocate_file(b, size, entry, precise);
+    entry_index_insert(b, &b->key_index, b->header_entry_count - 1);
+    forget_key_order(b);
 
     *out_entry = entry;
     return RuckSackErrorNone;
 }
 
-static struct RuckSackFileEntry *find_file_entry(struct RuckSackBundlePrivate *b,
-        const char *key, int key_size)
+static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key, int key_size,
+        long int size, long alignment, struct RuckSackFileEntry **out_entry, char precise)
 {
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
-        if (memneql(key, key_size, e->key, e->key_size) == 0)
+    int err = create_file_entry(b, key, key_size, alignment, out_entry);
+    if (err)
+        return err;
+    allocate_file(b, size, *out_entry, precise);
+    return RuckSackErrorNone;
+}
+
+static struct RuckSackFileEntry *find_file_entry(struct RuckSackBundlePrivate *b,
+        const char *key, int key_size)
+{
+    if (b->lazy)
+        return find_lazy_entry(b, key, key_size);
+
+    struct EntryIndex *index = &b->key_index;
+    if (!index->slots)
+        return NULL;
+
+    uint32_t hash = hash_key(key, key_size);
+    long mask = index->size - 1;
+    for (long slot = hash & mask; index->slots[slot] != -1; slot = (slot + 1) & mask) {
+        struct RuckSackFileEntry *e = &b->entries[index->slots[slot]];
+        if (e->key_hash == hash && memneql(key, key_size, e->key, e->key_size) == 0)
             return e;
     }
     return NULL;
 }
 
 static int get_file_entry(struct RuckSackBundlePrivate *b, const char *key,
-        int key_size, long int size, struct RuckSackFileEntry **out_entry, char precise)
+        int key_size, long int size, long alignment, struct RuckSackFileEntry **out_entry,
+        char precise)
 {
     // return info for existing entry
     struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
     if (e) {
-        if (e->allocated_size < size) {
-            int err = resize_file_entry(b, e, size, precise);
-            if (err) {
-                *out_entry = NULL;
-                return err;
+        e->alignment = alignment;
+        // the caller is about to overwrite the contents
+        if (e->is_duplicate || e->ref_count > 1 || !is_aligned(e->offset, alignment)) {
+            // other entries keep the old contents, or the new contents
+            // have to start somewhere else, so this one moves out
+            leave_region(b, e);
+            allocate_file(b, size, e, precise);
+        } else {
+            if (entry_owns_hashed_region(e))
+                entry_index_remove(b, &b->content_index, e - b->entries);
+            e->has_content_hash = false;
+            e->has_checksum = false;
+            if (e->allocated_size < size) {
+                int err = resize_file_entry(b, e, size, precise);
+                if (err) {
+                    *out_entry = NULL;
+                    return err;
+                }
             }
         }
         *out_entry = e;
@@ -706,13 +1781,33 @@ static int get_file_entry(struct RuckSackBundlePrivate *b, const char *key,
     }
 
     // none found, allocate new entry
-    return allocate_file_entry(b, key, key_size, size, out_entry, precise);
+    return allocate_file_entry(b, key, key_size, size, alignment, out_entry, precise);
+}
+
+// the alignment of an entry that asks for alignment, where 0 stands for the
+// bundle's default
+static int resolve_alignment(struct RuckSackBundlePrivate *b, long alignment,
+        long *out_alignment)
+{
+    if (alignment == 0)
+        alignment = b->alignment;
+    if (!valid_alignment(alignment))
+        return RuckSackErrorInvalidAlignment;
+    *out_alignment = alignment;
+    return RuckSackErrorNone;
 }
 
 static int add_stream(struct RuckSackBundle *bundle, const char *key,
-        int key_size, long size_guess, struct RuckSackOutStream **out_stream,
+        int key_size, long size_guess, long alignment, struct RuckSackOutStream **out_stream,
         char precise, long mtime)
 {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    int err = resolve_alignment(b, alignment, &alignment);
+    if (err) {
+        *out_stream = NULL;
+        return err;
+    }
+
     struct RuckSackOutStream *stream = calloc(1, sizeof(struct RuckSackOutStream));
 
     if (!stream) {
@@ -721,9 +1816,9 @@ static int add_stream(struct RuckSackBundle *bundle, const char *key,
     }
     key_size = (key_size == -1) ? strlen(key) : key_size;
 
-    stream->b = (struct RuckSackBundlePrivate *) bundle;
+    stream->b = b;
     long stream_size = alloc_size_precise(precise, size_guess);
-    int err = get_file_entry(stream->b, key, key_size, stream_size, &stream->e, precise);
+    err = get_file_entry(b, key, key_size, stream_size, alignment, &stream->e, precise);
     if (err) {
         free(stream);
         *out_stream = NULL;
@@ -731,8 +1826,11 @@ static int add_stream(struct RuckSackBundle *bundle, const char *key,
     }
     stream->e->is_open = 1;
     stream->e->size = 0;
+    stream->e->compression = RuckSackCompressionNone;
+    stream->e->uncompressed_size = 0;
     stream->e->mtime = mtime;
     stream->e->touched = 1;
+    stream->content_hash = CONTENT_HASH_INIT;
 
     *out_stream = stream;
     return RuckSackErrorNone;
@@ -742,21 +1840,73 @@ int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle,
         const char *key, int key_size, long size, struct RuckSackOutStream **out_stream,
         long mtime)
 {
-    return add_stream(bundle, key, key_size, size, out_stream, 1, mtime);
+    return add_stream(bundle, key, key_size, size, 0, out_stream, 1, mtime);
 }
 
 int rucksack_bundle_add_stream(struct RuckSackBundle *bundle,
         const char *key, int key_size, long size_guess, struct RuckSackOutStream **out_stream)
 {
-    return add_stream(bundle, key, key_size, size_guess, out_stream, 0, time(0));
+    return add_stream(bundle, key, key_size, size_guess, 0, out_stream, 0, time(0));
+}
+
+int rucksack_bundle_add_stream_aligned(struct RuckSackBundle *bundle,
+        const char *key, int key_size, long size_guess, long alignment,
+        struct RuckSackOutStream **out_stream)
+{
+    return add_stream(bundle, key, key_size, size_guess, alignment, out_stream, 0, time(0));
+}
+
+int rucksack_bundle_add_stream_precise_aligned(struct RuckSackBundle *bundle,
+        const char *key, int key_size, long size, long alignment,
+        struct RuckSackOutStream **out_stream, long mtime)
+{
+    return add_stream(bundle, key, key_size, size, alignment, out_stream, 1, mtime);
+}
+
+int rucksack_bundle_set_alignment(struct RuckSackBundle *bundle, long alignment) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    if (!valid_alignment(alignment))
+        return RuckSackErrorInvalidAlignment;
+    b->alignment = alignment;
+    return RuckSackErrorNone;
+}
+
+long rucksack_bundle_alignment(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    return b->alignment;
+}
+
+void rucksack_stream_set_compression(struct RuckSackOutStream *stream,
+        int compression, long uncompressed_size)
+{
+    stream->e->compression = compression;
+    stream->e->uncompressed_size = uncompressed_size;
 }
 
 void rucksack_stream_close(struct RuckSackOutStream *stream) {
-    stream->e->is_open = 0;
+    struct RuckSackBundlePrivate *b = stream->b;
+    struct RuckSackFileEntry *e = stream->e;
+    e->is_open = 0;
+
+    if (!stream->write_failed) {
+        e->content_hash = stream->content_hash;
+        e->has_content_hash = true;
+        e->checksum = stream->checksum;
+        e->has_checksum = true;
+        // if the bundle already had these contents, drop the new copy
+        struct RuckSackFileEntry *owner = find_same_contents(b, e, NULL);
+        if (owner) {
+            free_region(b, e);
+            share_region(e, owner);
+        } else {
+            entry_index_insert(b, &b->content_index, e - b->entries);
+        }
+    }
+
     free(stream);
 }
 
-int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
+static int write_to_stream(struct RuckSackOutStream *stream, const void *ptr,
         long int count)
 {
     long int pos = stream->e->size;
@@ -774,6 +1924,7 @@ int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
     if (fseek(f, stream->e->offset + pos, SEEK_SET))
         return RuckSackErrorFileAccess;
 
+    stream->b->write_pending = true;
     if (fwrite(ptr, 1, count, stream->b->f) != count)
         return RuckSackErrorFileAccess;
 
@@ -782,6 +1933,325 @@ int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
     return RuckSackErrorNone;
 }
 
+int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
+        long int count)
+{
+    int err = write_to_stream(stream, ptr, count);
+    if (err) {
+        stream->write_failed = true;
+    } else if (!stream->hashes_known) {
+        stream->content_hash = hash_content(stream->content_hash, ptr, count);
+        stream->checksum = rucksack_crc32c(stream->checksum, ptr, count);
+    }
+    return err;
+}
+
+// adds or replaces the entry for key, pointing it at the region of owner,
+// whose offset suits alignment
+static int add_duplicate_entry(struct RuckSackBundlePrivate *b, const char *key,
+        int key_size, long alignment, struct RuckSackFileEntry *owner)
+{
+    key_size = (key_size == -1) ? strlen(key) : key_size;
+    struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
+    if (e == owner || (e && e->is_duplicate && e->offset == owner->offset)) {
+        // nothing changed
+    } else if (e) {
+        leave_region(b, e);
+        share_region(e, owner);
+    } else {
+        // creating the entry may move the others
+        long owner_index = owner - b->entries;
+        int err = create_file_entry(b, key, key_size, alignment, &e);
+        if (err)
+            return err;
+        share_region(e, &b->entries[owner_index]);
+    }
+    e->alignment = alignment;
+    e->mtime = time(0);
+    e->touched = 1;
+    return RuckSackErrorNone;
+}
+
+struct AddFilesItem {
+    // the bytes to store, either the file contents or the compressed version
+    unsigned char *data;
+    long stored_size;
+    long size;
+    int compression;
+    // of data
+    uint64_t content_hash;
+    uint32_t checksum;
+    int err;
+    bool done;
+};
+
+struct AddFilesContext {
+    const struct RuckSackFileSource *files;
+    struct AddFilesItem *items;
+    long count;
+    // the workers stay at most this many files ahead of the writer, which
+    // bounds how much memory the prepared files take up
+    long window;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    pthread_cond_t space_cond;
+    // protected by mutex
+    long next;
+    long written;
+    bool abort;
+};
+
+static int load_file(const char *path, unsigned char **out_data, long *out_size) {
+    *out_data = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return RuckSackErrorFileAccess;
+
+    struct stat st;
+    if (fstat(fileno(f), &st)) {
+        fclose(f);
+        return RuckSackErrorFileAccess;
+    }
+
+    long size = st.st_size;
+    unsigned char *data = malloc(size ? size : 1);
+    if (!data) {
+        fclose(f);
+        return RuckSackErrorNoMem;
+    }
+    if (fread(data, 1, size, f) != size) {
+        free(data);
+        fclose(f);
+        return RuckSackErrorFileAccess;
+    }
+    if (fclose(f)) {
+        free(data);
+        return RuckSackErrorFileAccess;
+    }
+
+    *out_data = data;
+    *out_size = size;
+    return RuckSackErrorNone;
+}
+
+static void compress_prepared_file(const struct RuckSackFileSource *src,
+        struct AddFilesItem *item)
+{
+    int codec = src->compression;
+    if (codec == RuckSackCompressionAuto)
+        codec = rucksack_codec_choose(item->data, item->size);
+    if (codec == RuckSackCompressionNone)
+        return;
+    if (!rucksack_codec_available(codec)) {
+        item->err = RuckSackErrorCompressionUnsupported;
+        return;
+    }
+
+    unsigned char *compressed;
+    long compressed_size;
+    item->err = rucksack_codec_compress(codec, item->data, item->size,
+            &compressed, &compressed_size);
+    if (item->err || !compressed)
+        return;
+
+    // not worth a decompression step unless it saves at least 1/16
+    if (compressed_size >= item->size - item->size / 16) {
+        free(compressed);
+        return;
+    }
+    free(item->data);
+    item->data = compressed;
+    item->stored_size = compressed_size;
+    item->compression = codec;
+}
+
+// reads, compresses and hashes one file. safe to call from any thread.
+static void prepare_file(const struct RuckSackFileSource *src, struct AddFilesItem *item) {
+    item->err = load_file(src->path, &item->data, &item->size);
+    if (item->err)
+        return;
+    item->stored_size = item->size;
+    item->compression = RuckSackCompressionNone;
+
+    compress_prepared_file(src, item);
+    if (!item->err) {
+        item->content_hash = hash_content(CONTENT_HASH_INIT, item->data, item->stored_size);
+        item->checksum = rucksack_crc32c(0, item->data, item->stored_size);
+    }
+}
+
+static int write_prepared_file(struct RuckSackBundle *bundle,
+        const struct RuckSackFileSource *src, struct AddFilesItem *item)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    long alignment;
+    int err = resolve_alignment(b, src->alignment, &alignment);
+    if (err)
+        return err;
+
+    // don't write contents the bundle already has
+    struct RuckSackFileEntry like;
+    memset(&like, 0, sizeof(like));
+    like.size = item->stored_size;
+    like.compression = item->compression;
+    like.uncompressed_size = item->size;
+    like.content_hash = item->content_hash;
+    like.alignment = alignment;
+    struct RuckSackFileEntry *owner = find_same_contents(b, &like, item->data);
+    if (owner)
+        return add_duplicate_entry(b, src->key, src->key_size, alignment, owner);
+
+    struct RuckSackOutStream *stream;
+    err = rucksack_bundle_add_stream_aligned(bundle, src->key, src->key_size,
+            item->stored_size, alignment, &stream);
+    if (err)
+        return err;
+    stream->content_hash = item->content_hash;
+    stream->checksum = item->checksum;
+    stream->hashes_known = true;
+    err = rucksack_stream_write(stream, item->data, item->stored_size);
+    if (item->compression)
+        rucksack_stream_set_compression(stream, item->compression, item->size);
+    rucksack_stream_close(stream);
+    return err;
+}
+
+static void *add_files_worker(void *arg) {
+    struct AddFilesContext *ctx = arg;
+    pthread_mutex_lock(&ctx->mutex);
+    for (;;) {
+        while (!ctx->abort && ctx->next < ctx->count &&
+                ctx->next >= ctx->written + ctx->window)
+        {
+            pthread_cond_wait(&ctx->space_cond, &ctx->mutex);
+        }
+        if (ctx->abort || ctx->next >= ctx->count)
+            break;
+        long index = ctx->next;
+        ctx->next += 1;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        prepare_file(&ctx->files[index], &ctx->items[index]);
+
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->items[index].done = true;
+        pthread_cond_broadcast(&ctx->done_cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return NULL;
+}
+
+int rucksack_bundle_add_files(struct RuckSackBundle *bundle,
+        const struct RuckSackFileSource *files, long count, int thread_count,
+        long *failed_index)
+{
+    if (thread_count <= 0)
+        thread_count = rucksack_cpu_count();
+    if (thread_count > count)
+        thread_count = count;
+
+    struct AddFilesContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.files = files;
+    ctx.count = count;
+    ctx.window = thread_count * 2;
+    ctx.items = calloc(count ? count : 1, sizeof(struct AddFilesItem));
+    if (!ctx.items)
+        return RuckSackErrorNoMem;
+
+    int err = RuckSackErrorNone;
+    long index = 0;
+
+    if (thread_count <= 1) {
+        for (; index < count && !err; index += 1) {
+            struct AddFilesItem *item = &ctx.items[index];
+            prepare_file(&files[index], item);
+            err = item->err;
+            if (!err)
+                err = write_prepared_file(bundle, &files[index], item);
+            free(item->data);
+        }
+        free(ctx.items);
+        if (err && failed_index)
+            *failed_index = index - 1;
+        return err;
+    }
+
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    if (!threads) {
+        free(ctx.items);
+        return RuckSackErrorNoMem;
+    }
+    pthread_mutex_init(&ctx.mutex, NULL);
+    pthread_cond_init(&ctx.done_cond, NULL);
+    pthread_cond_init(&ctx.space_cond, NULL);
+
+    int started = 0;
+    for (; started < thread_count; started += 1) {
+        if (pthread_create(&threads[started], NULL, add_files_worker, &ctx))
+            break;
+    }
+    if (started == 0)
+        err = RuckSackErrorNoMem;
+
+    // write the files in order as the workers finish them
+    for (; index < count && !err; index += 1) {
+        struct AddFilesItem *item = &ctx.items[index];
+        pthread_mutex_lock(&ctx.mutex);
+        while (!item->done)
+            pthread_cond_wait(&ctx.done_cond, &ctx.mutex);
+        pthread_mutex_unlock(&ctx.mutex);
+
+        err = item->err;
+        if (!err)
+            err = write_prepared_file(bundle, &files[index], item);
+        free(item->data);
+        item->data = NULL;
+
+        pthread_mutex_lock(&ctx.mutex);
+        ctx.written = index + 1;
+        pthread_cond_broadcast(&ctx.space_cond);
+        pthread_mutex_unlock(&ctx.mutex);
+    }
+    if (err && failed_index)
+        *failed_index = index - 1;
+
+    pthread_mutex_lock(&ctx.mutex);
+    ctx.abort = true;
+    pthread_cond_broadcast(&ctx.space_cond);
+    pthread_mutex_unlock(&ctx.mutex);
+    for (int i = 0; i < started; i += 1)
+        pthread_join(threads[i], NULL);
+
+    // files that were prepared but never written because of an error
+    for (long i = 0; i < count; i += 1)
+        free(ctx.items[i].data);
+
+    pthread_cond_destroy(&ctx.space_cond);
+    pthread_cond_destroy(&ctx.done_cond);
+    pthread_mutex_destroy(&ctx.mutex);
+    free(threads);
+    free(ctx.items);
+    return err;
+}
+
+int rucksack_bundle_add_file_compressed(struct RuckSackBundle *bundle,
+        const char *key, int key_size, const char *file_name, int compression)
+{
+    struct RuckSackFileSource src;
+    src.key = key;
+    src.key_size = key_size;
+    src.path = file_name;
+    src.compression = compression;
+    src.alignment = 0;
+    return rucksack_bundle_add_files(bundle, &src, 1, 1, NULL);
+}
+
+int rucksack_compression_available(int compression) {
+    return rucksack_codec_available(compression);
+}
+
 struct RuckSackFileEntry *rucksack_bundle_find_file(struct RuckSackBundle *bundle,
         const char *key, int key_size)
 {
@@ -791,50 +2261,855 @@ struct RuckSackFileEntry *rucksack_bundle_find_file(struct RuckSackBundle *bundl
 }
 
 long int rucksack_file_size(struct RuckSackFileEntry *entry) {
+    return entry->compression ? entry->uncompressed_size : entry->size;
+}
+
+long rucksack_file_stored_size(struct RuckSackFileEntry *entry) {
     return entry->size;
 }
 
+int rucksack_file_compression(struct RuckSackFileEntry *entry) {
+    return entry->compression;
+}
+
 const char *rucksack_file_name(struct RuckSackFileEntry *entry) {
     return entry->key;
 }
 
-int rucksack_file_name_size(struct RuckSackFileEntry *entry) {
-    return entry->key_size;
+int rucksack_file_name_size(struct RuckSackFileEntry *entry) {
+    return entry->key_size;
+}
+
+int rucksack_file_read_stored(struct RuckSackFileEntry *e, unsigned char *buffer) {
+    long amt_read = bundle_pread(e->b, buffer, e->size, e->offset);
+    if (amt_read != e->size)
+        return RuckSackErrorFileAccess;
+    return RuckSackErrorNone;
+}
+
+// checks the stored bytes of e if the bundle is set to verify reads
+static int verify_read(struct RuckSackFileEntry *e, const unsigned char *stored) {
+    if (!e->b->verify_reads || !e->has_checksum)
+        return RuckSackErrorNone;
+    if (rucksack_crc32c(0, stored, e->size) != e->checksum)
+        return RuckSackErrorChecksumMismatch;
+    return RuckSackErrorNone;
+}
+
+int rucksack_file_checksum(struct RuckSackFileEntry *e, unsigned long *checksum) {
+    if (!e->has_checksum)
+        return 0;
+    *checksum = e->checksum;
+    return 1;
+}
+
+// stored bytes are checksummed this many at a time
+static const long VERIFY_CHUNK_SIZE = 1024 * 1024;
+
+int rucksack_file_verify(struct RuckSackFileEntry *e) {
+    struct RuckSackBundlePrivate *b = e->b;
+    if (!e->has_checksum)
+        return RuckSackErrorNone;
+
+    uint32_t crc = 0;
+    if (!b->f) {
+        if (e->offset < 0 || e->offset + e->size > b->mem_buffer_size)
+            return RuckSackErrorFileAccess;
+        crc = rucksack_crc32c(0, (const unsigned char *)b->mem_buffer + e->offset, e->size);
+    } else {
+        long chunk_size = MIN(VERIFY_CHUNK_SIZE, MAX(e->size, 1));
+        unsigned char *chunk = malloc(chunk_size);
+        if (!chunk)
+            return RuckSackErrorNoMem;
+        for (long pos = 0; pos < e->size; pos += chunk_size) {
+            long amt = MIN(chunk_size, e->size - pos);
+            if (bundle_pread(b, chunk, amt, e->offset + pos) != amt) {
+                free(chunk);
+                return RuckSackErrorFileAccess;
+            }
+            crc = rucksack_crc32c(crc, chunk, amt);
+        }
+        free(chunk);
+    }
+
+    return (crc == e->checksum) ? RuckSackErrorNone : RuckSackErrorChecksumMismatch;
+}
+
+struct VerifyContext {
+    struct RuckSackBundlePrivate *b;
+    int *results;
+    pthread_mutex_t mutex;
+    long next; // protected by mutex
+};
+
+static void *verify_worker(void *arg) {
+    struct VerifyContext *ctx = arg;
+    struct RuckSackBundlePrivate *b = ctx->b;
+    for (;;) {
+        pthread_mutex_lock(&ctx->mutex);
+        long index = ctx->next;
+        ctx->next += 1;
+        pthread_mutex_unlock(&ctx->mutex);
+        if (index >= b->header_entry_count)
+            break;
+
+        // duplicates get the result of their region's owner afterwards,
+        // except in lazy bundles, which have no index to find the owner with
+        struct RuckSackFileEntry *e = &b->entries[index];
+        if (!e->is_duplicate || b->lazy)
+            ctx->results[index] = rucksack_file_verify(e);
+    }
+    return NULL;
+}
+
+int rucksack_bundle_verify(struct RuckSackBundle *bundle, int thread_count, int *results) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+
+    // the workers read with pread, which must not have to flush anything
+    if (b->f && bundle_flush(b))
+        return RuckSackErrorFileAccess;
+
+    int err = load_all_entries(b);
+    if (err)
+        return err;
+
+    if (thread_count <= 0)
+        thread_count = rucksack_cpu_count();
+#ifndef RUCKSACK_HAVE_PREAD
+    // reading goes through the shared file position
+    if (b->f)
+        thread_count = 1;
+#endif
+    if (thread_count > b->header_entry_count)
+        thread_count = b->header_entry_count;
+
+    struct VerifyContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.b = b;
+    ctx.results = results;
+    pthread_mutex_init(&ctx.mutex, NULL);
+
+    pthread_t *threads = calloc(MAX(thread_count, 1), sizeof(pthread_t));
+    if (!threads) {
+        pthread_mutex_destroy(&ctx.mutex);
+        return RuckSackErrorNoMem;
+    }
+    int started = 0;
+    for (; started < thread_count; started += 1) {
+        if (pthread_create(&threads[started], NULL, verify_worker, &ctx))
+            break;
+    }
+    // with no threads at all, do the work here
+    if (started == 0)
+        verify_worker(&ctx);
+    for (int i = 0; i < started; i += 1)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&ctx.mutex);
+
+    for (long i = 0; i < b->header_entry_count && !b->lazy; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+        if (e->is_duplicate)
+            results[i] = results[find_region_owner(b, e) - b->entries];
+    }
+
+    return RuckSackErrorNone;
+}
+
+void rucksack_bundle_set_verify_reads(struct RuckSackBundle *bundle, int verify) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    b->verify_reads = verify != 0;
+}
+
+// decompresses the whole entry into buffer
+static int read_compressed(struct RuckSackFileEntry *e, unsigned char *buffer) {
+    struct RuckSackBundlePrivate *b = e->b;
+    if (!rucksack_codec_available(e->compression))
+        return RuckSackErrorCompressionUnsupported;
+
+    // memory bundles can decompress straight from the bundle
+    if (!b->f) {
+        if (e->offset < 0 || e->offset + e->size > b->mem_buffer_size)
+            return RuckSackErrorFileAccess;
+        const unsigned char *stored = (const unsigned char *)b->mem_buffer + e->offset;
+        int err = verify_read(e, stored);
+        if (err)
+            return err;
+        return rucksack_codec_decompress(e->compression, stored, e->size,
+                buffer, e->uncompressed_size);
+    }
+
+    unsigned char *stored = malloc(e->size);
+    if (!stored)
+        return RuckSackErrorNoMem;
+    int err = rucksack_file_read_stored(e, stored);
+    if (!err)
+        err = verify_read(e, stored);
+    if (!err) {
+        err = rucksack_codec_decompress(e->compression, stored, e->size,
+                buffer, e->uncompressed_size);
+    }
+    free(stored);
+    return err;
+}
+
+int rucksack_file_read(struct RuckSackFileEntry *e, unsigned char *buffer)
+{
+    return rucksack_file_read_range(e, 0, rucksack_file_size(e), buffer);
+}
+
+// compressed bytes are read from the bundle this many at a time
+static const long IN_STREAM_CHUNK_SIZE = 64 * 1024;
+
+// the decoder cannot start in the middle, so the bytes before offset are
+// decompressed into a scratch buffer and thrown away. decoding stops once
+// the range has been read.
+static int read_compressed_range(struct RuckSackFileEntry *e, long offset,
+        long length, unsigned char *buffer)
+{
+    struct RuckSackInStream *stream;
+    int err = rucksack_file_open_stream(e, &stream);
+    if (err)
+        return err;
+    unsigned char *scratch = NULL;
+    if (offset > 0) {
+        scratch = malloc(MIN(offset, IN_STREAM_CHUNK_SIZE));
+        if (!scratch) {
+            rucksack_in_stream_close(stream);
+            return RuckSackErrorNoMem;
+        }
+    }
+    long amt_read;
+    for (long skipped = 0; skipped < offset; skipped += amt_read) {
+        err = rucksack_in_stream_read(stream, scratch,
+                MIN(offset - skipped, IN_STREAM_CHUNK_SIZE), &amt_read);
+        if (!err && amt_read == 0)
+            err = RuckSackErrorCorruptData;
+        if (err)
+            break;
+    }
+    if (!err) {
+        err = rucksack_in_stream_read(stream, buffer, length, &amt_read);
+        if (!err && amt_read != length)
+            err = RuckSackErrorCorruptData;
+    }
+    free(scratch);
+    rucksack_in_stream_close(stream);
+    return err;
+}
+
+int rucksack_file_read_range(struct RuckSackFileEntry *e, long offset,
+        long length, unsigned char *buffer)
+{
+    long size = rucksack_file_size(e);
+    if (offset < 0 || length < 0 || offset > size || length > size - offset)
+        return RuckSackErrorInvalidRange;
+
+    if (e->compression) {
+        if (offset == 0 && length == size)
+            return read_compressed(e, buffer);
+        return read_compressed_range(e, offset, length, buffer);
+    }
+
+    long amt_read = bundle_pread(e->b, buffer, length, e->offset + offset);
+    if (amt_read != length)
+        return RuckSackErrorFileAccess;
+    if (offset == 0 && length == e->size)
+        return verify_read(e, buffer);
+    return RuckSackErrorNone;
+}
+
+struct ReadManyItem {
+    long offset;
+    long index;
+};
+
+static int compare_read_many_items(const void *a, const void *b) {
+    const struct ReadManyItem *item_a = a;
+    const struct ReadManyItem *item_b = b;
+    if (item_a->offset < item_b->offset)
+        return -1;
+    return item_a->offset > item_b->offset;
+}
+
+// entries closer together than this are read in one go, wasting the bytes
+// in between rather than paying for another read
+static const long READ_MANY_MAX_GAP = 64 * 1024;
+// but a single merged read never gets bigger than this
+static const long READ_MANY_MAX_RUN = 4 * 1024 * 1024;
+
+int rucksack_bundle_read_many(struct RuckSackBundle *bundle,
+        struct RuckSackFileEntry **entries, unsigned char **buffers, long count)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+
+    struct ReadManyItem *items = malloc(count * sizeof(struct ReadManyItem));
+    if (!items && count > 0)
+        return RuckSackErrorNoMem;
+    for (long i = 0; i < count; i += 1) {
+        items[i].offset = entries[i]->offset;
+        items[i].index = i;
+    }
+    qsort(items, count, sizeof(struct ReadManyItem), compare_read_many_items);
+
+    unsigned char *run_buf = NULL;
+    long run_buf_size = 0;
+    int err = RuckSackErrorNone;
+
+    long i = 0;
+    while (i < count && !err) {
+        // grow the run while the next entry starts close to where it ends
+        long run_start = items[i].offset;
+        long run_end = run_start + entries[items[i].index]->size;
+        long run_count = 1;
+        while (i + run_count < count) {
+            struct RuckSackFileEntry *e = entries[items[i + run_count].index];
+            long new_end = MAX(run_end, e->offset + e->size);
+            if (e->offset - run_end > READ_MANY_MAX_GAP ||
+                new_end - run_start > READ_MANY_MAX_RUN)
+            {
+                break;
+            }
+            run_end = new_end;
+            run_count += 1;
+        }
+        long run_first = i;
+        i += run_count;
+
+        // memory bundles gain nothing from merging
+        if (run_count == 1 || !b->f) {
+            for (long j = run_first; j < i && !err; j += 1) {
+                long index = items[j].index;
+                err = rucksack_file_read(entries[index], buffers[index]);
+            }
+            continue;
+        }
+
+        long run_size = run_end - run_start;
+        if (run_size > run_buf_size) {
+            unsigned char *new_buf = realloc(run_buf, run_size);
+            if (!new_buf) {
+                err = RuckSackErrorNoMem;
+                continue;
+            }
+            run_buf = new_buf;
+            run_buf_size = run_size;
+        }
+        if (bundle_pread(b, run_buf, run_size, run_start) != run_size) {
+            err = RuckSackErrorFileAccess;
+            continue;
+        }
+        for (long j = run_first; j < i && !err; j += 1) {
+            long index = items[j].index;
+            struct RuckSackFileEntry *e = entries[index];
+            const unsigned char *stored = run_buf + (e->offset - run_start);
+            err = verify_read(e, stored);
+            if (err)
+                continue;
+            if (!e->compression) {
+                memcpy(buffers[index], stored, e->size);
+            } else if (!rucksack_codec_available(e->compression)) {
+                err = RuckSackErrorCompressionUnsupported;
+            } else {
+                err = rucksack_codec_decompress(e->compression, stored, e->size,
+                        buffers[index], e->uncompressed_size);
+            }
+        }
+    }
+
+    free(run_buf);
+    free(items);
+    return err;
+}
+
+const unsigned char *rucksack_file_data_ptr(struct RuckSackFileEntry *e) {
+    struct RuckSackBundlePrivate *b = e->b;
+    if (!b->mem_buffer || e->compression || e->offset + e->size > b->mem_buffer_size)
+        return NULL;
+    return (const unsigned char *)b->mem_buffer + e->offset;
+}
+
+struct RuckSackInStream {
+    struct RuckSackFileEntry *e;
+    // uncompressed bytes handed out so far
+    long pos;
+
+    // set when the stored bytes are checked as they go by
+    bool verify;
+    uint32_t checksum; // of the stored bytes seen so far
+
+    // the rest only applies to compressed entries
+    struct RuckSackDecoder *decoder;
+    // stored bytes consumed from the bundle so far
+    long stored_pos;
+    unsigned char *chunk;
+    // input that the decoder has not used up yet
+    const unsigned char *input;
+    long input_size;
+};
+
+int rucksack_file_open_stream(struct RuckSackFileEntry *e,
+        struct RuckSackInStream **out_stream)
+{
+    *out_stream = NULL;
+    struct RuckSackInStream *stream = calloc(1, sizeof(struct RuckSackInStream));
+    if (!stream)
+        return RuckSackErrorNoMem;
+    stream->e = e;
+    stream->verify = e->b->verify_reads && e->has_checksum;
+
+    if (e->compression) {
+        int err = rucksack_decoder_create(e->compression, &stream->decoder);
+        if (err) {
+            free(stream);
+            return err;
+        }
+        // memory bundles feed the decoder straight from the bundle
+        if (e->b->f) {
+            stream->chunk = malloc(MIN(IN_STREAM_CHUNK_SIZE, MAX(e->size, 1)));
+            if (!stream->chunk) {
+                rucksack_in_stream_close(stream);
+                return RuckSackErrorNoMem;
+            }
+        }
+    }
+
+    *out_stream = stream;
+    return RuckSackErrorNone;
+}
+
+// adds stored bytes to the running checksum, checking it once the last of
+// them have gone by
+static int in_stream_verify(struct RuckSackInStream *stream,
+        const unsigned char *stored, long size, bool at_end)
+{
+    if (!stream->verify)
+        return RuckSackErrorNone;
+    stream->checksum = rucksack_crc32c(stream->checksum, stored, size);
+    if (at_end && stream->checksum != stream->e->checksum)
+        return RuckSackErrorChecksumMismatch;
+    return RuckSackErrorNone;
+}
+
+// makes sure the decoder has input, unless all of it has been consumed
+static int in_stream_fill(struct RuckSackInStream *stream) {
+    struct RuckSackFileEntry *e = stream->e;
+    struct RuckSackBundlePrivate *b = e->b;
+    if (stream->input_size > 0 || stream->stored_pos >= e->size)
+        return RuckSackErrorNone;
+
+    if (!b->f) {
+        if (e->offset < 0 || e->offset + e->size > b->mem_buffer_size)
+            return RuckSackErrorFileAccess;
+        stream->input = (const unsigned char *)b->mem_buffer + e->offset;
+        stream->input_size = e->size;
+        stream->stored_pos = e->size;
+        return in_stream_verify(stream, stream->input, e->size, true);
+    }
+
+    long amt_to_read = MIN(IN_STREAM_CHUNK_SIZE, e->size - stream->stored_pos);
+    long amt_read = bundle_pread(b, stream->chunk, amt_to_read, e->offset + stream->stored_pos);
+    if (amt_read != amt_to_read)
+        return RuckSackErrorFileAccess;
+    stream->stored_pos += amt_read;
+    stream->input = stream->chunk;
+    stream->input_size = amt_read;
+    return in_stream_verify(stream, stream->chunk, amt_read, stream->stored_pos == e->size);
+}
+
+int rucksack_in_stream_read(struct RuckSackInStream *stream, void *ptr,
+        long count, long *amt_read)
+{
+    struct RuckSackFileEntry *e = stream->e;
+    *amt_read = 0;
+    long remaining = rucksack_file_size(e) - stream->pos;
+    if (count > remaining)
+        count = remaining;
+    if (count <= 0)
+        return RuckSackErrorNone;
+
+    if (!e->compression) {
+        long amt = bundle_pread(e->b, ptr, count, e->offset + stream->pos);
+        if (amt != count)
+            return RuckSackErrorFileAccess;
+        int err = in_stream_verify(stream, ptr, count, stream->pos + count == e->size);
+        if (err)
+            return err;
+        stream->pos += count;
+        *amt_read = count;
+        return RuckSackErrorNone;
+    }
+
+    unsigned char *dest = ptr;
+    long produced = 0;
+    while (produced < count) {
+        int err = in_stream_fill(stream);
+        if (err)
+            return err;
+        bool had_input = stream->input_size > 0;
+        long written;
+        err = rucksack_decoder_run(stream->decoder, &stream->input, &stream->input_size,
+                dest + produced, count - produced, &written);
+        if (err)
+            return err;
+        produced += written;
+        // no progress with all input consumed means the data ends early
+        if (written == 0 && !had_input)
+            return RuckSackErrorCorruptData;
+    }
+
+    stream->pos += produced;
+    *amt_read = produced;
+    return RuckSackErrorNone;
+}
+
+void rucksack_in_stream_close(struct RuckSackInStream *stream) {
+    if (!stream)
+        return;
+    rucksack_decoder_destroy(stream->decoder);
+    free(stream->chunk);
+    free(stream);
+}
+
+void rucksack_version(int *major, int *minor, int *patch) {
+    if (major) *major = RUCKSACK_VERSION_MAJOR;
+    if (minor) *minor = RUCKSACK_VERSION_MINOR;
+    if (patch) *patch = RUCKSACK_VERSION_PATCH;
+}
+
+long int rucksack_bundle_file_count(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    return b->header_entry_count;
+}
+
+int rucksack_bundle_get_files(struct RuckSackBundle *bundle,
+        struct RuckSackFileEntry **entries)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    int err = load_all_entries(b);
+    if (err)
+        return err;
+    for (int i = 0; i < b->header_entry_count; i += 1) {
+        entries[i] = &b->entries[i];
+    }
+    return RuckSackErrorNone;
+}
+
+// which keys rucksack_bundle_iter_prefix and rucksack_bundle_iter_range visit
+struct KeyRange {
+    const char *first;
+    long first_size;
+    const char *prefix; // keys must start with it unless it is NULL
+    long prefix_size;
+    const char *end; // keys must come before it unless it is NULL
+    long end_size;
+};
+
+static int iter_key_range(struct RuckSackBundlePrivate *b, const struct KeyRange *range,
+        RuckSackIterCallback callback, void *userdata)
+{
+    int err = prepare_key_order(b);
+    if (err)
+        return err;
+
+    // find the first key that is not less than range->first
+    long lo = 0;
+    long hi = b->header_entry_count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        const char *key;
+        long key_size;
+        err = get_sorted_key(b, mid, &key, &key_size);
+        if (err)
+            return err;
+        if (compare_keys(key, key_size, range->first, range->first_size) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (long rank = lo; rank < b->header_entry_count; rank += 1) {
+        const char *key;
+        long key_size;
+        err = get_sorted_key(b, rank, &key, &key_size);
+        if (err)
+            return err;
+        if (range->prefix && (key_size < range->prefix_size ||
+                    memcmp(key, range->prefix, range->prefix_size) != 0))
+        {
+            break;
+        }
+        if (range->end && compare_keys(key, key_size, range->end, range->end_size) >= 0)
+            break;
+
+        struct RuckSackFileEntry *entry;
+        err = get_sorted_entry(b, rank, &entry);
+        if (err)
+            return err;
+        if (callback(entry, userdata))
+            break;
+    }
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_iter_prefix(struct RuckSackBundle *bundle, const char *prefix,
+        int prefix_size, RuckSackIterCallback callback, void *userdata)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    struct KeyRange range;
+    memset(&range, 0, sizeof(range));
+    range.prefix = prefix;
+    range.prefix_size = (prefix_size == -1) ? strlen(prefix) : prefix_size;
+    range.first = range.prefix;
+    range.first_size = range.prefix_size;
+    return iter_key_range(b, &range, callback, userdata);
+}
+
+int rucksack_bundle_iter_range(struct RuckSackBundle *bundle,
+        const char *first, int first_size, const char *end, int end_size,
+        RuckSackIterCallback callback, void *userdata)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    struct KeyRange range;
+    memset(&range, 0, sizeof(range));
+    range.first = first ? first : "";
+    range.first_size = !first ? 0 : (first_size == -1) ? strlen(first) : first_size;
+    range.end = end;
+    range.end_size = (end && end_size == -1) ? strlen(end) : end_size;
+    return iter_key_range(b, &range, callback, userdata);
+}
+
+const char *rucksack_err_str(int err) {
+    return ERROR_STR[err];
+}
+
+static uint32_t read_uint32le(const unsigned char *buf) {
+    return buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) |
+        ((uint32_t)buf[3] << 24);
+}
+
+static float read_float32le(const unsigned char *buf) {
+    uint32_t bits = read_uint32le(buf);
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static bool host_is_little_endian(void) {
+    uint32_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+// the sprite table of a version 2 texture is cast to this struct
+typedef char sprite_len_check[sizeof(struct RuckSackSprite) == 36 ? 1 : -1];
+// and so is its trim table
+typedef char sprite_trim_len_check[sizeof(struct RuckSackSpriteTrim) == 16 ? 1 : -1];
+
+// version 1 textures store a list of image entries of different sizes. they
+// are converted to a sprite table when the texture is opened.
+static int load_image_entries(struct RuckSackTexturePrivate *t,
+        const unsigned char *meta, long meta_size, long first_offset)
+{
+    long count = t->images_count;
+    long keys_size = 0;
+    long pos = first_offset;
+    for (long i = 0; i < count; i += 1) {
+        if (pos + IMAGE_HEADER_LEN > meta_size)
+            return RuckSackErrorInvalidFormat;
+        long this_size = read_uint32be(&meta[pos]);
+        long key_size = read_uint32be(&meta[pos + 33]);
+        if (this_size < IMAGE_HEADER_LEN + key_size || pos + this_size > meta_size)
+            return RuckSackErrorInvalidFormat;
+        keys_size += key_size + 1;
+        pos += this_size;
+    }
+
+    long slot_count = key_table_slot_count(count);
+    long sprites_size = count * SPRITE_LEN;
+    long slots_size = slot_count * SPRITE_SLOT_LEN;
+    t->tables_buf = malloc(sprites_size + slots_size + keys_size + 1);
+    if (!t->tables_buf)
+        return RuckSackErrorNoMem;
+    struct RuckSackSprite *sprites = (struct RuckSackSprite *)t->tables_buf;
+    uint32_t *slots = (uint32_t *)&t->tables_buf[sprites_size];
+    char *keys = (char *)&t->tables_buf[sprites_size + slots_size];
+    memset(slots, 0xff, slots_size);
+
+    pos = first_offset;
+    long key_pos = 0;
+    for (long i = 0; i < count; i += 1) {
+        const unsigned char *buf = &meta[pos];
+        struct RuckSackSprite *sprite = &sprites[i];
+        memset(sprite, 0, sizeof(struct RuckSackSprite));
+        sprite->anchor = read_uint32be(&buf[4]);
+        sprite->anchor_x = read_float32be(&buf[8]);
+        sprite->anchor_y = read_float32be(&buf[12]);
+        sprite->x = read_uint32be(&buf[16]);
+        sprite->y = read_uint32be(&buf[20]);
+        sprite->width = read_uint32be(&buf[24]);
+        sprite->height = read_uint32be(&buf[28]);
+        sprite->r90 = buf[32];
+        sprite->key_size = read_uint32be(&buf[33]);
+        sprite->key_offset = key_pos;
+
+        memcpy(&keys[key_pos], &buf[IMAGE_HEADER_LEN], sprite->key_size);
+        keys[key_pos + sprite->key_size] = 0;
+        sprite_slot_insert(slots, slot_count, hash_key(&keys[key_pos], sprite->key_size), i);
+
+        key_pos += sprite->key_size + 1;
+        pos += read_uint32be(buf);
+    }
+
+    t->sprites = sprites;
+    t->sprite_slots = slots;
+    t->sprite_slot_count = slot_count;
+    t->keys = keys;
+    t->keys_size = keys_size;
+    return RuckSackErrorNone;
 }
 
-int rucksack_file_read(struct RuckSackFileEntry *e, unsigned char *buffer)
+// version 2 textures store the sprite table and its key table the way they
+// are used in memory. they are only copied when the byte order of this
+// machine is different or they are not aligned.
+static int load_sprite_table(struct RuckSackTexturePrivate *t,
+        const unsigned char *meta, long meta_size, long sprites_offset)
 {
-    struct RuckSackBundlePrivate *b = e->b;
-    if (bundle_seek(b, e->offset))
-        return RuckSackErrorFileAccess;
-    long amt_read = bundle_read(b, buffer, e->size);
-    if (amt_read != e->size)
-        return RuckSackErrorFileAccess;
-    return RuckSackErrorNone;
-}
+    long count = t->images_count;
+    long slots_offset = read_uint32be(&meta[44]);
+    long slot_count = read_uint32be(&meta[48]);
+    long keys_offset = read_uint32be(&meta[52]);
+    long trims_offset = sprites_offset + count * SPRITE_LEN;
+    long trims_size = t->has_sprite_trims ? count * SPRITE_TRIM_LEN : 0;
+    if (trims_offset + trims_size > meta_size ||
+        (slot_count & (slot_count - 1)) || (count > 0 && slot_count <= count) ||
+        slots_offset + slot_count * SPRITE_SLOT_LEN > meta_size ||
+        keys_offset > meta_size || sprites_offset % 4 != 0 || slots_offset % 4 != 0)
+    {
+        return RuckSackErrorInvalidFormat;
+    }
 
-void rucksack_version(int *major, int *minor, int *patch) {
-    if (major) *major = RUCKSACK_VERSION_MAJOR;
-    if (minor) *minor = RUCKSACK_VERSION_MINOR;
-    if (patch) *patch = RUCKSACK_VERSION_PATCH;
+    t->sprite_slot_count = slot_count;
+    t->keys = (const char *)&meta[keys_offset];
+    t->keys_size = meta_size - keys_offset;
+
+    if (host_is_little_endian() && (uintptr_t)meta % 4 == 0) {
+        t->sprites = (const struct RuckSackSprite *)&meta[sprites_offset];
+        t->sprite_slots = (const uint32_t *)&meta[slots_offset];
+        if (t->has_sprite_trims)
+            t->sprite_trims = (const struct RuckSackSpriteTrim *)&meta[trims_offset];
+        return RuckSackErrorNone;
+    }
+
+    long sprites_size = count * SPRITE_LEN;
+    long slots_size = slot_count * SPRITE_SLOT_LEN;
+    t->tables_buf = malloc(sprites_size + slots_size + trims_size + 1);
+    if (!t->tables_buf)
+        return RuckSackErrorNoMem;
+    struct RuckSackSprite *sprites = (struct RuckSackSprite *)t->tables_buf;
+    uint32_t *slots = (uint32_t *)&t->tables_buf[sprites_size];
+    struct RuckSackSpriteTrim *trims =
+        (struct RuckSackSpriteTrim *)&t->tables_buf[sprites_size + slots_size];
+
+    for (long i = 0; i < count; i += 1) {
+        const unsigned char *buf = &meta[sprites_offset + i * SPRITE_LEN];
+        struct RuckSackSprite *sprite = &sprites[i];
+        memset(sprite, 0, sizeof(struct RuckSackSprite));
+        sprite->x = read_uint32le(&buf[0]);
+        sprite->y = read_uint32le(&buf[4]);
+        sprite->width = read_uint32le(&buf[8]);
+        sprite->height = read_uint32le(&buf[12]);
+        sprite->anchor_x = read_float32le(&buf[16]);
+        sprite->anchor_y = read_float32le(&buf[20]);
+        sprite->key_offset = read_uint32le(&buf[24]);
+        sprite->key_size = read_uint32le(&buf[28]);
+        sprite->anchor = buf[32];
+        sprite->r90 = buf[33];
+        sprite->page = buf[34] | (buf[35] << 8);
+    }
+    for (long i = 0; i < slot_count * 2; i += 1)
+        slots[i] = read_uint32le(&meta[slots_offset + i * 4]);
+    for (long i = 0; i < trims_size / SPRITE_TRIM_LEN; i += 1) {
+        const unsigned char *buf = &meta[trims_offset + i * SPRITE_TRIM_LEN];
+        struct RuckSackSpriteTrim *trim = &trims[i];
+        trim->x = read_uint32le(&buf[0]);
+        trim->y = read_uint32le(&buf[4]);
+        trim->full_width = read_uint32le(&buf[8]);
+        trim->full_height = read_uint32le(&buf[12]);
+    }
+
+    t->sprites = sprites;
+    t->sprite_slots = slots;
+    if (t->has_sprite_trims)
+        t->sprite_trims = trims;
+    return RuckSackErrorNone;
 }
 
-long int rucksack_bundle_file_count(struct RuckSackBundle *bundle) {
-    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
-    return b->header_entry_count;
+// version 1 textures hold a single PNG level on a single page
+static int load_png_level(struct RuckSackTexturePrivate *t) {
+    struct RuckSackTexture *texture = &t->externals;
+    texture->format = RuckSackTextureFormatPng;
+    texture->compression = RuckSackCompressionNone;
+    texture->mip_levels = 1;
+    t->pixel_size = t->pixel_data_size;
+    t->levels = calloc(1, sizeof(struct RuckSackTextureLevel));
+    if (!t->levels)
+        return RuckSackErrorNoMem;
+    t->levels[0].size = t->pixel_size;
+    t->level_count = 1;
+    t->page_count = 1;
+    return RuckSackErrorNone;
 }
 
-void rucksack_bundle_get_files(struct RuckSackBundle *bundle,
-        struct RuckSackFileEntry **entries)
+// reads the rest of the version 2 header and the level table, which ends
+// before header_len
+static int load_pixel_format(struct RuckSackTexturePrivate *t,
+        const unsigned char *meta, long header_len)
 {
-    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        entries[i] = &b->entries[i];
+    struct RuckSackTexture *texture = &t->externals;
+    texture->format = read_uint32be(&meta[56]);
+    texture->compression = read_uint32be(&meta[60]);
+    t->pixel_size = read_uint64be(&meta[64]);
+    long level_count = read_uint32be(&meta[80]);
+    long levels_offset = read_uint32be(&meta[84]);
+    long page_count = read_uint32be(&meta[88]);
+    texture->packing = meta[92];
+    texture->sort_by = meta[93];
+    texture->trim = meta[94];
+    t->has_sprite_trims = meta[95];
+    if (texture->compression < RuckSackCompressionNone ||
+        texture->compression >= RuckSackCompressionAuto ||
+        (texture->compression == RuckSackCompressionNone &&
+         t->pixel_size != t->pixel_data_size) ||
+        level_count < 1 || page_count < 1 || page_count > MAX_PAGES ||
+        levels_offset < TEXTURE_HEADER_LEN_V2 ||
+        levels_offset + page_count * level_count * TEXTURE_LEVEL_LEN > header_len)
+    {
+        return RuckSackErrorInvalidFormat;
     }
-}
 
-const char *rucksack_err_str(int err) {
-    return ERROR_STR[err];
+    t->levels = calloc(page_count * level_count, sizeof(struct RuckSackTextureLevel));
+    if (!t->levels)
+        return RuckSackErrorNoMem;
+    t->level_count = level_count;
+    t->page_count = page_count;
+    texture->mip_levels = level_count;
+    for (long i = 0; i < page_count * level_count; i += 1) {
+        const unsigned char *buf = &meta[levels_offset + i * TEXTURE_LEVEL_LEN];
+        struct RuckSackTextureLevel *level = &t->levels[i];
+        level->offset = read_uint64be(&buf[0]);
+        level->size = read_uint64be(&buf[8]);
+        level->width = read_uint32be(&buf[16]);
+        level->height = read_uint32be(&buf[20]);
+        level->pitch = read_uint32be(&buf[24]);
+        if (level->offset < 0 || level->size < 0 || level->offset > t->pixel_size ||
+            level->size > t->pixel_size - level->offset)
+        {
+            return RuckSackErrorInvalidFormat;
+        }
+    }
+    return RuckSackErrorNone;
 }
 
 int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
@@ -847,22 +3122,31 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
     if (!t)
         return RuckSackErrorNoMem;
     t->entry = entry;
+    pthread_mutex_init(&t->images_mutex, NULL);
 
-    struct RuckSackBundlePrivate *b = entry->b;
-    if (bundle_seek(b, entry->offset)) {
+    if (entry->compression || entry->size < TEXTURE_HEADER_LEN) {
         rucksack_texture_close(texture);
-        return RuckSackErrorFileAccess;
+        return RuckSackErrorInvalidFormat;
     }
 
-    unsigned char buf[MAX(TEXTURE_HEADER_LEN, IMAGE_HEADER_LEN)];
-    long amt_read = bundle_read(b, buf, TEXTURE_HEADER_LEN);
-    if (amt_read != TEXTURE_HEADER_LEN) {
-        rucksack_texture_close(texture);
-        return RuckSackErrorFileAccess;
+    // all of the metadata is used in place when the bundle is memory mapped
+    struct RuckSackBundlePrivate *b = entry->b;
+    const unsigned char *meta = rucksack_file_data_ptr(entry);
+    unsigned char header_buf[TEXTURE_HEADER_LEN];
+    const unsigned char *buf = meta;
+    if (!buf) {
+        long amt_read = bundle_pread(b, header_buf, TEXTURE_HEADER_LEN, entry->offset);
+        if (amt_read != TEXTURE_HEADER_LEN) {
+            rucksack_texture_close(texture);
+            return RuckSackErrorFileAccess;
+        }
+        buf = header_buf;
     }
 
-    if (memcmp(TEXTURE_UUID, buf, UUID_SIZE) != 0)
+    if (memcmp(TEXTURE_UUID, buf, UUID_SIZE) != 0) {
+        rucksack_texture_close(texture);
         return RuckSackErrorInvalidFormat;
+    }
 
     t->pixel_data_offset = read_uint32be(&buf[16]);
     t->pixel_data_size = entry->size - t->pixel_data_offset;
@@ -874,53 +3158,57 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
     texture->pow2 = buf[36];
     texture->allow_r90 = buf[37];
 
-    t->images = calloc(t->images_count, sizeof(struct RuckSackImagePrivate));
-
-    if (!t->images) {
+    if (t->images_count < 0 || t->pixel_data_offset > entry->size ||
+        offset_to_first_img > t->pixel_data_offset)
+    {
         rucksack_texture_close(texture);
-        return RuckSackErrorNoMem;
+        return RuckSackErrorInvalidFormat;
     }
 
-    long next_offset = entry->offset + offset_to_first_img;
-    for (int i = 0; i < t->images_count; i += 1) {
-        struct RuckSackImagePrivate *img = &t->images[i];
-        struct RuckSackImage *image = &img->externals;
-
-        if (bundle_seek(b, next_offset)) {
-            rucksack_texture_close(texture);
-            return RuckSackErrorFileAccess;
-        }
-
-        long amt_read = bundle_read(b, buf, IMAGE_HEADER_LEN);
-        if (amt_read != IMAGE_HEADER_LEN) {
-            rucksack_texture_close(texture);
-            return RuckSackErrorFileAccess;
-        }
-
-        long this_size = read_uint32be(&buf[0]);
-        next_offset += this_size;
-
-        image->anchor = read_uint32be(&buf[4]);
-        image->anchor_x = read_float32be(&buf[8]);
-        image->anchor_y = read_float32be(&buf[12]);
-        image->x = read_uint32be(&buf[16]);
-        image->y = read_uint32be(&buf[20]);
-        image->width = read_uint32be(&buf[24]);
-        image->height = read_uint32be(&buf[28]);
-        image->r90 = buf[32];
-
-        image->key_size = read_uint32be(&buf[33]);
-        image->key = malloc(image->key_size + 1);
-        if (!image->key) {
+    if (!meta) {
+        t->meta_buf = malloc(t->pixel_data_offset);
+        if (!t->meta_buf) {
             rucksack_texture_close(texture);
             return RuckSackErrorNoMem;
         }
-        amt_read = bundle_read(b, image->key, image->key_size);
-        if (amt_read != image->key_size) {
+        long amt_read = bundle_pread(b, t->meta_buf, t->pixel_data_offset, entry->offset);
+        if (amt_read != t->pixel_data_offset) {
             rucksack_texture_close(texture);
             return RuckSackErrorFileAccess;
         }
-        image->key[image->key_size] = 0;
+        meta = t->meta_buf;
+    }
+
+    int err;
+    if (offset_to_first_img == TEXTURE_HEADER_LEN) {
+        err = load_image_entries(t, meta, t->pixel_data_offset, offset_to_first_img);
+        if (!err)
+            err = load_png_level(t);
+        // the image entries are not needed anymore
+        free(t->meta_buf);
+        t->meta_buf = NULL;
+    } else if (offset_to_first_img >= TEXTURE_HEADER_LEN_V2 &&
+        read_uint32be(&meta[40]) == TEXTURE_VERSION)
+    {
+        texture->smallest_size = meta[38];
+        t->requested_compression = meta[39];
+        // the header says whether there is a trim table after the sprites
+        err = load_pixel_format(t, meta, offset_to_first_img);
+        if (!err)
+            err = load_sprite_table(t, meta, t->pixel_data_offset, offset_to_first_img);
+    } else {
+        err = RuckSackErrorInvalidFormat;
+    }
+    if (err) {
+        rucksack_texture_close(texture);
+        return err;
+    }
+
+    // the RuckSackImage structs are filled in when they are asked for
+    t->images = calloc(t->images_count + 1, sizeof(struct RuckSackImagePrivate));
+    if (!t->images) {
+        rucksack_texture_close(texture);
+        return RuckSackErrorNoMem;
     }
 
     texture->key = entry->key;
@@ -932,17 +3220,70 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
 
 long rucksack_texture_size(struct RuckSackTexture *texture) {
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
-    return t->pixel_data_size;
+    return t->pixel_size;
 }
 
 int rucksack_texture_read(struct RuckSackTexture *texture, unsigned char *buffer) {
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
     struct RuckSackFileEntry *entry = t->entry;
-    if (bundle_seek(entry->b, entry->offset + t->pixel_data_offset))
-        return RuckSackErrorFileAccess;
-    long int amt_read = bundle_read(entry->b, buffer, t->pixel_data_size);
-    if (amt_read != t->pixel_data_size)
-        return RuckSackErrorFileAccess;
+    if (texture->compression == RuckSackCompressionNone) {
+        long int amt_read = bundle_pread(entry->b, buffer, t->pixel_data_size,
+                entry->offset + t->pixel_data_offset);
+        if (amt_read != t->pixel_data_size)
+            return RuckSackErrorFileAccess;
+        return RuckSackErrorNone;
+    }
+
+    if (!rucksack_codec_available(texture->compression))
+        return RuckSackErrorCompressionUnsupported;
+    unsigned char *stored = malloc(t->pixel_data_size + 1);
+    if (!stored)
+        return RuckSackErrorNoMem;
+    long int amt_read = bundle_pread(entry->b, stored, t->pixel_data_size,
+            entry->offset + t->pixel_data_offset);
+    int err = (amt_read != t->pixel_data_size) ? RuckSackErrorFileAccess :
+        rucksack_codec_decompress(texture->compression, stored, t->pixel_data_size,
+                buffer, t->pixel_size);
+    free(stored);
+    return err;
+}
+
+const unsigned char *rucksack_texture_data_ptr(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    if (texture->compression != RuckSackCompressionNone)
+        return NULL;
+    const unsigned char *ptr = rucksack_file_data_ptr(t->entry);
+    return ptr ? ptr + t->pixel_data_offset : NULL;
+}
+
+long rucksack_texture_level_count(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    return t->level_count;
+}
+
+int rucksack_texture_get_level(struct RuckSackTexture *texture, long level,
+        struct RuckSackTextureLevel *out_level)
+{
+    return rucksack_texture_get_page_level(texture, 0, level, out_level);
+}
+
+long rucksack_texture_page_count(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    return t->page_count;
+}
+
+int rucksack_texture_requested_compression(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    return t->requested_compression;
+}
+
+int rucksack_texture_get_page_level(struct RuckSackTexture *texture, long page,
+        long level, struct RuckSackTextureLevel *out_level)
+{
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    if (page < 0 || page >= t->page_count || level < 0 || level >= t->level_count)
+        return RuckSackErrorInvalidArg;
+    *out_level = t->levels[page * t->level_count + level];
     return RuckSackErrorNone;
 }
 
@@ -951,15 +3292,110 @@ long rucksack_texture_image_count(struct RuckSackTexture *texture) {
     return t->images_count;
 }
 
+// the caller holds images_mutex
+static struct RuckSackImage *get_image(struct RuckSackTexturePrivate *t, long index) {
+    struct RuckSackImage *image = &t->images[index].externals;
+    if (image->key)
+        return image;
+
+    const struct RuckSackSprite *sprite = &t->sprites[index];
+    const char *key = rucksack_texture_sprite_key(&t->externals, sprite);
+    image->key = key ? key : "";
+    image->key_size = key ? (int)sprite->key_size : 0;
+    image->anchor = sprite->anchor;
+    image->anchor_x = sprite->anchor_x;
+    image->anchor_y = sprite->anchor_y;
+    image->x = sprite->x;
+    image->y = sprite->y;
+    image->width = sprite->width;
+    image->height = sprite->height;
+    image->r90 = sprite->r90;
+    image->page = sprite->page;
+    const struct RuckSackSpriteTrim *trim = t->sprite_trims ? &t->sprite_trims[index] : NULL;
+    image->trim = trim && trim->full_width != 0;
+    image->trim_x = image->trim ? (int)trim->x : 0;
+    image->trim_y = image->trim ? (int)trim->y : 0;
+    image->full_width = image->trim ? (int)trim->full_width : image->width;
+    image->full_height = image->trim ? (int)trim->full_height : image->height;
+    return image;
+}
+
 void rucksack_texture_get_images(struct RuckSackTexture *texture,
         struct RuckSackImage **images)
 {
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
-    for (int i = 0; i < t->images_count; i += 1) {
-        struct RuckSackImagePrivate *img = &t->images[i];
-        struct RuckSackImage *image = &img->externals;
-        images[i] = image;
+    pthread_mutex_lock(&t->images_mutex);
+    for (int i = 0; i < t->images_count; i += 1)
+        images[i] = get_image(t, i);
+    pthread_mutex_unlock(&t->images_mutex);
+}
+
+const struct RuckSackSprite *rucksack_texture_sprites(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    return t->sprites;
+}
+
+const struct RuckSackSpriteTrim *rucksack_texture_sprite_trims(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    return t->sprite_trims;
+}
+
+const char *rucksack_texture_sprite_key(struct RuckSackTexture *texture,
+        const struct RuckSackSprite *sprite)
+{
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    long end = (long)sprite->key_offset + sprite->key_size;
+    if (end >= t->keys_size || t->keys[end] != 0)
+        return NULL;
+    return &t->keys[sprite->key_offset];
+}
+
+long rucksack_texture_find_sprite(struct RuckSackTexture *texture,
+        const char *key, int key_size)
+{
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    if (t->sprite_slot_count == 0)
+        return -1;
+    if (key_size == -1)
+        key_size = strlen(key);
+
+    uint32_t hash = hash_key(key, key_size);
+    long mask = t->sprite_slot_count - 1;
+    long slot = hash & mask;
+    for (long probes = 0; probes < t->sprite_slot_count; probes += 1) {
+        const uint32_t *slot_ptr = &t->sprite_slots[slot * 2];
+        slot = (slot + 1) & mask;
+
+        uint32_t index = slot_ptr[1];
+        if (index == SPRITE_SLOT_EMPTY)
+            return -1;
+        if (slot_ptr[0] != hash || index >= (uint32_t)t->images_count)
+            continue;
+        const struct RuckSackSprite *sprite = &t->sprites[index];
+        if (sprite->key_size != (uint32_t)key_size)
+            continue;
+        const char *sprite_key = rucksack_texture_sprite_key(texture, sprite);
+        if (sprite_key && memcmp(sprite_key, key, key_size) == 0)
+            return index;
     }
+    return -1;
+}
+
+struct RuckSackImage *rucksack_texture_find_image(struct RuckSackTexture *texture,
+        const char *key, int key_size)
+{
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    long index = rucksack_texture_find_sprite(texture, key, key_size);
+    if (index < 0)
+        return NULL;
+    pthread_mutex_lock(&t->images_mutex);
+    struct RuckSackImage *image = get_image(t, index);
+    pthread_mutex_unlock(&t->images_mutex);
+    return image;
+}
+
+long rucksack_file_alignment(struct RuckSackFileEntry *entry) {
+    return entry->alignment;
 }
 
 long rucksack_file_mtime(struct RuckSackFileEntry *entry) {
@@ -972,15 +3408,12 @@ int rucksack_bundle_version(void) {
 
 int rucksack_file_is_texture(struct RuckSackFileEntry *e, int *is_texture) {
     struct RuckSackBundlePrivate *b = e->b;
-    if (e->size < UUID_SIZE) {
+    if (e->compression || e->size < UUID_SIZE) {
         *is_texture = 0;
         return RuckSackErrorNone;
     }
-    if (bundle_seek(b, e->offset))
-        return RuckSackErrorFileAccess;
-
     unsigned char buf[UUID_SIZE];
-    long int amt_read = bundle_read(b, buf, UUID_SIZE);
+    long int amt_read = bundle_pread(b, buf, UUID_SIZE, e->offset);
     if (amt_read != UUID_SIZE)
         return RuckSackErrorFileAccess;
 
@@ -991,28 +3424,36 @@ int rucksack_file_is_texture(struct RuckSackFileEntry *e, int *is_texture) {
 
 long rucksack_bundle_get_headers_byte_count(struct RuckSackBundle *bundle) {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
-    return b->headers_byte_count;
+    return header_region_size(b);
 }
 
 static void delete_entry(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
-    long allocated_size = e->allocated_size;
+    leave_region(b, e);
+
     b->headers_byte_count -= HEADER_ENTRY_LEN + e->key_size;
-    b->header_entry_count -= 1;
-    struct RuckSackFileEntry *prev = get_prev_entry(b, e);
-    struct RuckSackFileEntry *next = get_next_entry(b, e);
-    struct RuckSackFileEntry *next_last = get_prev_entry(b, b->last_entry);
-    if (e->key)
-        free(e->key);
-    *e = *b->last_entry;
-    b->last_entry = next_last;
-    if (prev) {
-        prev->allocated_size += allocated_size;
-    } else if (next) {
-        b->first_entry = next;
-        b->first_file_offset = b->first_entry->offset;
-    } else {
-        init_new_bundle(b, -1);
+    forget_key_order(b);
+    long index = e - b->entries;
+    long last_index = b->header_entry_count - 1;
+    entry_index_remove(b, &b->key_index, index);
+    free(e->key);
+
+    // fill the hole with the last entry in the array
+    if (index != last_index) {
+        struct RuckSackFileEntry *last = &b->entries[last_index];
+        long key_slot = entry_index_find_slot(b, &b->key_index, last_index);
+        long content_slot = entry_owns_hashed_region(last) ?
+            entry_index_find_slot(b, &b->content_index, last_index) : -1;
+        *e = *last;
+        b->key_index.slots[key_slot] = index;
+        if (content_slot != -1)
+            b->content_index.slots[content_slot] = index;
+        if (b->first_entry == last)
+            b->first_entry = e;
+        if (b->last_entry == last)
+            b->last_entry = e;
     }
+    memset(&b->entries[last_index], 0, sizeof(struct RuckSackFileEntry));
+    b->header_entry_count -= 1;
 }
 
 int rucksack_bundle_delete_file(struct RuckSackBundle *bundle,
@@ -1021,6 +3462,9 @@ int rucksack_bundle_delete_file(struct RuckSackBundle *bundle,
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
     if (key_size == -1)
         key_size = strlen(key);
+    int err = stop_lazy_loading(b);
+    if (err)
+        return err;
     struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
     if (!e)
         return RuckSackErrorNotFound;
@@ -1033,6 +3477,8 @@ int rucksack_bundle_delete_file(struct RuckSackBundle *bundle,
 
 void rucksack_bundle_delete_untouched(struct RuckSackBundle *bundle) {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (stop_lazy_loading(b))
+        return;
     for (;;) {
         int deleted_something = 0;
         for (int i = 0; i < b->header_entry_count; i += 1) {
@@ -1062,12 +3508,406 @@ void rucksack_texture_close(struct RuckSackTexture *texture) {
         return;
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
 
-    for (int i = 0; i < t->images_count; i += 1) {
-        struct RuckSackImagePrivate *img = &t->images[i];
-        struct RuckSackImage *image = &img->externals;
-        free(image->key);
-    }
     free(t->images);
-    free(t->free_positions);
+    free(t->levels);
+    free(t->meta_buf);
+    free(t->tables_buf);
+    pthread_mutex_destroy(&t->images_mutex);
     free(t);
 }
+
+struct RuckSackReadJob {
+    struct RuckSackReadJob *next;
+    struct RuckSackFileEntry *entry;
+    unsigned char *buffer;
+    // for compressed entries the stored bytes are read here first and then
+    // decompressed into buffer
+    unsigned char *stored;
+    long offset; // absolute offset in the bundle
+    long size; // stored size
+    int compression; // enum RuckSackCompression
+    long uncompressed_size; // only meaningful when compression is set
+    long done; // bytes read so far
+    int err;
+    RuckSackReadCallback callback;
+    void *userdata;
+};
+
+struct RuckSackReadQueue {
+    struct RuckSackBundlePrivate *b;
+
+    // the worker pool. threads are started the first time a job needs them.
+    pthread_t *threads;
+    int thread_count;
+    int threads_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    // protected by mutex
+    struct RuckSackReadJob *jobs_head;
+    struct RuckSackReadJob *jobs_tail;
+    struct RuckSackReadJob *done_head;
+    struct RuckSackReadJob *done_tail;
+    bool quit;
+    // jobs handed to the pool whose callbacks have not run yet. only touched
+    // by the thread that owns the queue.
+    long pool_pending;
+
+#ifdef RUCKSACK_HAVE_IO_URING
+    bool use_uring;
+    struct RuckSackUring ring;
+    unsigned uring_in_flight;
+    // jobs waiting for room in the ring
+    struct RuckSackReadJob *backlog_head;
+    struct RuckSackReadJob *backlog_tail;
+#endif
+};
+
+static void job_list_append(struct RuckSackReadJob **head,
+        struct RuckSackReadJob **tail, struct RuckSackReadJob *job)
+{
+    job->next = NULL;
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+static struct RuckSackReadJob *job_list_pop(struct RuckSackReadJob **head,
+        struct RuckSackReadJob **tail)
+{
+    struct RuckSackReadJob *job = *head;
+    if (job) {
+        *head = job->next;
+        if (!*head)
+            *tail = NULL;
+    }
+    return job;
+}
+
+// verifies and decompresses what a job read
+static void read_queue_finish(struct RuckSackReadJob *job) {
+    struct RuckSackFileEntry *e = job->entry;
+    // texture reads only cover part of the entry
+    if (!job->err && job->offset == e->offset && job->size == e->size)
+        job->err = verify_read(e, job->stored ? job->stored : job->buffer);
+
+    if (!job->stored)
+        return;
+    if (!job->err) {
+        job->err = rucksack_codec_decompress(job->compression, job->stored, job->size,
+                job->buffer, job->uncompressed_size);
+    }
+    free(job->stored);
+    job->stored = NULL;
+}
+
+static void *read_queue_worker(void *arg) {
+    struct RuckSackReadQueue *q = arg;
+    pthread_mutex_lock(&q->mutex);
+    for (;;) {
+        while (!q->jobs_head && !q->quit)
+            pthread_cond_wait(&q->job_cond, &q->mutex);
+        if (q->quit)
+            break;
+        struct RuckSackReadJob *job = job_list_pop(&q->jobs_head, &q->jobs_tail);
+        pthread_mutex_unlock(&q->mutex);
+
+        unsigned char *dest = job->stored ? job->stored : job->buffer;
+        long amt_read = bundle_pread(q->b, dest, job->size, job->offset);
+        job->done = amt_read;
+        if (amt_read != job->size)
+            job->err = RuckSackErrorFileAccess;
+        // verify and decompress here so that it happens in parallel
+        read_queue_finish(job);
+
+        pthread_mutex_lock(&q->mutex);
+        job_list_append(&q->done_head, &q->done_tail, job);
+        pthread_cond_signal(&q->done_cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+static int read_queue_start_threads(struct RuckSackReadQueue *q) {
+    while (q->threads_started < q->thread_count) {
+        if (pthread_create(&q->threads[q->threads_started], NULL, read_queue_worker, q)) {
+            // we can get by with fewer threads, just not with none
+            if (q->threads_started == 0)
+                return RuckSackErrorNoMem;
+            q->thread_count = q->threads_started;
+            break;
+        }
+        q->threads_started += 1;
+    }
+    return RuckSackErrorNone;
+}
+
+static void read_queue_run_callback(struct RuckSackReadJob *job) {
+    read_queue_finish(job);
+    job->callback(job->entry, job->buffer, job->err, job->userdata);
+    free(job);
+}
+
+#ifdef RUCKSACK_HAVE_IO_URING
+static const unsigned READ_QUEUE_RING_SIZE = 256;
+
+// submits the rest of the job to the ring, or parks it in the backlog if the
+// ring is full. returns nonzero if the read could not be submitted.
+static int read_queue_uring_submit(struct RuckSackReadQueue *q,
+        struct RuckSackReadJob *job)
+{
+    if (q->uring_in_flight >= q->ring.capacity) {
+        job_list_append(&q->backlog_head, &q->backlog_tail, job);
+        return 0;
+    }
+    unsigned char *dest = job->stored ? job->stored : job->buffer;
+    int err = rucksack_uring_read(&q->ring, fileno(q->b->f), dest + job->done,
+            job->size - job->done, job->offset + job->done, job);
+    if (err)
+        return err;
+    q->uring_in_flight += 1;
+    return 0;
+}
+
+static int read_queue_uring_poll(struct RuckSackReadQueue *q) {
+    int count = 0;
+    void *user_data;
+    int result;
+    while (rucksack_uring_reap(&q->ring, &user_data, &result)) {
+        struct RuckSackReadJob *job = user_data;
+        q->uring_in_flight -= 1;
+
+        if (result <= 0) {
+            // 0 means the file is shorter than the header claims
+            job->err = RuckSackErrorFileAccess;
+        } else {
+            job->done += result;
+            if (job->done < job->size) {
+                if (!read_queue_uring_submit(q, job))
+                    continue;
+                job->err = RuckSackErrorFileAccess;
+            }
+        }
+        read_queue_run_callback(job);
+        count += 1;
+    }
+
+    while (q->backlog_head && q->uring_in_flight < q->ring.capacity) {
+        struct RuckSackReadJob *job = job_list_pop(&q->backlog_head, &q->backlog_tail);
+        if (read_queue_uring_submit(q, job)) {
+            job->err = RuckSackErrorFileAccess;
+            read_queue_run_callback(job);
+            count += 1;
+        }
+    }
+    return count;
+}
+#endif
+
+int rucksack_read_queue_create(struct RuckSackBundle *bundle, int worker_count,
+        struct RuckSackReadQueue **out_queue)
+{
+    *out_queue = NULL;
+
+    if (worker_count <= 0)
+        worker_count = rucksack_cpu_count();
+
+    struct RuckSackReadQueue *q = calloc(1, sizeof(struct RuckSackReadQueue));
+    if (!q)
+        return RuckSackErrorNoMem;
+    q->b = (struct RuckSackBundlePrivate *) bundle;
+    q->thread_count = worker_count;
+    q->threads = calloc(worker_count, sizeof(pthread_t));
+    if (!q->threads) {
+        free(q);
+        return RuckSackErrorNoMem;
+    }
+
+    if (pthread_mutex_init(&q->mutex, NULL)) {
+        free(q->threads);
+        free(q);
+        return RuckSackErrorNoMem;
+    }
+    if (pthread_cond_init(&q->job_cond, NULL)) {
+        pthread_mutex_destroy(&q->mutex);
+        free(q->threads);
+        free(q);
+        return RuckSackErrorNoMem;
+    }
+    if (pthread_cond_init(&q->done_cond, NULL)) {
+        pthread_cond_destroy(&q->job_cond);
+        pthread_mutex_destroy(&q->mutex);
+        free(q->threads);
+        free(q);
+        return RuckSackErrorNoMem;
+    }
+
+#ifdef RUCKSACK_HAVE_IO_URING
+    // io_uring only helps with real files. if the kernel does not support it
+    // everything goes to the worker pool instead.
+    if (q->b->f)
+        q->use_uring = rucksack_uring_init(&q->ring, READ_QUEUE_RING_SIZE) == 0;
+#endif
+
+    *out_queue = q;
+    return RuckSackErrorNone;
+}
+
+void rucksack_read_queue_destroy(struct RuckSackReadQueue *q) {
+    if (!q)
+        return;
+
+    rucksack_read_queue_wait(q);
+
+    pthread_mutex_lock(&q->mutex);
+    q->quit = true;
+    pthread_cond_broadcast(&q->job_cond);
+    pthread_mutex_unlock(&q->mutex);
+    for (int i = 0; i < q->threads_started; i += 1)
+        pthread_join(q->threads[i], NULL);
+
+#ifdef RUCKSACK_HAVE_IO_URING
+    if (q->use_uring)
+        rucksack_uring_destroy(&q->ring);
+#endif
+
+    pthread_cond_destroy(&q->done_cond);
+    pthread_cond_destroy(&q->job_cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->threads);
+    free(q);
+}
+
+static int read_queue_add(struct RuckSackReadQueue *q, struct RuckSackFileEntry *entry,
+        long offset, long size, int compression, long uncompressed_size,
+        unsigned char *buffer, RuckSackReadCallback callback, void *userdata)
+{
+    struct RuckSackBundlePrivate *b = q->b;
+    struct RuckSackReadJob *job = calloc(1, sizeof(struct RuckSackReadJob));
+    if (!job)
+        return RuckSackErrorNoMem;
+    job->entry = entry;
+    job->buffer = buffer;
+    job->offset = offset;
+    job->size = size;
+    job->compression = compression;
+    job->uncompressed_size = uncompressed_size;
+    job->callback = callback;
+    job->userdata = userdata;
+
+    if (compression) {
+        if (!rucksack_codec_available(compression)) {
+            free(job);
+            return RuckSackErrorCompressionUnsupported;
+        }
+        job->stored = malloc(size);
+        if (!job->stored) {
+            free(job);
+            return RuckSackErrorNoMem;
+        }
+    }
+
+    // neither the workers nor the kernel can see what is still sitting in
+    // the stdio buffer
+    if (b->f && bundle_flush(b)) {
+        free(job->stored);
+        free(job);
+        return RuckSackErrorFileAccess;
+    }
+
+#ifdef RUCKSACK_HAVE_IO_URING
+    if (q->use_uring && size > 0) {
+        if (read_queue_uring_submit(q, job)) {
+            free(job->stored);
+            free(job);
+            return RuckSackErrorFileAccess;
+        }
+        return RuckSackErrorNone;
+    }
+#endif
+
+    pthread_mutex_lock(&q->mutex);
+    int err = read_queue_start_threads(q);
+    if (err) {
+        pthread_mutex_unlock(&q->mutex);
+        free(job->stored);
+        free(job);
+        return err;
+    }
+    job_list_append(&q->jobs_head, &q->jobs_tail, job);
+    pthread_cond_signal(&q->job_cond);
+    pthread_mutex_unlock(&q->mutex);
+    q->pool_pending += 1;
+
+    return RuckSackErrorNone;
+}
+
+int rucksack_read_async(struct RuckSackReadQueue *q, struct RuckSackFileEntry *entry,
+        unsigned char *buffer, RuckSackReadCallback callback, void *userdata)
+{
+    return read_queue_add(q, entry, entry->offset, entry->size, entry->compression,
+            entry->uncompressed_size, buffer, callback, userdata);
+}
+
+int rucksack_texture_read_async(struct RuckSackReadQueue *q,
+        struct RuckSackTexture *texture, unsigned char *buffer,
+        RuckSackReadCallback callback, void *userdata)
+{
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    struct RuckSackFileEntry *entry = t->entry;
+    return read_queue_add(q, entry, entry->offset + t->pixel_data_offset,
+            t->pixel_data_size, texture->compression, t->pixel_size, buffer,
+            callback, userdata);
+}
+
+int rucksack_read_queue_poll(struct RuckSackReadQueue *q) {
+    int count = 0;
+
+#ifdef RUCKSACK_HAVE_IO_URING
+    if (q->use_uring)
+        count += read_queue_uring_poll(q);
+#endif
+
+    if (q->pool_pending == 0)
+        return count;
+
+    pthread_mutex_lock(&q->mutex);
+    struct RuckSackReadJob *job = q->done_head;
+    q->done_head = NULL;
+    q->done_tail = NULL;
+    pthread_mutex_unlock(&q->mutex);
+
+    // run callbacks without the lock so they may queue more reads
+    while (job) {
+        struct RuckSackReadJob *next = job->next;
+        q->pool_pending -= 1;
+        read_queue_run_callback(job);
+        count += 1;
+        job = next;
+    }
+    return count;
+}
+
+int rucksack_read_queue_wait(struct RuckSackReadQueue *q) {
+    for (;;) {
+        rucksack_read_queue_poll(q);
+
+#ifdef RUCKSACK_HAVE_IO_URING
+        if (q->uring_in_flight > 0) {
+            if (rucksack_uring_wait(&q->ring))
+                return RuckSackErrorFileAccess;
+            continue;
+        }
+#endif
+
+        if (q->pool_pending == 0)
+            return RuckSackErrorNone;
+
+        pthread_mutex_lock(&q->mutex);
+        while (!q->done_head)
+            pthread_cond_wait(&q->done_cond, &q->mutex);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
@@ -8,6 +8,8 @@
 #ifndef RUCKSACK_H_INCLUDED
 #define RUCKSACK_H_INCLUDED
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -28,6 +30,15 @@ enum RuckSackError {
     RuckSackErrorImageFormat,
     RuckSackErrorNotFound,
     RuckSackErrorStreamOpen,
+    RuckSackErrorInvalidRange,
+    RuckSackErrorCompressionUnsupported,
+    RuckSackErrorCorruptData,
+    RuckSackErrorChecksumMismatch,
+    RuckSackErrorInvalidAlignment,
+    RuckSackErrorTextureFormat,
+    RuckSackErrorInvalidPacking,
+    RuckSackErrorInvalidArg,
+    RuckSackErrorCodecFailed,
 };
 
 /* the size of this struct is not part of the public ABI. */
@@ -38,6 +49,30 @@ struct RuckSackBundle {
 
 struct RuckSackFileEntry;
 
+/* how a file entry is stored in the bundle */
+enum RuckSackCompression {
+    RuckSackCompressionNone,
+    /* zlib stream */
+    RuckSackCompressionDeflate,
+    RuckSackCompressionLz4,
+    RuckSackCompressionZstd,
+    /* never stored. tells rucksack to pick one of the above depending on
+     * the size and contents of the file. */
+    RuckSackCompressionAuto,
+};
+
+/* describes one file for rucksack_bundle_add_files */
+struct RuckSackFileSource {
+    const char *key;
+    /* -1 to run strlen on key */
+    int key_size;
+    const char *path;
+    /* one of enum RuckSackCompression */
+    int compression;
+    /* see rucksack_bundle_add_stream_aligned. 0 for the bundle's default */
+    long alignment;
+};
+
 enum RuckSackAnchor {
     RuckSackAnchorCenter,
     RuckSackAnchorExplicit,
@@ -57,7 +92,7 @@ enum RuckSackAnchor {
  * Create with rucksack_image_create */
 struct RuckSackImage {
     /* when writing, set this value. when reading it is set automatically. */
-    char *key;
+    const char *key;
     /* key is an array of bytes, not a null-delimited string. however,
      * key_size defaults to -1 which tells rucksack to run strlen on key. */
     int key_size;
@@ -68,6 +103,10 @@ struct RuckSackImage {
     /* set these if you set anchor to RuckSackAnchorExplicit */
     float anchor_x;
     float anchor_y;
+    /* set to 1 to pack only the pixels inside the bounding box of the ones
+     * that are not fully transparent. the anchor stays where it is in the
+     * full image. when reading, whether the image was trimmed. */
+    char trim;
 
     /* the following fields are assigned after a call to
      * rucksack_bundle_add_texture and also populated when reading a texture
@@ -82,6 +121,112 @@ struct RuckSackImage {
      * you may set this value to force an image to be rotated which may be
      * useful for debugging. */
     char r90;
+
+    /* the page of the texture that holds this image. assigned like x and y. */
+    int page;
+
+    /* where the width x height pixels that were packed are in the full
+     * image, from its top left, and the size of the full image. without
+     * trim they are 0, 0 and the same size. */
+    int trim_x;
+    int trim_y;
+    int full_width;
+    int full_height;
+};
+
+/* how the pixels of a texture are stored */
+enum RuckSackTextureFormat {
+    /* a PNG file */
+    RuckSackTextureFormatPng,
+    /* 4 bytes per pixel in the order red, green, blue, alpha. rows go from
+     * the top of the texture to the bottom, like the rows of the PNG. */
+    RuckSackTextureFormatRgba8,
+    /* block compressed formats. the pixels are stored in blocks of 4x4, 8
+     * or 16 bytes each, in rows from the top. sprites are placed on block
+     * boundaries so that no block mixes two sprites. */
+    /* BC1 (DXT1), 8 bytes per block. pixels with alpha below 128 become
+     * fully transparent, the rest opaque. */
+    RuckSackTextureFormatBc1,
+    /* BC3 (DXT5), 16 bytes per block: 8 bit alpha, then BC1 color */
+    RuckSackTextureFormatBc3,
+    /* BC7, 16 bytes per block. written in mode 6 only. */
+    RuckSackTextureFormatBc7,
+};
+
+/* where one level of a texture is in its pixel data. level 0 is the full
+ * size texture. */
+struct RuckSackTextureLevel {
+    /* from the start of what rucksack_texture_read reads */
+    long offset;
+    long size;
+    /* 0 for PNG textures written before pixel formats existed */
+    int width;
+    int height;
+    /* bytes from the start of one row to the start of the next, or from one
+     * row of blocks to the next for block formats. 0 for PNG. */
+    long pitch;
+};
+
+/* One entry of the sprite table of a texture. This is the layout that the
+ * texture stores, in little-endian byte order, so on little-endian machines
+ * the table can be used straight out of a memory mapped bundle. */
+struct RuckSackSprite {
+    uint32_t x;
+    uint32_t y;
+    /* unrotated size */
+    uint32_t width;
+    uint32_t height;
+    float anchor_x;
+    float anchor_y;
+    /* position of the key in the key bytes of the texture. see
+     * rucksack_texture_sprite_key */
+    uint32_t key_offset;
+    uint32_t key_size;
+    /* enum RuckSackAnchor */
+    uint8_t anchor;
+    /* whether this image is rotated 90 degrees */
+    uint8_t r90;
+    /* the page of the texture that holds this image */
+    uint16_t page;
+};
+
+/* One entry of the trim table of a texture, laid out like the sprite table.
+ * See rucksack_texture_sprite_trims */
+struct RuckSackSpriteTrim {
+    /* where the pixels of the sprite are in the full image, from its top left */
+    uint32_t x;
+    uint32_t y;
+    /* the size of the full image. 0 for sprites that were not trimmed. */
+    uint32_t full_width;
+    uint32_t full_height;
+};
+
+/* how packing chooses among the free rectangles of a texture for the next
+ * image, which always goes in a corner of one of them */
+enum RuckSackPacking {
+    /* the least space left over along the shorter side */
+    RuckSackPackingShortSideFit,
+    /* the least space left over along the longer side */
+    RuckSackPackingLongSideFit,
+    /* the least area left over */
+    RuckSackPackingAreaFit,
+    /* the lowest y, then the lowest x */
+    RuckSackPackingBottomLeft,
+    /* the most edge touching the texture edges and images placed before */
+    RuckSackPackingContactPoint,
+    /* each of the above with each enum RuckSackSortBy order, on a thread per
+     * CPU, keeping whichever takes up the fewest pixels */
+    RuckSackPackingBest,
+};
+
+/* the order in which images are packed, largest first */
+enum RuckSackSortBy {
+    /* the longer side, then the shorter side */
+    RuckSackSortByMaxSide,
+    RuckSackSortByArea,
+    RuckSackSortByPerimeter,
+    /* the height, then the width */
+    RuckSackSortByHeight,
 };
 
 /* A RuckSackTexture contains multiple images. Also known as a spritesheet.
@@ -102,9 +247,48 @@ struct RuckSackTexture {
     /* normally rucksack is free to rotate images 90 degrees if it would
      * provide tighter texture packing. Set this field to 0 to prevent this. */
     char allow_r90;
+    /* one of enum RuckSackTextureFormat. defaults to RuckSackTextureFormatPng.
+     * when reading it is set automatically. */
+    int format;
+    /* compression of the pixel data, one of enum RuckSackCompression. it is
+     * undone by rucksack_texture_read. meant for raw formats, which take
+     * well to lz4. defaults to RuckSackCompressionNone. when reading it is
+     * set automatically. */
+    int compression;
+    /* how many levels to store, the full size one included. 0 stores every
+     * level down to 1x1. each mip level is half the size of the one above
+     * it, box filtered in linear light. images are placed on multiples of
+     * 2^(mip_levels - 1) pixels, up to 16, so that the first 5 levels never
+     * mix two of them. defaults to 1, no mip levels. when reading it is set
+     * automatically. */
+    int mip_levels;
+    /* when the images do not fit in max_width x max_height, they spill onto
+     * more pages of the same size, up to this many. 0 for no limit. defaults
+     * to 1, which fails with RuckSackErrorCannotFit instead. */
+    int max_pages;
+    /* instead of packing into max_width x max_height pages and cropping,
+     * try page sizes up to that on a thread per CPU and keep the one that
+     * takes up the fewest pixels without needing more pages. with pow2 that is every pair of powers of
+     * 2, otherwise every width in steps of 4 pixels. defaults to 0. */
+    char smallest_size;
+    /* one of enum RuckSackPacking. defaults to RuckSackPackingShortSideFit.
+     * when reading it is set automatically. */
+    int packing;
+    /* one of enum RuckSackSortBy. defaults to RuckSackSortByMaxSide. when
+     * reading it is set automatically. */
+    int sort_by;
+    /* trims every image, as if each had trim set. defaults to 0. when
+     * reading it is set automatically. */
+    char trim;
 };
 
 struct RuckSackOutStream;
+struct RuckSackInStream;
+
+/* Reading from a bundle does not use a shared file position. Once a bundle
+ * is open, the functions that only read from it (finding, reading and
+ * opening entries and textures) may be called from many threads at once, as
+ * long as no thread is modifying the bundle at the same time. */
 
 void rucksack_version(int *major, int *minor, int *patch);
 int rucksack_bundle_version(void);
@@ -119,18 +303,60 @@ int rucksack_bundle_open_precise(const char *bundle_path, struct RuckSackBundle
 int rucksack_bundle_open_read(const char *bundle_path, struct RuckSackBundle **bundle);
 int rucksack_bundle_open_read_mem(const unsigned char *buffer, long size,
         struct RuckSackBundle **bundle);
+/* open read-only by mapping the whole file into memory. use
+ * rucksack_file_data_ptr to access entries without copying them. */
+int rucksack_bundle_open_mmap(const char *bundle_path, struct RuckSackBundle **bundle);
 
 int rucksack_bundle_close(struct RuckSackBundle *bundle);
 
 int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
         int key_size, const char *file_name);
+/* like rucksack_bundle_add_file, but the file is stored compressed with
+ * compression, one of enum RuckSackCompression. when compressing does not
+ * make the file meaningfully smaller it is stored uncompressed instead. */
+int rucksack_bundle_add_file_compressed(struct RuckSackBundle *bundle,
+        const char *key, int key_size, const char *file_name, int compression);
+/* add count files at once. the files are read and compressed on
+ * thread_count threads (0 for one per CPU) and written to the bundle in
+ * order from the calling thread. if an error occurs and failed_index is not
+ * NULL it is set to the index of the file that failed. */
+int rucksack_bundle_add_files(struct RuckSackBundle *bundle,
+        const struct RuckSackFileSource *files, long count, int thread_count,
+        long *failed_index);
+/* whether this build of rucksack supports compression, one of
+ * enum RuckSackCompression */
+int rucksack_compression_available(int compression);
+
 int rucksack_bundle_add_stream(struct RuckSackBundle *bundle, const char *key,
         int key_size, long size_guess, struct RuckSackOutStream **stream);
 int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle, const char *key,
         int key_size, long size, struct RuckSackOutStream **stream, long mtime);
+/* like rucksack_bundle_add_stream, but the contents start at a multiple of
+ * alignment bytes instead of the bundle's default alignment. pass 0 to use
+ * the default. */
+int rucksack_bundle_add_stream_aligned(struct RuckSackBundle *bundle, const char *key,
+        int key_size, long size_guess, long alignment, struct RuckSackOutStream **stream);
+/* like rucksack_bundle_add_stream_precise, with an alignment as for
+ * rucksack_bundle_add_stream_aligned */
+int rucksack_bundle_add_stream_precise_aligned(struct RuckSackBundle *bundle,
+        const char *key, int key_size, long size, long alignment,
+        struct RuckSackOutStream **stream, long mtime);
+
+/* files added from now on have their contents start at a multiple of
+ * alignment bytes from the start of the bundle, so that they can be mapped,
+ * read with O_DIRECT or uploaded without copying. alignment is a power of 2
+ * up to 16MB. the default is 1, which is no alignment at all. the setting is
+ * stored in the bundle. */
+int rucksack_bundle_set_alignment(struct RuckSackBundle *bundle, long alignment);
+long rucksack_bundle_alignment(struct RuckSackBundle *bundle);
 
 int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
         long count);
+/* declare that the bytes written to this stream are already compressed with
+ * compression and decompress to uncompressed_size bytes. used by the `strip`
+ * command to copy entries without recompressing them. */
+void rucksack_stream_set_compression(struct RuckSackOutStream *stream,
+        int compression, long uncompressed_size);
 void rucksack_stream_close(struct RuckSackOutStream *stream);
 
 int rucksack_bundle_delete_file(struct RuckSackBundle *bundle, const char *key,
@@ -141,16 +367,90 @@ void rucksack_texture_touch(struct RuckSackTexture *texture);
 
 
 long rucksack_bundle_file_count(struct RuckSackBundle *bundle);
-void rucksack_bundle_get_files(struct RuckSackBundle *bundle,
+/* puts rucksack_bundle_file_count entries in entries. bundles opened for
+ * reading parse their headers as they are needed, so this can fail if one
+ * of them is damaged. */
+int rucksack_bundle_get_files(struct RuckSackBundle *bundle,
         struct RuckSackFileEntry **entries);
 
 struct RuckSackFileEntry *rucksack_bundle_find_file(
         struct RuckSackBundle *bundle, const char *key, int key_size);
+
+/* visits files in key order. keys are ordered bytewise, and a key comes
+ * before the longer keys it is a prefix of. return 0 from the callback to
+ * keep going or anything else to stop. */
+typedef int (*RuckSackIterCallback)(struct RuckSackFileEntry *entry, void *userdata);
+/* visits every file whose key starts with prefix. prefix_size may be -1 for
+ * a NUL terminated prefix; an empty prefix visits every file. */
+int rucksack_bundle_iter_prefix(struct RuckSackBundle *bundle, const char *prefix,
+        int prefix_size, RuckSackIterCallback callback, void *userdata);
+/* visits every file whose key is at least first and less than end. a NULL
+ * first starts at the first key and a NULL end goes on to the last one. */
+int rucksack_bundle_iter_range(struct RuckSackBundle *bundle,
+        const char *first, int first_size, const char *end, int end_size,
+        RuckSackIterCallback callback, void *userdata);
+/* the uncompressed size; this is how big the buffer given to
+ * rucksack_file_read must be */
 long rucksack_file_size(struct RuckSackFileEntry *entry);
 const char *rucksack_file_name(struct RuckSackFileEntry *entry);
 int rucksack_file_name_size(struct RuckSackFileEntry *entry);
 long rucksack_file_mtime(struct RuckSackFileEntry *entry);
+/* the offset of the file contents in the bundle is a multiple of this */
+long rucksack_file_alignment(struct RuckSackFileEntry *entry);
+/* compressed files are decompressed transparently */
 int rucksack_file_read(struct RuckSackFileEntry *entry, unsigned char *buffer);
+/* read length bytes starting at offset within the file into buffer. returns
+ * RuckSackErrorInvalidRange if the range goes past the end of the file. */
+int rucksack_file_read_range(struct RuckSackFileEntry *entry, long offset,
+        long length, unsigned char *buffer);
+/* read count files at once. buffers[i] receives the contents of entries[i]
+ * and must hold rucksack_file_size(entries[i]) bytes. the reads are sorted
+ * by their position in the bundle and nearby files are read together, which
+ * is much faster than reading them one by one in arbitrary order. */
+int rucksack_bundle_read_many(struct RuckSackBundle *bundle,
+        struct RuckSackFileEntry **entries, unsigned char **buffers, long count);
+/* pointer to the file contents inside the bundle's memory. only available
+ * for uncompressed files in bundles opened with rucksack_bundle_open_mmap or
+ * rucksack_bundle_open_read_mem; returns NULL otherwise. the memory is
+ * read-only and valid until the bundle is closed. */
+const unsigned char *rucksack_file_data_ptr(struct RuckSackFileEntry *entry);
+
+/* one of enum RuckSackCompression, never RuckSackCompressionAuto */
+int rucksack_file_compression(struct RuckSackFileEntry *entry);
+/* how many bytes the file takes up in the bundle */
+long rucksack_file_stored_size(struct RuckSackFileEntry *entry);
+/* read the bytes as stored, without decompressing them */
+int rucksack_file_read_stored(struct RuckSackFileEntry *entry, unsigned char *buffer);
+
+/* every file stores a CRC32C of its stored bytes. puts it in checksum and
+ * returns 1, or returns 0 for files written before bundle format version 4,
+ * which have none. */
+int rucksack_file_checksum(struct RuckSackFileEntry *entry, unsigned long *checksum);
+/* reads the stored bytes and checks them against the checksum. returns
+ * RuckSackErrorChecksumMismatch if they differ. files without a checksum
+ * always pass. */
+int rucksack_file_verify(struct RuckSackFileEntry *entry);
+/* verifies every file in the bundle on thread_count threads, or one per core
+ * if thread_count is 0. results[i] receives the result of
+ * rucksack_file_verify for the i-th file from rucksack_bundle_get_files. */
+int rucksack_bundle_verify(struct RuckSackBundle *bundle, int thread_count, int *results);
+/* when on, reads that cover all of a file also verify it and fail with
+ * RuckSackErrorChecksumMismatch if it is damaged. that includes
+ * rucksack_file_read, rucksack_bundle_read_many, rucksack_read_async,
+ * and in streams that are read to the end. partial reads of uncompressed
+ * files are not checked. off by default. */
+void rucksack_bundle_set_verify_reads(struct RuckSackBundle *bundle, int verify);
+
+/* read a file a piece at a time rather than all at once. compressed files
+ * are decompressed as they are read, so memory use does not depend on the
+ * size of the file. call rucksack_in_stream_close when done. */
+int rucksack_file_open_stream(struct RuckSackFileEntry *entry,
+        struct RuckSackInStream **stream);
+/* reads up to count bytes into ptr and puts how many were read in amt_read.
+ * amt_read is only less than count at the end of the file, where it is 0. */
+int rucksack_in_stream_read(struct RuckSackInStream *stream, void *ptr,
+        long count, long *amt_read);
+void rucksack_in_stream_close(struct RuckSackInStream *stream);
 
 /* mark this file so that rucksack_bundle_delete_untouched will not delete it */
 void rucksack_file_touch(struct RuckSackFileEntry *entry);
@@ -164,13 +464,85 @@ void rucksack_texture_close(struct RuckSackTexture *texture);
 
 /* get the size of the image data for this texture */
 long rucksack_texture_size(struct RuckSackTexture *texture);
-/* get the image data for this texture */
+/* get the image data for this texture. with a raw format these are the
+ * levels described by rucksack_texture_get_level, ready to upload. */
 int rucksack_texture_read(struct RuckSackTexture *texture, unsigned char *buffer);
+/* like rucksack_file_data_ptr but for the image data of this texture. NULL
+ * when the image data is compressed. */
+const unsigned char *rucksack_texture_data_ptr(struct RuckSackTexture *texture);
+/* the number of levels in the image data of each page, at least 1 */
+long rucksack_texture_level_count(struct RuckSackTexture *texture);
+/* a level of page 0. level goes from 0 to rucksack_texture_level_count - 1,
+ * anything else returns RuckSackErrorInvalidArg. */
+int rucksack_texture_get_level(struct RuckSackTexture *texture, long level,
+        struct RuckSackTextureLevel *out_level);
+/* the number of pages, at least 1. every page has the same size and number
+ * of levels, and the image data holds them one after the other. */
+long rucksack_texture_page_count(struct RuckSackTexture *texture);
+/* the compression that was asked for when the texture was added, which can
+ * be RuckSackCompressionAuto. the compression field says how the image data
+ * ended up being stored. */
+int rucksack_texture_requested_compression(struct RuckSackTexture *texture);
+/* page goes from 0 to rucksack_texture_page_count - 1 and level from 0 to
+ * rucksack_texture_level_count - 1, anything else returns
+ * RuckSackErrorInvalidArg. */
+int rucksack_texture_get_page_level(struct RuckSackTexture *texture, long page,
+        long level, struct RuckSackTextureLevel *out_level);
 
 /* image metadata */
 long rucksack_texture_image_count(struct RuckSackTexture *texture);
 void rucksack_texture_get_images(struct RuckSackTexture *texture,
         struct RuckSackImage **images);
+/* returns the image with this key, or NULL if there is none. key_size -1
+ * means strlen(key). the image belongs to the texture. */
+struct RuckSackImage *rucksack_texture_find_image(struct RuckSackTexture *texture,
+        const char *key, int key_size);
+
+/* the same metadata without converting it to RuckSackImage structs. the
+ * sprite table has rucksack_texture_image_count entries in the same order as
+ * rucksack_texture_get_images. it belongs to the texture. */
+const struct RuckSackSprite *rucksack_texture_sprites(struct RuckSackTexture *texture);
+/* the trim table, with an entry for each sprite of the sprite table. NULL if
+ * no image of the texture was trimmed. it belongs to the texture. */
+const struct RuckSackSpriteTrim *rucksack_texture_sprite_trims(struct RuckSackTexture *texture);
+/* the key of a sprite, followed by a 0 byte. NULL if the texture is damaged. */
+const char *rucksack_texture_sprite_key(struct RuckSackTexture *texture,
+        const struct RuckSackSprite *sprite);
+/* returns the index of the sprite with this key, or -1 if there is none */
+long rucksack_texture_find_sprite(struct RuckSackTexture *texture,
+        const char *key, int key_size);
+
+/* asynchronous reads. a read queue belongs to one bundle and one thread:
+ * the callbacks run on that thread from inside rucksack_read_queue_poll and
+ * rucksack_read_queue_wait. on Linux the reads go through io_uring when the
+ * kernel supports it; otherwise a pool of worker_count threads does them.
+ * pass 0 for worker_count to use one thread per CPU. */
+struct RuckSackReadQueue;
+/* err is one of enum RuckSackError */
+typedef void (*RuckSackReadCallback)(struct RuckSackFileEntry *entry,
+        unsigned char *buffer, int err, void *userdata);
+
+int rucksack_read_queue_create(struct RuckSackBundle *bundle, int worker_count,
+        struct RuckSackReadQueue **queue);
+/* waits for all outstanding reads first */
+void rucksack_read_queue_destroy(struct RuckSackReadQueue *queue);
+
+/* buffer must hold rucksack_file_size bytes and stay valid until the
+ * callback runs */
+int rucksack_read_async(struct RuckSackReadQueue *queue,
+        struct RuckSackFileEntry *entry, unsigned char *buffer,
+        RuckSackReadCallback callback, void *userdata);
+/* like rucksack_read_async but reads the image data of a texture.
+ * buffer must hold rucksack_texture_size bytes. */
+int rucksack_texture_read_async(struct RuckSackReadQueue *queue,
+        struct RuckSackTexture *texture, unsigned char *buffer,
+        RuckSackReadCallback callback, void *userdata);
+
+/* runs the callbacks of finished reads without blocking. returns how many
+ * ran. */
+int rucksack_read_queue_poll(struct RuckSackReadQueue *queue);
+/* blocks until every queued read has finished and its callback has run */
+int rucksack_read_queue_wait(struct RuckSackReadQueue *queue);
 
 /* usually not needed. used by the `strip` command */
 long rucksack_bundle_get_headers_byte_count(struct RuckSackBundle *bundle);
@@ -11,14 +11,31 @@
 // everything in this file is shared by both rucksack.c and spritesheet.c
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <FreeImage.h>
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 static const int UUID_SIZE = 16;
 static const char *TEXTURE_UUID = "\x0e\xb1\x4c\x84\x47\x4c\xb3\xad\xa6\xbd\x93\xe4\xbe\xa5\x46\xba";
 static const int TEXTURE_HEADER_LEN = 38;
 static const int IMAGE_HEADER_LEN = 37; // not taking into account key bytes
+// version 2 textures store their images as a sprite table instead of image
+// entries, after a longer header that the level table follows. the header
+// always has all of its fields. adding more means a new TEXTURE_VERSION.
+static const int TEXTURE_HEADER_LEN_V2 = 96;
+// the sprite table stores pages in 16 bits
+static const int MAX_PAGES = 65535;
+static const int TEXTURE_LEVEL_LEN = 28;
+static const long PIXEL_DATA_ALIGNMENT = 16;
+static const uint32_t TEXTURE_VERSION = 2;
+static const int SPRITE_LEN = 36; // sizeof(struct RuckSackSprite)
+static const int SPRITE_TRIM_LEN = 16; // sizeof(struct RuckSackSpriteTrim)
+// a sprite key table slot holds the key hash and the index of the sprite
+static const int SPRITE_SLOT_LEN = 8;
+static const uint32_t SPRITE_SLOT_EMPTY = 0xffffffff;
 static const float FIXED_POINT_N = 16384.0f;
 
 struct Rect {
@@ -35,41 +52,95 @@ struct RuckSackTexturePrivate {
     int images_count;
     int images_size;
 
-    struct Rect *free_positions;
-    int free_pos_count;
-    int free_pos_size;
-    int garbage_count;
+    long page_count;
 
+    // the size of every page
     int width;
     int height;
 
     // for reading
     struct RuckSackFileEntry *entry;
     long pixel_data_offset;
-    long pixel_data_size;
+    long pixel_data_size; // as stored
+    long pixel_size; // after undoing the compression
+    // the compression asked for when the texture was added, which can be
+    // auto. the compression of externals is the one the pixels are stored
+    // with.
+    int requested_compression;
+    // level_count levels for each page
+    struct RuckSackTextureLevel *levels;
+    long level_count;
+    // the sprite table, its key table and the key bytes. they point into
+    // the memory mapped bundle when they can be used as they are, and into
+    // meta_buf otherwise.
+    const struct RuckSackSprite *sprites;
+    // follows the sprite table when has_sprite_trims is set, NULL otherwise
+    const struct RuckSackSpriteTrim *sprite_trims;
+    bool has_sprite_trims;
+    const uint32_t *sprite_slots; // SPRITE_SLOT_LEN bytes each
+    long sprite_slot_count; // a power of 2, or 0
+    const char *keys;
+    long keys_size;
+    // the metadata read from the file when the bundle is not memory mapped
+    unsigned char *meta_buf;
+    // the tables when they had to be converted
+    unsigned char *tables_buf;
+    // guards filling in images on demand
+    pthread_mutex_t images_mutex;
 };
 
 struct RuckSackFileEntry {
     struct RuckSackBundlePrivate *b;
     long offset;
-    long size;
+    long size; // bytes stored in the bundle
     long allocated_size;
     int key_size;
     long mtime;
     char *key;
+    uint32_t key_hash;
+    int compression; // enum RuckSackCompression
+    long uncompressed_size; // only meaningful when compression is set
     int is_open; // flag for when an out stream is writing to this entry
     int touched; // flag, set when the entry is written to
+    uint64_t content_hash; // of the stored bytes, see hash_content
+    bool has_content_hash;
+    uint32_t checksum; // CRC32C of the stored bytes
+    bool has_checksum;
+    // set when the stored bytes live in the region of another entry with
+    // the same contents. such entries have no allocated_size of their own.
+    bool is_duplicate;
+    long ref_count; // how many entries use this entry's region, itself included
+    long alignment; // offset is a multiple of this power of 2
 };
 
 struct RuckSackOutStream {
     struct RuckSackBundlePrivate *b;
     struct RuckSackFileEntry *e;
+    // of the bytes written so far
+    uint64_t content_hash;
+    uint32_t checksum;
+    // set when the writer supplies content_hash and checksum instead of
+    // having the stream compute them
+    bool hashes_known;
+    // set when a write failed, which leaves the contents unknown
+    bool write_failed;
 };
 
 struct RuckSackImagePrivate {
     struct RuckSackImage externals;
 
     FIBITMAP *bmp;
+    // the r90 that the image was added with, which packing has to keep to
+    char force_r90;
+    // the bounding box of the pixels that are not fully transparent, from
+    // the top left of the full image
+    struct Rect opaque;
+    // of the pixels inside opaque. images with the same pixels are packed
+    // once, and whatever gets packed of them lies inside it.
+    uint64_t visible_hash;
+    // the index in the images array of the image whose place this one
+    // shares, or -1 if it is packed itself
+    int alias;
 };
 
 static void write_uint32be(unsigned char *buf, uint32_t x) {
@@ -85,4 +156,37 @@ static void write_uint32be(unsigned char *buf, uint32_t x) {
     buf[0] = x & 0xff;
 }
 
+// FNV-1a
+static uint32_t hash_key(const char *key, int key_size) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < key_size; i += 1) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// the number of slots in the key tables written for entry_count entries. like
+// the in-memory indexes they are kept at most half full.
+static long key_table_slot_count(long entry_count) {
+    if (entry_count == 0)
+        return 0;
+    long count = 16;
+    while (count < entry_count * 2)
+        count *= 2;
+    return count;
+}
+
+// slots holds slot_count pairs of key hash and sprite index in host byte order
+static void sprite_slot_insert(uint32_t *slots, long slot_count, uint32_t hash,
+        uint32_t index)
+{
+    long mask = slot_count - 1;
+    long slot = hash & mask;
+    while (slots[slot * 2 + 1] != SPRITE_SLOT_EMPTY)
+        slot = (slot + 1) & mask;
+    slots[slot * 2] = hash;
+    slots[slot * 2 + 1] = index;
+}
+
 #endif
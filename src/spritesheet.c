@@ -7,11 +7,20 @@
 
 #include "spritesheet.h"
 #include "shared.h"
+#include "cpu.h"
+#include "codec.h"
+#include "bcn.h"
+#include "mipmap.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct RuckSackImage *rucksack_image_create(void) {
     struct RuckSackImagePrivate *img = calloc(1, sizeof(struct RuckSackImagePrivate));
@@ -30,13 +39,95 @@ void rucksack_image_destroy(struct RuckSackImage *image) {
     free(img);
 }
 
-static char *dupe_byte_str(char *src, int len) {
+static char *dupe_byte_str(const char *src, int len) {
     char *dest = malloc(len);
     if (dest)
         memcpy(dest, src, len);
     return dest;
 }
 
+// whether any of count pixels of a 32 bit bitmap is not fully transparent
+static bool any_visible(const BYTE *pixels, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    // 4 pixels at a time, keeping only their alpha bytes
+    const __m128i alpha_mask = _mm_set1_epi32((int)(0xffu << (8 * FI_RGBA_ALPHA)));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)&pixels[4 * i]);
+        __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(px, alpha_mask), zero);
+        if (_mm_movemask_epi8(transparent) != 0xffff)
+            return true;
+    }
+#endif
+    for (; i < count; i += 1) {
+        if (pixels[4 * i + FI_RGBA_ALPHA] != 0)
+            return true;
+    }
+    return false;
+}
+
+// FNV-1a, 64 bits wide, of the pixels of a 32 bit bitmap inside r, which is
+// from its top left
+static uint64_t hash_pixels(FIBITMAP *bmp, struct Rect r) {
+    uint64_t hash = 14695981039346656037ull;
+    int height = FreeImage_GetHeight(bmp);
+    for (int y = r.y; y < r.y + r.h; y += 1) {
+        const BYTE *pixels = FreeImage_GetScanLine(bmp, height - 1 - y) + 4 * r.x;
+        for (long i = 0; i < 4L * r.w; i += 1) {
+            hash ^= pixels[i];
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// the bounding box of the pixels of a 32 bit bitmap that are not fully
+// transparent, from its top left. an image with none keeps its top left
+// pixel, so that it still has a place in the texture.
+static struct Rect find_visible_rect(FIBITMAP *bmp) {
+    int width = FreeImage_GetWidth(bmp);
+    int height = FreeImage_GetHeight(bmp);
+
+    // rows of freeimage bitmaps go from the bottom up
+    int bottom = 0;
+    while (bottom < height && !any_visible(FreeImage_GetScanLine(bmp, bottom), width))
+        bottom += 1;
+    struct Rect r;
+    if (bottom == height) {
+        r.x = 0;
+        r.y = 0;
+        r.w = 1;
+        r.h = 1;
+        return r;
+    }
+    int top = height - 1;
+    while (!any_visible(FreeImage_GetScanLine(bmp, top), width))
+        top -= 1;
+
+    // each row only has to be looked at outside of the columns found so far
+    int left = width;
+    int right = -1;
+    for (int row = bottom; row <= top; row += 1) {
+        const BYTE *pixels = FreeImage_GetScanLine(bmp, row);
+        if (any_visible(pixels, left)) {
+            left = 0;
+            while (pixels[4 * left + FI_RGBA_ALPHA] == 0)
+                left += 1;
+        }
+        if (any_visible(&pixels[4 * (right + 1)], width - right - 1)) {
+            right = width - 1;
+            while (pixels[4 * right + FI_RGBA_ALPHA] == 0)
+                right -= 1;
+        }
+    }
+    r.x = left;
+    r.y = height - 1 - top;
+    r.w = right - left + 1;
+    r.h = top - bottom + 1;
+    return r;
+}
+
 int rucksack_texture_add_image(struct RuckSackTexture *texture, struct RuckSackImage *userimg)
 {
     struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
@@ -54,6 +145,15 @@ int rucksack_texture_add_image(struct RuckSackTexture *texture, struct RuckSackI
     if (!FreeImage_HasPixels(bmp))
         return RuckSackErrorNoPixels;
 
+    // trimming looks at the alpha of each pixel
+    if (FreeImage_GetBPP(bmp) != 32) {
+        FIBITMAP *new_bmp = FreeImage_ConvertTo32Bits(bmp);
+        FreeImage_Unload(bmp);
+        if (!new_bmp)
+            return RuckSackErrorNoMem;
+        bmp = new_bmp;
+    }
+
     if (p->images_count >= p->images_size) {
         p->images_size += 512;
         struct RuckSackImagePrivate *new_ptr = realloc(p->images,
@@ -67,9 +167,18 @@ int rucksack_texture_add_image(struct RuckSackTexture *texture, struct RuckSackI
 
     img->bmp = bmp;
     img->externals.r90 = userimg->r90;
+    img->force_r90 = userimg->r90;
+    img->opaque = find_visible_rect(bmp);
+    img->visible_hash = hash_pixels(bmp, img->opaque);
+    img->alias = -1;
 
     image->width = FreeImage_GetWidth(bmp);
     image->height = FreeImage_GetHeight(bmp);
+    image->trim = userimg->trim;
+    image->trim_x = 0;
+    image->trim_y = 0;
+    image->full_width = image->width;
+    image->full_height = image->height;
 
     image->anchor = userimg->anchor;
     switch (userimg->anchor) {
@@ -127,8 +236,17 @@ int rucksack_texture_add_image(struct RuckSackTexture *texture, struct RuckSackI
     return RuckSackErrorNone;
 }
 
-static void write_float32be(unsigned char *buf, float x) {
-    write_uint32be(buf, x * FIXED_POINT_N);
+static void write_uint32le(unsigned char *buf, uint32_t x) {
+    buf[0] = x & 0xff;
+    buf[1] = (x >> 8) & 0xff;
+    buf[2] = (x >> 16) & 0xff;
+    buf[3] = (x >> 24) & 0xff;
+}
+
+static void write_float32le(unsigned char *buf, float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    write_uint32le(buf, bits);
 }
 
 static int compare_images(const void *a, const void *b) {
@@ -162,43 +280,142 @@ static int compare_images(const void *a, const void *b) {
     return (delta == 0) ? (other_dim_b - other_dim_a) : delta;
 }
 
-static struct Rect *add_free_rect(struct RuckSackTexturePrivate *p) {
-    // search for garbage
-    if (p->garbage_count > 0) {
-        for (int i = 0; i < p->free_pos_count; i += 1) {
-            struct Rect *r = &p->free_positions[i];
-            if (r->x == -1) {
-                p->garbage_count -= 1;
-                return r;
-            }
+struct IntList {
+    int *items;
+    int count;
+    int size;
+};
+
+static bool int_list_append(struct IntList *list, int x) {
+    if (list->count >= list->size) {
+        int new_size = list->size + 64;
+        int *new_ptr = realloc(list->items, new_size * sizeof(int));
+        if (!new_ptr)
+            return false;
+        list->items = new_ptr;
+        list->size = new_size;
+    }
+    list->items[list->count] = x;
+    list->count += 1;
+    return true;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int int_a = *(const int *)a;
+    int int_b = *(const int *)b;
+    return (int_a > int_b) - (int_a < int_b);
+}
+
+// the free rectangles of one page while it is being packed
+struct Page {
+    struct Rect *free_positions;
+    int free_pos_count;
+    int free_pos_size;
+    int garbage_count;
+
+    // indexes of removed free rectangles, a min-heap so that the lowest one
+    // is reused first. an index that has since been reused or trimmed off
+    // the end is skipped when it comes up.
+    struct IntList garbage;
+
+    // the free rectangles added while placing the current image
+    struct IntList added;
+
+    // the footprints of the images placed so far, for the contact point rule
+    struct Rect *used;
+    int used_count;
+    int used_size;
+};
+
+static void garbage_push(struct Page *page, int index) {
+    struct IntList *heap = &page->garbage;
+    if (!int_list_append(heap, index)) {
+        // without the index the slot is not reused, which only costs space
+        return;
+    }
+    int *items = heap->items;
+    int i = heap->count - 1;
+    while (i > 0 && items[(i - 1) / 2] > items[i]) {
+        int parent = (i - 1) / 2;
+        int tmp = items[parent];
+        items[parent] = items[i];
+        items[i] = tmp;
+        i = parent;
+    }
+}
+
+static int garbage_pop(struct Page *page) {
+    struct IntList *heap = &page->garbage;
+    int *items = heap->items;
+    int top = items[0];
+    heap->count -= 1;
+    items[0] = items[heap->count];
+    int i = 0;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap->count && items[left] < items[smallest])
+            smallest = left;
+        if (right < heap->count && items[right] < items[smallest])
+            smallest = right;
+        if (smallest == i)
+            break;
+        int tmp = items[smallest];
+        items[smallest] = items[i];
+        items[i] = tmp;
+        i = smallest;
+    }
+    return top;
+}
+
+// the lowest removed index still in use as a slot, or -1
+static int take_garbage(struct Page *page) {
+    if (page->garbage_count == 0)
+        return -1;
+    while (page->garbage.count > 0) {
+        int index = garbage_pop(page);
+        if (index < page->free_pos_count && page->free_positions[index].x == -1) {
+            page->garbage_count -= 1;
+            return index;
         }
-        assert(0);
     }
-    if (p->free_pos_count >= p->free_pos_size) {
-        p->free_pos_size += 512;
-        struct Rect *new_ptr = realloc(p->free_positions,
-                p->free_pos_size * sizeof(struct Rect));
-        if (!new_ptr)
-            return NULL;
-        p->free_positions = new_ptr;
+    return -1;
+}
+
+static struct Rect *add_free_rect(struct Page *page) {
+    // reuse garbage
+    int index = take_garbage(page);
+    if (index == -1) {
+        if (page->free_pos_count >= page->free_pos_size) {
+            page->free_pos_size += 512;
+            struct Rect *new_ptr = realloc(page->free_positions,
+                    page->free_pos_size * sizeof(struct Rect));
+            if (!new_ptr)
+                return NULL;
+            page->free_positions = new_ptr;
+        }
+        index = page->free_pos_count;
+        page->free_pos_count += 1;
     }
-    struct Rect *ptr = &p->free_positions[p->free_pos_count];
-    p->free_pos_count += 1;
+    if (!int_list_append(&page->added, index))
+        return NULL;
 
-    return ptr;
+    return &page->free_positions[index];
 }
 
-static void remove_free_rect(struct RuckSackTexturePrivate *p, struct Rect *r) {
+static void remove_free_rect(struct Page *page, struct Rect *r) {
     // mark the object as absent
     r->x = -1;
-    p->garbage_count += 1;
+    page->garbage_count += 1;
+    garbage_push(page, r - page->free_positions);
 
     // decrement the end pointer if we can
-    int next_free_pos_count = p->free_pos_count - 1;
-    while (next_free_pos_count >= 0 && p->free_positions[next_free_pos_count].x == -1) {
-        p->free_pos_count = next_free_pos_count;
+    int next_free_pos_count = page->free_pos_count - 1;
+    while (next_free_pos_count >= 0 && page->free_positions[next_free_pos_count].x == -1) {
+        page->free_pos_count = next_free_pos_count;
         next_free_pos_count -= 1;
-        p->garbage_count -= 1;
+        page->garbage_count -= 1;
     }
 }
 
@@ -209,216 +426,491 @@ static char rects_intersect(struct Rect *r1, struct Rect *r2) {
             r2->y < r1->y + r1->h);
 }
 
-static int do_maxrect_bssf(struct RuckSackTexture *texture) {
-    struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
+// where packing put an image
+struct Spot {
+    int x;
+    int y;
+    int page;
+    char r90;
+};
+
+// one attempt at packing the images into pages of one size, with one
+// placement rule and one order of the images. attempts can run on threads of
+// their own, so each one keeps its own free rectangles and results.
+struct Packing {
+    int page_width;
+    int page_height;
+    // one of enum RuckSackPacking, but not RuckSackPackingBest
+    int rule;
+    // indexes of the images in the order to pack them. NULL for the order
+    // of the images array.
+    const int *order;
+
+    struct Page *pages;
+    int page_count;
+    int pages_size;
+
+    // one for each image, in the order of the images
+    struct Spot *spots;
+    // how much of the pages the images use
+    int width;
+    int height;
+};
+
+static void free_page(struct Page *page) {
+    free(page->free_positions);
+    free(page->garbage.items);
+    free(page->added.items);
+    free(page->used);
+}
 
-    // the Maximal Rectangles Algorithm, Best Short Side Fit
-    // calculate the positions according to max width and height. later we'll crop.
+static void clear_pages(struct Packing *packing) {
+    for (int i = 0; i < packing->page_count; i += 1)
+        free_page(&packing->pages[i]);
+    packing->page_count = 0;
+}
 
-    // sort using a nice heuristic
-    qsort(p->images, p->images_count, sizeof(struct RuckSackImagePrivate), compare_images);
+static void free_packing(struct Packing *packing) {
+    clear_pages(packing);
+    free(packing->pages);
+    free(packing->spots);
+}
 
-    struct Rect *r = add_free_rect(p);
-    if (!r)
-        return RuckSackErrorNoMem;
+// starts a page that is one free rectangle
+static struct Page *add_page(struct Packing *packing) {
+    if (packing->page_count >= packing->pages_size) {
+        int new_size = packing->pages_size + 16;
+        struct Page *new_ptr = realloc(packing->pages, new_size * sizeof(struct Page));
+        if (!new_ptr)
+            return NULL;
+        packing->pages = new_ptr;
+        packing->pages_size = new_size;
+    }
+    struct Page *page = &packing->pages[packing->page_count];
+    memset(page, 0, sizeof(struct Page));
+    struct Rect *r = add_free_rect(page);
+    if (!r) {
+        free_page(page);
+        return NULL;
+    }
+    packing->page_count += 1;
     r->x = 0;
     r->y = 0;
-    r->w = texture->max_width;
-    r->h = texture->max_height;
+    r->w = packing->page_width;
+    r->h = packing->page_height;
+    return page;
+}
 
-    // keep track of the actual texture size
-    p->width = 0;
-    p->height = 0;
+// mip levels, counting the full size one, that keep every sprite to itself.
+// levels below these are too small for one sprite bleeding into the next to
+// be seen, and keeping them apart would cost more padding than they are worth.
+static const int MIP_ISOLATED_LEVELS = 5;
 
-    for (int i = 0; i < p->images_count; i += 1) {
-        struct RuckSackImagePrivate *img = &p->images[i];
-        struct RuckSackImage *image = &img->externals;
+static int align_up(int x, int align) {
+    return (x + align - 1) / align * align;
+}
 
-        // pick a value that will definitely be larger than any other
-        int best_short_side = INT_MAX;
-        char best_short_side_is_r90;
-        struct Rect *best_rect = NULL;
-
-        // decide which free rectangle to pack into
-        for (int free_i = 0; free_i < p->free_pos_count; free_i += 1) {
-            struct Rect *free_r = &p->free_positions[free_i];
-            if (free_r->x == -1) {
-                // this free rectangle has been removed from the set. skip it
-                continue;
-            }
+// images are placed on multiples of this many pixels
+static int packing_alignment(struct RuckSackTexture *texture) {
+    // block formats compress 4x4 pixels at a time. every image takes up
+    // whole blocks so that no block holds parts of two images, which would
+    // bleed into each other when filtered.
+    int align = rucksack_bcn_is_block_format(texture->format) ? 4 : 1;
+
+    // each mip level halves the position of an image. an image on a multiple
+    // of 2^n pixels stays on whole pixels, apart from its neighbors, for n
+    // levels below the full size one.
+    int levels = texture->mip_levels;
+    if (levels <= 0 || levels > MIP_ISOLATED_LEVELS)
+        levels = MIP_ISOLATED_LEVELS;
+    int mip_align = 1 << (levels - 1);
+    return MAX(align, mip_align);
+}
 
-            // calculate short side fit without rotating
-            if (!image->r90) {
-                int w_len = free_r->w - image->width;
-                int h_len = free_r->h - image->height;
-                int short_side = (w_len < h_len) ? w_len : h_len;
-                int can_fit = w_len > 0 && h_len > 0;
-                if (can_fit && short_side < best_short_side) {
-                    best_short_side = short_side;
-                    best_rect = free_r;
-                    best_short_side_is_r90 = 0;
-                }
-            }
+// where an image goes. free rectangles are referred to by index because
+// adding one can move them all.
+struct Placement {
+    int page;
+    int rect;
+    char r90;
+    // lower is better. tie_score decides between equal scores.
+    long score;
+    long tie_score;
+};
+
+static int common_length(int a_start, int a_end, int b_start, int b_end) {
+    return MAX(0, MIN(a_end, b_end) - MAX(a_start, b_start));
+}
 
-            // calculate short side fit with rotating 90 degrees
-            if (texture->allow_r90 || image->r90) {
-                int w_len = free_r->w - image->height;
-                int h_len = free_r->h - image->width;
-                int short_side = (w_len < h_len) ? w_len : h_len;
-                int can_fit = w_len > 0 && h_len > 0;
-                if (can_fit && short_side < best_short_side) {
-                    best_short_side = short_side;
-                    best_rect = free_r;
-                    best_short_side_is_r90 = 1;
-                }
-            }
+// how much of the edges of r touch placed images or the edges of the page
+// at x 0 and y 0. the far edges do not count because the texture is cropped
+// to the images, and images pushed against them would stretch it.
+static long contact_length(struct Page *page, struct Rect *r) {
+    long length = 0;
+    if (r->x == 0)
+        length += r->h;
+    if (r->y == 0)
+        length += r->w;
+    for (int i = 0; i < page->used_count; i += 1) {
+        struct Rect *used = &page->used[i];
+        if (used->x == r->x + r->w || used->x + used->w == r->x)
+            length += common_length(r->y, r->y + r->h, used->y, used->y + used->h);
+        if (used->y == r->y + r->h || used->y + used->h == r->y)
+            length += common_length(r->x, r->x + r->w, used->x, used->x + used->w);
+    }
+    return length;
+}
+
+// scores putting a footprint of width x height at the corner of free_r
+// according to the placement rule of packing. false if it does not fit.
+static bool score_position(struct Packing *packing, struct Page *page, struct Rect *free_r,
+        int width, int height, long *score, long *tie_score)
+{
+    int w_len = free_r->w - width;
+    int h_len = free_r->h - height;
+    if (w_len <= 0 || h_len <= 0)
+        return false;
+    int short_side = (w_len < h_len) ? w_len : h_len;
+    int long_side = (w_len < h_len) ? h_len : w_len;
+    struct Rect r;
+    switch (packing->rule) {
+        case RuckSackPackingLongSideFit:
+            *score = long_side;
+            *tie_score = short_side;
+            break;
+        case RuckSackPackingAreaFit:
+            *score = (long)free_r->w * free_r->h - (long)width * height;
+            *tie_score = short_side;
+            break;
+        case RuckSackPackingBottomLeft:
+            *score = free_r->y + height;
+            *tie_score = free_r->x;
+            break;
+        case RuckSackPackingContactPoint:
+            r.x = free_r->x;
+            r.y = free_r->y;
+            r.w = width;
+            r.h = height;
+            *score = -contact_length(page, &r);
+            *tie_score = free_r->y + height;
+            break;
+        default:
+            *score = short_side;
+            *tie_score = 0;
+            break;
+    }
+    return true;
+}
+
+static void consider_position(struct Placement *best, long score, long tie_score,
+        int page_index, int rect, char r90)
+{
+    if (score < best->score || (score == best->score && tie_score < best->tie_score)) {
+        best->score = score;
+        best->tie_score = tie_score;
+        best->page = page_index;
+        best->rect = rect;
+        best->r90 = r90;
+    }
+}
+
+// looks for a free rectangle of the page that scores better than best.
+// width and height are the footprint of the image.
+static void find_position(struct Packing *packing, const struct RuckSackImagePrivate *img,
+        char allow_r90, int width, int height, int page_index, struct Placement *best)
+{
+    struct Page *page = &packing->pages[page_index];
+    for (int free_i = 0; free_i < page->free_pos_count; free_i += 1) {
+        struct Rect *free_r = &page->free_positions[free_i];
+        if (free_r->x == -1) {
+            // this free rectangle has been removed from the set. skip it
+            continue;
         }
 
-        if (!best_rect)
-            return RuckSackErrorCannotFit;
+        long score;
+        long tie_score;
 
-        // freeimage images are upside down. so, geometrically we are placing
-        // the image at the top left of this rect. However due to freeimage's
-        // inverted Y axis, the image will actually end up in the bottom left.
-        struct Rect img_rect;
-        img_rect.x = best_rect->x;
-        img_rect.y = best_rect->y;
-        img_rect.w = best_short_side_is_r90 ? image->height : image->width;
-        img_rect.h = best_short_side_is_r90 ? image->width : image->height;
+        // calculate the fit without rotating
+        if (!img->force_r90 &&
+            score_position(packing, page, free_r, width, height, &score, &tie_score))
+        {
+            consider_position(best, score, tie_score, page_index, free_i, 0);
+        }
 
-        image->x = img_rect.x;
-        image->y = img_rect.y;
-        image->r90 = best_short_side_is_r90;
+        // calculate the fit with rotating 90 degrees
+        if ((allow_r90 || img->force_r90) &&
+            score_position(packing, page, free_r, height, width, &score, &tie_score))
+        {
+            consider_position(best, score, tie_score, page_index, free_i, 1);
+        }
+    }
+}
 
-        // keep track of texture boundaries
-        p->width = MAX(image->x + img_rect.w, p->width);
-        p->height = MAX(image->y + img_rect.h, p->height);
+// whether inner lies inside outer
+static bool rect_inside(const struct Rect *inner, const struct Rect *outer) {
+    int x_diff = inner->x - outer->x;
+    int y_diff = inner->y - outer->y;
+    return x_diff >= 0 && y_diff >= 0 &&
+        inner->w <= outer->w - x_diff &&
+        inner->h <= outer->h - y_diff;
+}
 
-        // insert the two new rectangles into our set
-        struct Rect *horiz = add_free_rect(p);
-        if (!horiz)
-            return RuckSackErrorNoMem;
-        horiz->x = best_rect->x;
-        horiz->y = best_rect->y + image->height;
-        horiz->w = best_rect->w;
-        horiz->h = best_rect->h - image->height;
+// checks the free rectangle at first against the ones after it, removing
+// whichever lies inside the other. a rectangle that was there before this
+// image is only checked against the added ones, because the rectangles from
+// before did not lie inside each other. once first is removed itself, it
+// keeps being checked with its x set to -1, which catches some rectangles
+// near the left edge of the page too. placements so far have depended on it.
+static void prune_pairs(struct Page *page, int first, const int *added, int added_count) {
+    struct Rect *r1 = &page->free_positions[first];
+    int removed_at = -1;
+    int count = added ? added_count : page->free_pos_count - first - 1;
+    for (int i = 0; i < count; i += 1) {
+        int second = added ? added[i] : first + 1 + i;
+        if (second >= page->free_pos_count)
+            break;
+        struct Rect *r2 = &page->free_positions[second];
+        if (r2->x == -1) {
+            // this free rectangle has been removed from the set. skip it
+            continue;
+        }
+        if (rect_inside(r1, r2)) {
+            remove_free_rect(page, r1);
+            removed_at = second;
+            break;
+        }
+        if (rect_inside(r2, r1))
+            remove_free_rect(page, r2);
+    }
+    if (removed_at == -1)
+        return;
 
-        struct Rect *vert  = add_free_rect(p);
-        if (!vert)
-            return RuckSackErrorNoMem;
-        vert->x = best_rect->x + image->width;
-        vert->y = best_rect->y;
-        vert->w = best_rect->w - image->width;
-        vert->h = best_rect->h;
-
-        // remove the no longer free rectangle we just used from our set
-        remove_free_rect(p, best_rect);
-
-        // now we loop over all the free rectangles in our set and break them
-        // into smaller rectangles if the chosen position overlaps
-        for (int free_i = 0; free_i < p->free_pos_count; free_i += 1) {
-            struct Rect *free_r = &p->free_positions[free_i];
-            if (free_r->x == -1) {
-                // this free rectangle has been removed from the set. skip it
-                continue;
-            }
+    for (int second = removed_at + 1; second < page->free_pos_count; second += 1) {
+        struct Rect *r2 = &page->free_positions[second];
+        if (r2->x != -1 && rect_inside(r2, r1))
+            remove_free_rect(page, r2);
+    }
+}
 
-            if (rects_intersect(free_r, &img_rect)) {
-                struct Rect outer;
-
-                // check left side
-                outer.x = free_r->x;
-                outer.y = free_r->y;
-                outer.w = image->x - free_r->x;
-                outer.h = free_r->h;
-                if (outer.w > 0) {
-                    struct Rect *new_free_rect = add_free_rect(p);
-                    if (!new_free_rect)
-                        return RuckSackErrorNoMem;
-                    *new_free_rect = outer;
-                }
+// removes the degenerate rectangles - rectangles that are subrectangles of
+// another. the pairs are checked in the same order as checking every pair,
+// but only the pairs with a rectangle added for this image, which makes
+// this linear in the number of free rectangles rather than quadratic.
+static void prune_free_rects(struct Page *page) {
+    struct IntList *added = &page->added;
+    qsort(added->items, added->count, sizeof(int), compare_ints);
+
+    // the slot of an added rectangle can be reused for another one
+    int added_count = 0;
+    for (int i = 0; i < added->count; i += 1) {
+        if (added_count == 0 || added->items[i] != added->items[added_count - 1]) {
+            added->items[added_count] = added->items[i];
+            added_count += 1;
+        }
+    }
+    added->count = added_count;
+
+    int added_i = 0;
+    for (int first = 0; first < page->free_pos_count; first += 1) {
+        while (added_i < added->count && added->items[added_i] < first)
+            added_i += 1;
+        if (page->free_positions[first].x == -1) {
+            // this free rectangle has been removed from the set. skip it
+            continue;
+        }
+        if (added_i < added->count && added->items[added_i] == first) {
+            prune_pairs(page, first, NULL, 0);
+        } else {
+            prune_pairs(page, first, &added->items[added_i], added->count - added_i);
+        }
+    }
+}
 
-                // check right side
-                outer.x = image->x + img_rect.w;
-                outer.y = free_r->y;
-                outer.w = free_r->x + free_r->w - outer.x;
-                outer.h = free_r->h;
-                if (outer.w > 0) {
-                    struct Rect *new_free_rect = add_free_rect(p);
-                    if (!new_free_rect)
-                        return RuckSackErrorNoMem;
-                    *new_free_rect = outer;
-                }
+// puts the image where find_position said and takes the space it uses out
+// of the free rectangles of its page
+static int place_image(struct Page *page, struct Spot *spot,
+        int width, int height, struct Placement *placement)
+{
+    struct Rect best_rect = page->free_positions[placement->rect];
+
+    // freeimage images are upside down. so, geometrically we are placing
+    // the image at the top left of this rect. However due to freeimage's
+    // inverted Y axis, the image will actually end up in the bottom left.
+    struct Rect img_rect;
+    img_rect.x = best_rect.x;
+    img_rect.y = best_rect.y;
+    img_rect.w = placement->r90 ? height : width;
+    img_rect.h = placement->r90 ? width : height;
+
+    spot->x = img_rect.x;
+    spot->y = img_rect.y;
+    spot->page = placement->page;
+    spot->r90 = placement->r90;
+
+    if (page->used_count >= page->used_size) {
+        int new_size = page->used_size + 512;
+        struct Rect *new_ptr = realloc(page->used, new_size * sizeof(struct Rect));
+        if (!new_ptr)
+            return RuckSackErrorNoMem;
+        page->used = new_ptr;
+        page->used_size = new_size;
+    }
+    page->used[page->used_count] = img_rect;
+    page->used_count += 1;
 
-                // check top side
-                outer.x = free_r->x;
-                outer.y = free_r->y;
-                outer.w = free_r->w;
-                outer.h = image->y - free_r->y;
-                if (outer.h > 0) {
-                    struct Rect *new_free_rect = add_free_rect(p);
-                    if (!new_free_rect)
-                        return RuckSackErrorNoMem;
-                    *new_free_rect = outer;
-                }
+    // insert the two new rectangles into our set
+    page->added.count = 0;
+    struct Rect *horiz = add_free_rect(page);
+    if (!horiz)
+        return RuckSackErrorNoMem;
+    horiz->x = best_rect.x;
+    horiz->y = best_rect.y + height;
+    horiz->w = best_rect.w;
+    horiz->h = best_rect.h - height;
 
-                // check bottom side
-                outer.x = free_r->x;
-                outer.y = image->y + img_rect.h;
-                outer.w = free_r->w;
-                outer.h = free_r->y + free_r->h - outer.y;
-                if (outer.h > 0) {
-                    struct Rect *new_free_rect = add_free_rect(p);
-                    if (!new_free_rect)
-                        return RuckSackErrorNoMem;
-                    *new_free_rect = outer;
-                }
+    struct Rect *vert  = add_free_rect(page);
+    if (!vert)
+        return RuckSackErrorNoMem;
+    vert->x = best_rect.x + width;
+    vert->y = best_rect.y;
+    vert->w = best_rect.w - width;
+    vert->h = best_rect.h;
+
+    // remove the no longer free rectangle we just used from our set
+    remove_free_rect(page, &page->free_positions[placement->rect]);
+
+    // now we loop over all the free rectangles in our set and break them
+    // into smaller rectangles if the chosen position overlaps
+    for (int free_i = 0; free_i < page->free_pos_count; free_i += 1) {
+        struct Rect free_r = page->free_positions[free_i];
+        if (free_r.x == -1) {
+            // this free rectangle has been removed from the set. skip it
+            continue;
+        }
 
-                remove_free_rect(p, free_r);
+        if (rects_intersect(&free_r, &img_rect)) {
+            struct Rect outer;
+
+            // check left side
+            outer.x = free_r.x;
+            outer.y = free_r.y;
+            outer.w = img_rect.x - free_r.x;
+            outer.h = free_r.h;
+            if (outer.w > 0) {
+                struct Rect *new_free_rect = add_free_rect(page);
+                if (!new_free_rect)
+                    return RuckSackErrorNoMem;
+                *new_free_rect = outer;
             }
-        }
 
-        // now we loop over the free rectangle set again looking for and
-        // removing degenerate rectagles - rectangles that are subrectangles
-        // of another
-        for (int free_i = 0; free_i < p->free_pos_count; free_i += 1) {
-            struct Rect *free_r1 = &p->free_positions[free_i];
-            if (free_r1->x == -1) {
-                // this free rectangle has been removed from the set. skip it
-                continue;
+            // check right side
+            outer.x = img_rect.x + img_rect.w;
+            outer.y = free_r.y;
+            outer.w = free_r.x + free_r.w - outer.x;
+            outer.h = free_r.h;
+            if (outer.w > 0) {
+                struct Rect *new_free_rect = add_free_rect(page);
+                if (!new_free_rect)
+                    return RuckSackErrorNoMem;
+                *new_free_rect = outer;
             }
-            for (int free_j = free_i + 1; free_j < p->free_pos_count; free_j += 1) {
-                struct Rect *free_r2 = &p->free_positions[free_j];
-                if (free_r2->x == -1) {
-                    // this free rectangle has been removed from the set. skip it
-                    continue;
-                }
 
-                // check if r1 is a subrect of r2
-                int x_diff = free_r1->x - free_r2->x;
-                int y_diff = free_r1->y - free_r2->y;
-                if (x_diff >= 0 && y_diff >= 0 &&
-                    free_r1->w <= free_r2->w - x_diff &&
-                    free_r1->h <= free_r2->h - y_diff)
-                {
-                    remove_free_rect(p, free_r1);
-                    continue;
-                }
+            // check top side
+            outer.x = free_r.x;
+            outer.y = free_r.y;
+            outer.w = free_r.w;
+            outer.h = img_rect.y - free_r.y;
+            if (outer.h > 0) {
+                struct Rect *new_free_rect = add_free_rect(page);
+                if (!new_free_rect)
+                    return RuckSackErrorNoMem;
+                *new_free_rect = outer;
+            }
 
-                // check if r2 is a subrect of r1
-                x_diff = free_r2->x - free_r1->x;
-                y_diff = free_r2->y - free_r1->y;
-                if (x_diff >= 0 && y_diff >= 0 &&
-                    free_r2->w <= free_r1->w - x_diff &&
-                    free_r2->h <= free_r1->h - y_diff)
-                {
-                    remove_free_rect(p, free_r2);
-                    continue;
-                }
+            // check bottom side
+            outer.x = free_r.x;
+            outer.y = img_rect.y + img_rect.h;
+            outer.w = free_r.w;
+            outer.h = free_r.y + free_r.h - outer.y;
+            if (outer.h > 0) {
+                struct Rect *new_free_rect = add_free_rect(page);
+                if (!new_free_rect)
+                    return RuckSackErrorNoMem;
+                *new_free_rect = outer;
             }
+
+            remove_free_rect(page, &page->free_positions[free_i]);
         }
     }
 
+    prune_free_rects(page);
+    return RuckSackErrorNone;
+}
+
+// packs the images into pages of the size that packing asks for, in its
+// order and with its placement rule
+static int do_maxrect(struct RuckSackTexture *texture, struct Packing *packing) {
+    struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
+
+    // the Maximal Rectangles Algorithm
+    // calculate the positions according to the page size. later we'll crop.
+
+    int block = packing_alignment(texture);
+    int max_pages = texture->max_pages;
+    if (max_pages <= 0 || max_pages > MAX_PAGES)
+        max_pages = MAX_PAGES;
+
+    clear_pages(packing);
+    if (!add_page(packing))
+        return RuckSackErrorNoMem;
+
+    // keep track of the actual texture size
+    packing->width = 0;
+    packing->height = 0;
+
+    for (int order_i = 0; order_i < p->images_count; order_i += 1) {
+        int i = packing->order ? packing->order[order_i] : order_i;
+        struct RuckSackImagePrivate *img = &p->images[i];
+        struct RuckSackImage *image = &img->externals;
+        struct Spot *spot = &packing->spots[i];
+        int width = align_up(image->width, block);
+        int height = align_up(image->height, block);
+        if (img->alias != -1) {
+            // it goes wherever the image it shares pixels with goes
+            continue;
+        }
+
+        // decide which free rectangle to pack into. pick a value that will
+        // definitely be larger than any other
+        struct Placement best;
+        best.rect = -1;
+        best.score = LONG_MAX;
+        best.tie_score = LONG_MAX;
+        for (int page_i = 0; page_i < packing->page_count; page_i += 1)
+            find_position(packing, img, texture->allow_r90, width, height, page_i, &best);
+
+        if (best.rect == -1) {
+            // nothing fits on the pages so far. an empty page is the last
+            // chance.
+            if (packing->page_count >= max_pages)
+                return RuckSackErrorCannotFit;
+            if (!add_page(packing))
+                return RuckSackErrorNoMem;
+            find_position(packing, img, texture->allow_r90, width, height,
+                    packing->page_count - 1, &best);
+            if (best.rect == -1)
+                return RuckSackErrorCannotFit;
+        }
+
+        int err = place_image(&packing->pages[best.page], spot, width, height, &best);
+        if (err)
+            return err;
+
+        // keep track of texture boundaries
+        packing->width = MAX(spot->x + (spot->r90 ? height : width), packing->width);
+        packing->height = MAX(spot->y + (spot->r90 ? width : height), packing->height);
+    }
+
     return RuckSackErrorNone;
 }
 
@@ -429,40 +921,682 @@ static int next_pow2(int x) {
     return power;
 }
 
-int rucksack_bundle_add_texture(struct RuckSackBundle *bundle, struct RuckSackTexture *texture)
+// the pixels that a packing takes up once it is cropped
+static long packed_area(struct RuckSackTexture *texture, struct Packing *packing) {
+    long width = texture->pow2 ? next_pow2(packing->width) : packing->width;
+    long height = texture->pow2 ? next_pow2(packing->height) : packing->height;
+    return packing->page_count * width * height;
+}
+
+static const int PACKING_RULE_COUNT = RuckSackPackingBest;
+static const int SORT_BY_COUNT = RuckSackSortByHeight + 1;
+
+struct PageSize {
+    int width;
+    int height;
+};
+
+// one page size, placement rule and order to try
+struct Attempt {
+    int page_width;
+    int page_height;
+    int rule;
+    int sort_by;
+};
+
+// the search for the attempt that packs the images onto the fewest pages,
+// and into the fewest pixels among those
+struct Search {
+    struct RuckSackTexture *texture;
+    struct Attempt *attempts;
+    int attempt_count;
+    int next_attempt;
+    // the order of the images for each enum RuckSackSortBy value
+    int *orders[RuckSackSortByHeight + 1];
+};
+
+// each thread of the search keeps the best of the attempts that it made
+struct Searcher {
+    struct Search *search;
+    struct Packing best;
+    int best_index;
+    long best_area;
+    struct Packing scratch;
+    int err;
+};
+
+// whether the packing of attempts[index], area pixels over page_count pages,
+// beats the best so far. spilling onto another page is a last resort, so
+// fewer pages win before fewer pixels do. ties go to the earlier attempt so
+// that the result does not depend on which thread got there first.
+static bool is_better_packing(long area, int page_count, int index,
+        long best_area, int best_page_count, int best_index)
+{
+    if (best_index == -1)
+        return true;
+    if (page_count != best_page_count)
+        return page_count < best_page_count;
+    if (area != best_area)
+        return area < best_area;
+    return index < best_index;
+}
+
+static void *search_attempts(void *arg) {
+    struct Searcher *searcher = arg;
+    struct Search *search = searcher->search;
+    for (;;) {
+        int index = __atomic_fetch_add(&search->next_attempt, 1, __ATOMIC_RELAXED);
+        if (index >= search->attempt_count)
+            break;
+        struct Attempt *attempt = &search->attempts[index];
+        struct Packing *scratch = &searcher->scratch;
+        scratch->page_width = attempt->page_width;
+        scratch->page_height = attempt->page_height;
+        scratch->rule = attempt->rule;
+        scratch->order = search->orders[attempt->sort_by];
+        int err = do_maxrect(search->texture, scratch);
+        if (err == RuckSackErrorCannotFit)
+            continue;
+        if (err) {
+            searcher->err = err;
+            break;
+        }
+        long area = packed_area(search->texture, scratch);
+        if (is_better_packing(area, scratch->page_count, index, searcher->best_area,
+                    searcher->best.page_count, searcher->best_index))
+        {
+            struct Packing tmp = searcher->best;
+            searcher->best = *scratch;
+            *scratch = tmp;
+            searcher->best_index = index;
+            searcher->best_area = area;
+        }
+    }
+    return NULL;
+}
+
+// the page sizes to try. the full size comes first so that it wins ties. with
+// smallest_size and pow2 every pair of powers of 2 that fits is tried;
+// without pow2 the height gets cropped anyway, so only widths in steps of 4
+// pixels are.
+static struct PageSize *page_sizes(struct RuckSackTexture *texture, int block,
+        int *out_count)
+{
+    int full_width = texture->max_width / block * block;
+    int full_height = texture->max_height / block * block;
+    int step = MAX(block, 4);
+    int count = 1;
+    if (texture->smallest_size && texture->pow2) {
+        for (int w = block; w <= full_width; w *= 2)
+            for (int h = block; h <= full_height; h *= 2)
+                count += 1;
+    } else if (texture->smallest_size) {
+        count += full_width / step;
+    }
+    struct PageSize *sizes = malloc(count * sizeof(struct PageSize));
+    if (!sizes)
+        return NULL;
+    sizes[0].width = full_width;
+    sizes[0].height = full_height;
+    int i = 1;
+    if (texture->smallest_size && texture->pow2) {
+        for (int w = block; w <= full_width; w *= 2) {
+            for (int h = block; h <= full_height; h *= 2) {
+                sizes[i].width = w;
+                sizes[i].height = h;
+                i += 1;
+            }
+        }
+    } else if (texture->smallest_size) {
+        for (int w = step; w <= full_width; w += step) {
+            sizes[i].width = w;
+            sizes[i].height = full_height;
+            i += 1;
+        }
+    }
+    *out_count = i;
+    return sizes;
+}
+
+// every page size with every placement rule and order that the texture asks
+// for. the ones the texture names come first so that they win ties.
+static struct Attempt *list_attempts(struct RuckSackTexture *texture, int *out_count) {
+    int size_count;
+    struct PageSize *sizes = page_sizes(texture, packing_alignment(texture), &size_count);
+    if (!sizes)
+        return NULL;
+    bool best = (texture->packing == RuckSackPackingBest);
+    int rule_count = best ? PACKING_RULE_COUNT : 1;
+    int sort_count = best ? SORT_BY_COUNT : 1;
+    struct Attempt *attempts = malloc(size_count * rule_count * sort_count *
+            sizeof(struct Attempt));
+    if (!attempts) {
+        free(sizes);
+        return NULL;
+    }
+    int count = 0;
+    for (int size_i = 0; size_i < size_count; size_i += 1) {
+        for (int rule_i = 0; rule_i < rule_count; rule_i += 1) {
+            for (int sort_i = 0; sort_i < sort_count; sort_i += 1) {
+                struct Attempt *attempt = &attempts[count];
+                attempt->page_width = sizes[size_i].width;
+                attempt->page_height = sizes[size_i].height;
+                attempt->rule = best ? rule_i : texture->packing;
+                // the named order first, then the others
+                attempt->sort_by = (sort_i == 0) ? texture->sort_by :
+                    (sort_i <= texture->sort_by) ? sort_i - 1 : sort_i;
+                count += 1;
+            }
+        }
+    }
+    free(sizes);
+    *out_count = count;
+    return attempts;
+}
+
+struct SortKey {
+    long primary;
+    long secondary;
+    int index;
+};
+
+// largest first. images that tie stay in the order of the images array.
+static int compare_sort_keys(const void *a, const void *b) {
+    const struct SortKey *key_a = a;
+    const struct SortKey *key_b = b;
+    if (key_a->primary != key_b->primary)
+        return (key_a->primary < key_b->primary) ? 1 : -1;
+    if (key_a->secondary != key_b->secondary)
+        return (key_a->secondary < key_b->secondary) ? 1 : -1;
+    return key_a->index - key_b->index;
+}
+
+// the order of the images for sort_by. the images array itself is sorted by
+// their longer side already, so that order is NULL.
+static int make_order(struct RuckSackTexturePrivate *p, int sort_by, int **out_order) {
+    *out_order = NULL;
+    if (sort_by == RuckSackSortByMaxSide)
+        return RuckSackErrorNone;
+    struct SortKey *keys = malloc(p->images_count * sizeof(struct SortKey) + 1);
+    int *order = malloc(p->images_count * sizeof(int) + 1);
+    if (!keys || !order) {
+        free(keys);
+        free(order);
+        return RuckSackErrorNoMem;
+    }
+    for (int i = 0; i < p->images_count; i += 1) {
+        struct RuckSackImage *image = &p->images[i].externals;
+        struct SortKey *key = &keys[i];
+        long max_side = MAX(image->width, image->height);
+        key->index = i;
+        switch (sort_by) {
+            case RuckSackSortByArea:
+                key->primary = (long)image->width * image->height;
+                key->secondary = max_side;
+                break;
+            case RuckSackSortByPerimeter:
+                key->primary = image->width + image->height;
+                key->secondary = max_side;
+                break;
+            default:
+                key->primary = image->height;
+                key->secondary = image->width;
+                break;
+        }
+    }
+    qsort(keys, p->images_count, sizeof(struct SortKey), compare_sort_keys);
+    for (int i = 0; i < p->images_count; i += 1)
+        order[i] = keys[i].index;
+    free(keys);
+    *out_order = order;
+    return RuckSackErrorNone;
+}
+
+// makes every attempt on as many threads as there are CPUs and keeps the
+// packing that takes up the fewest pixels
+static int search_attempts_in_parallel(struct RuckSackTexture *texture,
+        struct Packing *out_packing)
 {
     struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
+    struct Search search;
+    memset(&search, 0, sizeof(struct Search));
+    search.texture = texture;
+    search.attempts = list_attempts(texture, &search.attempt_count);
+    if (!search.attempts)
+        return RuckSackErrorNoMem;
+
+    int err = RuckSackErrorNone;
+    for (int i = 0; i < search.attempt_count && !err; i += 1) {
+        int sort_by = search.attempts[i].sort_by;
+        if (sort_by != RuckSackSortByMaxSide && !search.orders[sort_by])
+            err = make_order(p, sort_by, &search.orders[sort_by]);
+    }
+
+    int thread_count = MIN(rucksack_cpu_count(), search.attempt_count);
+    struct Searcher *searchers = calloc(thread_count, sizeof(struct Searcher));
+    if (!searchers)
+        err = RuckSackErrorNoMem;
+    for (int i = 0; i < thread_count && searchers; i += 1) {
+        struct Searcher *searcher = &searchers[i];
+        searcher->search = &search;
+        searcher->best_index = -1;
+        searcher->best.spots = malloc(p->images_count * sizeof(struct Spot) + 1);
+        searcher->scratch.spots = malloc(p->images_count * sizeof(struct Spot) + 1);
+        if (!searcher->best.spots || !searcher->scratch.spots)
+            err = RuckSackErrorNoMem;
+    }
+
+    // the calling thread searches too, so it is one fewer to start
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (!err && thread_count > 1) {
+        threads = malloc((thread_count - 1) * sizeof(pthread_t));
+        if (!threads)
+            err = RuckSackErrorNoMem;
+        for (; !err && started < thread_count - 1; started += 1) {
+            // if a thread does not start, the others take its attempts
+            if (pthread_create(&threads[started], NULL, search_attempts,
+                        &searchers[started + 1]))
+            {
+                break;
+            }
+        }
+    }
+    if (!err)
+        search_attempts(&searchers[0]);
+    for (int i = 0; i < started; i += 1)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(search.attempts);
+    for (int i = 0; i < SORT_BY_COUNT; i += 1)
+        free(search.orders[i]);
+    if (!searchers)
+        return err;
+
+    struct Searcher *winner = NULL;
+    for (int i = 0; i < thread_count; i += 1) {
+        struct Searcher *searcher = &searchers[i];
+        if (searcher->err)
+            err = searcher->err;
+        if (searcher->best_index != -1 && (!winner ||
+            is_better_packing(searcher->best_area, searcher->best.page_count,
+                searcher->best_index, winner->best_area, winner->best.page_count,
+                winner->best_index)))
+        {
+            winner = searcher;
+        }
+    }
+    if (!err && !winner)
+        err = RuckSackErrorCannotFit;
+    if (!err) {
+        *out_packing = winner->best;
+        memset(&winner->best, 0, sizeof(struct Packing));
+    }
+    for (int i = 0; i < thread_count; i += 1) {
+        free_packing(&searchers[i].best);
+        free_packing(&searchers[i].scratch);
+    }
+    free(searchers);
+    return err;
+}
 
-    // assigns x and y positions to all images
-    int err = do_maxrect_bssf(texture);
+// sets the size of each image to what gets packed. trimming is decided
+// here rather than when the images are added, so that the trim of the
+// texture can be set at any point before.
+static void trim_images(struct RuckSackTexturePrivate *p) {
+    for (int i = 0; i < p->images_count; i += 1) {
+        struct RuckSackImagePrivate *img = &p->images[i];
+        struct RuckSackImage *image = &img->externals;
+        if (image->trim || p->externals.trim) {
+            image->trim_x = img->opaque.x;
+            image->trim_y = img->opaque.y;
+            image->width = img->opaque.w;
+            image->height = img->opaque.h;
+        } else {
+            image->trim_x = 0;
+            image->trim_y = 0;
+            image->width = image->full_width;
+            image->height = image->full_height;
+        }
+    }
+}
+
+// the bottom left of the part of an image that gets packed. rows of
+// freeimage bitmaps go from the bottom up.
+static BYTE *packed_bits(struct RuckSackImagePrivate *img) {
+    struct RuckSackImage *image = &img->externals;
+    int bottom = image->full_height - image->trim_y - image->height;
+    return FreeImage_GetBits(img->bmp) + FreeImage_GetPitch(img->bmp) * bottom +
+        4 * image->trim_x;
+}
+
+// whether two images pack the same pixels, and can share their place
+static bool same_packed_pixels(struct RuckSackImagePrivate *a, struct RuckSackImagePrivate *b) {
+    struct RuckSackImage *image_a = &a->externals;
+    struct RuckSackImage *image_b = &b->externals;
+    if (a->visible_hash != b->visible_hash || a->force_r90 != b->force_r90 ||
+        image_a->width != image_b->width || image_a->height != image_b->height)
+    {
+        return false;
+    }
+    const BYTE *bits_a = packed_bits(a);
+    const BYTE *bits_b = packed_bits(b);
+    int pitch_a = FreeImage_GetPitch(a->bmp);
+    int pitch_b = FreeImage_GetPitch(b->bmp);
+    for (int y = 0; y < image_a->height; y += 1) {
+        if (memcmp(bits_a + pitch_a * y, bits_b + pitch_b * y, 4 * image_a->width) != 0)
+            return false;
+    }
+    return true;
+}
+
+struct HashedImage {
+    uint64_t hash;
+    int index;
+};
+
+static int compare_hashed_images(const void *a, const void *b) {
+    const struct HashedImage *hashed_a = a;
+    const struct HashedImage *hashed_b = b;
+    if (hashed_a->hash != hashed_b->hash)
+        return (hashed_a->hash < hashed_b->hash) ? -1 : 1;
+    return hashed_a->index - hashed_b->index;
+}
+
+// points each image at the first one with the same packed pixels, if it is
+// not the first itself. images with the same visible pixels hash the same
+// whether they are trimmed or not, so only those are compared.
+static int find_aliases(struct RuckSackTexturePrivate *p) {
+    struct HashedImage *hashed = malloc(p->images_count * sizeof(struct HashedImage) + 1);
+    if (!hashed)
+        return RuckSackErrorNoMem;
+    for (int i = 0; i < p->images_count; i += 1) {
+        p->images[i].alias = -1;
+        hashed[i].hash = p->images[i].visible_hash;
+        hashed[i].index = i;
+    }
+    qsort(hashed, p->images_count, sizeof(struct HashedImage), compare_hashed_images);
+    for (int i = 0; i < p->images_count; i += 1) {
+        struct RuckSackImagePrivate *img = &p->images[hashed[i].index];
+        for (int j = i - 1; j >= 0 && hashed[j].hash == hashed[i].hash; j -= 1) {
+            struct RuckSackImagePrivate *other = &p->images[hashed[j].index];
+            if (other->alias == -1 && same_packed_pixels(img, other)) {
+                img->alias = hashed[j].index;
+                break;
+            }
+        }
+    }
+    free(hashed);
+    return RuckSackErrorNone;
+}
+
+// assigns a page, x and y to all images
+static int pack_images(struct RuckSackTexture *texture) {
+    struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
+
+    trim_images(p);
+
+    // sort using a nice heuristic
+    qsort(p->images, p->images_count, sizeof(struct RuckSackImagePrivate), compare_images);
+
+    int err = find_aliases(p);
     if (err)
         return err;
 
-    // find the smallest power of 2 width/height
-    if (texture->pow2) {
-        p->width = next_pow2(p->width);
-        p->height = next_pow2(p->height);
+    // a single attempt runs on the calling thread
+    struct Packing packing;
+    memset(&packing, 0, sizeof(struct Packing));
+    err = search_attempts_in_parallel(texture, &packing);
+    if (err)
+        return err;
+
+    for (int i = 0; i < p->images_count; i += 1) {
+        struct RuckSackImage *image = &p->images[i].externals;
+        struct Spot *spot = &packing.spots[i];
+        image->x = spot->x;
+        image->y = spot->y;
+        image->page = spot->page;
+        image->r90 = spot->r90;
+    }
+    for (int i = 0; i < p->images_count; i += 1) {
+        struct RuckSackImagePrivate *img = &p->images[i];
+        if (img->alias == -1)
+            continue;
+        struct RuckSackImage *image = &img->externals;
+        struct RuckSackImage *shared = &p->images[img->alias].externals;
+        image->x = shared->x;
+        image->y = shared->y;
+        image->page = shared->page;
+        image->r90 = shared->r90;
+    }
+    p->page_count = packing.page_count;
+    p->width = packing.width;
+    p->height = packing.height;
+    free_packing(&packing);
+    return RuckSackErrorNone;
+}
+
+// RGBA8 pixels of a 32 bit bitmap, from the top row down
+static unsigned char *read_rgba(FIBITMAP *bmp) {
+    int width = FreeImage_GetWidth(bmp);
+    int height = FreeImage_GetHeight(bmp);
+    long pitch = 4L * width;
+    unsigned char *data = malloc(pitch * height);
+    if (!data)
+        return NULL;
+    for (int row = 0; row < height; row += 1) {
+        const BYTE *src = FreeImage_GetScanLine(bmp, height - 1 - row);
+        unsigned char *dest = &data[row * pitch];
+        for (int x = 0; x < width; x += 1) {
+            dest[0] = src[FI_RGBA_RED];
+            dest[1] = src[FI_RGBA_GREEN];
+            dest[2] = src[FI_RGBA_BLUE];
+            dest[3] = src[FI_RGBA_ALPHA];
+            src += 4;
+            dest += 4;
+        }
+    }
+    return data;
+}
+
+static FIBITMAP *bitmap_from_rgba(const unsigned char *rgba, int width, int height) {
+    FIBITMAP *bmp = FreeImage_Allocate(width, height, 32, 0, 0, 0);
+    if (!bmp)
+        return NULL;
+    for (int row = 0; row < height; row += 1) {
+        const unsigned char *src = &rgba[4L * width * row];
+        BYTE *dest = FreeImage_GetScanLine(bmp, height - 1 - row);
+        for (int x = 0; x < width; x += 1) {
+            dest[FI_RGBA_RED] = src[0];
+            dest[FI_RGBA_GREEN] = src[1];
+            dest[FI_RGBA_BLUE] = src[2];
+            dest[FI_RGBA_ALPHA] = src[3];
+            src += 4;
+            dest += 4;
+        }
+    }
+    return bmp;
+}
+
+static int encode_png(const unsigned char *rgba, int width, int height,
+        unsigned char **out_data, long *out_size)
+{
+    FIBITMAP *bmp = bitmap_from_rgba(rgba, width, height);
+    if (!bmp)
+        return RuckSackErrorNoMem;
+    FIMEMORY *stream = FreeImage_OpenMemory(NULL, 0);
+    if (!stream) {
+        FreeImage_Unload(bmp);
+        return RuckSackErrorNoMem;
+    }
+    BOOL saved = FreeImage_SaveToMemory(FIF_PNG, bmp, stream, 0);
+    FreeImage_Unload(bmp);
+    if (!saved) {
+        FreeImage_CloseMemory(stream);
+        return RuckSackErrorNoMem;
+    }
+    BYTE *data;
+    DWORD data_size;
+    FreeImage_AcquireMemory(stream, &data, &data_size);
+    *out_data = malloc(data_size);
+    if (!*out_data) {
+        FreeImage_CloseMemory(stream);
+        return RuckSackErrorNoMem;
+    }
+    memcpy(*out_data, data, data_size);
+    FreeImage_CloseMemory(stream);
+    *out_size = data_size;
+    return RuckSackErrorNone;
+}
+
+static int encode_blocks(int format, const unsigned char *rgba, int width, int height,
+        unsigned char **out_data, long *out_size)
+{
+    // the packer keeps the full size level a whole number of blocks in size,
+    // but the small mip levels are not. their last blocks repeat the edge.
+    int block_width = align_up(width, 4);
+    int block_height = align_up(height, 4);
+    unsigned char *padded = NULL;
+    if (block_width != width || block_height != height) {
+        padded = malloc(4L * block_width * block_height);
+        if (!padded)
+            return RuckSackErrorNoMem;
+        for (int y = 0; y < block_height; y += 1) {
+            const unsigned char *src = &rgba[4L * width * MIN(y, height - 1)];
+            unsigned char *dest = &padded[4L * block_width * y];
+            memcpy(dest, src, 4L * width);
+            for (int x = width; x < block_width; x += 1)
+                memcpy(&dest[4 * x], &src[4 * (width - 1)], 4);
+        }
+        rgba = padded;
+    }
+
+    long size = rucksack_bcn_size(format, block_width, block_height);
+    unsigned char *blocks = malloc(size);
+    if (!blocks) {
+        free(padded);
+        return RuckSackErrorNoMem;
+    }
+    int err = rucksack_bcn_encode(format, rgba, block_width, block_height, blocks, 0);
+    free(padded);
+    if (err) {
+        free(blocks);
+        return err;
+    }
+    *out_data = blocks;
+    *out_size = size;
+    return RuckSackErrorNone;
+}
+
+// one level of the atlas in the format the texture asks for. rgba holds its
+// pixels from the top row down, which is also how raw formats store them so
+// that they match the rows of the PNG.
+static int encode_level(struct RuckSackTexture *texture, const unsigned char *rgba,
+        int width, int height, unsigned char **out_data, long *out_size, long *out_pitch)
+{
+    switch (texture->format) {
+        case RuckSackTextureFormatPng:
+            *out_pitch = 0;
+            return encode_png(rgba, width, height, out_data, out_size);
+        case RuckSackTextureFormatRgba8:
+            *out_size = 4L * width * height;
+            *out_pitch = 4L * width;
+            *out_data = malloc(*out_size);
+            if (!*out_data)
+                return RuckSackErrorNoMem;
+            memcpy(*out_data, rgba, *out_size);
+            return RuckSackErrorNone;
+        default:
+            *out_pitch = rucksack_bcn_pitch(texture->format, width);
+            return encode_blocks(texture->format, rgba, width, height, out_data, out_size);
+    }
+}
+
+// the full size level and the mip levels below it, one after the other,
+// each starting at a multiple of PIXEL_DATA_ALIGNMENT
+static int encode_levels(struct RuckSackTexture *texture, unsigned char *rgba,
+        int width, int height, struct RuckSackTextureLevel *levels, int level_count,
+        unsigned char **out_data, long *out_size)
+{
+    // a chain from an int sized texture has fewer than 32 levels
+    unsigned char *level_data[32];
+    int err = RuckSackErrorNone;
+    int done = 0;
+    unsigned char *pixels = rgba;
+    for (; done < level_count; done += 1) {
+        struct RuckSackTextureLevel *level = &levels[done];
+        level->width = width;
+        level->height = height;
+        err = encode_level(texture, pixels, width, height, &level_data[done],
+                &level->size, &level->pitch);
+        if (err)
+            break;
+        if (done + 1 == level_count)
+            continue;
+        int next_width, next_height;
+        rucksack_mipmap_next_size(width, height, &next_width, &next_height);
+        unsigned char *next = malloc(4L * next_width * next_height);
+        if (!next) {
+            free(level_data[done]);
+            err = RuckSackErrorNoMem;
+            break;
+        }
+        rucksack_mipmap_downsample(pixels, width, height, next);
+        if (pixels != rgba)
+            free(pixels);
+        pixels = next;
+        width = next_width;
+        height = next_height;
+    }
+    if (pixels != rgba)
+        free(pixels);
+
+    if (!err && level_count == 1) {
+        levels[0].offset = 0;
+        *out_data = level_data[0];
+        *out_size = levels[0].size;
+        return RuckSackErrorNone;
     }
 
+    long total_size = 0;
+    for (int i = 0; i < done; i += 1) {
+        levels[i].offset = total_size;
+        total_size = (total_size + levels[i].size + PIXEL_DATA_ALIGNMENT - 1) &
+            ~(PIXEL_DATA_ALIGNMENT - 1);
+    }
+    unsigned char *data = err ? NULL : calloc(1, total_size);
+    if (!err && !data)
+        err = RuckSackErrorNoMem;
+    for (int i = 0; i < done; i += 1) {
+        if (!err)
+            memcpy(&data[levels[i].offset], level_data[i], levels[i].size);
+        free(level_data[i]);
+    }
+    if (err)
+        return err;
+    *out_data = data;
+    *out_size = levels[done - 1].offset + levels[done - 1].size;
+    return RuckSackErrorNone;
+}
+
+// draws the images of one page onto a bitmap of the page size and returns its
+// pixels from the top row down
+static unsigned char *compose_page(struct RuckSackTexturePrivate *p, int page) {
     // create the output picture
     FIBITMAP *out_bmp = FreeImage_Allocate(p->width, p->height, 32, 0, 0, 0);
     BYTE *out_bits = FreeImage_GetBits(out_bmp);
     int out_pitch = FreeImage_GetPitch(out_bmp);
 
-    // copy all the images to the final one
+    // copy the images of this page to the final one
     for (int i = 0; i < p->images_count; i += 1) {
         struct RuckSackImagePrivate *img = &p->images[i];
         struct RuckSackImage *image = &img->externals;
+        if (image->page != page || img->alias != -1)
+            continue;
 
-        // make sure the input picture is 32-bits
-        if (FreeImage_GetBPP(img->bmp) != 32) {
-            FIBITMAP *new_bmp = FreeImage_ConvertTo32Bits(img->bmp);
-            FreeImage_Unload(img->bmp);
-            img->bmp = new_bmp;
-        }
-
+        // the input picture was made 32-bits when it was added
         int img_pitch = FreeImage_GetPitch(img->bmp);
-        BYTE *img_bits = FreeImage_GetBits(img->bmp);
+        BYTE *img_bits = packed_bits(img);
         BYTE *out_bits_ptr = out_bits + out_pitch * image->y + 4 * image->x;
         if (image->r90) {
             for (int x = image->width - 1; x >= 0; x -= 1) {
@@ -481,67 +1615,266 @@ int rucksack_bundle_add_texture(struct RuckSackBundle *bundle, struct RuckSackTe
         }
     }
 
-    // write it to a memory buffer
-    FIMEMORY *out_stream = FreeImage_OpenMemory(NULL, 0);
-    FreeImage_SaveToMemory(FIF_PNG, out_bmp, out_stream, 0);
+    unsigned char *rgba = read_rgba(out_bmp);
     FreeImage_Unload(out_bmp);
+    return rgba;
+}
 
-    BYTE *data;
-    DWORD data_size;
-    FreeImage_AcquireMemory(out_stream, &data, &data_size);
+// compresses the pixel data when it is worth it, the same way
+// rucksack_bundle_add_files decides for files
+static int compress_atlas(int compression, unsigned char **data, long *size,
+        int *out_codec)
+{
+    *out_codec = RuckSackCompressionNone;
+    int codec = compression;
+    if (codec == RuckSackCompressionAuto)
+        codec = rucksack_codec_choose(*data, *size);
+    if (codec == RuckSackCompressionNone)
+        return RuckSackErrorNone;
+    if (!rucksack_codec_available(codec))
+        return RuckSackErrorCompressionUnsupported;
+
+    unsigned char *compressed;
+    long compressed_size;
+    int err = rucksack_codec_compress(codec, *data, *size, &compressed, &compressed_size);
+    if (err || !compressed)
+        return err;
+    if (compressed_size >= *size - *size / 16) {
+        free(compressed);
+        return RuckSackErrorNone;
+    }
+    free(*data);
+    *data = compressed;
+    *size = compressed_size;
+    *out_codec = codec;
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_add_texture(struct RuckSackBundle *bundle, struct RuckSackTexture *texture)
+{
+    struct RuckSackTexturePrivate *p = (struct RuckSackTexturePrivate *) texture;
+
+    if (texture->format < RuckSackTextureFormatPng ||
+        texture->format > RuckSackTextureFormatBc7)
+    {
+        return RuckSackErrorTextureFormat;
+    }
+    if (texture->compression < RuckSackCompressionNone ||
+        texture->compression > RuckSackCompressionAuto)
+    {
+        return RuckSackErrorCompressionUnsupported;
+    }
+    if (texture->packing < RuckSackPackingShortSideFit ||
+        texture->packing > RuckSackPackingBest ||
+        texture->sort_by < RuckSackSortByMaxSide ||
+        texture->sort_by > RuckSackSortByHeight)
+    {
+        return RuckSackErrorInvalidPacking;
+    }
+
+    int err = pack_images(texture);
+    if (err)
+        return err;
+
+    // find the smallest power of 2 width/height
+    if (texture->pow2) {
+        p->width = next_pow2(p->width);
+        p->height = next_pow2(p->height);
+    }
+
+    int full_count = rucksack_mipmap_full_count(p->width, p->height);
+    int level_count = texture->mip_levels;
+    if (level_count <= 0 || level_count > full_count)
+        level_count = full_count;
+    long page_count = p->page_count;
+    long level_total = page_count * level_count;
+    struct RuckSackTextureLevel *levels = calloc(level_total,
+            sizeof(struct RuckSackTextureLevel));
+    if (!levels)
+        return RuckSackErrorNoMem;
+
+    // the pages follow each other, each starting aligned like the first
+    unsigned char *data = NULL;
+    long data_size = 0;
+    for (long page = 0; page < page_count; page += 1) {
+        unsigned char *rgba = compose_page(p, page);
+        if (!rgba) {
+            err = RuckSackErrorNoMem;
+            break;
+        }
+        struct RuckSackTextureLevel *page_levels = &levels[page * level_count];
+        unsigned char *page_data;
+        long page_size;
+        err = encode_levels(texture, rgba, p->width, p->height, page_levels, level_count,
+                &page_data, &page_size);
+        free(rgba);
+        if (err)
+            break;
+        if (page == 0) {
+            data = page_data;
+            data_size = page_size;
+            continue;
+        }
+        long base = (data_size + PIXEL_DATA_ALIGNMENT - 1) & ~(PIXEL_DATA_ALIGNMENT - 1);
+        unsigned char *new_data = realloc(data, base + page_size);
+        if (!new_data) {
+            free(page_data);
+            err = RuckSackErrorNoMem;
+            break;
+        }
+        data = new_data;
+        memset(&data[data_size], 0, base - data_size);
+        memcpy(&data[base], page_data, page_size);
+        free(page_data);
+        data_size = base + page_size;
+        for (int i = 0; i < level_count; i += 1)
+            page_levels[i].offset += base;
+    }
+    if (err) {
+        free(levels);
+        free(data);
+        return err;
+    }
+    long pixel_size = data_size;
+    int compression;
+    err = compress_atlas(texture->compression, &data, &data_size, &compression);
+    if (err) {
+        free(levels);
+        free(data);
+        return err;
+    }
 
     // calculate the total size needed by the texture and texture coordinates
     // and calculate the offsets needed
-    long total_image_entries_size = 0;
-    for (int i = 0; i < p->images_count; i += 1) {
+    long count = p->images_count;
+    long slot_count = key_table_slot_count(count);
+    long keys_size = 0;
+    for (int i = 0; i < count; i += 1) {
         struct RuckSackImagePrivate *img = &p->images[i];
         struct RuckSackImage *image = &img->externals;
-        total_image_entries_size += IMAGE_HEADER_LEN + image->key_size;
+        keys_size += image->key_size + 1;
     }
-    long image_data_offset = TEXTURE_HEADER_LEN + total_image_entries_size;
+    // the trim table is left out when nothing was trimmed
+    bool has_trims = texture->trim;
+    for (int i = 0; i < count; i += 1)
+        has_trims = has_trims || p->images[i].externals.trim;
+    long levels_offset = TEXTURE_HEADER_LEN_V2;
+    long sprites_offset = levels_offset + level_total * TEXTURE_LEVEL_LEN;
+    long trims_offset = sprites_offset + count * SPRITE_LEN;
+    long slots_offset = trims_offset + (has_trims ? count * SPRITE_TRIM_LEN : 0);
+    long keys_offset = slots_offset + slot_count * SPRITE_SLOT_LEN;
+    // raw pixels are uploaded from where they are, so they start aligned
+    long image_data_offset = (keys_offset + keys_size + PIXEL_DATA_ALIGNMENT - 1) &
+        ~(PIXEL_DATA_ALIGNMENT - 1);
     long total_size = image_data_offset + data_size;
 
-    struct RuckSackOutStream *stream;
-    err = rucksack_bundle_add_stream(bundle, texture->key, texture->key_size, total_size, &stream);
-    if (err)
-        return err;
-
-    unsigned char buf[MAX(TEXTURE_HEADER_LEN, IMAGE_HEADER_LEN)];
-    memcpy(&buf[0], TEXTURE_UUID, UUID_SIZE);
-    write_uint32be(&buf[16], image_data_offset);
-    write_uint32be(&buf[20], p->images_count);
-    write_uint32be(&buf[24], TEXTURE_HEADER_LEN);
-    write_uint32be(&buf[28], texture->max_width);
-    write_uint32be(&buf[32], texture->max_height);
-    buf[36] = texture->pow2;
-    buf[37] = texture->allow_r90;
-
-    err = rucksack_stream_write(stream, buf, TEXTURE_HEADER_LEN);
-    if (err)
-        return err;
+    // the metadata is written in one piece. calloc takes care of the padding
+    // and the 0 byte after each key.
+    unsigned char *meta = calloc(1, image_data_offset);
+    uint32_t *slots = malloc(slot_count * SPRITE_SLOT_LEN + 1);
+    if (!meta || !slots) {
+        free(meta);
+        free(slots);
+        free(levels);
+        free(data);
+        return RuckSackErrorNoMem;
+    }
+    memset(slots, 0xff, slot_count * SPRITE_SLOT_LEN);
+
+    memcpy(&meta[0], TEXTURE_UUID, UUID_SIZE);
+    write_uint32be(&meta[16], image_data_offset);
+    write_uint32be(&meta[20], count);
+    write_uint32be(&meta[24], sprites_offset);
+    write_uint32be(&meta[28], texture->max_width);
+    write_uint32be(&meta[32], texture->max_height);
+    meta[36] = texture->pow2;
+    meta[37] = texture->allow_r90;
+    meta[38] = texture->smallest_size;
+    meta[39] = texture->compression;
+    write_uint32be(&meta[40], TEXTURE_VERSION);
+    write_uint32be(&meta[44], slots_offset);
+    write_uint32be(&meta[48], slot_count);
+    write_uint32be(&meta[52], keys_offset);
+    write_uint32be(&meta[56], texture->format);
+    write_uint32be(&meta[60], compression);
+    write_uint32be(&meta[64], pixel_size >> 32);
+    write_uint32be(&meta[68], pixel_size & 0xffffffff);
+    write_uint32be(&meta[72], p->width);
+    write_uint32be(&meta[76], p->height);
+    write_uint32be(&meta[80], level_count);
+    write_uint32be(&meta[84], levels_offset);
+    write_uint32be(&meta[88], page_count);
+    meta[92] = texture->packing;
+    meta[93] = texture->sort_by;
+    meta[94] = texture->trim;
+    meta[95] = has_trims;
+
+    for (long i = 0; i < level_total; i += 1) {
+        unsigned char *buf = &meta[levels_offset + i * TEXTURE_LEVEL_LEN];
+        struct RuckSackTextureLevel *level = &levels[i];
+        write_uint32be(&buf[0], (uint64_t)level->offset >> 32);
+        write_uint32be(&buf[4], level->offset & 0xffffffff);
+        write_uint32be(&buf[8], (uint64_t)level->size >> 32);
+        write_uint32be(&buf[12], level->size & 0xffffffff);
+        write_uint32be(&buf[16], level->width);
+        write_uint32be(&buf[20], level->height);
+        write_uint32be(&buf[24], level->pitch);
+    }
+    free(levels);
 
-    for (int i = 0; i < p->images_count; i += 1) {
+    long key_pos = 0;
+    for (int i = 0; i < count; i += 1) {
         struct RuckSackImagePrivate *img = &p->images[i];
         struct RuckSackImage *image = &img->externals;
+        unsigned char *buf = &meta[sprites_offset + i * SPRITE_LEN];
+
+        write_uint32le(&buf[0], image->x);
+        write_uint32le(&buf[4], image->y);
+        write_uint32le(&buf[8], image->width);
+        write_uint32le(&buf[12], image->height);
+        write_float32le(&buf[16], image->anchor_x);
+        write_float32le(&buf[20], image->anchor_y);
+        write_uint32le(&buf[24], key_pos);
+        write_uint32le(&buf[28], image->key_size);
+        buf[32] = image->anchor;
+        buf[33] = image->r90;
+        buf[34] = image->page & 0xff;
+        buf[35] = image->page >> 8;
+
+        if (image->trim || texture->trim) {
+            buf = &meta[trims_offset + i * SPRITE_TRIM_LEN];
+            write_uint32le(&buf[0], image->trim_x);
+            write_uint32le(&buf[4], image->trim_y);
+            write_uint32le(&buf[8], image->full_width);
+            write_uint32le(&buf[12], image->full_height);
+        }
 
-        write_uint32be(&buf[0], IMAGE_HEADER_LEN + image->key_size);
-        write_uint32be(&buf[4], image->anchor);
-        write_float32be(&buf[8], image->anchor_x);
-        write_float32be(&buf[12], image->anchor_y);
-        write_uint32be(&buf[16], image->x);
-        write_uint32be(&buf[20], image->y);
-        write_uint32be(&buf[24], image->width);
-        write_uint32be(&buf[28], image->height);
-        buf[32] = image->r90;
-        write_uint32be(&buf[33], image->key_size);
-
-        err = rucksack_stream_write(stream, buf, IMAGE_HEADER_LEN);
-        if (err)
-            return err;
+        memcpy(&meta[keys_offset + key_pos], image->key, image->key_size);
+        sprite_slot_insert(slots, slot_count, hash_key(image->key, image->key_size), i);
+        key_pos += image->key_size + 1;
+    }
+    for (long i = 0; i < slot_count * 2; i += 1)
+        write_uint32le(&meta[slots_offset + i * 4], slots[i]);
+    free(slots);
+
+    // readers use the sprite table and the pixels in place, which needs
+    // them to be aligned
+    long alignment = (rucksack_bundle_alignment(bundle) < PIXEL_DATA_ALIGNMENT) ?
+        PIXEL_DATA_ALIGNMENT : 0;
+    struct RuckSackOutStream *stream;
+    err = rucksack_bundle_add_stream_aligned(bundle, texture->key, texture->key_size,
+            total_size, alignment, &stream);
+    if (err) {
+        free(meta);
+        free(data);
+        return err;
+    }
 
-        err = rucksack_stream_write(stream, image->key, image->key_size);
-        if (err)
-            return err;
+    err = rucksack_stream_write(stream, meta, image_data_offset);
+    free(meta);
+    if (err) {
+        free(data);
+        return err;
     }
 
     // make sure that the position that we told we were about to write the
@@ -549,11 +1882,11 @@ int rucksack_bundle_add_texture(struct RuckSackBundle *bundle, struct RuckSackTe
     assert(image_data_offset == stream->e->size);
 
     err = rucksack_stream_write(stream, data, data_size);
+    free(data);
     if (err)
         return err;
 
     rucksack_stream_close(stream);
-    FreeImage_CloseMemory(out_stream);
 
     return RuckSackErrorNone;
 }
@@ -569,6 +1902,10 @@ struct RuckSackTexture *rucksack_texture_create(void) {
     texture->max_height = 1024;
     texture->pow2 = 1;
     texture->allow_r90 = 1;
+    texture->format = RuckSackTextureFormatPng;
+    texture->compression = RuckSackCompressionNone;
+    texture->mip_levels = 1;
+    texture->max_pages = 1;
     return texture;
 }
 
@@ -580,11 +1917,11 @@ void rucksack_texture_destroy(struct RuckSackTexture *texture) {
     for (int i = 0; i < t->images_count; i += 1) {
         struct RuckSackImagePrivate *img = &t->images[i];
         struct RuckSackImage *image = &img->externals;
-        free(image->key);
+        // the key was copied when the image was added
+        free((char *)image->key);
         FreeImage_Unload(img->bmp);
     }
     free(t->images);
-    free(t->free_positions);
     free(t);
     FreeImage_DeInitialise();
 }
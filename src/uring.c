@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+// for syscall()
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+// the kernel takes a 32 bit length. longer reads complete short and the
+// caller submits the rest.
+static const size_t MAX_READ_SIZE = 1 << 30;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int rucksack_uring_init(struct RuckSackUring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(struct RuckSackUring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -errno;
+
+    // IORING_OP_READ arrived in the same kernel as this feature flag
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return -ENOSYS;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        int err = -errno;
+        close(ring->fd);
+        return err;
+    }
+
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            int err = -errno;
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return err;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int err = -errno;
+        if (!single_mmap)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return err;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    ring->capacity = params.cq_entries;
+
+    return 0;
+}
+
+void rucksack_uring_destroy(struct RuckSackUring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+int rucksack_uring_read(struct RuckSackUring *ring, int fd, void *buf,
+        size_t size, long offset, void *user_data)
+{
+    // we submit every entry right away, so the submission queue always has
+    // room as long as the caller respects ring->capacity
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (size > MAX_READ_SIZE) ? MAX_READ_SIZE : size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;) {
+        int ret = io_uring_enter(ring->fd, 1, 0, 0);
+        if (ret >= 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+
+        // take the entry back if the kernel did not consume it, so that it
+        // does not write to buf after we report failure
+        int err = -errno;
+        if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail)
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        return err;
+    }
+}
+
+int rucksack_uring_reap(struct RuckSackUring *ring, void **user_data, int *result) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe *cqe = &((struct io_uring_cqe *)ring->cqes)[head & ring->cq_mask];
+    *user_data = (void *)(uintptr_t)cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int rucksack_uring_wait(struct RuckSackUring *ring) {
+    for (;;) {
+        int ret = io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret >= 0)
+            return 0;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
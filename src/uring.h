@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_URING_H_INCLUDED
+#define RUCKSACK_URING_H_INCLUDED
+
+// a minimal io_uring wrapper that only knows how to read. only one thread
+// may use a ring at a time.
+
+#include <stddef.h>
+
+struct RuckSackUring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    void *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    void *cqes;
+
+    // how many reads can be in flight without overflowing the completion
+    // queue
+    unsigned capacity;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// returns 0 on success or a negative errno value, for example when the
+// kernel does not support io_uring
+int rucksack_uring_init(struct RuckSackUring *ring, unsigned entries);
+void rucksack_uring_destroy(struct RuckSackUring *ring);
+
+// queues and submits a read. the caller must keep fewer than ring->capacity
+// reads in flight. returns 0 or a negative errno value.
+int rucksack_uring_read(struct RuckSackUring *ring, int fd, void *buf,
+        size_t size, long offset, void *user_data);
+
+// pops one completion. returns 0 if there was none, otherwise 1 with
+// the read's user_data and result, which is the byte count or a negative
+// errno value.
+int rucksack_uring_reap(struct RuckSackUring *ring, void **user_data, int *result);
+
+// blocks until at least one completion is available
+int rucksack_uring_wait(struct RuckSackUring *ring);
+
+#endif /* RUCKSACK_URING_H_INCLUDED */
@@ -12,8 +12,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <FreeImage.h>
 
 static void ok(int err) {
@@ -169,6 +172,16 @@ static void test_texture_packing(void) {
     assert(got_them[2]);
     assert(got_them[3]);
 
+    struct RuckSackImage *found = rucksack_texture_find_image(texture, "image2", -1);
+    assert(found);
+    assert(strcmp(found->key, "image2") == 0);
+    assert(found->anchor == RuckSackAnchorRight);
+    found = rucksack_texture_find_image(texture, "image0_and_more", 6);
+    assert(found);
+    assert(found->anchor == RuckSackAnchorExplicit);
+    assert(!rucksack_texture_find_image(texture, "image", -1));
+    assert(!rucksack_texture_find_image(texture, "image4", -1));
+
     long texture_size = rucksack_texture_size(texture);
     unsigned char *buffer = malloc(texture_size);
     assert(buffer);
@@ -324,6 +337,9 @@ static void test_non_default_texture_props(void) {
     texture->max_height = 128;
     texture->pow2 = 0;
     texture->allow_r90 = 0;
+    texture->smallest_size = 1;
+    texture->packing = RuckSackPackingContactPoint;
+    texture->sort_by = RuckSackSortByArea;
 
     struct RuckSackImage *img = rucksack_image_create();
     assert(img);
@@ -352,6 +368,9 @@ static void test_non_default_texture_props(void) {
     assert(texture->max_height == 128);
     assert(texture->pow2 == 0);
     assert(texture->allow_r90 == 0);
+    assert(texture->smallest_size == 1);
+    assert(texture->packing == RuckSackPackingContactPoint);
+    assert(texture->sort_by == RuckSackSortByArea);
 
     rucksack_texture_close(texture);
 
@@ -427,6 +446,2531 @@ static void test_delete_from_bundle(void) {
     ok(rucksack_bundle_close(bundle));
 }
 
+static void test_open_mmap(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+
+    // file backed bundles have no memory to point into
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    assert(rucksack_file_data_ptr(entry) == NULL);
+
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+    entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == 10);
+    const unsigned char *ptr = rucksack_file_data_ptr(entry);
+    assert(ptr);
+    assert(memcmp(ptr, "aoeu\n1234\n", 10) == 0);
+
+    entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    long size = rucksack_file_size(entry);
+    unsigned char *buffer = malloc(size);
+    ok(rucksack_file_read(entry, buffer));
+    ptr = rucksack_file_data_ptr(entry);
+    assert(ptr);
+    assert(memcmp(ptr, buffer, size) == 0);
+    free(buffer);
+
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_many_entries(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const int count = 2000;
+    char key[32];
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < count; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, -1, sizeof(int), &stream));
+        ok(rucksack_stream_write(stream, &i, sizeof(int)));
+        rucksack_stream_close(stream);
+    }
+
+    // delete every third entry
+    for (int i = 0; i < count; i += 3) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        ok(rucksack_bundle_delete_file(bundle, key, -1));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == count - (count + 2) / 3);
+    for (int i = 0; i < count; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+        if (i % 3 == 0) {
+            assert(!entry);
+            continue;
+        }
+        assert(entry);
+        assert(rucksack_file_size(entry) == sizeof(int));
+        int value;
+        ok(rucksack_file_read(entry, (unsigned char *)&value));
+        assert(value == i);
+    }
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_long_keys(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    // keys much longer than average make the header region bigger than the
+    // initial guess used when reading it
+    char key[1024];
+    memset(key, 'k', sizeof(key) - 1);
+    key[sizeof(key) - 1] = 0;
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, key, -1, "../test/blah.txt"));
+    key[0] = 'x';
+    ok(rucksack_bundle_add_file(bundle, key, -1, "../test/globby/globby1.txt"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    assert(rucksack_file_name_size(entry) == sizeof(key) - 1);
+    key[0] = 'k';
+    entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == 10);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static struct RuckSackBundle *concurrent_bundle;
+
+static void *concurrent_reader(void *arg) {
+    char key[32];
+    for (int round = 0; round < 20; round += 1) {
+        for (int i = 0; i < 100; i += 1) {
+            snprintf(key, sizeof(key), "entry%d", i);
+            struct RuckSackFileEntry *entry = rucksack_bundle_find_file(concurrent_bundle, key, -1);
+            assert(entry);
+            int values[64];
+            assert(rucksack_file_size(entry) == sizeof(values));
+            ok(rucksack_file_read(entry, (unsigned char *)values));
+            for (int j = 0; j < 64; j += 1)
+                assert(values[j] == i * 64 + j);
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent_reads(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    char key[32];
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 100; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        int values[64];
+        for (int j = 0; j < 64; j += 1)
+            values[j] = i * 64 + j;
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, -1, sizeof(values), &stream));
+        ok(rucksack_stream_write(stream, values, sizeof(values)));
+        rucksack_stream_close(stream);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &concurrent_bundle));
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i += 1)
+        assert(pthread_create(&threads[i], NULL, concurrent_reader, NULL) == 0);
+    for (int i = 0; i < 4; i += 1)
+        assert(pthread_join(threads[i], NULL) == 0);
+    ok(rucksack_bundle_close(concurrent_bundle));
+}
+
+static void test_read_range(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    long size = rucksack_file_size(entry);
+    unsigned char *whole = malloc(size);
+    ok(rucksack_file_read(entry, whole));
+
+    unsigned char window[4096];
+    for (long offset = 0; offset < size; offset += sizeof(window)) {
+        long length = size - offset;
+        if (length > (long)sizeof(window))
+            length = sizeof(window);
+        ok(rucksack_file_read_range(entry, offset, length, window));
+        assert(memcmp(window, whole + offset, length) == 0);
+    }
+    ok(rucksack_file_read_range(entry, size, 0, window));
+    assert(rucksack_file_read_range(entry, size - 10, 11, window) == RuckSackErrorInvalidRange);
+    assert(rucksack_file_read_range(entry, -1, 1, window) == RuckSackErrorInvalidRange);
+
+    free(whole);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static int async_reads_done;
+
+static void check_async_read(struct RuckSackFileEntry *entry, unsigned char *buffer,
+        int err, void *userdata)
+{
+    ok(err);
+    int i = (int)(intptr_t)userdata;
+    int *values = (int *)buffer;
+    assert(rucksack_file_size(entry) == 64 * sizeof(int));
+    for (int j = 0; j < 64; j += 1)
+        assert(values[j] == i * 64 + j);
+    async_reads_done += 1;
+}
+
+static void read_all_async(struct RuckSackBundle *bundle, int entry_count, int use_poll) {
+    struct RuckSackReadQueue *queue;
+    ok(rucksack_read_queue_create(bundle, 0, &queue));
+    int *buffers = malloc(entry_count * 64 * sizeof(int));
+    assert(buffers);
+
+    char key[32];
+    async_reads_done = 0;
+    for (int i = 0; i < entry_count; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+        assert(entry);
+        ok(rucksack_read_async(queue, entry, (unsigned char *)&buffers[i * 64],
+                    check_async_read, (void *)(intptr_t)i));
+    }
+    if (use_poll) {
+        while (async_reads_done < entry_count)
+            rucksack_read_queue_poll(queue);
+    } else {
+        ok(rucksack_read_queue_wait(queue));
+    }
+    assert(async_reads_done == entry_count);
+    rucksack_read_queue_destroy(queue);
+    free(buffers);
+}
+
+static void test_read_async(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    char key[32];
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 300; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        int values[64];
+        for (int j = 0; j < 64; j += 1)
+            values[j] = i * 64 + j;
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, -1, sizeof(values), &stream));
+        ok(rucksack_stream_write(stream, values, sizeof(values)));
+        rucksack_stream_close(stream);
+    }
+    // the data has not been flushed yet
+    read_all_async(bundle, 300, 0);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    read_all_async(bundle, 300, 0);
+    read_all_async(bundle, 300, 1);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    read_all_async(bundle, 300, 0);
+    read_all_async(bundle, 300, 1);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_read_many(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    char key[32];
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 200; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        int values[64];
+        for (int j = 0; j < 64; j += 1)
+            values[j] = i * 64 + j;
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, -1, sizeof(values), &stream));
+        ok(rucksack_stream_write(stream, values, sizeof(values)));
+        rucksack_stream_close(stream);
+    }
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+
+    for (int pass = 0; pass < 2; pass += 1) {
+        if (pass == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+        // ask in reverse order, with one entry twice and a big one in the middle
+        struct RuckSackFileEntry *entries[202];
+        unsigned char *buffers[202];
+        for (int i = 0; i < 200; i += 1) {
+            snprintf(key, sizeof(key), "entry%d", 199 - i);
+            entries[i] = rucksack_bundle_find_file(bundle, key, -1);
+            assert(entries[i]);
+        }
+        entries[200] = entries[0];
+        entries[201] = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+        assert(entries[201]);
+        for (int i = 0; i < 202; i += 1) {
+            buffers[i] = malloc(rucksack_file_size(entries[i]));
+            assert(buffers[i]);
+        }
+
+        ok(rucksack_bundle_read_many(bundle, entries, buffers, 202));
+
+        for (int i = 0; i < 200; i += 1) {
+            int *values = (int *)buffers[i];
+            for (int j = 0; j < 64; j += 1)
+                assert(values[j] == (199 - i) * 64 + j);
+        }
+        assert(memcmp(buffers[0], buffers[200], 64 * sizeof(int)) == 0);
+        long monkey_size = rucksack_file_size(entries[201]);
+        unsigned char *monkey = malloc(monkey_size);
+        ok(rucksack_file_read(entries[201], monkey));
+        assert(memcmp(monkey, buffers[201], monkey_size) == 0);
+        free(monkey);
+
+        for (int i = 0; i < 202; i += 1)
+            free(buffers[i]);
+        ok(rucksack_bundle_close(bundle));
+    }
+}
+
+static unsigned char *read_whole_file(const char *path, long *size) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    struct stat st;
+    assert(fstat(fileno(f), &st) == 0);
+    *size = st.st_size;
+    unsigned char *data = malloc(*size);
+    assert(data);
+    assert(fread(data, 1, *size, f) == *size);
+    fclose(f);
+    return data;
+}
+
+static void check_entry_contents(struct RuckSackFileEntry *entry,
+        const unsigned char *expected, long expected_size)
+{
+    assert(rucksack_file_size(entry) == expected_size);
+    unsigned char *buffer = malloc(expected_size);
+    assert(buffer);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, expected, expected_size) == 0);
+    if (expected_size >= 150) {
+        ok(rucksack_file_read_range(entry, 100, 50, buffer));
+        assert(memcmp(buffer, expected + 100, 50) == 0);
+        // past everything that gets decompressed in one go
+        ok(rucksack_file_read_range(entry, expected_size - 50, 50, buffer));
+        assert(memcmp(buffer, expected + expected_size - 50, 50) == 0);
+    }
+    free(buffer);
+}
+
+static void count_async_read(struct RuckSackFileEntry *entry, unsigned char *buffer,
+        int err, void *userdata)
+{
+    ok(err);
+    async_reads_done += 1;
+}
+
+static void test_compression(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    long monkey_size;
+    unsigned char *monkey = read_whole_file("../test/monkey.obj", &monkey_size);
+
+    // bytes that look random should be left alone
+    const char *random_name = "random.bin";
+    unsigned char random_bytes[8192];
+    uint32_t x = 12345;
+    for (int i = 0; i < (int)sizeof(random_bytes); i += 1) {
+        x = x * 1103515245 + 12345;
+        random_bytes[i] = x >> 24;
+    }
+    FILE *f = fopen(random_name, "wb");
+    assert(f);
+    assert(fwrite(random_bytes, 1, sizeof(random_bytes), f) == sizeof(random_bytes));
+    fclose(f);
+
+    const char *keys[] = {"none", "deflate", "lz4", "zstd", "auto"};
+    int codecs[] = {
+        RuckSackCompressionNone,
+        RuckSackCompressionDeflate,
+        RuckSackCompressionLz4,
+        RuckSackCompressionZstd,
+        RuckSackCompressionAuto,
+    };
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 5; i += 1) {
+        int err = rucksack_bundle_add_file_compressed(bundle, keys[i], -1,
+                "../test/monkey.obj", codecs[i]);
+        if (codecs[i] != RuckSackCompressionAuto && !rucksack_compression_available(codecs[i])) {
+            assert(err == RuckSackErrorCompressionUnsupported);
+            continue;
+        }
+        ok(err);
+    }
+    ok(rucksack_bundle_add_file_compressed(bundle, "random", -1, random_name,
+                RuckSackCompressionAuto));
+
+    // many files at once, compressed in parallel
+    struct RuckSackFileSource sources[40];
+    char source_keys[40][16];
+    for (int i = 0; i < 40; i += 1) {
+        snprintf(source_keys[i], sizeof(source_keys[i]), "many%d", i);
+        sources[i].key = source_keys[i];
+        sources[i].key_size = -1;
+        sources[i].path = (i % 2) ? "../test/monkey.obj" : random_name;
+        sources[i].compression = RuckSackCompressionAuto;
+        sources[i].alignment = 0;
+    }
+    ok(rucksack_bundle_add_files(bundle, sources, 40, 4, NULL));
+    ok(rucksack_bundle_close(bundle));
+
+    for (int pass = 0; pass < 2; pass += 1) {
+        if (pass == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+        for (int i = 0; i < 5; i += 1) {
+            struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+            if (codecs[i] != RuckSackCompressionAuto && !rucksack_compression_available(codecs[i])) {
+                assert(!entry);
+                continue;
+            }
+            assert(entry);
+            if (codecs[i] != RuckSackCompressionAuto)
+                assert(rucksack_file_compression(entry) == codecs[i]);
+            if (rucksack_file_compression(entry) != RuckSackCompressionNone) {
+                assert(rucksack_file_stored_size(entry) < monkey_size);
+                assert(!rucksack_file_data_ptr(entry));
+            }
+            check_entry_contents(entry, monkey, monkey_size);
+
+            int is_texture;
+            ok(rucksack_file_is_texture(entry, &is_texture));
+            assert(!is_texture);
+        }
+
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "random", -1);
+        assert(entry);
+        assert(rucksack_file_compression(entry) == RuckSackCompressionNone);
+        check_entry_contents(entry, random_bytes, sizeof(random_bytes));
+
+        struct RuckSackFileEntry *entries[40];
+        unsigned char *buffers[40];
+        for (int i = 0; i < 40; i += 1) {
+            entries[i] = rucksack_bundle_find_file(bundle, source_keys[i], -1);
+            assert(entries[i]);
+            buffers[i] = malloc(rucksack_file_size(entries[i]));
+            assert(buffers[i]);
+        }
+        ok(rucksack_bundle_read_many(bundle, entries, buffers, 40));
+
+        // async reads decompress too
+        unsigned char *async_buffers[40];
+        struct RuckSackReadQueue *queue;
+        ok(rucksack_read_queue_create(bundle, 2, &queue));
+        async_reads_done = 0;
+        for (int i = 0; i < 40; i += 1) {
+            async_buffers[i] = malloc(rucksack_file_size(entries[i]));
+            assert(async_buffers[i]);
+            ok(rucksack_read_async(queue, entries[i], async_buffers[i],
+                        count_async_read, NULL));
+        }
+        ok(rucksack_read_queue_wait(queue));
+        assert(async_reads_done == 40);
+        rucksack_read_queue_destroy(queue);
+
+        for (int i = 0; i < 40; i += 1) {
+            assert(memcmp(async_buffers[i], buffers[i], rucksack_file_size(entries[i])) == 0);
+            free(async_buffers[i]);
+            if (i % 2) {
+                assert(rucksack_file_size(entries[i]) == monkey_size);
+                assert(memcmp(buffers[i], monkey, monkey_size) == 0);
+            } else {
+                assert(rucksack_file_size(entries[i]) == sizeof(random_bytes));
+                assert(memcmp(buffers[i], random_bytes, sizeof(random_bytes)) == 0);
+            }
+            free(buffers[i]);
+        }
+        ok(rucksack_bundle_close(bundle));
+    }
+
+    free(monkey);
+    remove(random_name);
+}
+
+static void test_read_version_1(void) {
+    // a version 1 bundle with a single entry "a" containing "hello"
+    unsigned char data[70];
+    memset(data, 0, sizeof(data));
+    memcpy(data, "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20", 16);
+    data[19] = 1; // version
+    data[23] = 28; // first header offset
+    data[27] = 1; // entry count
+    unsigned char *entry_buf = &data[28];
+    entry_buf[3] = 37; // entry size
+    entry_buf[11] = 65; // offset
+    entry_buf[19] = 5; // size
+    entry_buf[27] = 5; // allocated size
+    entry_buf[35] = 1; // key size
+    entry_buf[36] = 'a';
+    memcpy(&data[65], "hello", 5);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open_read_mem(data, sizeof(data), &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "a", -1);
+    assert(entry);
+    assert(rucksack_file_compression(entry) == RuckSackCompressionNone);
+    check_entry_contents(entry, (const unsigned char *)"hello", 5);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_in_stream(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    // about 1MB of compressible text, big enough to take several chunks
+    const char *big_name = "big.txt";
+    long big_size = 0;
+    FILE *f = fopen(big_name, "wb");
+    assert(f);
+    for (int i = 0; i < 40000; i += 1)
+        big_size += fprintf(f, "line %d of a big file\n", i);
+    fclose(f);
+    long expected_size;
+    unsigned char *expected = read_whole_file(big_name, &expected_size);
+    assert(expected_size == big_size);
+
+    const char *keys[] = {"none", "deflate", "lz4", "zstd"};
+    int codecs[] = {
+        RuckSackCompressionNone,
+        RuckSackCompressionDeflate,
+        RuckSackCompressionLz4,
+        RuckSackCompressionZstd,
+    };
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 4; i += 1) {
+        if (rucksack_compression_available(codecs[i]))
+            ok(rucksack_bundle_add_file_compressed(bundle, keys[i], -1, big_name, codecs[i]));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    unsigned char *buffer = malloc(256 * 1024);
+    assert(buffer);
+    long chunk_sizes[] = {1, 1000, 256 * 1024};
+    for (int pass = 0; pass < 2; pass += 1) {
+        if (pass == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+        for (int i = 0; i < 4; i += 1) {
+            if (!rucksack_compression_available(codecs[i]))
+                continue;
+            struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+            assert(entry);
+            assert(rucksack_file_compression(entry) == codecs[i]);
+            for (int j = 0; j < 3; j += 1) {
+                struct RuckSackInStream *stream;
+                ok(rucksack_file_open_stream(entry, &stream));
+                long pos = 0;
+                // reading one byte at a time is too slow for the whole file
+                long limit = (chunk_sizes[j] == 1) ? 5000 : expected_size;
+                for (;;) {
+                    long amt_read;
+                    ok(rucksack_in_stream_read(stream, buffer, chunk_sizes[j], &amt_read));
+                    if (amt_read == 0)
+                        break;
+                    assert(amt_read == chunk_sizes[j] || pos + amt_read == expected_size);
+                    assert(memcmp(buffer, expected + pos, amt_read) == 0);
+                    pos += amt_read;
+                    if (pos >= limit)
+                        break;
+                }
+                assert(pos >= limit);
+                rucksack_in_stream_close(stream);
+            }
+        }
+        ok(rucksack_bundle_close(bundle));
+    }
+
+    free(buffer);
+    free(expected);
+    remove(big_name);
+}
+
+static void check_same_region(struct RuckSackBundle *bundle, const char *key1,
+        const char *key2, int same)
+{
+    struct RuckSackFileEntry *entry1 = rucksack_bundle_find_file(bundle, key1, -1);
+    struct RuckSackFileEntry *entry2 = rucksack_bundle_find_file(bundle, key2, -1);
+    assert(entry1);
+    assert(entry2);
+    const unsigned char *ptr1 = rucksack_file_data_ptr(entry1);
+    const unsigned char *ptr2 = rucksack_file_data_ptr(entry2);
+    assert(ptr1);
+    assert(ptr2);
+    assert((ptr1 == ptr2) == same);
+}
+
+static void test_dedupe(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    long monkey_size;
+    unsigned char *monkey = read_whole_file("../test/monkey.obj", &monkey_size);
+    long blah_size;
+    unsigned char *blah = read_whole_file("../test/blah.txt", &blah_size);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "a", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_add_file(bundle, "b", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_add_file(bundle, "c", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file_compressed(bundle, "d", -1, "../test/monkey.obj",
+                RuckSackCompressionNone));
+    // enough copies that the headers outgrow their space and push the
+    // shared regions around
+    char key[32];
+    for (int i = 0; i < 300; i += 1) {
+        sprintf(key, "copy%d", i);
+        ok(rucksack_bundle_add_file(bundle, key, -1, "../test/blah.txt"));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    check_same_region(bundle, "a", "b", 1);
+    check_same_region(bundle, "a", "d", 1);
+    check_same_region(bundle, "a", "c", 0);
+    check_same_region(bundle, "c", "copy299", 1);
+    for (int i = 0; i < 300; i += 1) {
+        sprintf(key, "copy%d", i);
+        check_entry_contents(rucksack_bundle_find_file(bundle, key, -1), blah, blah_size);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    // deleting or overwriting one entry leaves the others alone
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_delete_file(bundle, "a", -1));
+    ok(rucksack_bundle_add_file(bundle, "b", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "e", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_delete_file(bundle, "c", -1));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    assert(rucksack_bundle_find_file(bundle, "a", -1) == NULL);
+    check_entry_contents(rucksack_bundle_find_file(bundle, "b", -1), blah, blah_size);
+    check_entry_contents(rucksack_bundle_find_file(bundle, "d", -1), monkey, monkey_size);
+    check_entry_contents(rucksack_bundle_find_file(bundle, "e", -1), monkey, monkey_size);
+    check_same_region(bundle, "d", "e", 1);
+    check_same_region(bundle, "b", "copy0", 1);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_delete_file(bundle, "d", -1));
+    ok(rucksack_bundle_delete_file(bundle, "e", -1));
+    ok(rucksack_bundle_add_file(bundle, "f", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    check_entry_contents(rucksack_bundle_find_file(bundle, "f", -1), monkey, monkey_size);
+    check_entry_contents(rucksack_bundle_find_file(bundle, "b", -1), blah, blah_size);
+    ok(rucksack_bundle_close(bundle));
+
+    free(monkey);
+    free(blah);
+}
+
+// a bit at a time, to check the fast versions against
+static uint32_t reference_crc32c(const unsigned char *data, long size) {
+    uint32_t crc = 0xffffffff;
+    for (long i = 0; i < size; i += 1) {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j += 1)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+    }
+    return ~crc;
+}
+
+static int last_async_err;
+
+static void store_async_err(struct RuckSackFileEntry *entry, unsigned char *buffer,
+        int err, void *userdata)
+{
+    last_async_err = err;
+}
+
+static long find_bytes(const unsigned char *haystack, long haystack_size,
+        const unsigned char *needle, long needle_size)
+{
+    for (long i = 0; i + needle_size <= haystack_size; i += 1) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_size) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void test_checksums(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    // big enough for the interleaved code path, with an odd size for the tail
+    const char *big_name = "big.bin";
+    long big_size = 1000003;
+    unsigned char *big = malloc(big_size);
+    assert(big);
+    uint32_t x = 1;
+    for (long i = 0; i < big_size; i += 1) {
+        x = x * 1103515245 + 12345;
+        big[i] = 'a' + (x >> 24) % 4;
+    }
+    FILE *f = fopen(big_name, "wb");
+    assert(f);
+    assert(fwrite(big, 1, big_size, f) == big_size);
+    fclose(f);
+
+    int codec = RuckSackCompressionNone;
+    if (rucksack_compression_available(RuckSackCompressionDeflate))
+        codec = RuckSackCompressionDeflate;
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, "digits", -1, 9, &stream));
+    ok(rucksack_stream_write(stream, "123456789", 9));
+    rucksack_stream_close(stream);
+    ok(rucksack_bundle_add_file(bundle, "big", -1, big_name));
+    if (codec)
+        ok(rucksack_bundle_add_file_compressed(bundle, "packed", -1, big_name, codec));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    unsigned long checksum;
+    struct RuckSackFileEntry *digits = rucksack_bundle_find_file(bundle, "digits", -1);
+    assert(rucksack_file_checksum(digits, &checksum));
+    assert(checksum == 0xe3069283);
+    struct RuckSackFileEntry *big_entry = rucksack_bundle_find_file(bundle, "big", -1);
+    assert(rucksack_file_checksum(big_entry, &checksum));
+    assert(checksum == reference_crc32c(big, big_size));
+    unsigned char *packed = NULL;
+    long packed_size = 0;
+    if (codec) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "packed", -1);
+        packed_size = rucksack_file_stored_size(entry);
+        packed = malloc(packed_size);
+        assert(packed);
+        ok(rucksack_file_read_stored(entry, packed));
+        assert(rucksack_file_checksum(entry, &checksum));
+        assert(checksum == reference_crc32c(packed, packed_size));
+    }
+    long count = rucksack_bundle_file_count(bundle);
+    int results[3];
+    ok(rucksack_bundle_verify(bundle, 0, results));
+    for (int i = 0; i < count; i += 1)
+        ok(results[i]);
+    ok(rucksack_bundle_close(bundle));
+
+    // damage one byte of every file
+    long bundle_size;
+    unsigned char *bundle_data = read_whole_file(bundle_name, &bundle_size);
+    long digits_offset = find_bytes(bundle_data, bundle_size, (const unsigned char *)"123456789", 9);
+    assert(digits_offset != -1);
+    bundle_data[digits_offset + 4] ^= 1;
+    long big_offset = find_bytes(bundle_data, bundle_size, big, 4096);
+    assert(big_offset != -1);
+    bundle_data[big_offset + 500000] ^= 1;
+    if (codec) {
+        long packed_offset = find_bytes(bundle_data, bundle_size, packed, packed_size);
+        assert(packed_offset != -1);
+        bundle_data[packed_offset + packed_size - 1] ^= 1;
+    }
+    f = fopen(bundle_name, "wb");
+    assert(f);
+    assert(fwrite(bundle_data, 1, bundle_size, f) == bundle_size);
+    fclose(f);
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    digits = rucksack_bundle_find_file(bundle, "digits", -1);
+    big_entry = rucksack_bundle_find_file(bundle, "big", -1);
+    unsigned char *buffer = malloc(big_size);
+    assert(buffer);
+
+    // nobody notices unless asked to
+    ok(rucksack_file_read(big_entry, buffer));
+    rucksack_bundle_set_verify_reads(bundle, 1);
+    assert(rucksack_file_read(big_entry, buffer) == RuckSackErrorChecksumMismatch);
+    assert(rucksack_file_read(digits, buffer) == RuckSackErrorChecksumMismatch);
+    ok(rucksack_file_read_range(big_entry, 10, 100, buffer));
+    if (codec) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "packed", -1);
+        assert(rucksack_file_read(entry, buffer) == RuckSackErrorChecksumMismatch);
+    }
+
+    struct RuckSackFileEntry *many_entries[] = {digits, big_entry};
+    unsigned char digits_buffer[9];
+    unsigned char *many_buffers[] = {digits_buffer, buffer};
+    assert(rucksack_bundle_read_many(bundle, many_entries, many_buffers, 2) ==
+            RuckSackErrorChecksumMismatch);
+
+    struct RuckSackInStream *in_stream;
+    ok(rucksack_file_open_stream(big_entry, &in_stream));
+    long amt_read;
+    ok(rucksack_in_stream_read(in_stream, buffer, big_size - 1, &amt_read));
+    assert(rucksack_in_stream_read(in_stream, buffer, 1, &amt_read) ==
+            RuckSackErrorChecksumMismatch);
+    rucksack_in_stream_close(in_stream);
+
+    struct RuckSackReadQueue *queue;
+    ok(rucksack_read_queue_create(bundle, 0, &queue));
+    ok(rucksack_read_async(queue, big_entry, buffer, store_async_err, NULL));
+    ok(rucksack_read_queue_wait(queue));
+    assert(last_async_err == RuckSackErrorChecksumMismatch);
+    rucksack_read_queue_destroy(queue);
+
+    ok(rucksack_bundle_verify(bundle, 0, results));
+    for (int i = 0; i < count; i += 1)
+        assert(results[i] == RuckSackErrorChecksumMismatch);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    ok(rucksack_bundle_verify(bundle, 2, results));
+    for (int i = 0; i < count; i += 1)
+        assert(results[i] == RuckSackErrorChecksumMismatch);
+    ok(rucksack_bundle_close(bundle));
+
+    free(buffer);
+    free(bundle_data);
+    free(packed);
+    free(big);
+    remove(big_name);
+}
+
+static void test_key_table(void) {
+    const char *bundle_name = "test.bundle";
+
+    // start from a version 1 bundle, whose header entries begin where a
+    // version 5 main header ends
+    unsigned char data[70];
+    memset(data, 0, sizeof(data));
+    memcpy(data, "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20", 16);
+    data[19] = 1; // version
+    data[23] = 28; // first header offset
+    data[27] = 1; // entry count
+    unsigned char *entry_buf = &data[28];
+    entry_buf[3] = 37; // entry size
+    entry_buf[11] = 65; // offset
+    entry_buf[19] = 5; // size
+    entry_buf[27] = 5; // allocated size
+    entry_buf[35] = 1; // key size
+    entry_buf[36] = 'a';
+    memcpy(&data[65], "hello", 5);
+    FILE *f = fopen(bundle_name, "wb");
+    assert(f);
+    assert(fwrite(data, 1, sizeof(data), f) == sizeof(data));
+    fclose(f);
+
+    const int count = 300;
+    char key[32];
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < count; i += 1) {
+        snprintf(key, sizeof(key), "entry%d", i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, -1, sizeof(int), &stream));
+        int value = i % 10; // some of them are duplicates
+        ok(rucksack_stream_write(stream, &value, sizeof(int)));
+        rucksack_stream_close(stream);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    long size;
+    unsigned char *contents = read_whole_file(bundle_name, &size);
+    for (int mode = 0; mode < 3; mode += 1) {
+        if (mode == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else if (mode == 1)
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_read_mem(contents, size, &bundle));
+        assert(rucksack_bundle_file_count(bundle) == count + 1);
+
+        check_entry_contents(rucksack_bundle_find_file(bundle, "a", -1),
+                (const unsigned char *)"hello", 5);
+        assert(!rucksack_bundle_find_file(bundle, "entry", -1));
+        assert(!rucksack_bundle_find_file(bundle, "entry300", -1));
+
+        // look up some of the entries before listing all of them, which
+        // must hand out the same entries
+        struct RuckSackFileEntry *found[10];
+        for (int i = 0; i < 10; i += 1) {
+            snprintf(key, sizeof(key), "entry%d", i * 7);
+            found[i] = rucksack_bundle_find_file(bundle, key, -1);
+            assert(found[i]);
+            assert(rucksack_bundle_find_file(bundle, key, -1) == found[i]);
+        }
+        struct RuckSackFileEntry **entries = malloc((count + 1) * sizeof(struct RuckSackFileEntry *));
+        ok(rucksack_bundle_get_files(bundle, entries));
+        assert(entries[0] == rucksack_bundle_find_file(bundle, "a", -1));
+        for (int i = 0; i < count; i += 1) {
+            struct RuckSackFileEntry *entry = entries[i + 1];
+            snprintf(key, sizeof(key), "entry%d", i);
+            assert(rucksack_file_name_size(entry) == (int)strlen(key));
+            assert(memcmp(rucksack_file_name(entry), key, strlen(key)) == 0);
+            assert(rucksack_bundle_find_file(bundle, key, -1) == entry);
+            if (i % 7 == 0 && i / 7 < 10)
+                assert(found[i / 7] == entry);
+            int value;
+            ok(rucksack_file_read(entry, (unsigned char *)&value));
+            assert(value == i % 10);
+        }
+        free(entries);
+
+        int results[301];
+        ok(rucksack_bundle_verify(bundle, 4, results));
+        for (int i = 1; i < count + 1; i += 1)
+            assert(results[i] == RuckSackErrorNone);
+
+        // deleting from a read-only bundle only changes what it looks like
+        // in memory
+        ok(rucksack_bundle_delete_file(bundle, "entry3", -1));
+        assert(!rucksack_bundle_find_file(bundle, "entry3", -1));
+        assert(rucksack_bundle_find_file(bundle, "entry13", -1));
+        assert(rucksack_bundle_file_count(bundle) == count);
+        ok(rucksack_bundle_close(bundle));
+    }
+
+    // headers are parsed when they are needed, so a damaged one is only
+    // found when listing the files. the first one claims a key longer than
+    // all of the headers.
+    long first_header = ((long)contents[20] << 24) | (contents[21] << 16) |
+        (contents[22] << 8) | contents[23];
+    memset(&contents[first_header + 32], 0xff, 4);
+    ok(rucksack_bundle_open_read_mem(contents, size, &bundle));
+    struct RuckSackFileEntry **entries = malloc((count + 1) * sizeof(struct RuckSackFileEntry *));
+    assert(entries);
+    assert(rucksack_bundle_get_files(bundle, entries) == RuckSackErrorInvalidFormat);
+    free(entries);
+    ok(rucksack_bundle_close(bundle));
+    free(contents);
+}
+
+struct IterKeys {
+    char keys[16][32];
+    int count;
+    int stop_after;
+};
+
+static int collect_key(struct RuckSackFileEntry *entry, void *userdata) {
+    struct IterKeys *iter = userdata;
+    assert(iter->count < 16);
+    snprintf(iter->keys[iter->count], 32, "%s", rucksack_file_name(entry));
+    iter->count += 1;
+    return iter->count == iter->stop_after;
+}
+
+static void check_prefix(struct RuckSackBundle *bundle, const char *prefix,
+        const char **expected, int expected_count)
+{
+    struct IterKeys iter;
+    memset(&iter, 0, sizeof(iter));
+    ok(rucksack_bundle_iter_prefix(bundle, prefix, -1, collect_key, &iter));
+    assert(iter.count == expected_count);
+    for (int i = 0; i < expected_count; i += 1)
+        assert(strcmp(iter.keys[i], expected[i]) == 0);
+}
+
+static void test_iter_keys(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const char *keys[] = {
+        "levels/forest/trees", "b", "levels/desert/sand", "levels/forest",
+        "levels/forest/bushes", "levels/forestry", "a", "levels/forest/\xff",
+    };
+    const int key_count = sizeof(keys) / sizeof(keys[0]);
+    const char *forest[] = {"levels/forest/bushes", "levels/forest/trees",
+        "levels/forest/\xff"};
+    const char *sorted[] = {"a", "b", "levels/desert/sand", "levels/forest",
+        "levels/forest/bushes", "levels/forest/trees", "levels/forest/\xff",
+        "levels/forestry"};
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < key_count; i += 1) {
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, keys[i], -1, sizeof(int), &stream));
+        ok(rucksack_stream_write(stream, &i, sizeof(int)));
+        rucksack_stream_close(stream);
+    }
+    check_prefix(bundle, "levels/forest/", forest, 3);
+    check_prefix(bundle, "", sorted, key_count);
+
+    // entries that come and go after the keys were sorted
+    ok(rucksack_bundle_delete_file(bundle, "levels/forest/bushes", -1));
+    check_prefix(bundle, "levels/forest/", &forest[1], 2);
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, "levels/forest/bushes", -1, sizeof(int), &stream));
+    ok(rucksack_stream_write(stream, &key_count, sizeof(int)));
+    rucksack_stream_close(stream);
+    check_prefix(bundle, "levels/forest/", forest, 3);
+    ok(rucksack_bundle_close(bundle));
+
+    for (int mode = 0; mode < 3; mode += 1) {
+        if (mode == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else if (mode == 1)
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open(bundle_name, &bundle));
+
+        check_prefix(bundle, "levels/forest/", forest, 3);
+        check_prefix(bundle, "", sorted, key_count);
+        check_prefix(bundle, "levels/forest", &sorted[3], 5);
+        check_prefix(bundle, "levels/j", NULL, 0);
+        check_prefix(bundle, "z", NULL, 0);
+
+        struct IterKeys iter;
+        memset(&iter, 0, sizeof(iter));
+        ok(rucksack_bundle_iter_range(bundle, "b", -1, "levels/forest/", -1,
+                    collect_key, &iter));
+        assert(iter.count == 3);
+        assert(strcmp(iter.keys[0], "b") == 0);
+        assert(strcmp(iter.keys[2], "levels/forest") == 0);
+
+        memset(&iter, 0, sizeof(iter));
+        ok(rucksack_bundle_iter_range(bundle, NULL, 0, "b", 1, collect_key, &iter));
+        assert(iter.count == 1);
+        assert(strcmp(iter.keys[0], "a") == 0);
+
+        memset(&iter, 0, sizeof(iter));
+        iter.stop_after = 2;
+        ok(rucksack_bundle_iter_range(bundle, "levels/a", -1, NULL, 0, collect_key, &iter));
+        assert(iter.count == 2);
+        assert(strcmp(iter.keys[1], "levels/forest") == 0);
+
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "levels/forest/bushes", -1);
+        int value;
+        ok(rucksack_file_read(entry, (unsigned char *)&value));
+        assert(value == key_count);
+        ok(rucksack_bundle_close(bundle));
+    }
+}
+
+static void add_pattern(struct RuckSackBundle *bundle, const char *key, long size,
+        long alignment)
+{
+    unsigned char *data = malloc(size);
+    for (long i = 0; i < size; i += 1)
+        data[i] = (unsigned char)(i * 7 + size);
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream_aligned(bundle, key, -1, size, alignment, &stream));
+    ok(rucksack_stream_write(stream, data, size));
+    rucksack_stream_close(stream);
+    free(data);
+}
+
+static void check_aligned(struct RuckSackBundle *bundle, const char *key, long size,
+        long alignment)
+{
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    assert(rucksack_file_alignment(entry) == alignment);
+    assert(rucksack_file_size(entry) == size);
+    // the mapping starts on a page boundary
+    const unsigned char *ptr = rucksack_file_data_ptr(entry);
+    assert(ptr);
+    assert((uintptr_t)ptr % alignment == 0);
+    for (long i = 0; i < size; i += 1)
+        assert(ptr[i] == (unsigned char)(i * 7 + size));
+}
+
+static void test_alignment(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(rucksack_bundle_alignment(bundle) == 1);
+    assert(rucksack_bundle_set_alignment(bundle, 48) == RuckSackErrorInvalidAlignment);
+    ok(rucksack_bundle_set_alignment(bundle, 64));
+    struct RuckSackOutStream *stream;
+    assert(rucksack_bundle_add_stream_aligned(bundle, "bad", -1, 10, 3, &stream) ==
+            RuckSackErrorInvalidAlignment);
+
+    char key[32];
+    for (int i = 0; i < 20; i += 1) {
+        snprintf(key, sizeof(key), "small%d", i);
+        add_pattern(bundle, key, i * 37 + 1, 0);
+    }
+    add_pattern(bundle, "page", 5000, 4096);
+    // same contents as small5, but that one is not aligned enough to share
+    add_pattern(bundle, "small5_page", 5 * 37 + 1, 4096);
+    // overwriting an entry with a bigger alignment moves it
+    add_pattern(bundle, "small3", 3 * 37 + 1, 4096);
+    ok(rucksack_bundle_delete_file(bundle, "small10", -1));
+
+    struct RuckSackFileSource src;
+    src.key = "monkey";
+    src.key_size = -1;
+    src.path = "../test/monkey.obj";
+    src.compression = RuckSackCompressionNone;
+    src.alignment = 256;
+    ok(rucksack_bundle_add_files(bundle, &src, 1, 1, NULL));
+    ok(rucksack_bundle_close(bundle));
+
+    for (int pass = 0; pass < 2; pass += 1) {
+        ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+        assert(rucksack_bundle_alignment(bundle) == 64);
+        for (int i = 0; i < 20; i += 1) {
+            snprintf(key, sizeof(key), "small%d", i);
+            if (i == 10)
+                assert(!rucksack_bundle_find_file(bundle, key, -1));
+            else if (i != 3)
+                check_aligned(bundle, key, i * 37 + 1, 64);
+        }
+        check_aligned(bundle, "small3", 3 * 37 + 1, 4096);
+        check_aligned(bundle, "page", 5000, 4096);
+        check_aligned(bundle, "small5_page", 5 * 37 + 1, 4096);
+        struct RuckSackFileEntry *monkey = rucksack_bundle_find_file(bundle, "monkey", -1);
+        assert(rucksack_file_alignment(monkey) == 256);
+        assert((uintptr_t)rucksack_file_data_ptr(monkey) % 256 == 0);
+        if (pass == 1)
+            check_aligned(bundle, "late", 20000, 64);
+        ok(rucksack_bundle_close(bundle));
+
+        // the default alignment is kept for files added later
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        add_pattern(bundle, "late", 20000, 0);
+        ok(rucksack_bundle_close(bundle));
+    }
+}
+
+static void test_find_image(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    char key[32];
+    img->key = key;
+    img->path = "../test/file0.png";
+    for (int i = 0; i < 500; i += 1) {
+        snprintf(key, sizeof(key), "sprite_%d", i);
+        img->anchor_x = i;
+        img->anchor = RuckSackAnchorExplicit;
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->key = "sprites";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "sprites", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    for (int i = 0; i < 500; i += 1) {
+        snprintf(key, sizeof(key), "sprite_%d", i);
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, key, -1);
+        assert(image);
+        assert(strcmp(image->key, key) == 0);
+        assert(image->anchor_x == i);
+    }
+    assert(!rucksack_texture_find_image(texture, "sprite_500", -1));
+    assert(!rucksack_texture_find_image(texture, "", 0));
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void put_uint32be(unsigned char *buf, uint32_t x) {
+    buf[0] = x >> 24;
+    buf[1] = x >> 16;
+    buf[2] = x >> 8;
+    buf[3] = x;
+}
+
+static void check_sprites(struct RuckSackTexture *texture) {
+    long count = rucksack_texture_image_count(texture);
+    const struct RuckSackSprite *sprites = rucksack_texture_sprites(texture);
+    struct RuckSackImage **images = malloc(count * sizeof(struct RuckSackImage *));
+    assert(images);
+    rucksack_texture_get_images(texture, images);
+    for (long i = 0; i < count; i += 1) {
+        const struct RuckSackSprite *sprite = &sprites[i];
+        const char *key = rucksack_texture_sprite_key(texture, sprite);
+        assert(key);
+        assert(key[sprite->key_size] == 0);
+        assert(rucksack_texture_find_sprite(texture, key, sprite->key_size) == i);
+        assert(rucksack_texture_find_image(texture, key, sprite->key_size) == images[i]);
+        assert(images[i]->key_size == (int)sprite->key_size);
+        assert(memcmp(images[i]->key, key, sprite->key_size) == 0);
+        assert(images[i]->x == (int)sprite->x);
+        assert(images[i]->y == (int)sprite->y);
+        assert(images[i]->width == (int)sprite->width);
+        assert(images[i]->height == (int)sprite->height);
+        assert(images[i]->anchor == sprite->anchor);
+        assert(images[i]->anchor_x == sprite->anchor_x);
+        assert(images[i]->anchor_y == sprite->anchor_y);
+        assert(images[i]->r90 == sprite->r90);
+    }
+    free(images);
+}
+
+static void test_sprite_table(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = "../test/file0.png";
+    img->key = "small";
+    ok(rucksack_texture_add_image(texture, img));
+    img->path = "../test/file1.png";
+    img->key = "big";
+    img->anchor = RuckSackAnchorExplicit;
+    img->anchor_x = -1.25f;
+    img->anchor_y = 3.0f;
+    ok(rucksack_texture_add_image(texture, img));
+    rucksack_image_destroy(img);
+    texture->key = "new";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+
+    // a texture as it was stored before the sprite table, with two images
+    const char *keys[] = {"first", "second_image"};
+    unsigned char data[38 + 2 * 37 + 17 + 4];
+    memset(data, 0, sizeof(data));
+    memcpy(data, "\x0e\xb1\x4c\x84\x47\x4c\xb3\xad\xa6\xbd\x93\xe4\xbe\xa5\x46\xba", 16);
+    put_uint32be(&data[16], sizeof(data) - 4);
+    put_uint32be(&data[20], 2);
+    put_uint32be(&data[24], 38);
+    put_uint32be(&data[28], 64);
+    put_uint32be(&data[32], 32);
+    long pos = 38;
+    for (int i = 0; i < 2; i += 1) {
+        unsigned char *buf = &data[pos];
+        int key_size = strlen(keys[i]);
+        put_uint32be(&buf[0], 37 + key_size);
+        put_uint32be(&buf[4], RuckSackAnchorExplicit);
+        put_uint32be(&buf[8], 16384 * (i + 1));
+        put_uint32be(&buf[12], 8192);
+        put_uint32be(&buf[16], 10 * i);
+        put_uint32be(&buf[24], 7 + i);
+        put_uint32be(&buf[28], 9);
+        buf[32] = i;
+        put_uint32be(&buf[33], key_size);
+        memcpy(&buf[37], keys[i], key_size);
+        pos += 37 + key_size;
+    }
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, "old", -1, sizeof(data), &stream));
+    ok(rucksack_stream_write(stream, data, sizeof(data)));
+    rucksack_stream_close(stream);
+    ok(rucksack_bundle_close(bundle));
+
+    for (int pass = 0; pass < 2; pass += 1) {
+        if (pass == 0)
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "new", -1);
+        assert(entry);
+        ok(rucksack_file_open_texture(entry, &texture));
+        assert(rucksack_texture_image_count(texture) == 2);
+        check_sprites(texture);
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, "big", -1);
+        assert(image);
+        assert(image->width == 16);
+        assert(image->anchor == RuckSackAnchorExplicit);
+        assert(image->anchor_x == -1.25f);
+        assert(image->anchor_y == 3.0f);
+        assert(rucksack_texture_find_sprite(texture, "bi", -1) == -1);
+
+        // the sprite table is used straight from the mapped file
+        const unsigned char *ptr = rucksack_file_data_ptr(entry);
+        const unsigned char *sprites = (const unsigned char *)rucksack_texture_sprites(texture);
+        uint32_t one = 1;
+        if (ptr && *(const unsigned char *)&one == 1)
+            assert(sprites > ptr && sprites < ptr + rucksack_file_size(entry));
+        rucksack_texture_close(texture);
+
+        entry = rucksack_bundle_find_file(bundle, "old", -1);
+        assert(entry);
+        int is_texture;
+        ok(rucksack_file_is_texture(entry, &is_texture));
+        assert(is_texture);
+        ok(rucksack_file_open_texture(entry, &texture));
+        assert(rucksack_texture_image_count(texture) == 2);
+        assert(rucksack_texture_size(texture) == 4);
+        check_sprites(texture);
+        image = rucksack_texture_find_image(texture, "second_image", -1);
+        assert(image);
+        assert(image->x == 10);
+        assert(image->width == 8);
+        assert(image->height == 9);
+        assert(image->r90 == 1);
+        assert(image->anchor_x == 2.0f);
+        assert(image->anchor_y == 0.5f);
+        assert(rucksack_texture_find_sprite(texture, "first", -1) == 0);
+        rucksack_texture_close(texture);
+
+        ok(rucksack_bundle_close(bundle));
+    }
+}
+
+static void add_four_images(struct RuckSackBundle *bundle, const char *key, int format,
+        int compression)
+{
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    char path[32];
+    char image_key[32];
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < 4; i += 1) {
+        snprintf(path, sizeof(path), "../test/file%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->key = (char *)key;
+    texture->format = format;
+    texture->compression = compression;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+}
+
+static unsigned char *expected_pixels;
+static long expected_pixels_size;
+static int texture_reads_done;
+
+static void check_texture_read(struct RuckSackFileEntry *entry, unsigned char *buffer,
+        int err, void *userdata)
+{
+    ok(err);
+    assert(memcmp(buffer, expected_pixels, expected_pixels_size) == 0);
+    texture_reads_done += 1;
+}
+
+static void test_texture_formats(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_four_images(bundle, "png", RuckSackTextureFormatPng, RuckSackCompressionNone);
+    add_four_images(bundle, "png_auto", RuckSackTextureFormatPng, RuckSackCompressionAuto);
+    add_four_images(bundle, "raw", RuckSackTextureFormatRgba8, RuckSackCompressionNone);
+    int have_lz4 = rucksack_compression_available(RuckSackCompressionLz4);
+    if (have_lz4)
+        add_four_images(bundle, "lz4", RuckSackTextureFormatRgba8, RuckSackCompressionLz4);
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    texture->key = "bad";
+    texture->format = 1000;
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorTextureFormat);
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+
+    // PNG pixels are not worth compressing again, but the setting is kept
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "png_auto", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(texture->compression == RuckSackCompressionNone);
+    assert(rucksack_texture_requested_compression(texture) == RuckSackCompressionAuto);
+    rucksack_texture_close(texture);
+
+    // the raw pixels are the rows of the PNG, from top to bottom
+    entry = rucksack_bundle_find_file(bundle, "png", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(texture->format == RuckSackTextureFormatPng);
+    assert(rucksack_texture_requested_compression(texture) == RuckSackCompressionNone);
+    assert(rucksack_texture_level_count(texture) == 1);
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(texture, 0, &level);
+    assert(level.width == 16);
+    assert(level.height == 64);
+    assert(level.pitch == 0);
+    long png_size = rucksack_texture_size(texture);
+    unsigned char *png = malloc(png_size);
+    assert(png);
+    ok(rucksack_texture_read(texture, png));
+    rucksack_texture_close(texture);
+
+    FIMEMORY *fi_mem = FreeImage_OpenMemory(png, png_size);
+    FIBITMAP *bmp = FreeImage_LoadFromMemory(FIF_PNG, fi_mem, 0);
+    assert(bmp);
+    FIBITMAP *bmp32 = FreeImage_ConvertTo32Bits(bmp);
+    expected_pixels_size = 16 * 64 * 4;
+    expected_pixels = malloc(expected_pixels_size);
+    assert(expected_pixels);
+    for (int row = 0; row < 64; row += 1) {
+        const BYTE *src = FreeImage_GetScanLine(bmp32, 63 - row);
+        for (int x = 0; x < 16; x += 1) {
+            unsigned char *dest = &expected_pixels[(row * 16 + x) * 4];
+            dest[0] = src[x * 4 + FI_RGBA_RED];
+            dest[1] = src[x * 4 + FI_RGBA_GREEN];
+            dest[2] = src[x * 4 + FI_RGBA_BLUE];
+            dest[3] = src[x * 4 + FI_RGBA_ALPHA];
+        }
+    }
+    FreeImage_Unload(bmp32);
+    FreeImage_Unload(bmp);
+    FreeImage_CloseMemory(fi_mem);
+    free(png);
+
+    struct RuckSackReadQueue *queue;
+    ok(rucksack_read_queue_create(bundle, 0, &queue));
+    unsigned char *buffers[2];
+    texture_reads_done = 0;
+    const char *keys[] = {"raw", "lz4"};
+    for (int i = 0; i < 1 + have_lz4; i += 1) {
+        entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+        assert(entry);
+        ok(rucksack_file_open_texture(entry, &texture));
+        assert(texture->format == RuckSackTextureFormatRgba8);
+        assert(texture->compression ==
+                (i ? RuckSackCompressionLz4 : RuckSackCompressionNone));
+        assert(rucksack_texture_requested_compression(texture) == texture->compression);
+        assert(rucksack_texture_level_count(texture) == 1);
+        rucksack_texture_get_level(texture, 0, &level);
+        assert(level.offset == 0);
+        assert(level.width == 16);
+        assert(level.height == 64);
+        assert(level.pitch == 16 * 4);
+        assert(level.size == expected_pixels_size);
+        assert(rucksack_texture_size(texture) == expected_pixels_size);
+
+        const unsigned char *ptr = rucksack_texture_data_ptr(texture);
+        if (i == 0) {
+            assert(ptr);
+            assert((uintptr_t)ptr % 16 == 0);
+            assert(memcmp(ptr, expected_pixels, expected_pixels_size) == 0);
+        } else {
+            assert(!ptr);
+        }
+        buffers[i] = malloc(expected_pixels_size);
+        assert(buffers[i]);
+        ok(rucksack_texture_read(texture, buffers[i]));
+        assert(memcmp(buffers[i], expected_pixels, expected_pixels_size) == 0);
+        memset(buffers[i], 0, expected_pixels_size);
+        ok(rucksack_texture_read_async(queue, texture, buffers[i], check_texture_read, NULL));
+        ok(rucksack_read_queue_wait(queue));
+        rucksack_texture_close(texture);
+        free(buffers[i]);
+    }
+    assert(texture_reads_done == 1 + have_lz4);
+    rucksack_read_queue_destroy(queue);
+    free(expected_pixels);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void decode_color_block(const unsigned char *block, int allow_three_color,
+        unsigned char out[16][4])
+{
+    int c[2] = {block[0] | (block[1] << 8), block[2] | (block[3] << 8)};
+    unsigned char palette[4][4];
+    for (int e = 0; e < 2; e += 1) {
+        int r = (c[e] >> 11) & 31, g = (c[e] >> 5) & 63, b = c[e] & 31;
+        palette[e][0] = (r << 3) | (r >> 2);
+        palette[e][1] = (g << 2) | (g >> 4);
+        palette[e][2] = (b << 3) | (b >> 2);
+        palette[e][3] = 255;
+    }
+    for (int ch = 0; ch < 4; ch += 1) {
+        if (c[0] > c[1] || !allow_three_color) {
+            palette[2][ch] = (2 * palette[0][ch] + palette[1][ch]) / 3;
+            palette[3][ch] = (palette[0][ch] + 2 * palette[1][ch]) / 3;
+        } else {
+            palette[2][ch] = (palette[0][ch] + palette[1][ch]) / 2;
+            palette[3][ch] = 0;
+        }
+    }
+    uint32_t bits = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+    for (int i = 0; i < 16; i += 1)
+        memcpy(out[i], palette[(bits >> (2 * i)) & 3], 4);
+}
+
+static void decode_alpha_block(const unsigned char *block, unsigned char out[16][4]) {
+    int a0 = block[0], a1 = block[1];
+    int palette[8] = {a0, a1};
+    for (int i = 1; i < 7; i += 1) {
+        if (a0 > a1)
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+        else
+            palette[i + 1] = (i < 5) ? ((5 - i) * a0 + i * a1) / 5 : (i == 5) ? 0 : 255;
+    }
+    uint64_t bits = 0;
+    for (int k = 0; k < 6; k += 1)
+        bits |= (uint64_t)block[2 + k] << (8 * k);
+    for (int i = 0; i < 16; i += 1)
+        out[i][3] = palette[(bits >> (3 * i)) & 7];
+}
+
+static int get_bits(const unsigned char *block, int *pos, int count) {
+    int value = 0;
+    for (int i = 0; i < count; i += 1, *pos += 1)
+        value |= ((block[*pos >> 3] >> (*pos & 7)) & 1) << i;
+    return value;
+}
+
+static void decode_bc7_block(const unsigned char *block, unsigned char out[16][4]) {
+    static const int weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+    int pos = 0;
+    assert(get_bits(block, &pos, 7) == 0x40); // mode 6
+    int e[2][4];
+    for (int ch = 0; ch < 4; ch += 1) {
+        e[0][ch] = get_bits(block, &pos, 7) << 1;
+        e[1][ch] = get_bits(block, &pos, 7) << 1;
+    }
+    int p0 = get_bits(block, &pos, 1);
+    int p1 = get_bits(block, &pos, 1);
+    for (int ch = 0; ch < 4; ch += 1) {
+        e[0][ch] |= p0;
+        e[1][ch] |= p1;
+    }
+    for (int i = 0; i < 16; i += 1) {
+        int w = weights[get_bits(block, &pos, i == 0 ? 3 : 4)];
+        for (int ch = 0; ch < 4; ch += 1)
+            out[i][ch] = ((64 - w) * e[0][ch] + w * e[1][ch] + 32) >> 6;
+    }
+}
+
+static void decode_blocks(int format, const unsigned char *data, int width, int height,
+        unsigned char *rgba)
+{
+    int block_size = (format == RuckSackTextureFormatBc1) ? 8 : 16;
+    for (int by = 0; by < height; by += 4) {
+        for (int bx = 0; bx < width; bx += 4) {
+            unsigned char px[16][4];
+            if (format == RuckSackTextureFormatBc1) {
+                decode_color_block(data, 1, px);
+            } else if (format == RuckSackTextureFormatBc3) {
+                decode_color_block(data + 8, 0, px);
+                decode_alpha_block(data, px);
+            } else {
+                decode_bc7_block(data, px);
+            }
+            for (int i = 0; i < 16; i += 1)
+                memcpy(&rgba[((by + i / 4) * width + bx + i % 4) * 4], px[i], 4);
+            data += block_size;
+        }
+    }
+}
+
+static void test_block_formats(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_four_images(bundle, "raw", RuckSackTextureFormatRgba8, RuckSackCompressionNone);
+    add_four_images(bundle, "bc1", RuckSackTextureFormatBc1, RuckSackCompressionNone);
+    add_four_images(bundle, "bc3", RuckSackTextureFormatBc3, RuckSackCompressionNone);
+    add_four_images(bundle, "bc7", RuckSackTextureFormatBc7, RuckSackCompressionNone);
+
+    // sizes that are not multiples of 4 still start on a block
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    texture->key = "odd";
+    texture->format = RuckSackTextureFormatBc7;
+    texture->pow2 = 0;
+    texture->max_width = 255;
+    const char *paths[] = {"../test/radar-circle.png", "../test/arrow.png", "../test/file0.png"};
+    const char *keys[] = {"radarCircle", "arrow", "file0"};
+    for (int i = 0; i < 3; i += 1) {
+        struct RuckSackImage *img = rucksack_image_create();
+        assert(img);
+        img->path = (char *)paths[i];
+        img->key = (char *)keys[i];
+        ok(rucksack_texture_add_image(texture, img));
+        rucksack_image_destroy(img);
+    }
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "raw", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    long size = rucksack_texture_size(texture);
+    unsigned char *expected = malloc(size);
+    unsigned char *decoded = malloc(size);
+    assert(expected && decoded);
+    ok(rucksack_texture_read(texture, expected));
+    rucksack_texture_close(texture);
+
+    const char *formats[] = {"bc1", "bc3", "bc7"};
+    for (int f = 0; f < 3; f += 1) {
+        entry = rucksack_bundle_find_file(bundle, formats[f], -1);
+        assert(entry);
+        ok(rucksack_file_open_texture(entry, &texture));
+        int format = RuckSackTextureFormatBc1 + f;
+        assert(texture->format == format);
+        struct RuckSackTextureLevel level;
+        rucksack_texture_get_level(texture, 0, &level);
+        assert(level.width == 16);
+        assert(level.height == 64);
+        int block_size = (format == RuckSackTextureFormatBc1) ? 8 : 16;
+        assert(level.pitch == 4 * block_size);
+        assert(level.size == 4 * 16 * block_size);
+        unsigned char *blocks = malloc(level.size);
+        assert(blocks);
+        ok(rucksack_texture_read(texture, blocks));
+        decode_blocks(format, blocks, 16, 64, decoded);
+        free(blocks);
+        rucksack_texture_close(texture);
+
+        // BC1 keeps 1 bit of alpha. the color of invisible pixels is free.
+        double color_err = 0, alpha_err = 0;
+        long visible = 0;
+        for (long i = 0; i < 16 * 64; i += 1) {
+            const unsigned char *want = &expected[i * 4];
+            const unsigned char *got = &decoded[i * 4];
+            int want_alpha = want[3];
+            if (format == RuckSackTextureFormatBc1)
+                want_alpha = (want_alpha >= 128) ? 255 : 0;
+            alpha_err += (got[3] - want_alpha) * (got[3] - want_alpha);
+            if (want_alpha == 0)
+                continue;
+            for (int ch = 0; ch < 3; ch += 1)
+                color_err += (got[ch] - want[ch]) * (got[ch] - want[ch]);
+            visible += 1;
+        }
+        assert(visible > 0);
+        assert(color_err / (3 * visible) < 64);
+        if (format == RuckSackTextureFormatBc1)
+            assert(alpha_err == 0);
+        else
+            assert(alpha_err / (16 * 64) < 16);
+    }
+    free(expected);
+    free(decoded);
+
+    entry = rucksack_bundle_find_file(bundle, "odd", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(texture, 0, &level);
+    assert(level.width % 4 == 0);
+    assert(level.height % 4 == 0);
+    assert(level.width <= 252);
+    assert(level.pitch == level.width / 4 * 16);
+    assert(level.size == level.pitch * (level.height / 4));
+    for (int i = 0; i < 3; i += 1) {
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, keys[i], -1);
+        assert(image);
+        assert(image->x % 4 == 0);
+        assert(image->y % 4 == 0);
+        for (int j = 0; j < i; j += 1) {
+            // the blocks of two images never overlap
+            struct RuckSackImage *other = rucksack_texture_find_image(texture, keys[j], -1);
+            int w1 = ((image->r90 ? image->height : image->width) + 3) / 4 * 4;
+            int h1 = ((image->r90 ? image->width : image->height) + 3) / 4 * 4;
+            int w2 = ((other->r90 ? other->height : other->width) + 3) / 4 * 4;
+            int h2 = ((other->r90 ? other->width : other->height) + 3) / 4 * 4;
+            assert(image->x >= other->x + w2 || other->x >= image->x + w1 ||
+                    image->y >= other->y + h2 || other->y >= image->y + h1);
+        }
+    }
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+// writes a PNG of width x height RGBA8 pixels given from the top row down
+static void write_png(const char *path, const unsigned char *rgba, int width, int height) {
+    FIBITMAP *bmp = FreeImage_Allocate(width, height, 32, 0, 0, 0);
+    assert(bmp);
+    for (int row = 0; row < height; row += 1) {
+        BYTE *dest = FreeImage_GetScanLine(bmp, height - 1 - row);
+        for (int x = 0; x < width; x += 1) {
+            const unsigned char *src = &rgba[(row * width + x) * 4];
+            dest[x * 4 + FI_RGBA_RED] = src[0];
+            dest[x * 4 + FI_RGBA_GREEN] = src[1];
+            dest[x * 4 + FI_RGBA_BLUE] = src[2];
+            dest[x * 4 + FI_RGBA_ALPHA] = src[3];
+        }
+    }
+    assert(FreeImage_Save(FIF_PNG, bmp, path, 0));
+    FreeImage_Unload(bmp);
+}
+
+static void add_one_image(struct RuckSackBundle *bundle, const char *key, const char *path,
+        int format, int mip_levels)
+{
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = (char *)path;
+    img->key = "image";
+    ok(rucksack_texture_add_image(texture, img));
+    rucksack_image_destroy(img);
+    texture->key = (char *)key;
+    texture->format = format;
+    texture->mip_levels = mip_levels;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+}
+
+static void test_mipmaps(void) {
+    // black and white average to the gray of half the light, not to 128.
+    // transparent pixels do not darken the red next to them.
+    const unsigned char stripes[] = {
+        255, 255, 255, 255,   0, 0, 0, 255,
+        255, 255, 255, 255,   0, 0, 0, 255,
+    };
+    const unsigned char edge[] = {
+        255, 0, 0, 255,   0, 0, 0, 0,
+        255, 0, 0, 255,   0, 0, 0, 0,
+    };
+    write_png("stripes.png", stripes, 2, 2);
+    write_png("edge.png", edge, 2, 2);
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_one_image(bundle, "stripes", "stripes.png", RuckSackTextureFormatRgba8, 2);
+    add_one_image(bundle, "edge", "edge.png", RuckSackTextureFormatRgba8, 2);
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    char path[32];
+    char image_key[32];
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < 4; i += 1) {
+        snprintf(path, sizeof(path), "../test/file%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->key = "bc7";
+    texture->format = RuckSackTextureFormatBc7;
+    texture->mip_levels = 0;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->key = "png";
+    texture->format = RuckSackTextureFormatPng;
+    texture->mip_levels = 3;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    remove("stripes.png");
+    remove("edge.png");
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    unsigned char pixels[32];
+    struct RuckSackTextureLevel level;
+
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "stripes", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(texture->mip_levels == 2);
+    assert(rucksack_texture_level_count(texture) == 2);
+    rucksack_texture_get_level(texture, 1, &level);
+    assert(level.offset == 16);
+    assert(level.width == 1);
+    assert(level.height == 1);
+    assert(level.size == 4);
+    assert(rucksack_texture_size(texture) == 20);
+    ok(rucksack_texture_read(texture, pixels));
+    assert(memcmp(pixels, stripes, 16) == 0);
+    assert(pixels[16] == 188 && pixels[17] == 188 && pixels[18] == 188 && pixels[19] == 255);
+    rucksack_texture_close(texture);
+
+    entry = rucksack_bundle_find_file(bundle, "edge", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(texture->mip_levels == 2);
+    ok(rucksack_texture_read(texture, pixels));
+    assert(pixels[16] == 255 && pixels[17] == 0 && pixels[18] == 0 && pixels[19] == 128);
+    rucksack_texture_close(texture);
+
+    // every level down to 1x1. a full chain keeps the first 5 levels of
+    // each image apart, which puts them on multiples of 16 pixels.
+    entry = rucksack_bundle_find_file(bundle, "bc7", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    long count = rucksack_texture_level_count(texture);
+    assert(texture->mip_levels == count);
+    rucksack_texture_get_level(texture, 0, &level);
+    int width = level.width;
+    int height = level.height;
+    long end = 0;
+    for (long i = 0; i < count; i += 1) {
+        rucksack_texture_get_level(texture, i, &level);
+        assert(level.width == width);
+        assert(level.height == height);
+        assert(level.offset % 16 == 0);
+        assert(level.offset >= end);
+        assert(level.pitch == (width + 3) / 4 * 16);
+        assert(level.size == level.pitch * ((height + 3) / 4));
+        end = level.offset + level.size;
+        width = (width > 1) ? width / 2 : 1;
+        height = (height > 1) ? height / 2 : 1;
+    }
+    assert(width == 1 && height == 1);
+    assert(rucksack_texture_size(texture) == end);
+    for (int i = 0; i < 4; i += 1) {
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, image_key, -1);
+        assert(image);
+        assert(image->x % 16 == 0);
+        assert(image->y % 16 == 0);
+    }
+    rucksack_texture_close(texture);
+
+    // each PNG level is a PNG file of its own
+    entry = rucksack_bundle_find_file(bundle, "png", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(rucksack_texture_level_count(texture) == 3);
+    long size = rucksack_texture_size(texture);
+    unsigned char *data = malloc(size);
+    assert(data);
+    ok(rucksack_texture_read(texture, data));
+    for (long i = 0; i < 3; i += 1) {
+        rucksack_texture_get_level(texture, i, &level);
+        FIMEMORY *fi_mem = FreeImage_OpenMemory(data + level.offset, level.size);
+        FIBITMAP *bmp = FreeImage_LoadFromMemory(FIF_PNG, fi_mem, 0);
+        assert(bmp);
+        assert((int)FreeImage_GetWidth(bmp) == level.width);
+        assert((int)FreeImage_GetHeight(bmp) == level.height);
+        FreeImage_Unload(bmp);
+        FreeImage_CloseMemory(fi_mem);
+    }
+    free(data);
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_pages(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    assert(texture->max_pages == 1);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    char path[32];
+    char image_key[32];
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < 4; i += 1) {
+        snprintf(path, sizeof(path), "../test/file%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->key = "pages";
+    texture->format = RuckSackTextureFormatRgba8;
+    texture->allow_r90 = 0;
+    texture->mip_levels = 2;
+    texture->max_width = 18;
+    texture->max_height = 18;
+    // the two 16x16 images take a page each and the 8x8 ones share a third
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorCannotFit);
+    texture->max_pages = 2;
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorCannotFit);
+    texture->max_pages = 0;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    // an image larger than a page does not fit on any number of them
+    texture->key = "too_small";
+    texture->max_width = 8;
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorCannotFit);
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "pages", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    long page_count = rucksack_texture_page_count(texture);
+    assert(page_count == 3);
+    assert(rucksack_texture_level_count(texture) == 2);
+    long size = rucksack_texture_size(texture);
+    unsigned char *data = malloc(size);
+    assert(data);
+    ok(rucksack_texture_read(texture, data));
+
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(texture, 0, &level);
+    int width = level.width;
+    int height = level.height;
+    assert(width == 16 && height == 16);
+    long end = 0;
+    for (long page = 0; page < page_count; page += 1) {
+        for (long i = 0; i < 2; i += 1) {
+            ok(rucksack_texture_get_page_level(texture, page, i, &level));
+            assert(level.width == (width >> i));
+            assert(level.height == (height >> i));
+            assert(level.offset % 16 == 0);
+            assert(level.offset >= end);
+            end = level.offset + level.size;
+        }
+    }
+    assert(end == size);
+    assert(rucksack_texture_get_page_level(texture, 3, 0, &level) == RuckSackErrorInvalidArg);
+    assert(rucksack_texture_get_page_level(texture, 0, 2, &level) == RuckSackErrorInvalidArg);
+    assert(rucksack_texture_get_page_level(texture, -1, 0, &level) == RuckSackErrorInvalidArg);
+    assert(rucksack_texture_get_level(texture, 2, &level) == RuckSackErrorInvalidArg);
+
+    int images_on_page[3] = {0, 0, 0};
+    for (int i = 0; i < 4; i += 1) {
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, image_key, -1);
+        assert(image);
+        assert(image->page >= 0 && image->page < page_count);
+        images_on_page[image->page] += 1;
+
+        // the pixels of the image are on its page. like in FreeImage, y
+        // counts rows from the bottom.
+        snprintf(path, sizeof(path), "../test/file%d.png", i);
+        FIBITMAP *bmp = FreeImage_Load(FIF_PNG, path, 0);
+        assert(bmp);
+        FIBITMAP *bmp32 = FreeImage_ConvertTo32Bits(bmp);
+        assert(bmp32);
+        rucksack_texture_get_page_level(texture, image->page, 0, &level);
+        for (int y = 0; y < image->height; y += 1) {
+            BYTE *src = FreeImage_GetScanLine(bmp32, y);
+            int row = level.height - 1 - (image->y + y);
+            unsigned char *dest = &data[level.offset + level.pitch * row + 4 * image->x];
+            for (int x = 0; x < image->width; x += 1) {
+                assert(dest[x * 4 + 0] == src[x * 4 + FI_RGBA_RED]);
+                assert(dest[x * 4 + 3] == src[x * 4 + FI_RGBA_ALPHA]);
+            }
+        }
+        FreeImage_Unload(bmp32);
+        FreeImage_Unload(bmp);
+    }
+    for (long page = 0; page < page_count; page += 1)
+        assert(images_on_page[page] > 0);
+    free(data);
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+// the pixels of the texture, checking that its images do not overlap, other
+// than identical ones sharing their place
+static long texture_area(struct RuckSackBundle *bundle, const char *key) {
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    struct RuckSackTexture *texture;
+    ok(rucksack_file_open_texture(entry, &texture));
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(texture, 0, &level);
+    long image_count = rucksack_texture_image_count(texture);
+    struct RuckSackImage **images = malloc(sizeof(struct RuckSackImage *) * image_count);
+    assert(images);
+    rucksack_texture_get_images(texture, images);
+    for (int i = 0; i < image_count; i += 1) {
+        struct RuckSackImage *a = images[i];
+        int a_w = a->r90 ? a->height : a->width;
+        int a_h = a->r90 ? a->width : a->height;
+        assert(a->x + a_w <= level.width);
+        assert(a->y + a_h <= level.height);
+        for (int j = i + 1; j < image_count; j += 1) {
+            struct RuckSackImage *b = images[j];
+            int b_w = b->r90 ? b->height : b->width;
+            int b_h = b->r90 ? b->width : b->height;
+            if (a->x == b->x && a->y == b->y && a->page == b->page && a_w == b_w && a_h == b_h)
+                continue;
+            assert(a->page != b->page || a->x >= b->x + b_w || b->x >= a->x + a_w ||
+                   a->y >= b->y + b_h || b->y >= a->y + a_h);
+        }
+    }
+    free(images);
+    long area = (long)level.width * level.height * rucksack_texture_page_count(texture);
+    rucksack_texture_close(texture);
+    return area;
+}
+
+static void test_smallest_size(void) {
+    // sizes like the test files, with different pixels so that none of
+    // them share a place
+    const int sides[] = {8, 16, 16, 8};
+    unsigned char rgba[16 * 16 * 4];
+    memset(rgba, 0xff, sizeof(rgba));
+    char path[32];
+    char image_key[32];
+    for (int i = 0; i < 12; i += 1) {
+        rgba[0] = i;
+        snprintf(path, sizeof(path), "smallest%d.png", i);
+        write_png(path, rgba, sides[i % 4], sides[i % 4]);
+    }
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < 12; i += 1) {
+        snprintf(path, sizeof(path), "smallest%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+
+    texture->key = "pow2_full";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->smallest_size = 1;
+    texture->key = "pow2_smallest";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->key = "pow2_again";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->pow2 = 0;
+    texture->smallest_size = 0;
+    texture->key = "any_full";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->smallest_size = 1;
+    texture->key = "any_smallest";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    // the sizes that are too small are passed over, but when none is large
+    // enough the search fails
+    texture->max_width = 16;
+    texture->key = "too_small";
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorCannotFit);
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    for (int i = 0; i < 12; i += 1) {
+        snprintf(path, sizeof(path), "smallest%d.png", i);
+        remove(path);
+    }
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    long pow2_full = texture_area(bundle, "pow2_full");
+    long pow2_smallest = texture_area(bundle, "pow2_smallest");
+    assert(pow2_smallest < pow2_full);
+    assert(texture_area(bundle, "pow2_again") == pow2_smallest);
+    long any_full = texture_area(bundle, "any_full");
+    long any_smallest = texture_area(bundle, "any_smallest");
+    assert(any_smallest < any_full);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_smallest_size_pages(void) {
+    unsigned char rgba[16 * 16 * 4];
+    memset(rgba, 0xff, sizeof(rgba));
+    char path[32];
+    char image_key[32];
+    for (int i = 0; i < 12; i += 1) {
+        rgba[0] = i;
+        snprintf(path, sizeof(path), "pages%d.png", i);
+        write_png(path, rgba, 16, 16);
+    }
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < 12; i += 1) {
+        snprintf(path, sizeof(path), "pages%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    // a page for each image takes up fewer pixels than any single page of
+    // powers of 2 that holds them all, but they fit on one, so they stay
+    // on one
+    texture->smallest_size = 1;
+    texture->max_width = 256;
+    texture->max_height = 256;
+    const char *keys[] = {"unlimited", "four", "unlimited_any"};
+    const int max_pages[] = {0, 4, 0};
+    for (int i = 0; i < 3; i += 1) {
+        texture->pow2 = (i < 2);
+        texture->max_pages = max_pages[i];
+        texture->key = (char *)keys[i];
+        ok(rucksack_bundle_add_texture(bundle, texture));
+    }
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    for (int i = 0; i < 12; i += 1) {
+        snprintf(path, sizeof(path), "pages%d.png", i);
+        remove(path);
+    }
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    for (int i = 0; i < 3; i += 1) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+        assert(entry);
+        ok(rucksack_file_open_texture(entry, &texture));
+        assert(rucksack_texture_page_count(texture) == 1);
+        rucksack_texture_close(texture);
+        texture_area(bundle, keys[i]);
+    }
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_packing_rules(void) {
+    // sizes that leave awkward gaps
+    const int sizes[][2] = {
+        {5, 3}, {7, 12}, {20, 6}, {9, 9}, {3, 17}, {11, 4}, {6, 6}, {14, 2},
+        {2, 2}, {8, 13}, {13, 8}, {4, 10},
+    };
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char rgba[20 * 20 * 4];
+    memset(rgba, 0xff, sizeof(rgba));
+    char path[32];
+    char image_key[32];
+    for (int i = 0; i < size_count; i += 1) {
+        snprintf(path, sizeof(path), "rule%d.png", i);
+        write_png(path, rgba, sizes[i][0], sizes[i][1]);
+    }
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < size_count; i += 1) {
+        snprintf(path, sizeof(path), "rule%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+
+    texture->pow2 = 0;
+    texture->max_width = 32;
+    texture->max_height = 128;
+    char texture_key[32];
+    texture->key = texture_key;
+    for (int rule = 0; rule < RuckSackPackingBest; rule += 1) {
+        for (int sort_by = 0; sort_by <= RuckSackSortByHeight; sort_by += 1) {
+            texture->packing = rule;
+            texture->sort_by = sort_by;
+            snprintf(texture_key, sizeof(texture_key), "rule%d_%d", rule, sort_by);
+            ok(rucksack_bundle_add_texture(bundle, texture));
+        }
+    }
+    texture->packing = RuckSackPackingBest;
+    texture->sort_by = RuckSackSortByMaxSide;
+    snprintf(texture_key, sizeof(texture_key), "best");
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    texture->packing = RuckSackPackingBest + 1;
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorInvalidPacking);
+    texture->packing = RuckSackPackingShortSideFit;
+    texture->sort_by = -1;
+    assert(rucksack_bundle_add_texture(bundle, texture) == RuckSackErrorInvalidPacking);
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    for (int i = 0; i < size_count; i += 1) {
+        snprintf(path, sizeof(path), "rule%d.png", i);
+        remove(path);
+    }
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    long smallest = LONG_MAX;
+    long default_area = 0;
+    for (int rule = 0; rule < RuckSackPackingBest; rule += 1) {
+        for (int sort_by = 0; sort_by <= RuckSackSortByHeight; sort_by += 1) {
+            snprintf(texture_key, sizeof(texture_key), "rule%d_%d", rule, sort_by);
+            long area = texture_area(bundle, texture_key);
+            if (area < smallest)
+                smallest = area;
+            if (rule == 0 && sort_by == 0)
+                default_area = area;
+        }
+    }
+    // the best of them all is at least as small as each one
+    long best_area = texture_area(bundle, "best");
+    assert(best_area == smallest);
+    assert(best_area <= default_area);
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "best", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(texture->packing == RuckSackPackingBest);
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_packing_placements(void) {
+    // width, height, then where the packer puts them. pruning the free
+    // rectangles reuses the slots of removed ones many times over with
+    // these, and must not move any image.
+    const int expected[][5] = {
+        {8, 12, 0, 69, 0},
+        {19, 20, 74, 40, 1},
+        {20, 10, 114, 47, 1},
+        {21, 29, 30, 0, 1},
+        {2, 23, 125, 0, 0},
+        {26, 4, 0, 23, 0},
+        {16, 6, 42, 58, 1},
+        {9, 6, 94, 40, 0},
+        {17, 16, 54, 59, 0},
+        {2, 22, 58, 36, 1},
+        {13, 12, 38, 74, 0},
+        {12, 24, 0, 47, 1},
+        {22, 9, 81, 31, 0},
+        {12, 2, 25, 27, 1},
+        {6, 23, 119, 0, 0},
+        {9, 18, 0, 59, 1},
+        {30, 20, 0, 0, 0},
+        {24, 4, 86, 7, 0},
+        {2, 9, 51, 60, 0},
+        {27, 20, 28, 21, 0},
+        {18, 20, 94, 47, 1},
+        {27, 22, 59, 0, 0},
+        {13, 23, 109, 24, 0},
+        {21, 14, 60, 38, 1},
+        {23, 14, 58, 22, 0},
+        {12, 15, 23, 69, 1},
+        {25, 7, 86, 0, 0},
+        {20, 23, 86, 11, 1},
+        {3, 8, 81, 22, 0},
+        {11, 3, 54, 47, 1},
+        {17, 25, 25, 41, 1},
+        {17, 4, 122, 23, 1},
+        {17, 14, 9, 68, 1},
+        {3, 28, 0, 20, 1},
+        {11, 18, 24, 58, 1},
+        {4, 19, 50, 41, 0},
+        {8, 24, 111, 0, 0},
+        {20, 25, 0, 27, 1},
+        {26, 3, 55, 21, 1},
+        {9, 10, 23, 81, 1},
+    };
+    const int count = sizeof(expected) / sizeof(expected[0]);
+    unsigned char rgba[32 * 32 * 4];
+    memset(rgba, 0xff, sizeof(rgba));
+    char path[32];
+    char image_key[32];
+    for (int i = 0; i < count; i += 1) {
+        // different pixels so that none of them share a place
+        rgba[0] = i;
+        snprintf(path, sizeof(path), "placement%d.png", i);
+        write_png(path, rgba, expected[i][0], expected[i][1]);
+    }
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = path;
+    img->key = image_key;
+    for (int i = 0; i < count; i += 1) {
+        snprintf(path, sizeof(path), "placement%d.png", i);
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->key = "texture";
+    texture->pow2 = 0;
+    texture->max_width = 128;
+    texture->max_height = 128;
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    for (int i = 0; i < count; i += 1) {
+        snprintf(path, sizeof(path), "placement%d.png", i);
+        remove(path);
+    }
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "texture", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    for (int i = 0; i < count; i += 1) {
+        snprintf(image_key, sizeof(image_key), "image%d", i);
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, image_key, -1);
+        assert(image);
+        assert(image->x == expected[i][2]);
+        assert(image->y == expected[i][3]);
+        assert(image->r90 == expected[i][4]);
+    }
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_trim(void) {
+    // the visible part is 7x5 at 3, 2 from the top left, its top left pixel
+    // barely visible. each pixel has a color of its own.
+    unsigned char padded[12][20][4];
+    memset(padded, 0, sizeof(padded));
+    for (int y = 2; y < 7; y += 1) {
+        for (int x = 3; x < 10; x += 1) {
+            padded[y][x][0] = x * 10;
+            padded[y][x][1] = y * 10;
+            padded[y][x][3] = 255;
+        }
+    }
+    padded[2][3][3] = 1;
+    unsigned char blank[5 * 5 * 4];
+    memset(blank, 0, sizeof(blank));
+    write_png("padded.png", &padded[0][0][0], 20, 12);
+    write_png("blank.png", blank, 5, 5);
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    img->path = "padded.png";
+    img->key = "padded";
+    img->trim = 1;
+    ok(rucksack_texture_add_image(texture, img));
+    img->path = "blank.png";
+    img->key = "blank";
+    img->trim = 0;
+    ok(rucksack_texture_add_image(texture, img));
+    rucksack_image_destroy(img);
+    texture->format = RuckSackTextureFormatRgba8;
+    texture->allow_r90 = 0;
+    texture->key = "some";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    // the trim of the texture counts no matter when it is set
+    texture->trim = 1;
+    texture->key = "all";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+
+    texture = rucksack_texture_create();
+    assert(texture);
+    img = rucksack_image_create();
+    assert(img);
+    img->path = "padded.png";
+    img->key = "padded";
+    ok(rucksack_texture_add_image(texture, img));
+    rucksack_image_destroy(img);
+    texture->key = "none";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    remove("padded.png");
+    remove("blank.png");
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    const char *keys[] = {"some", "all"};
+    for (int i = 0; i < 2; i += 1) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+        assert(entry);
+        ok(rucksack_file_open_texture(entry, &texture));
+        assert(texture->trim == i);
+        assert(rucksack_texture_sprite_trims(texture));
+
+        // the anchor stays in the middle of the full image
+        struct RuckSackImage *image = rucksack_texture_find_image(texture, "padded", -1);
+        assert(image);
+        assert(image->trim);
+        assert(image->width == 7 && image->height == 5);
+        assert(image->trim_x == 3 && image->trim_y == 2);
+        assert(image->full_width == 20 && image->full_height == 12);
+        assert(image->anchor_x == 10.0f && image->anchor_y == 6.0f);
+
+        long size = rucksack_texture_size(texture);
+        unsigned char *data = malloc(size);
+        assert(data);
+        ok(rucksack_texture_read(texture, data));
+        struct RuckSackTextureLevel level;
+        rucksack_texture_get_level(texture, 0, &level);
+        for (int y = 0; y < image->height; y += 1) {
+            // y counts rows from the bottom of the texture
+            int row = level.height - 1 - (image->y + image->height - 1 - y);
+            unsigned char *dest = &data[level.offset + level.pitch * row + 4 * image->x];
+            for (int x = 0; x < image->width; x += 1)
+                assert(memcmp(&dest[x * 4], padded[image->trim_y + y][image->trim_x + x], 4) == 0);
+        }
+        free(data);
+
+        // an image with nothing to see keeps one pixel
+        image = rucksack_texture_find_image(texture, "blank", -1);
+        assert(image);
+        assert(image->trim == i);
+        assert(image->width == (i ? 1 : 5) && image->height == (i ? 1 : 5));
+        assert(image->trim_x == 0 && image->trim_y == 0);
+        assert(image->full_width == 5 && image->full_height == 5);
+        rucksack_texture_close(texture);
+    }
+
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "none", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    assert(!texture->trim);
+    assert(!rucksack_texture_sprite_trims(texture));
+    struct RuckSackImage *image = rucksack_texture_find_image(texture, "padded", -1);
+    assert(image);
+    assert(!image->trim);
+    assert(image->width == 20 && image->height == 12);
+    assert(image->full_width == 20 && image->full_height == 12);
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_identical_images(void) {
+    unsigned char sprite[6][6][4];
+    for (int y = 0; y < 6; y += 1) {
+        for (int x = 0; x < 6; x += 1) {
+            sprite[y][x][0] = x * 40;
+            sprite[y][x][1] = y * 40;
+            sprite[y][x][2] = 0;
+            sprite[y][x][3] = 255;
+        }
+    }
+    // the same pixels with a transparent border
+    unsigned char padded[10][10][4];
+    memset(padded, 0, sizeof(padded));
+    for (int y = 0; y < 6; y += 1)
+        memcpy(padded[y + 2][3], sprite[y], sizeof(sprite[y]));
+    write_png("sprite.png", &sprite[0][0][0], 6, 6);
+    write_png("copy.png", &sprite[0][0][0], 6, 6);
+    write_png("padded.png", &padded[0][0][0], 10, 10);
+    sprite[5][5][2] = 1;
+    write_png("other.png", &sprite[0][0][0], 6, 6);
+
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackTexture *texture = rucksack_texture_create();
+    assert(texture);
+    struct RuckSackImage *img = rucksack_image_create();
+    assert(img);
+    char *paths[] = {"sprite.png", "copy.png", "other.png", "padded.png", "padded.png"};
+    const char *keys[] = {"sprite", "copy", "other", "trimmed", "padded"};
+    for (int i = 0; i < 5; i += 1) {
+        img->path = paths[i];
+        img->key = keys[i];
+        img->anchor = RuckSackAnchorLeft;
+        img->trim = (i == 3);
+        ok(rucksack_texture_add_image(texture, img));
+    }
+    rucksack_image_destroy(img);
+    texture->format = RuckSackTextureFormatRgba8;
+    texture->allow_r90 = 0;
+    texture->key = "texture";
+    ok(rucksack_bundle_add_texture(bundle, texture));
+    rucksack_texture_destroy(texture);
+    ok(rucksack_bundle_close(bundle));
+    remove("sprite.png");
+    remove("copy.png");
+    remove("other.png");
+    remove("padded.png");
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "texture", -1);
+    assert(entry);
+    ok(rucksack_file_open_texture(entry, &texture));
+    struct RuckSackImage *images[5];
+    for (int i = 0; i < 5; i += 1) {
+        images[i] = rucksack_texture_find_image(texture, keys[i], -1);
+        assert(images[i]);
+    }
+    // copies of the same pixels share a place, each with its own anchor
+    // and trim
+    for (int i = 1; i < 4; i += 1) {
+        int same = images[i]->x == images[0]->x && images[i]->y == images[0]->y &&
+            images[i]->page == images[0]->page && images[i]->r90 == images[0]->r90;
+        assert(same == (i != 2));
+    }
+    assert(images[0]->anchor_x == 0.0f && images[0]->anchor_y == 3.0f);
+    assert(images[3]->anchor_x == 0.0f && images[3]->anchor_y == 5.0f);
+    assert(images[3]->trim_x == 3 && images[3]->trim_y == 2);
+    assert(images[4]->x != images[0]->x || images[4]->y != images[0]->y);
+
+    long size = rucksack_texture_size(texture);
+    unsigned char *data = malloc(size);
+    assert(data);
+    ok(rucksack_texture_read(texture, data));
+    struct RuckSackTextureLevel level;
+    rucksack_texture_get_level(texture, 0, &level);
+    sprite[5][5][2] = 0;
+    struct RuckSackImage *image = images[0];
+    for (int y = 0; y < 6; y += 1) {
+        // rows of the sprite go up from the bottom of the texture
+        int row = level.height - 1 - (image->y + 5 - y);
+        unsigned char *dest = &data[level.offset + level.pitch * row + 4 * image->x];
+        assert(memcmp(dest, sprite[y], sizeof(sprite[y])) == 0);
+    }
+    free(data);
+    rucksack_texture_close(texture);
+    ok(rucksack_bundle_close(bundle));
+}
+
 struct Test {
     const char *name;
     void (*fn)(void);
@@ -443,6 +2987,33 @@ static struct Test tests[] = {
     {"non-default texture properties", test_non_default_texture_props},
     {"open bundle read-only", test_open_read_only},
     {"delete from a bundle", test_delete_from_bundle},
+    {"open bundle with mmap", test_open_mmap},
+    {"find files in a bundle with many entries", test_many_entries},
+    {"keys longer than the header read guess", test_long_keys},
+    {"read from many threads at once", test_concurrent_reads},
+    {"read part of a file", test_read_range},
+    {"read files asynchronously", test_read_async},
+    {"read many files at once", test_read_many},
+    {"compressed files", test_compression},
+    {"read a version 1 bundle", test_read_version_1},
+    {"read files a piece at a time", test_in_stream},
+    {"store identical files once", test_dedupe},
+    {"checksums", test_checksums},
+    {"look keys up in the key table", test_key_table},
+    {"iterate over keys in order", test_iter_keys},
+    {"align file contents", test_alignment},
+    {"find images by key", test_find_image},
+    {"read the sprite table of a texture", test_sprite_table},
+    {"store textures as raw pixels", test_texture_formats},
+    {"store textures block compressed", test_block_formats},
+    {"generate mip levels", test_mipmaps},
+    {"spill images onto more pages", test_pages},
+    {"find the smallest texture size", test_smallest_size},
+    {"keep the smallest texture on one page", test_smallest_size_pages},
+    {"choose among packing rules", test_packing_rules},
+    {"keep packing placements", test_packing_placements},
+    {"trim transparent borders", test_trim},
+    {"pack identical images once", test_identical_images},
     {NULL, NULL},
 };
 